@@ -0,0 +1,274 @@
+/* election and failover of ZkMgr against zksim, n candidates of one task
+ *   elect     ZkMgr::create of every candidate, until it is MASTER or SLAVE
+ *   failover  the session of the master expires while its task runs, until
+ *             a standby returns from suspend as MASTER and execs the task
+ *   ops       the zookeeper requests of the round, of all the candidates
+ * DCRON_MAXRETRY is the number of nodes + 1, every node is a standby and
+ * none is out, the cap of DCRON_MAXRETRY is raised to it. maxretry and
+ * out of a row are the ones in effect
+ * every candidate is a thread with a session of its own, the times are
+ * the virtual ones of zksim, no zookeeper is needed
+ * usage: electbench [-l latency us] [-s scale] [-p serial|pipeline] [nodes ...]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define ERRBUF_MAX   1024
+#define WAIT_TIMEOUT 120  // s, of the election of a round
+
+struct Round {
+  int   nodes;
+  char  name[128];
+  char  maxRetry[32];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  std::vector<int64_t> elect;   // us
+  int        suspended;
+  int        failed;
+  int        out;         // beyond DCRON_MAXRETRY at the election, they do not wait
+  int        effectiveRetry;   // DCRON_MAXRETRY after the cap
+  zhandle_t *master;      // of the first master, expired by main
+  bool       mastered;
+  int64_t    expiredAt;
+  int64_t    failover;    // -1 until a standby is master
+};
+
+struct Node {
+  Round *round;
+  int    id;
+};
+
+static void *nodeRoutine(void *data)
+{
+  Node *node = (Node *) data;
+  Round *round = node->round;
+  char errbuf[ERRBUF_MAX];
+
+  char id[32], name[160];
+  snprintf(id, sizeof(id), "DCRON_ID=node%04d", node->id);
+  snprintf(name, sizeof(name), "DCRON_NAME=%s", round->name);
+  char *argv[] = {(char *) "dcron", id, name, round->maxRetry, (char *) "--",
+                  (char *) "/bin/sleep", (char *) "3600", 0};
+  int envc;
+  ConfigOpt *cnf = ConfigOpt::create(7, argv, &envc, errbuf);
+  if (cnf) {
+    pthread_mutex_lock(&round->mutex);
+    round->effectiveRetry = cnf->maxRetry();
+    pthread_mutex_unlock(&round->mutex);
+  }
+  ZkSession *session = cnf ? ZkSession::create(cnf->zkhost(), cnf->zkTimeout(), errbuf) : 0;
+
+  int64_t begin = zksim_now();
+  ZkMgr *mgr = session ? ZkMgr::create(cnf, session, errbuf) : 0;
+  int64_t elect = zksim_now() - begin;
+
+  pthread_mutex_lock(&round->mutex);
+  if (mgr) {
+    round->elect.push_back(elect);
+  } else {
+    fprintf(stderr, "node%04d %s\n", node->id, errbuf);
+    ++round->failed;
+  }
+  pthread_cond_broadcast(&round->cond);
+  pthread_mutex_unlock(&round->mutex);
+
+  bool standby = false;
+  while (mgr) {
+    if (mgr->status() == ZkMgr::MASTER) {
+      /* the first master runs until its session expires, a standby exits at once */
+      pthread_mutex_lock(&round->mutex);
+      bool first = !round->mastered;
+      round->mastered = true;
+      if (first) round->master = session->handle();
+      else round->failover = zksim_now() - round->expiredAt;
+      pthread_cond_broadcast(&round->cond);
+      pthread_mutex_unlock(&round->mutex);
+
+      char *targv[] = {(char *) (first ? "/bin/sleep" : "/bin/true"), (char *) "3600", 0};
+      mgr->exec(first ? 2 : 1, targv);
+      break;
+    } else if (mgr->status() == ZkMgr::SLAVE) {
+      standby = true;
+      pthread_mutex_lock(&round->mutex);
+      ++round->suspended;
+      pthread_cond_broadcast(&round->cond);
+      pthread_mutex_unlock(&round->mutex);
+
+      mgr->suspend();
+
+      pthread_mutex_lock(&round->mutex);
+      --round->suspended;
+      pthread_mutex_unlock(&round->mutex);
+    } else {
+      pthread_mutex_lock(&round->mutex);
+      if (!standby && mgr->status() == ZkMgr::OUT) ++round->out;
+      pthread_cond_broadcast(&round->cond);
+      pthread_mutex_unlock(&round->mutex);
+      break;
+    }
+  }
+
+  delete mgr;
+  if (session) session->release();
+  delete cnf;
+  return 0;
+}
+
+inline double percentile(const std::vector<int64_t> &sorted, int pct)
+{
+  size_t i = (sorted.size() * pct) / 100;
+  return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+static bool run(int nodes, const char *mode)
+{
+  static const char *OPS[] = {"create", "delete", "set", "get", "exists", "children", "multi"};
+
+  Round round;
+  round.nodes = nodes;
+  snprintf(round.name, sizeof(round.name), "electbench%d.%s%d.%%Y%%m%%d", (int) getpid(), mode, nodes);
+  snprintf(round.maxRetry, sizeof(round.maxRetry), "DCRON_MAXRETRY=%d", nodes + 1);
+  pthread_mutex_init(&round.mutex, 0);
+  pthread_cond_init(&round.cond, 0);
+  round.suspended = 0;
+  round.failed    = 0;
+  round.out       = 0;
+  round.effectiveRetry = 0;
+  round.master    = 0;
+  round.mastered  = false;
+  round.expiredAt = 0;
+  round.failover  = -1;
+
+  zksim_reset();
+
+  std::vector<Node> ctx(nodes);
+  std::vector<pthread_t> threads(nodes);
+  int started = 0;
+  for (int i = 0; i < nodes; ++i) {
+    ctx[i].round = &round;
+    ctx[i].id    = i;
+    if (pthread_create(&threads[i], 0, nodeRoutine, &ctx[i]) != 0) break;
+    ++started;
+  }
+
+  /* the election is over when the master runs and every other node is suspended or out */
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += WAIT_TIMEOUT;
+
+  pthread_mutex_lock(&round.mutex);
+  while (!(round.master && round.suspended + round.failed + round.out == started - 1) && round.failed < started) {
+    if (pthread_cond_timedwait(&round.cond, &round.mutex, &deadline) != 0) break;
+  }
+  std::vector<int64_t> elect = round.elect;
+  int64_t electOps = zksim_ops();
+  if (round.master) {
+    round.expiredAt = zksim_now();
+    zksim_expire(round.master);
+  }
+  bool elected = round.master != 0;
+  pthread_mutex_unlock(&round.mutex);
+
+  for (int i = 0; i < started; ++i) pthread_join(threads[i], 0);
+
+  if (!elected || elect.empty()) {
+    fprintf(stderr, "%s %d nodes, no master in %ds, %d failed\n", mode, nodes, WAIT_TIMEOUT, round.failed);
+    return false;
+  }
+
+  std::sort(elect.begin(), elect.end());
+  printf("%-8s nodes %4d  maxretry %4d  out %4d  elect p50 %8.2fms  p99 %8.2fms  max %8.2fms  ops %6lld (%5.1f/node)",
+         mode, nodes, round.effectiveRetry, round.out, percentile(elect, 50), percentile(elect, 99),
+         elect.back() / 1000.0, (long long) electOps, (double) electOps / nodes);
+  if (round.failover >= 0) {
+    printf("  failover %8.2fms  ops %6lld\n", round.failover / 1000.0, (long long) (zksim_ops() - electOps));
+  } else {
+    printf("  failover        -\n");
+  }
+
+  printf("%-8s                                      ", "");
+  for (int op = 0; op < ZKSIM_OP_MAX; ++op) printf(" %s %lld", OPS[op], (long long) zksim_op_count(op));
+  printf("\n");
+
+  pthread_mutex_destroy(&round.mutex);
+  pthread_cond_destroy(&round.cond);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  int latency = 500;
+  double scale = 1.0;
+  const char *mode = "all";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:p:")) != -1) {
+    if (opt == 'l') latency = atoi(optarg);
+    else if (opt == 's') scale = atof(optarg);
+    else if (opt == 'p') mode = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-l latency us] [-s scale] [-p serial|pipeline] [nodes ...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<int> sizes;
+  for (int i = optind; i < argc; ++i) sizes.push_back(atoi(argv[i]));
+  if (sizes.empty()) {
+    sizes.push_back(1);
+    sizes.push_back(10);
+    sizes.push_back(100);
+    sizes.push_back(1000);
+  }
+  ConfigOpt::setMaxRetryCap(*std::max_element(sizes.begin(), sizes.end()) + 1);
+
+  /* every candidate holds a few fds of its event loop */
+  struct rlimit rlmt;
+  if (getrlimit(RLIMIT_NOFILE, &rlmt) == 0) {
+    rlmt.rlim_cur = rlmt.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlmt);
+  }
+
+  zksim_config(latency, scale);
+  setenv("DCRON_ZK", "sim:2181/electbench", 1);
+  setenv("DCRON_LIBDIR", "/tmp", 0);
+  setenv("DCRON_LOGDIR", "/tmp", 0);
+  setenv("DCRON_AGENT", "none", 1);
+  setenv("DCRON_STDIOCAP", "false", 1);
+  setenv("DCRON_CGROUP", "none", 1);
+  setenv("DCRON_METRICS", "false", 1);
+
+  if (!Logger::create(std::string(getenv("DCRON_LOGDIR")) + "/electbench.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("latency %dus, scale %g\n", latency, scale);
+  bool ok = true;
+  for (size_t i = 0; i < sizes.size() && ok; ++i) {
+    if (strcmp(mode, "pipeline") != 0) {
+      setenv("DCRON_ZKPIPELINE", "false", 1);
+      ok = ok && run(sizes[i], "serial");
+    }
+    if (strcmp(mode, "serial") != 0) {
+      setenv("DCRON_ZKPIPELINE", "true", 1);
+      ok = ok && run(sizes[i], "pipeline");
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,291 @@
+/* failover of ZkMgr against zksim, rounds of n candidates of one task
+ *   failover  the master dies, its session expires after the session
+ *             timeout, until a standby returns from suspend as MASTER
+ *             and execs the task
+ *   orphan    from the expiry until exec of the old master has sent
+ *             SIGTERM to its task and returned
+ *   stuck     rounds without a failover in WAIT_TIMEOUT, a dropped watch
+ *             leaves the standbys asleep
+ * -f injects the faults of DCRON_ZKFAULT under every call, the latency
+ * of a fault is real time, keep the scale at 1 with it. an expire fault
+ * expires every candidate, they share the process
+ * usage: failbench [-l latency us] [-s scale] [-t session timeout ms] [-r rounds] [-f faults] [nodes]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "zkfault.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define ERRBUF_MAX   1024
+#define WAIT_TIMEOUT 30  // s, of the election and of the failover of a round
+
+struct Round {
+  char  name[128];
+  char  maxRetry[32];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  std::vector<zhandle_t *> handles;   // of every candidate, to end a stuck round
+  int        elected;     // candidates out of ZkMgr::create
+  int        done;        // candidates gone, an expire fault ends them all
+  zhandle_t *master;      // of the first master
+  int64_t    expiredAt;   // 0 until the session of the master expires
+  int64_t    failover;    // -1 until a standby execs
+  int64_t    orphan;      // -1 until exec of the first master returns
+};
+
+struct Node {
+  Round *round;
+  int    id;
+};
+
+static void *nodeRoutine(void *data)
+{
+  Node *node = (Node *) data;
+  Round *round = node->round;
+  char errbuf[ERRBUF_MAX];
+
+  char id[32], name[160];
+  snprintf(id, sizeof(id), "DCRON_ID=node%04d", node->id);
+  snprintf(name, sizeof(name), "DCRON_NAME=%s", round->name);
+  char *argv[] = {(char *) "dcron", id, name, round->maxRetry, (char *) "--",
+                  (char *) "/bin/sleep", (char *) "3600", 0};
+  int envc;
+  ConfigOpt *cnf = ConfigOpt::create(7, argv, &envc, errbuf);
+  ZkSession *session = cnf ? ZkSession::create(cnf->zkhost(), cnf->zkTimeout(), errbuf) : 0;
+
+  pthread_mutex_lock(&round->mutex);
+  if (session) round->handles.push_back(session->handle());
+  pthread_mutex_unlock(&round->mutex);
+
+  ZkMgr *mgr = session ? ZkMgr::create(cnf, session, errbuf) : 0;
+  if (!mgr) fprintf(stderr, "node%04d %s\n", node->id, errbuf);
+
+  pthread_mutex_lock(&round->mutex);
+  ++round->elected;
+  if (mgr && mgr->status() == ZkMgr::MASTER && !round->master) round->master = session->handle();
+  pthread_cond_broadcast(&round->cond);
+  pthread_mutex_unlock(&round->mutex);
+
+  while (mgr) {
+    if (mgr->status() == ZkMgr::MASTER) {
+      pthread_mutex_lock(&round->mutex);
+      bool first = round->master == session->handle();
+      if (!first && round->expiredAt) round->failover = zksim_now() - round->expiredAt;
+      pthread_cond_broadcast(&round->cond);
+      pthread_mutex_unlock(&round->mutex);
+
+      char *targv[] = {(char *) (first ? "/bin/sleep" : "/bin/true"), (char *) "3600", 0};
+      mgr->exec(first ? 2 : 1, targv);
+
+      if (first) {
+        pthread_mutex_lock(&round->mutex);
+        if (round->expiredAt) round->orphan = zksim_now() - round->expiredAt;
+        pthread_cond_broadcast(&round->cond);
+        pthread_mutex_unlock(&round->mutex);
+      }
+      break;
+    } else if (mgr->status() == ZkMgr::SLAVE) {
+      mgr->suspend();
+    } else {
+      break;
+    }
+  }
+
+  delete mgr;
+  if (session) {
+    pthread_mutex_lock(&round->mutex);
+    round->handles.erase(std::find(round->handles.begin(), round->handles.end(), session->handle()));
+    pthread_mutex_unlock(&round->mutex);
+    session->release();
+  }
+
+  pthread_mutex_lock(&round->mutex);
+  ++round->done;
+  pthread_cond_broadcast(&round->cond);
+  pthread_mutex_unlock(&round->mutex);
+  delete cnf;
+  return 0;
+}
+
+inline double percentile(const std::vector<int64_t> &sorted, int pct)
+{
+  if (sorted.empty()) return 0;
+  size_t i = (sorted.size() * pct) / 100;
+  return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+inline void deadlineAfter(struct timespec *deadline, int seconds)
+{
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += seconds;
+}
+
+/* false if the round elected no master */
+static bool run(int seq, int nodes, int timeout, double scale, int64_t *failover, int64_t *orphan, int64_t *ops)
+{
+  Round round;
+  snprintf(round.name, sizeof(round.name), "failbench%d.round%d.%%Y%%m%%d", (int) getpid(), seq);
+  snprintf(round.maxRetry, sizeof(round.maxRetry), "DCRON_MAXRETRY=%d", nodes + 1);
+  pthread_mutex_init(&round.mutex, 0);
+  pthread_cond_init(&round.cond, 0);
+  round.elected   = 0;
+  round.done      = 0;
+  round.master    = 0;
+  round.expiredAt = 0;
+  round.failover  = -1;
+  round.orphan    = -1;
+
+  zksim_reset();
+
+  std::vector<Node> ctx(nodes);
+  std::vector<pthread_t> threads(nodes);
+  int started = 0;
+  for (int i = 0; i < nodes; ++i) {
+    ctx[i].round = &round;
+    ctx[i].id    = i;
+    if (pthread_create(&threads[i], 0, nodeRoutine, &ctx[i]) != 0) break;
+    ++started;
+  }
+
+  struct timespec deadline;
+  deadlineAfter(&deadline, WAIT_TIMEOUT);
+
+  pthread_mutex_lock(&round.mutex);
+  while (round.elected < started) {
+    if (pthread_cond_timedwait(&round.cond, &round.mutex, &deadline) != 0) break;
+  }
+  zhandle_t *master = round.master;
+  pthread_mutex_unlock(&round.mutex);
+
+  /* the master dies now, the server notices it a session timeout later */
+  int64_t died = zksim_now();
+  if (master && timeout > 0) usleep((useconds_t) (timeout * 1000 * scale));
+
+  int64_t before = zksim_ops();
+  pthread_mutex_lock(&round.mutex);
+  /* the handle is closed if the master has already gone by a fault */
+  if (master && std::find(round.handles.begin(), round.handles.end(), master) != round.handles.end()) {
+    round.expiredAt = zksim_now();
+    zksim_expire(master);
+  }
+
+  deadlineAfter(&deadline, WAIT_TIMEOUT);
+  while (master && (round.failover < 0 || round.orphan < 0) && round.done < started) {
+    if (pthread_cond_timedwait(&round.cond, &round.mutex, &deadline) != 0) break;
+  }
+
+  /* a standby never woke up, end the round */
+  if (round.failover < 0) {
+    for (size_t i = 0; i < round.handles.size(); ++i) zksim_expire(round.handles[i]);
+  }
+  *failover = round.failover >= 0 ? round.failover + (round.expiredAt - died) : -1;
+  *orphan   = round.orphan;
+  pthread_mutex_unlock(&round.mutex);
+
+  for (int i = 0; i < started; ++i) pthread_join(threads[i], 0);
+  *ops = zksim_ops() - before;
+
+  /* the task killed by the old master is not waited for */
+  while (waitpid(-1, 0, WNOHANG) > 0) {}
+
+  pthread_mutex_destroy(&round.mutex);
+  pthread_cond_destroy(&round.cond);
+  return master != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int latency = 500;
+  double scale = 1.0;
+  int timeout = 0;
+  int rounds = 100;
+  const char *faults = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:t:r:f:")) != -1) {
+    if (opt == 'l') latency = atoi(optarg);
+    else if (opt == 's') scale = atof(optarg);
+    else if (opt == 't') timeout = atoi(optarg);
+    else if (opt == 'r') rounds = atoi(optarg);
+    else if (opt == 'f') faults = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-l latency us] [-s scale] [-t session timeout ms] [-r rounds] [-f faults] [nodes]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  int nodes = optind < argc ? atoi(argv[optind]) : 3;
+  if (nodes < 2 || rounds < 1) {
+    fprintf(stderr, "a failover needs 2 nodes and a round\n");
+    return EXIT_FAILURE;
+  }
+  /* every candidate a standby, beyond the cap of DCRON_MAXRETRY */
+  ConfigOpt::setMaxRetryCap(nodes + 1);
+
+  char errbuf[ERRBUF_MAX];
+  if (faults && !ZkFault::configure(faults, errbuf)) {
+    fprintf(stderr, "%s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  zksim_config(latency, scale);
+  setenv("DCRON_ZK", "sim:2181/failbench", 1);
+  setenv("DCRON_LIBDIR", "/tmp", 0);
+  setenv("DCRON_LOGDIR", "/tmp", 0);
+  setenv("DCRON_AGENT", "none", 1);
+  setenv("DCRON_STDIOCAP", "false", 1);
+  setenv("DCRON_CGROUP", "none", 1);
+  setenv("DCRON_METRICS", "false", 1);
+
+  if (!Logger::create(std::string(getenv("DCRON_LOGDIR")) + "/failbench.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<int64_t> failovers, orphans;
+  int64_t ops = 0;
+  int stuck = 0, failed = 0;
+  for (int i = 0; i < rounds; ++i) {
+    int64_t failover, orphan, n;
+    if (!run(i, nodes, timeout, scale, &failover, &orphan, &n)) {
+      ++failed;
+      continue;
+    }
+    if (failover >= 0) {
+      failovers.push_back(failover);
+      ops += n;
+    } else {
+      ++stuck;
+    }
+    if (orphan >= 0) orphans.push_back(orphan);
+  }
+
+  std::sort(failovers.begin(), failovers.end());
+  std::sort(orphans.begin(), orphans.end());
+
+  printf("latency %dus, scale %g, session timeout %dms, faults %s\n", latency, scale, timeout, faults ? faults : "none");
+  printf("nodes %d, rounds %d, stuck %d, no master %d\n", nodes, rounds, stuck, failed);
+  if (!failovers.empty()) {
+    printf("failover  p50 %8.2fms  p99 %8.2fms  max %8.2fms  ops %5.1f/round\n", percentile(failovers, 50),
+           percentile(failovers, 99), failovers.back() / 1000.0, (double) ops / failovers.size());
+  }
+  if (!orphans.empty()) {
+    printf("orphan    p50 %8.2fms  p99 %8.2fms  max %8.2fms\n", percentile(orphans, 50), percentile(orphans, 99),
+           orphans.back() / 1000.0);
+  }
+  return failed == rounds ? EXIT_FAILURE : EXIT_SUCCESS;
+}
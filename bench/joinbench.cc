@@ -0,0 +1,261 @@
+/* worker registration under contention against zksim, a master holds the
+ * task and n candidates join at the same time
+ *   seq  ZkMgr::create of every candidate, the shipped join: one create of
+ *        workers/<id>-<seq> EPHEMERAL|SEQUENCE and the children for the
+ *        rank. the latency is the join phase of its Metrics, after the
+ *        master create failed, the ops are of the whole create
+ *   cas  the former scheme for reference, zoo_get the workers JSON array,
+ *        append, zoo_set with version, the latency and ops are of the join
+ * DCRON_MAXRETRY is n + 1, the cap of ConfigOpt raised, every candidate
+ * must be admitted and none gives up early. before the round -c
+ * candidates join and leave one after another, every one bumps the
+ * cversion of workers. the times are the virtual ones of zksim
+ * usage: joinbench [-l latency us] [-s scale] [-c churn] [cas|seq] [rounds]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <json/json.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define ERRBUF_MAX 1024
+
+static struct ACL _ALL_ACL[] = {{0x1f, {(char *) "world", (char *) "anyone"}}};
+static struct ACL_vector ALL_ACL = {1, _ALL_ACL};
+
+static double SCALE = 1.0;
+
+struct Round {
+  char name[128];
+  int  maxRetry;   // every candidate and the master fit
+  bool cas;
+  std::string workersNode;   // of cas
+  pthread_barrier_t barrier;
+};
+
+struct Candidate {
+  Round *round;
+  int    id;
+
+  int64_t latency;   // us
+  int64_t ops;       // of cas, seq counts the round
+  bool    joined;
+};
+
+static ConfigOpt *config(const Round &round, int id, char *errbuf)
+{
+  char idArg[32], nameArg[160], maxRetry[32];
+  snprintf(idArg, sizeof(idArg), "DCRON_ID=node%04d", id);
+  snprintf(nameArg, sizeof(nameArg), "DCRON_NAME=%s", round.name);
+  snprintf(maxRetry, sizeof(maxRetry), "DCRON_MAXRETRY=%d", round.maxRetry);
+  char *argv[] = {(char *) "dcron", idArg, nameArg, maxRetry, (char *) "--", (char *) "/bin/true", 0};
+  int envc;
+  return ConfigOpt::create(6, argv, &envc, errbuf);
+}
+
+/* a standby of the task for the whole round, deleted by the caller */
+static ZkMgr *join(ConfigOpt *cnf, ZkSession **session, char *errbuf)
+{
+  *session = ZkSession::create(cnf->zkhost(), cnf->zkTimeout(), errbuf);
+  return *session ? ZkMgr::create(cnf, *session, errbuf) : 0;
+}
+
+static bool joinCas(zhandle_t *zh, Candidate *c)
+{
+  char buffer[1024 * 64];
+  struct Stat stat;
+  char id[32];
+  snprintf(id, sizeof(id), "node%04d", c->id);
+
+  while (true) {
+    int bufferLen = sizeof(buffer);
+    ++c->ops;
+    if (zoo_get(zh, c->round->workersNode.c_str(), 0, buffer, &bufferLen, &stat) != ZOK) return false;
+
+    Json::Value array(Json::arrayValue);
+    if (bufferLen > 0) Json::Reader().parse(buffer, buffer + bufferLen, array);
+
+    if ((int) array.size() >= c->round->maxRetry) return false;
+    array.append(id);
+    std::string json = Json::FastWriter().write(array);
+
+    ++c->ops;
+    int rc = zoo_set(zh, c->round->workersNode.c_str(), json.c_str(), json.size(), stat.version);
+    if (rc == ZOK) return true;
+    if (rc != ZBADVERSION) return false;
+  }
+}
+
+static void *candidateRoutine(void *data)
+{
+  Candidate *c = (Candidate *) data;
+  char errbuf[ERRBUF_MAX];
+
+  if (c->round->cas) {
+    ZkSession *session = ZkSession::create(getenv("DCRON_ZK"), 15000, errbuf);
+    pthread_barrier_wait(&c->round->barrier);
+
+    int64_t begin = zksim_now();
+    c->joined  = session && joinCas(session->handle(), c);
+    c->latency = zksim_now() - begin;
+    if (session) session->release();
+    return 0;
+  }
+
+  ConfigOpt *cnf = config(*c->round, c->id, errbuf);
+  pthread_barrier_wait(&c->round->barrier);
+
+  ZkSession *session = 0;
+  ZkMgr *mgr = cnf ? join(cnf, &session, errbuf) : 0;
+  c->latency = mgr ? (int64_t) (mgr->metrics()->phase(Metrics::JOIN)->sum() / SCALE) : 0;
+  c->joined  = mgr && mgr->status() == ZkMgr::SLAVE;
+  if (!mgr) fprintf(stderr, "node%04d %s\n", c->id, errbuf);
+
+  /* everybody is counted before anybody leaves */
+  pthread_barrier_wait(&c->round->barrier);
+  delete mgr;
+  if (session) session->release();
+  delete cnf;
+  return 0;
+}
+
+inline double percentile(const std::vector<int64_t> &sorted, int pct)
+{
+  size_t i = (sorted.size() * pct) / 100;
+  return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+static bool run(int n, bool cas, int churn, int r)
+{
+  char errbuf[ERRBUF_MAX];
+  Round round;
+  round.maxRetry = n + 1;
+  round.cas = cas;
+  snprintf(round.name, sizeof(round.name), "joinbench%d.%s%dr%d.%%Y%%m%%d", (int) getpid(), cas ? "cas" : "seq", n, r);
+
+  zksim_reset();
+
+  /* the master of the task, it stays for the round */
+  ConfigOpt *cnf = config(round, 9999, errbuf);
+  ZkSession *session = 0;
+  ZkMgr *master = cnf ? join(cnf, &session, errbuf) : 0;
+  if (!master || master->status() != ZkMgr::MASTER) {
+    fprintf(stderr, "master of %s error, %s\n", round.name, master ? "not master" : errbuf);
+    return false;
+  }
+
+  if (cas) {
+    round.workersNode = "/joinbench-cas";
+    zoo_create(session->handle(), round.workersNode.c_str(), "[\"node9999\"]", 12, &ALL_ACL, 0, 0, 0);
+  }
+
+  /* a worker of the JSON array never leaves, cas has no churn */
+  for (int i = 0; i < churn && !cas; ++i) {
+    ConfigOpt *ccnf = config(round, 5000 + i, errbuf);
+    ZkSession *csession = 0;
+    delete (ccnf ? join(ccnf, &csession, errbuf) : 0);
+    if (csession) csession->release();
+    delete ccnf;
+  }
+
+  pthread_barrier_init(&round.barrier, 0, n);
+  std::vector<Candidate> cs(n);
+  std::vector<pthread_t> tids(n);
+  int64_t ops = zksim_ops();
+  for (int i = 0; i < n; ++i) {
+    cs[i].round   = &round;
+    cs[i].id      = i;
+    cs[i].latency = cs[i].ops = 0;
+    cs[i].joined  = false;
+    pthread_create(&tids[i], 0, candidateRoutine, &cs[i]);
+  }
+
+  std::vector<int64_t> latency;
+  int joined = 0;
+  int64_t casOps = 0;
+  for (int i = 0; i < n; ++i) {
+    pthread_join(tids[i], 0);
+    latency.push_back(cs[i].latency);
+    joined += cs[i].joined;
+    casOps += cs[i].ops;
+  }
+  ops = cas ? casOps : zksim_ops() - ops;
+  pthread_barrier_destroy(&round.barrier);
+  std::sort(latency.begin(), latency.end());
+
+  printf("%-4s %4d candidates  joined %d of %d  ops %6lld (%5.1f/node)  p50 %8.2fms  p99 %8.2fms  max %8.2fms\n",
+         cas ? "cas" : "seq", n, joined, n, (long long) ops, (double) ops / n,
+         percentile(latency, 50), percentile(latency, 99), latency.back() / 1000.0);
+
+  delete master;
+  session->release();
+  delete cnf;
+  return joined == n;
+}
+
+int main(int argc, char *argv[])
+{
+  int latency = 1000;
+  double scale = 1.0;
+  int churn = 4;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:c:")) != -1) {
+    if (opt == 'l') latency = atoi(optarg);
+    else if (opt == 's') scale = atof(optarg);
+    else if (opt == 'c') churn = atoi(optarg);
+    else {
+      fprintf(stderr, "usage: %s [-l latency us] [-s scale] [-c churn] [cas|seq] [rounds]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const char *mode = optind < argc ? argv[optind] : "all";
+  int rounds = optind + 1 < argc ? atoi(argv[optind + 1]) : 1;
+
+  struct rlimit rlmt;
+  if (getrlimit(RLIMIT_NOFILE, &rlmt) == 0) {
+    rlmt.rlim_cur = rlmt.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlmt);
+  }
+
+  zksim_config(latency, scale);
+  SCALE = scale > 0 ? scale : 1.0;
+  setenv("DCRON_ZK", "sim:2181/joinbench", 1);
+  setenv("DCRON_LIBDIR", "/tmp", 0);
+  setenv("DCRON_LOGDIR", "/tmp", 0);
+  setenv("DCRON_AGENT", "none", 1);
+  setenv("DCRON_STDIOCAP", "false", 1);
+  setenv("DCRON_CGROUP", "none", 1);
+  setenv("DCRON_METRICS", "false", 1);
+  setenv("DCRON_ELECT_WAIT", "0", 1);
+
+  if (!Logger::create(std::string(getenv("DCRON_LOGDIR")) + "/joinbench.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  int sizes[] = {2, 10, 50, 200};
+  ConfigOpt::setMaxRetryCap(*std::max_element(sizes, sizes + sizeof(sizes) / sizeof(sizes[0])) + 1);
+  printf("latency %dus, scale %g, churn %d, DCRON_MAXRETRY candidates + 1\n", latency, scale, churn);
+  bool ok = true;
+  for (int r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      if (strcmp(mode, "seq") != 0) ok = run(sizes[i], true, churn, r) && ok;
+      if (strcmp(mode, "cas") != 0) ok = run(sizes[i], false, churn, r) && ok;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
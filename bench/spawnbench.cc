@@ -0,0 +1,131 @@
+/* spawn latency of the task, fork + execve as ZkMgr::exec did against
+ * Spawner, clone(CLONE_VM | CLONE_VFORK) with the environment in an arena
+ *   the latency is until the child has called execve, a pipe closed on exec
+ *   the parent has <rss> MB of touched memory, fork copies its page table
+ *   the environment has <keys> llap checkpoint keys, fork strdups each one
+ * usage: spawnbench [rounds] [keys] [rss MB]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "spawner.h"
+
+extern char **environ;
+
+inline long nowUs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static void report(const char *mode, std::vector<long> &latency)
+{
+  if (latency.empty()) return;
+
+  size_t n = latency.size();
+  std::sort(latency.begin(), latency.end());
+  printf("%-8s runs %4d  p50 %7.3fms  p99 %7.3fms  max %7.3fms\n", mode, (int) n,
+         latency[n / 2] / 1000.0, latency[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1000.0,
+         latency[n - 1] / 1000.0);
+}
+
+/* blocks until the child has called execve or exited */
+inline void waitExec(int fd)
+{
+  char c;
+  while (read(fd, &c, 1) > 0);
+}
+
+static pid_t forkExec(char *argv[], const std::vector<std::string> &env)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, 0);
+
+    std::vector<char *> *envp = new std::vector<char *>;
+    for (size_t i = 0; i < env.size(); ++i) envp->push_back(strdup(env[i].c_str()));
+    for (int j = 0; environ[j]; ++j) envp->push_back(environ[j]);
+    envp->push_back(0);
+
+    execve(argv[0], argv, &(*envp)[0]);
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+int main(int argc, char *argv[])
+{
+  int rounds = argc > 1 ? atoi(argv[1]) : 1000;
+  int keys   = argc > 2 ? atoi(argv[2]) : 100;
+  int rss    = argc > 3 ? atoi(argv[3]) : 512;
+
+  std::vector<char> memory((size_t) rss * 1024 * 1024);
+  for (size_t i = 0; i < memory.size(); i += 4096) memory[i] = 1;
+
+  std::vector<std::string> env;
+  for (int i = 0; i < keys; ++i) {
+    char entry[64];
+    snprintf(entry, sizeof(entry), "DCRON_KEY%d=%020d", i, i);
+    env.push_back(entry);
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, 0);
+
+  char *targv[] = {(char *) "/bin/true", 0};
+  std::vector<long> forkLatency, spawnLatency;
+
+  Spawner spawner;
+  for (size_t i = 0; i < env.size(); ++i) spawner.addEnv(env[i].c_str());
+  for (int j = 0; environ[j]; ++j) spawner.addEnv(environ[j]);
+
+  for (int round = 0; round < rounds; ++round) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return EXIT_FAILURE;
+
+    long begin = nowUs();
+    pid_t pid = forkExec(targv, env);
+    close(fds[1]);
+    waitExec(fds[0]);
+    forkLatency.push_back(nowUs() - begin);
+    close(fds[0]);
+    waitpid(pid, 0, 0);
+
+    if (pipe2(fds, O_CLOEXEC) == -1) return EXIT_FAILURE;
+
+    int pidfd;
+    begin = nowUs();
+    pid = spawner.spawn(targv, &pidfd);
+    close(fds[1]);
+    waitExec(fds[0]);
+    spawnLatency.push_back(nowUs() - begin);
+    close(fds[0]);
+    if (pidfd != -1) close(pidfd);
+    if (pid == -1 || spawner.step() != Spawner::NONE) {
+      fprintf(stderr, "spawn error, %s %s\n", Spawner::stepToString(spawner.step()), strerror(errno));
+      return EXIT_FAILURE;
+    }
+    waitpid(pid, 0, 0);
+  }
+
+  printf("rss %dMB, %d keys\n", rss, keys);
+  report("fork", forkLatency);
+  report("spawner", spawnLatency);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/* startup latency of ZkMgr::create, the serial zoo_* calls against the
+ * pipelined state machine, DCRON_ZKPIPELINE=false|true
+ *   cold    the first run of a task, the parents of the taskid dir are created
+ *   master  a new taskid of the same task, the first node becomes master
+ *   slave   a second node of the same taskid, master exists
+ *
+ * the master of the serial path reads the llap checkpoint in exec with one
+ * more round trip, the pipelined path reads it during startup
+ * links zksim in place of libzookeeper_mt, -l is the latency of every op
+ * usage: startbench [-l latency us] [-s scale] [-p serial|pipeline] [rounds]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define ERRBUF_MAX 1024
+
+inline long nowUs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static void report(const char *mode, const char *what, std::vector<long> &latency)
+{
+  if (latency.empty()) return;
+
+  size_t n = latency.size();
+  std::sort(latency.begin(), latency.end());
+  printf("%-8s %-6s runs %4d  p50 %7.2fms  p99 %7.2fms  max %7.2fms\n", mode, what, (int) n,
+         latency[n / 2] / 1000.0, latency[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1000.0,
+         latency[n - 1] / 1000.0);
+}
+
+static bool run(ZkSession *s1, ZkSession *s2, bool pipeline, int rounds)
+{
+  const char *mode = pipeline ? "pipeline" : "serial";
+  std::vector<long> cold, master, slave;
+
+  for (int round = 0; round < rounds; ++round) {
+    char task[128];
+    snprintf(task, sizeof(task), "startbench%d.%s%d.%%Y", (int) getpid(), mode, round);
+
+    for (int i = 0; i < 2; ++i) {
+      char name[256];
+      if (i == 0) snprintf(name, sizeof(name), "%s", task);
+      else snprintf(name, sizeof(name), "startbench%d.%s%d.again%%Y", (int) getpid(), mode, round);
+
+      char errbuf[ERRBUF_MAX];
+      std::string nameArg = std::string("DCRON_NAME=") + name;
+      char *argv[] = {(char *) "dcron", (char *) "DCRON_ID=node-a", (char *) nameArg.c_str(),
+                      (char *) (pipeline ? "DCRON_ZKPIPELINE=true" : "DCRON_ZKPIPELINE=false"),
+                      (char *) "DCRON_ELECT_WAIT=0", (char *) "--", (char *) "true", 0};
+      int envc;
+      ConfigOpt *cnfA = ConfigOpt::create(7, argv, &envc, errbuf);
+      argv[1] = (char *) "DCRON_ID=node-b";
+      ConfigOpt *cnfB = ConfigOpt::create(7, argv, &envc, errbuf);
+      if (!cnfA || !cnfB) {
+        fprintf(stderr, "config error, %s\n", errbuf);
+        return false;
+      }
+
+      long begin = nowUs();
+      ZkMgr *a = ZkMgr::create(cnfA, s1, errbuf);
+      long latencyA = nowUs() - begin;
+      if (!a || a->status() != ZkMgr::MASTER) {
+        fprintf(stderr, "%s node-a %s\n", name, a ? ZkMgr::statusToString(a->status()) : errbuf);
+        return false;
+      }
+
+      begin = nowUs();
+      ZkMgr *b = ZkMgr::create(cnfB, s2, errbuf);
+      long latencyB = nowUs() - begin;
+      if (!b || b->status() != ZkMgr::SLAVE) {
+        fprintf(stderr, "%s node-b %s\n", name, b ? ZkMgr::statusToString(b->status()) : errbuf);
+        return false;
+      }
+
+      (i == 0 ? cold : master).push_back(latencyA);
+      slave.push_back(latencyB);
+
+      delete b;
+      delete a;
+      delete cnfB;
+      delete cnfA;
+    }
+  }
+
+  report(mode, "cold", cold);
+  report(mode, "master", master);
+  report(mode, "slave", slave);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  int latency = 1000;
+  double scale = 1.0;
+  const char *mode = "all";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:p:")) != -1) {
+    if (opt == 'l') latency = atoi(optarg);
+    else if (opt == 's') scale = atof(optarg);
+    else if (opt == 'p') mode = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-l latency us] [-s scale] [-p serial|pipeline] [rounds]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  int rounds = optind < argc ? atoi(argv[optind]) : 100;
+
+  zksim_config(latency, scale);
+  setenv("DCRON_ZK", "sim:2181/startbench", 1);
+  setenv("DCRON_LIBDIR", "/tmp", 0);
+  setenv("DCRON_LOGDIR", "/tmp", 0);
+  setenv("DCRON_AGENT", "none", 1);
+
+  if (!Logger::create(std::string(getenv("DCRON_LOGDIR")) + "/startbench.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  char errbuf[ERRBUF_MAX];
+  ZkSession *s1 = ZkSession::create("sim:2181", 15000, errbuf);
+  ZkSession *s2 = s1 ? ZkSession::create("sim:2181", 15000, errbuf) : 0;
+  if (!s1 || !s2) {
+    fprintf(stderr, "%s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  if (strcmp(mode, "pipeline") != 0) ok = ok && run(s1, s2, false, rounds);
+  if (strcmp(mode, "serial") != 0) ok = ok && run(s1, s2, true, rounds);
+
+  s2->release();
+  s1->release();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1073 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "zksim.h"
+
+extern "C" {
+const int ZOO_PERM_READ   = 1 << 0;
+const int ZOO_PERM_WRITE  = 1 << 1;
+const int ZOO_PERM_CREATE = 1 << 2;
+const int ZOO_PERM_DELETE = 1 << 3;
+const int ZOO_PERM_ADMIN  = 1 << 4;
+const int ZOO_PERM_ALL    = 0x1f;
+
+const int ZOO_EPHEMERAL = 1 << 0;
+const int ZOO_SEQUENCE  = 1 << 1;
+
+const int ZOO_EXPIRED_SESSION_STATE = -112;
+const int ZOO_AUTH_FAILED_STATE     = -113;
+const int ZOO_CONNECTING_STATE      = 1;
+const int ZOO_ASSOCIATING_STATE     = 2;
+const int ZOO_CONNECTED_STATE       = 3;
+
+const int ZOO_CREATED_EVENT     = 1;
+const int ZOO_DELETED_EVENT     = 2;
+const int ZOO_CHANGED_EVENT     = 3;
+const int ZOO_CHILD_EVENT       = 4;
+const int ZOO_SESSION_EVENT     = -1;
+const int ZOO_NOTWATCHING_EVENT = -2;
+
+const int ZOOKEEPER_WRITE = 1 << 0;
+const int ZOOKEEPER_READ  = 1 << 1;
+
+static char WORLD[]  = "world";
+static char ANYONE[] = "anyone";
+static struct ACL OPEN_ACL[] = {{0x1f, {WORLD, ANYONE}}};
+struct ACL_vector ZOO_OPEN_ACL_UNSAFE = {1, OPEN_ACL};
+}
+
+struct SimNode {
+  std::string data;
+  bool        null;
+  struct Stat stat;
+  std::set<std::string> children;
+};
+typedef std::map<std::string, SimNode> SimTree;
+
+struct SimWatch {
+  zhandle_t  *zh;
+  watcher_fn  fn;
+  void       *ctx;
+};
+typedef std::multimap<std::string, SimWatch> SimWatches;
+
+struct SimEvent {
+  enum Kind { WATCH, VOID, STAT, DATA, STRINGS, STRING, MULTI };
+
+  Kind        kind;
+  int64_t     due;
+  watcher_fn  wfn;
+  void       *wctx;
+  int         type;
+  int         state;
+  std::string path;
+
+  int         rc;
+  const void *data;
+  void       *cb;
+  struct Stat stat;
+  bool        hasStat;
+  std::string value;
+  std::vector<std::string> strings;
+};
+
+struct _zhandle {
+  int64_t     session;
+  clientid_t  cid;
+  watcher_fn  fn;
+  void       *ctx;
+  int         state;
+  int         timeout;
+  bool        closing;
+
+  pthread_t       thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  std::deque<SimEvent> queue;
+};
+
+static pthread_mutex_t SIM_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static SimTree    SIM_TREE;
+static SimWatches SIM_EXIST_WATCHES;
+static SimWatches SIM_DATA_WATCHES;
+static SimWatches SIM_CHILD_WATCHES;
+static std::set<zhandle_t *> SIM_HANDLES;
+static int64_t SIM_ZXID    = 0;
+static int64_t SIM_SESSION = 0x1000;
+static int64_t SIM_OPS     = 0;
+static int64_t SIM_OP_COUNTS[ZKSIM_OP_MAX];
+static int     SIM_LATENCY[ZKSIM_OP_MAX];
+static double  SIM_SCALE   = 1.0;
+static int64_t SIM_EPOCH   = 0;
+
+static int64_t realMicros()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * (int64_t) 1000000 + tv.tv_usec;
+}
+
+static void realSleep(int64_t us)
+{
+  if (us <= 0) return;
+  struct timespec spec = { (time_t) (us / 1000000), (long) (us % 1000000) * 1000 };
+  while (nanosleep(&spec, &spec) == -1 && errno == EINTR);
+}
+
+static int64_t latencyReal(int op)
+{
+  return (int64_t) (SIM_LATENCY[op] * SIM_SCALE);
+}
+
+void zksim_config(int latencyUs, double scale)
+{
+  for (int op = 0; op < ZKSIM_OP_MAX; ++op) SIM_LATENCY[op] = latencyUs;
+  SIM_SCALE = scale > 0 ? scale : 1.0;
+}
+
+void zksim_latency(int op, int latencyUs)
+{
+  if (op >= 0 && op < ZKSIM_OP_MAX) SIM_LATENCY[op] = latencyUs;
+}
+
+int64_t zksim_now()
+{
+  if (SIM_EPOCH == 0) SIM_EPOCH = realMicros();
+  return (int64_t) ((realMicros() - SIM_EPOCH) / SIM_SCALE);
+}
+
+int64_t zksim_ops()
+{
+  return __sync_fetch_and_add(&SIM_OPS, 0);
+}
+
+int64_t zksim_op_count(int op)
+{
+  return op >= 0 && op < ZKSIM_OP_MAX ? __sync_fetch_and_add(&SIM_OP_COUNTS[op], 0) : 0;
+}
+
+static void initRoot()
+{
+  if (SIM_TREE.find("/") != SIM_TREE.end()) return;
+  SimNode &root = SIM_TREE["/"];
+  root.null = true;
+  memset(&root.stat, 0, sizeof(root.stat));
+  root.stat.dataLength = -1;
+}
+
+void zksim_reset()
+{
+  pthread_mutex_lock(&SIM_MUTEX);
+  SIM_TREE.clear();
+  SIM_EXIST_WATCHES.clear();
+  SIM_DATA_WATCHES.clear();
+  SIM_CHILD_WATCHES.clear();
+  SIM_OPS = 0;
+  memset(SIM_OP_COUNTS, 0, sizeof(SIM_OP_COUNTS));
+  SIM_EPOCH = realMicros();
+  initRoot();
+  pthread_mutex_unlock(&SIM_MUTEX);
+}
+
+/* event delivery, the queue is drained by the session thread */
+
+static void post(zhandle_t *zh, const SimEvent &ev)
+{
+  pthread_mutex_lock(&zh->mutex);
+  zh->queue.push_back(ev);
+  pthread_mutex_unlock(&zh->mutex);
+  pthread_cond_signal(&zh->cond);
+}
+
+static SimEvent watchEvent(const SimWatch &w, int type, int state, const std::string &path)
+{
+  SimEvent ev;
+  ev.kind  = SimEvent::WATCH;
+  ev.due   = 0;
+  ev.wfn   = w.fn;
+  ev.wctx  = w.ctx;
+  ev.type  = type;
+  ev.state = state;
+  ev.path  = path;
+  ev.rc = 0; ev.data = 0; ev.cb = 0; ev.hasStat = false;
+  return ev;
+}
+
+static SimEvent makeCompletion(SimEvent::Kind kind, int op, void *cb, int rc, const void *data)
+{
+  SimEvent ev;
+  ev.kind = kind;
+  ev.due  = realMicros() + latencyReal(op);
+  ev.wfn  = 0; ev.wctx = 0; ev.type = 0; ev.state = 0;
+  ev.rc   = rc;
+  ev.data = data;
+  ev.cb   = cb;
+  ev.hasStat = false;
+  return ev;
+}
+
+static void deliver(zhandle_t *zh, SimEvent &ev)
+{
+  switch (ev.kind) {
+  case SimEvent::WATCH:
+    ev.wfn(zh, ev.type, ev.state, ev.path.c_str(), ev.wctx);
+    break;
+  case SimEvent::VOID:
+  case SimEvent::MULTI:
+    if (ev.cb) ((void_completion_t) ev.cb)(ev.rc, ev.data);
+    break;
+  case SimEvent::STAT:
+    if (ev.cb) ((stat_completion_t) ev.cb)(ev.rc, ev.hasStat ? &ev.stat : 0, ev.data);
+    break;
+  case SimEvent::DATA:
+    if (ev.cb) ((data_completion_t) ev.cb)(ev.rc, ev.rc == ZOK ? ev.value.data() : 0,
+                                           ev.rc == ZOK ? (int) ev.value.size() : 0,
+                                           ev.hasStat ? &ev.stat : 0, ev.data);
+    break;
+  case SimEvent::STRING:
+    if (ev.cb) ((string_completion_t) ev.cb)(ev.rc, ev.rc == ZOK ? ev.value.c_str() : 0, ev.data);
+    break;
+  case SimEvent::STRINGS: {
+    struct String_vector sv = {0, 0};
+    std::vector<char *> ptrs;
+    for (size_t i = 0; i < ev.strings.size(); ++i) ptrs.push_back((char *) ev.strings[i].c_str());
+    sv.count = (int32_t) ptrs.size();
+    sv.data  = ptrs.empty() ? 0 : &ptrs[0];
+    if (ev.cb) ((strings_completion_t) ev.cb)(ev.rc, ev.rc == ZOK ? &sv : 0, ev.data);
+    break;
+  }
+  }
+}
+
+static void *dispatch(void *data)
+{
+  zhandle_t *zh = (zhandle_t *) data;
+  pthread_mutex_lock(&zh->mutex);
+  while (true) {
+    while (zh->queue.empty() && !zh->closing) pthread_cond_wait(&zh->cond, &zh->mutex);
+    if (zh->queue.empty() && zh->closing) break;
+
+    SimEvent ev = zh->queue.front();
+    zh->queue.pop_front();
+    pthread_mutex_unlock(&zh->mutex);
+
+    realSleep(ev.due - realMicros());
+    deliver(zh, ev);
+
+    pthread_mutex_lock(&zh->mutex);
+  }
+  pthread_mutex_unlock(&zh->mutex);
+  return 0;
+}
+
+/* tree operations, all called with SIM_MUTEX held */
+
+struct SimTrigger {
+  std::string path;
+  int type;
+  bool child;   // fire child watches of path instead of data watches
+};
+
+static std::string parentOf(const std::string &path)
+{
+  size_t slash = path.rfind('/');
+  if (slash == 0 || slash == std::string::npos) return "/";
+  return path.substr(0, slash);
+}
+
+static std::string nameOf(const std::string &path)
+{
+  return path.substr(path.rfind('/') + 1);
+}
+
+static bool validPath(const char *path)
+{
+  if (!path || path[0] != '/') return false;
+  size_t len = strlen(path);
+  if (len > 1 && path[len-1] == '/') return false;
+  return strstr(path, "//") == 0;
+}
+
+static int64_t nowMillis()
+{
+  return realMicros() / 1000;
+}
+
+static int doCreate(SimTree *tree, zhandle_t *zh, const char *path, const char *value, int valuelen,
+                    int flags, std::string *created, std::vector<SimTrigger> *triggers)
+{
+  if (!validPath(path)) return ZBADARGUMENTS;
+  std::string p(path);
+  if (p == "/") return ZNODEEXISTS;
+
+  std::string parent = parentOf(p);
+  SimTree::iterator pite = tree->find(parent);
+  if (pite == tree->end()) return ZNONODE;
+  if (pite->second.stat.ephemeralOwner != 0) return ZNOCHILDRENFOREPHEMERALS;
+
+  if (flags & ZOO_SEQUENCE) {
+    char seq[16];
+    snprintf(seq, 16, "%010d", pite->second.stat.cversion);
+    p.append(seq);
+  }
+  if (tree->find(p) != tree->end()) return ZNODEEXISTS;
+
+  int64_t zxid = ++SIM_ZXID;
+  SimNode &node = (*tree)[p];
+  node.null = (value == 0 || valuelen < 0);
+  if (!node.null) node.data.assign(value, valuelen);
+  memset(&node.stat, 0, sizeof(node.stat));
+  node.stat.czxid = node.stat.mzxid = node.stat.pzxid = zxid;
+  node.stat.ctime = node.stat.mtime = nowMillis();
+  node.stat.dataLength = node.null ? 0 : valuelen;
+  node.stat.ephemeralOwner = (flags & ZOO_EPHEMERAL) ? zh->session : 0;
+
+  SimNode &pnode = (*tree)[parent];
+  pnode.children.insert(nameOf(p));
+  pnode.stat.cversion++;
+  pnode.stat.numChildren = (int32_t) pnode.children.size();
+  pnode.stat.pzxid = zxid;
+
+  if (created) *created = p;
+
+  SimTrigger t1 = {p, ZOO_CREATED_EVENT, false};
+  SimTrigger t2 = {parent, ZOO_CHILD_EVENT, true};
+  triggers->push_back(t1);
+  triggers->push_back(t2);
+  return ZOK;
+}
+
+static int doDelete(SimTree *tree, const char *path, int version, std::vector<SimTrigger> *triggers)
+{
+  if (!validPath(path)) return ZBADARGUMENTS;
+  std::string p(path);
+  if (p == "/") return ZBADARGUMENTS;
+
+  SimTree::iterator ite = tree->find(p);
+  if (ite == tree->end()) return ZNONODE;
+  if (version != -1 && ite->second.stat.version != version) return ZBADVERSION;
+  if (!ite->second.children.empty()) return ZNOTEMPTY;
+  tree->erase(ite);
+
+  std::string parent = parentOf(p);
+  SimNode &pnode = (*tree)[parent];
+  pnode.children.erase(nameOf(p));
+  pnode.stat.cversion++;
+  pnode.stat.numChildren = (int32_t) pnode.children.size();
+  pnode.stat.pzxid = ++SIM_ZXID;
+
+  SimTrigger t1 = {p, ZOO_DELETED_EVENT, false};
+  SimTrigger t2 = {parent, ZOO_CHILD_EVENT, true};
+  triggers->push_back(t1);
+  triggers->push_back(t2);
+  return ZOK;
+}
+
+static int doSet(SimTree *tree, const char *path, const char *buffer, int buflen, int version,
+                 struct Stat *stat, std::vector<SimTrigger> *triggers)
+{
+  if (!validPath(path)) return ZBADARGUMENTS;
+  SimTree::iterator ite = tree->find(path);
+  if (ite == tree->end()) return ZNONODE;
+
+  SimNode &node = ite->second;
+  if (version != -1 && node.stat.version != version) return ZBADVERSION;
+
+  node.null = (buffer == 0 || buflen < 0);
+  if (node.null) node.data.clear();
+  else node.data.assign(buffer, buflen);
+  node.stat.version++;
+  node.stat.mzxid = ++SIM_ZXID;
+  node.stat.mtime = nowMillis();
+  node.stat.dataLength = (int32_t) node.data.size();
+  if (stat) *stat = node.stat;
+
+  SimTrigger t = {path, ZOO_CHANGED_EVENT, false};
+  triggers->push_back(t);
+  return ZOK;
+}
+
+static int doCheck(SimTree *tree, const char *path, int version)
+{
+  SimTree::iterator ite = tree->find(path);
+  if (ite == tree->end()) return ZNONODE;
+  if (version != -1 && ite->second.stat.version != version) return ZBADVERSION;
+  return ZOK;
+}
+
+static void fireWatches(SimWatches *watches, const std::string &path, int type)
+{
+  std::pair<SimWatches::iterator, SimWatches::iterator> range = watches->equal_range(path);
+  for (SimWatches::iterator ite = range.first; ite != range.second; ++ite) {
+    post(ite->second.zh, watchEvent(ite->second, type, ZOO_CONNECTED_STATE, path));
+  }
+  watches->erase(range.first, range.second);
+}
+
+static void fire(const std::vector<SimTrigger> &triggers)
+{
+  for (size_t i = 0; i < triggers.size(); ++i) {
+    const SimTrigger &t = triggers[i];
+    if (t.child) {
+      fireWatches(&SIM_CHILD_WATCHES, t.path, ZOO_CHILD_EVENT);
+    } else {
+      fireWatches(&SIM_EXIST_WATCHES, t.path, t.type);
+      if (t.type != ZOO_CREATED_EVENT) fireWatches(&SIM_DATA_WATCHES, t.path, t.type);
+      if (t.type == ZOO_DELETED_EVENT) fireWatches(&SIM_CHILD_WATCHES, t.path, ZOO_DELETED_EVENT);
+    }
+  }
+}
+
+static void addWatch(SimWatches *watches, zhandle_t *zh, const char *path, watcher_fn fn, void *ctx)
+{
+  SimWatch w = {zh, fn ? fn : zh->fn, fn ? ctx : zh->ctx};
+  watches->insert(std::make_pair(std::string(path), w));
+}
+
+static void dropWatches(SimWatches *watches, zhandle_t *zh, bool notify)
+{
+  for (SimWatches::iterator ite = watches->begin(); ite != watches->end(); /**/) {
+    if (ite->second.zh == zh) {
+      if (notify) post(zh, watchEvent(ite->second, ZOO_SESSION_EVENT, ZOO_EXPIRED_SESSION_STATE, ""));
+      watches->erase(ite++);
+    } else {
+      ++ite;
+    }
+  }
+}
+
+static void dropEphemerals(zhandle_t *zh)
+{
+  std::vector<std::string> paths;
+  for (SimTree::iterator ite = SIM_TREE.begin(); ite != SIM_TREE.end(); ++ite) {
+    if (ite->second.stat.ephemeralOwner == zh->session) paths.push_back(ite->first);
+  }
+
+  std::vector<SimTrigger> triggers;
+  for (size_t i = 0; i < paths.size(); ++i) doDelete(&SIM_TREE, paths[i].c_str(), -1, &triggers);
+  fire(triggers);
+}
+
+/* request entry, returns false when the session is not usable */
+static bool enter(zhandle_t *zh, int op, int *rc)
+{
+  __sync_fetch_and_add(&SIM_OPS, 1);
+  __sync_fetch_and_add(&SIM_OP_COUNTS[op], 1);
+  if (zh->state == ZOO_EXPIRED_SESSION_STATE) {
+    *rc = ZINVALIDSTATE;
+    return false;
+  }
+  return true;
+}
+
+extern "C" {
+
+const char *zerror(int c)
+{
+  switch (c) {
+  case ZOK: return "ok";
+  case ZSYSTEMERROR: return "system error";
+  case ZRUNTIMEINCONSISTENCY: return "run time inconsistency";
+  case ZDATAINCONSISTENCY: return "data inconsistency";
+  case ZCONNECTIONLOSS: return "connection loss";
+  case ZMARSHALLINGERROR: return "marshalling error";
+  case ZUNIMPLEMENTED: return "unimplemented";
+  case ZOPERATIONTIMEOUT: return "operation timeout";
+  case ZBADARGUMENTS: return "bad arguments";
+  case ZINVALIDSTATE: return "invalid zhandle state";
+  case ZAPIERROR: return "api error";
+  case ZNONODE: return "no node";
+  case ZNOAUTH: return "not authenticated";
+  case ZBADVERSION: return "bad version";
+  case ZNOCHILDRENFOREPHEMERALS: return "no children for ephemerals";
+  case ZNODEEXISTS: return "node exists";
+  case ZNOTEMPTY: return "not empty";
+  case ZSESSIONEXPIRED: return "session expired";
+  case ZINVALIDCALLBACK: return "invalid callback";
+  case ZINVALIDACL: return "invalid acl";
+  case ZAUTHFAILED: return "authentication failed";
+  case ZCLOSING: return "zookeeper is closing";
+  case ZNOTHING: return "(not error) no server responses to process";
+  case ZSESSIONMOVED: return "session moved to another server, so operation is ignored";
+  }
+  return "unknown error";
+}
+
+void zoo_set_debug_level(ZooLogLevel) {}
+void zoo_set_log_stream(FILE *) {}
+
+zhandle_t *zookeeper_init(const char *, watcher_fn fn, int recv_timeout, const clientid_t *clientid,
+                          void *context, int)
+{
+  zhandle_t *zh = new zhandle_t;
+  zh->fn      = fn;
+  zh->ctx     = context;
+  zh->state   = ZOO_CONNECTED_STATE;
+  zh->timeout = recv_timeout;
+  zh->closing = false;
+  pthread_mutex_init(&zh->mutex, 0);
+  pthread_cond_init(&zh->cond, 0);
+
+  /* the client id of a live session joins it */
+  pthread_mutex_lock(&SIM_MUTEX);
+  initRoot();
+  zh->session = ++SIM_SESSION;
+  for (std::set<zhandle_t *>::iterator ite = SIM_HANDLES.begin(); clientid && ite != SIM_HANDLES.end(); ++ite) {
+    if ((*ite)->session == clientid->client_id && (*ite)->state != ZOO_EXPIRED_SESSION_STATE) {
+      zh->session = clientid->client_id;
+    }
+  }
+  memset(&zh->cid, 0, sizeof(zh->cid));
+  zh->cid.client_id = zh->session;
+  SIM_HANDLES.insert(zh);
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  if (pthread_create(&zh->thread, 0, dispatch, zh) != 0) {
+    delete zh;
+    errno = EAGAIN;
+    return 0;
+  }
+
+  if (fn) {
+    SimWatch w = {zh, fn, context};
+    post(zh, watchEvent(w, ZOO_SESSION_EVENT, ZOO_CONNECTED_STATE, ""));
+  }
+  return zh;
+}
+
+static void expire(zhandle_t *zh);
+
+/* closing the session expires the other handles of it */
+int zookeeper_close(zhandle_t *zh)
+{
+  if (!zh) return ZBADARGUMENTS;
+
+  pthread_mutex_lock(&SIM_MUTEX);
+  SIM_HANDLES.erase(zh);
+  if (zh->state != ZOO_EXPIRED_SESSION_STATE) dropEphemerals(zh);
+  dropWatches(&SIM_EXIST_WATCHES, zh, false);
+  dropWatches(&SIM_DATA_WATCHES, zh, false);
+  dropWatches(&SIM_CHILD_WATCHES, zh, false);
+  for (std::set<zhandle_t *>::iterator ite = SIM_HANDLES.begin(); ite != SIM_HANDLES.end(); ++ite) {
+    if ((*ite)->session == zh->session) expire(*ite);
+  }
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  pthread_mutex_lock(&zh->mutex);
+  zh->closing = true;
+  pthread_mutex_unlock(&zh->mutex);
+  pthread_cond_signal(&zh->cond);
+
+  if (pthread_equal(zh->thread, pthread_self())) {
+    pthread_detach(zh->thread);  // handle leaks, like closing from a callback
+  } else {
+    pthread_join(zh->thread, 0);
+    pthread_mutex_destroy(&zh->mutex);
+    pthread_cond_destroy(&zh->cond);
+    delete zh;
+  }
+  return ZOK;
+}
+
+/* called with SIM_MUTEX held */
+static void expire(zhandle_t *zh)
+{
+  if (zh->state == ZOO_EXPIRED_SESSION_STATE) return;
+
+  zh->state = ZOO_EXPIRED_SESSION_STATE;
+  dropEphemerals(zh);
+  dropWatches(&SIM_EXIST_WATCHES, zh, true);
+  dropWatches(&SIM_DATA_WATCHES, zh, true);
+  dropWatches(&SIM_CHILD_WATCHES, zh, true);
+  if (zh->fn) {
+    SimWatch w = {zh, zh->fn, zh->ctx};
+    post(zh, watchEvent(w, ZOO_SESSION_EVENT, ZOO_EXPIRED_SESSION_STATE, ""));
+  }
+}
+
+void zksim_expire(zhandle_t *zh)
+{
+  pthread_mutex_lock(&SIM_MUTEX);
+  expire(zh);
+  pthread_mutex_unlock(&SIM_MUTEX);
+}
+
+int zksim_touch(const char *path, int64_t mtime)
+{
+  pthread_mutex_lock(&SIM_MUTEX);
+  SimTree::iterator ite = SIM_TREE.find(path);
+  int rc = ZNONODE;
+  if (ite != SIM_TREE.end()) {
+    ite->second.stat.mtime = mtime;
+    rc = ZOK;
+  }
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+const clientid_t *zoo_client_id(zhandle_t *zh) { return &zh->cid; }
+int zoo_recv_timeout(zhandle_t *zh) { return zh->timeout; }
+int zoo_state(zhandle_t *zh) { return zh->state; }
+const void *zoo_get_context(zhandle_t *zh) { return zh->ctx; }
+void zoo_set_context(zhandle_t *zh, void *context) { zh->ctx = context; }
+
+int zookeeper_interest(zhandle_t *, int *fd, int *interest, struct timeval *tv)
+{
+  *fd = -1;
+  *interest = 0;
+  tv->tv_sec = 1;
+  tv->tv_usec = 0;
+  return ZOK;
+}
+
+int zookeeper_process(zhandle_t *, int) { return ZOK; }
+
+int deallocate_String_vector(struct String_vector *v)
+{
+  if (v->data) {
+    for (int i = 0; i < v->count; ++i) free(v->data[i]);
+    free(v->data);
+    v->data = 0;
+  }
+  v->count = 0;
+  return 0;
+}
+
+static void fillStrings(const std::set<std::string> &children, struct String_vector *strings)
+{
+  strings->count = (int32_t) children.size();
+  strings->data  = children.empty() ? 0 : (char **) calloc(children.size(), sizeof(char *));
+  int i = 0;
+  for (std::set<std::string>::const_iterator ite = children.begin(); ite != children.end(); ++ite) {
+    strings->data[i++] = strdup(ite->c_str());
+  }
+}
+
+/* sync api */
+
+int zoo_create(zhandle_t *zh, const char *path, const char *value, int valuelen,
+               const struct ACL_vector *, int flags, char *path_buffer, int path_buffer_len)
+{
+  realSleep(latencyReal(ZKSIM_CREATE));
+  int rc;
+  if (!enter(zh, ZKSIM_CREATE, &rc)) return rc;
+
+  std::string created;
+  std::vector<SimTrigger> triggers;
+  pthread_mutex_lock(&SIM_MUTEX);
+  rc = doCreate(&SIM_TREE, zh, path, value, valuelen, flags, &created, &triggers);
+  fire(triggers);
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  if (rc == ZOK && path_buffer && path_buffer_len > 0) {
+    snprintf(path_buffer, path_buffer_len, "%s", created.c_str());
+  }
+  return rc;
+}
+
+int zoo_delete(zhandle_t *zh, const char *path, int version)
+{
+  realSleep(latencyReal(ZKSIM_DELETE));
+  int rc;
+  if (!enter(zh, ZKSIM_DELETE, &rc)) return rc;
+
+  std::vector<SimTrigger> triggers;
+  pthread_mutex_lock(&SIM_MUTEX);
+  rc = doDelete(&SIM_TREE, path, version, &triggers);
+  fire(triggers);
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+static int existsImpl(zhandle_t *zh, const char *path, watcher_fn fn, void *ctx, bool watch, struct Stat *stat)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_EXISTS, &rc)) return rc;
+
+  pthread_mutex_lock(&SIM_MUTEX);
+  SimTree::iterator ite = SIM_TREE.find(path);
+  if (ite == SIM_TREE.end()) {
+    rc = ZNONODE;
+  } else {
+    rc = ZOK;
+    if (stat) *stat = ite->second.stat;
+  }
+  if (watch) addWatch(&SIM_EXIST_WATCHES, zh, path, fn, ctx);
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+int zoo_exists(zhandle_t *zh, const char *path, int watch, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_EXISTS));
+  return existsImpl(zh, path, 0, 0, watch != 0, stat);
+}
+
+int zoo_wexists(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_EXISTS));
+  return existsImpl(zh, path, watcher, watcherCtx, watcher != 0, stat);
+}
+
+static int getImpl(zhandle_t *zh, const char *path, watcher_fn fn, void *ctx, bool watch,
+                   std::string *value, bool *null, struct Stat *stat)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_GET, &rc)) return rc;
+
+  pthread_mutex_lock(&SIM_MUTEX);
+  SimTree::iterator ite = SIM_TREE.find(path);
+  if (ite == SIM_TREE.end()) {
+    rc = ZNONODE;
+  } else {
+    rc = ZOK;
+    value->assign(ite->second.data);
+    *null = ite->second.null;
+    if (stat) *stat = ite->second.stat;
+    if (watch) addWatch(&SIM_DATA_WATCHES, zh, path, fn, ctx);
+  }
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+static int copyData(const std::string &value, bool null, char *buffer, int *buffer_len)
+{
+  if (null) {
+    *buffer_len = -1;
+  } else {
+    int n = (int) value.size() < *buffer_len ? (int) value.size() : *buffer_len;
+    if (n > 0) memcpy(buffer, value.data(), n);
+    *buffer_len = n;
+  }
+  return ZOK;
+}
+
+int zoo_get(zhandle_t *zh, const char *path, int watch, char *buffer, int *buffer_len, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_GET));
+  std::string value;
+  bool null = false;
+  int rc = getImpl(zh, path, 0, 0, watch != 0, &value, &null, stat);
+  if (rc == ZOK) copyData(value, null, buffer, buffer_len);
+  return rc;
+}
+
+int zoo_wget(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx,
+             char *buffer, int *buffer_len, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_GET));
+  std::string value;
+  bool null = false;
+  int rc = getImpl(zh, path, watcher, watcherCtx, watcher != 0, &value, &null, stat);
+  if (rc == ZOK) copyData(value, null, buffer, buffer_len);
+  return rc;
+}
+
+int zoo_set2(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_SET));
+  int rc;
+  if (!enter(zh, ZKSIM_SET, &rc)) return rc;
+
+  std::vector<SimTrigger> triggers;
+  pthread_mutex_lock(&SIM_MUTEX);
+  rc = doSet(&SIM_TREE, path, buffer, buflen, version, stat, &triggers);
+  fire(triggers);
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+int zoo_set(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version)
+{
+  return zoo_set2(zh, path, buffer, buflen, version, 0);
+}
+
+static int childrenImpl(zhandle_t *zh, const char *path, watcher_fn fn, void *ctx, bool watch,
+                        std::set<std::string> *children, struct Stat *stat)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_CHILDREN, &rc)) return rc;
+
+  pthread_mutex_lock(&SIM_MUTEX);
+  SimTree::iterator ite = SIM_TREE.find(path);
+  if (ite == SIM_TREE.end()) {
+    rc = ZNONODE;
+  } else {
+    rc = ZOK;
+    *children = ite->second.children;
+    if (stat) *stat = ite->second.stat;
+    if (watch) addWatch(&SIM_CHILD_WATCHES, zh, path, fn, ctx);
+  }
+  pthread_mutex_unlock(&SIM_MUTEX);
+  return rc;
+}
+
+int zoo_get_children2(zhandle_t *zh, const char *path, int watch, struct String_vector *strings, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_CHILDREN));
+  std::set<std::string> children;
+  int rc = childrenImpl(zh, path, 0, 0, watch != 0, &children, stat);
+  if (rc == ZOK) fillStrings(children, strings);
+  return rc;
+}
+
+int zoo_get_children(zhandle_t *zh, const char *path, int watch, struct String_vector *strings)
+{
+  return zoo_get_children2(zh, path, watch, strings, 0);
+}
+
+int zoo_wget_children2(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx,
+                       struct String_vector *strings, struct Stat *stat)
+{
+  realSleep(latencyReal(ZKSIM_CHILDREN));
+  std::set<std::string> children;
+  int rc = childrenImpl(zh, path, watcher, watcherCtx, watcher != 0, &children, stat);
+  if (rc == ZOK) fillStrings(children, strings);
+  return rc;
+}
+
+int zoo_wget_children(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx,
+                      struct String_vector *strings)
+{
+  return zoo_wget_children2(zh, path, watcher, watcherCtx, strings, 0);
+}
+
+void zoo_create_op_init(zoo_op_t *op, const char *path, const char *value, int valuelen,
+                        const struct ACL_vector *acl, int flags, char *path_buffer, int path_buffer_len)
+{
+  op->type = ZOO_CREATE_OP;
+  op->create_op.path    = path;
+  op->create_op.data    = value;
+  op->create_op.datalen = valuelen;
+  op->create_op.acl     = acl;
+  op->create_op.flags   = flags;
+  op->create_op.buf     = path_buffer;
+  op->create_op.buflen  = path_buffer_len;
+}
+
+void zoo_delete_op_init(zoo_op_t *op, const char *path, int version)
+{
+  op->type = ZOO_DELETE_OP;
+  op->delete_op.path    = path;
+  op->delete_op.version = version;
+}
+
+void zoo_set_op_init(zoo_op_t *op, const char *path, const char *buffer, int buflen, int version, struct Stat *stat)
+{
+  op->type = ZOO_SETDATA_OP;
+  op->set_op.path    = path;
+  op->set_op.data    = buffer;
+  op->set_op.datalen = buflen;
+  op->set_op.version = version;
+  op->set_op.stat    = stat;
+}
+
+void zoo_check_op_init(zoo_op_t *op, const char *path, int version)
+{
+  op->type = ZOO_CHECK_OP;
+  op->check_op.path    = path;
+  op->check_op.version = version;
+}
+
+static int multiImpl(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_MULTI, &rc)) return rc;
+
+  pthread_mutex_lock(&SIM_MUTEX);
+  SimTree tree(SIM_TREE);
+  int64_t zxid = SIM_ZXID;
+  std::vector<SimTrigger> triggers;
+  std::vector<std::string> created(count);
+
+  int failed = -1;
+  rc = ZOK;
+  for (int i = 0; i < count && failed == -1; ++i) {
+    const zoo_op_t &op = ops[i];
+    if (op.type == ZOO_CREATE_OP) {
+      rc = doCreate(&tree, zh, op.create_op.path, op.create_op.data, op.create_op.datalen,
+                    op.create_op.flags, &created[i], &triggers);
+    } else if (op.type == ZOO_DELETE_OP) {
+      rc = doDelete(&tree, op.delete_op.path, op.delete_op.version, &triggers);
+    } else if (op.type == ZOO_SETDATA_OP) {
+      rc = doSet(&tree, op.set_op.path, op.set_op.data, op.set_op.datalen, op.set_op.version,
+                 op.set_op.stat, &triggers);
+    } else if (op.type == ZOO_CHECK_OP) {
+      rc = doCheck(&tree, op.check_op.path, op.check_op.version);
+    } else {
+      rc = ZBADARGUMENTS;
+    }
+    if (rc != ZOK) failed = i;
+  }
+
+  if (failed == -1) {
+    SIM_TREE.swap(tree);
+    fire(triggers);
+  } else {
+    SIM_ZXID = zxid;
+  }
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  for (int i = 0; i < count; ++i) {
+    if (failed == -1) results[i].err = ZOK;
+    else if (i < failed) results[i].err = ZOK;
+    else if (i == failed) results[i].err = rc;
+    else results[i].err = ZRUNTIMEINCONSISTENCY;
+
+    if (failed == -1 && ops[i].type == ZOO_CREATE_OP && ops[i].create_op.buf && ops[i].create_op.buflen > 0) {
+      snprintf(ops[i].create_op.buf, ops[i].create_op.buflen, "%s", created[i].c_str());
+    }
+  }
+  return failed == -1 ? ZOK : rc;
+}
+
+int zoo_multi(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results)
+{
+  realSleep(latencyReal(ZKSIM_MULTI));
+  return multiImpl(zh, count, ops, results);
+}
+
+/* async api, the request is applied at once, the completion is delivered
+ * by the session thread after the configured latency
+ */
+
+int zoo_acreate(zhandle_t *zh, const char *path, const char *value, int valuelen,
+                const struct ACL_vector *, int flags, string_completion_t completion, const void *data)
+{
+  int rc;
+  SimEvent ev = makeCompletion(SimEvent::STRING, ZKSIM_CREATE, (void *) completion, ZOK, data);
+  if (enter(zh, ZKSIM_CREATE, &rc)) {
+    std::vector<SimTrigger> triggers;
+    pthread_mutex_lock(&SIM_MUTEX);
+    rc = doCreate(&SIM_TREE, zh, path, value, valuelen, flags, &ev.value, &triggers);
+    fire(triggers);
+    pthread_mutex_unlock(&SIM_MUTEX);
+  } else {
+    return rc;
+  }
+  ev.rc = rc;
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_adelete(zhandle_t *zh, const char *path, int version, void_completion_t completion, const void *data)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_DELETE, &rc)) return rc;
+
+  std::vector<SimTrigger> triggers;
+  pthread_mutex_lock(&SIM_MUTEX);
+  rc = doDelete(&SIM_TREE, path, version, &triggers);
+  fire(triggers);
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  post(zh, makeCompletion(SimEvent::VOID, ZKSIM_DELETE, (void *) completion, rc, data));
+  return ZOK;
+}
+
+int zoo_awexists(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx,
+                 stat_completion_t completion, const void *data)
+{
+  struct Stat stat;
+  int rc = existsImpl(zh, path, watcher, watcherCtx, watcher != 0, &stat);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  SimEvent ev = makeCompletion(SimEvent::STAT, ZKSIM_EXISTS, (void *) completion, rc, data);
+  ev.hasStat = (rc == ZOK);
+  ev.stat = stat;
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_aexists(zhandle_t *zh, const char *path, int watch, stat_completion_t completion, const void *data)
+{
+  struct Stat stat;
+  int rc = existsImpl(zh, path, 0, 0, watch != 0, &stat);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  SimEvent ev = makeCompletion(SimEvent::STAT, ZKSIM_EXISTS, (void *) completion, rc, data);
+  ev.hasStat = (rc == ZOK);
+  ev.stat = stat;
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_awget(zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx,
+              data_completion_t completion, const void *data)
+{
+  SimEvent ev = makeCompletion(SimEvent::DATA, ZKSIM_GET, (void *) completion, ZOK, data);
+  bool null = false;
+  int rc = getImpl(zh, path, watcher, watcherCtx, watcher != 0, &ev.value, &null, &ev.stat);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  ev.rc = rc;
+  ev.hasStat = (rc == ZOK);
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t completion, const void *data)
+{
+  SimEvent ev = makeCompletion(SimEvent::DATA, ZKSIM_GET, (void *) completion, ZOK, data);
+  bool null = false;
+  int rc = getImpl(zh, path, 0, 0, watch != 0, &ev.value, &null, &ev.stat);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  ev.rc = rc;
+  ev.hasStat = (rc == ZOK);
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen, int version,
+             stat_completion_t completion, const void *data)
+{
+  int rc;
+  if (!enter(zh, ZKSIM_SET, &rc)) return rc;
+
+  SimEvent ev = makeCompletion(SimEvent::STAT, ZKSIM_SET, (void *) completion, ZOK, data);
+  std::vector<SimTrigger> triggers;
+  pthread_mutex_lock(&SIM_MUTEX);
+  rc = doSet(&SIM_TREE, path, buffer, buflen, version, &ev.stat, &triggers);
+  fire(triggers);
+  pthread_mutex_unlock(&SIM_MUTEX);
+
+  ev.rc = rc;
+  ev.hasStat = (rc == ZOK);
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_aget_children(zhandle_t *zh, const char *path, int watch, strings_completion_t completion, const void *data)
+{
+  std::set<std::string> children;
+  int rc = childrenImpl(zh, path, 0, 0, watch != 0, &children, 0);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  SimEvent ev = makeCompletion(SimEvent::STRINGS, ZKSIM_CHILDREN, (void *) completion, rc, data);
+  ev.strings.assign(children.begin(), children.end());
+  post(zh, ev);
+  return ZOK;
+}
+
+int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results,
+               void_completion_t completion, const void *data)
+{
+  int rc = multiImpl(zh, count, ops, results);
+  if (rc == ZINVALIDSTATE) return rc;
+
+  post(zh, makeCompletion(SimEvent::MULTI, ZKSIM_MULTI, (void *) completion, rc, data));
+  return ZOK;
+}
+
+}
@@ -0,0 +1,54 @@
+#ifndef _ZKSIM_H_
+#define _ZKSIM_H_
+
+#include <stdint.h>
+#include <zookeeper/zookeeper.h>
+
+/* zksim implements the subset of the zookeeper C api used by ZkMgr in
+ * process, a bench links it instead of libzookeeper_mt. every zhandle_t
+ * is a session, watchers and completions are delivered by a thread of
+ * the session like the mt library does. the tree, the ephemerals, the
+ * sequences, the watches and zoo_multi behave as on the server, a chroot
+ * in the host is ignored
+ *
+ * the clock is virtual, a latency is in virtual microseconds and costs
+ * latency * scale real ones, a scale below 1 runs the simulation faster.
+ * the sleeps of ZkMgr itself are real
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum zksim_op { ZKSIM_CREATE, ZKSIM_DELETE, ZKSIM_SET, ZKSIM_GET, ZKSIM_EXISTS, ZKSIM_CHILDREN, ZKSIM_MULTI,
+                ZKSIM_OP_MAX };
+
+/* the latency of every op and the real/virtual scale */
+void zksim_config(int latencyUs, double scale);
+
+/* the latency of one op */
+void zksim_latency(int op, int latencyUs);
+
+/* virtual microseconds since zksim_reset */
+int64_t zksim_now();
+
+/* drop the session like the server does when it expires, closing a
+ * second handle made with zoo_client_id of the session does the same
+ */
+void zksim_expire(zhandle_t *zh);
+
+/* set the mtime of a node, ms since the epoch, the time it was last set */
+int zksim_touch(const char *path, int64_t mtime);
+
+/* number of requests the server received since zksim_reset, of all ops and of one */
+int64_t zksim_ops();
+int64_t zksim_op_count(int op);
+
+/* remove all nodes and reset counters, sessions must be closed */
+void zksim_reset();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 BIN="${BASH_SOURCE[0]}"
 BINDIR=$(readlink -e $(dirname $BIN))
 DCRON=$BINDIR/../build/dcron
+DCROND=$BINDIR/../build/dcrond
 JPATH=$BINDIR/../build/jsonpath
 LOGDIR=/var/log/dcron
 LIBDIR=/var/lib/dcron
@@ -111,6 +112,7 @@ test_abexit()
 test_fifo()
 {
   export DCRON_ID=node-a
+  export DCRON_LLAP_KEYS=5
   $DCRON $BINDIR/dumb.sh fifo_set
 
   IDX=0
@@ -131,6 +133,7 @@ test_fifo()
     echo "$LINENO status.status error"
     exit 1
   }
+  unset DCRON_LLAP_KEYS
 }
 
 test_user()
@@ -149,7 +152,6 @@ test_user()
 test_crash()
 {
   local save_retryon=$DCRON_RETRYON
-  rm -f $LIBDIR/blacktest.stick
   export DCRON_RETRYON=CRASH
 
   export DCRON_ID=node-a
@@ -166,16 +168,16 @@ test_crash()
     exit 1
   }
 
-  local node=$(cat $ZKDUMP | $JPATH 'workers[0]')
-  test "$node" = "node-a" || {
-    echo "$LINENO workers[0] error"
+  # workers are ephemeral, node-a left with its session
+  local node=$(cat $ZKDUMP | $JPATH 'status.id')
+  test "$node" = "node-b" || {
+    echo "$LINENO status.id error"
     exit 1
   }
 
-  node=$(cat $ZKDUMP | $JPATH 'status.id')
-  local nodeb=$(cat $ZKDUMP | $JPATH 'workers[1]')
-  test "$node" = "$nodeb" || {
-    echo "$LINENO status.id error"
+  local worker=$(cat $ZKDUMP | $JPATH 'workers[0]')
+  test "$worker" = "$node" || {
+    echo "$LINENO workers[0] error"
     exit 1
   }
 
@@ -208,7 +210,6 @@ test_rlimit_as()
 test_llap()
 {
   export DCRON_LLAP=true
-  rm -f $LIBDIR/blackbox.stick
 
   export DCRON_ID=node-a
   $DCRON $BINDIR/dumb.sh llap
@@ -237,8 +238,9 @@ test_stick()
   export DCRON_ID=node-a
   $DCRON $BINDIR/dumb.sh exit0
 
-  test -f "$LIBDIR/blackbox.stick" || {
-    echo "$LINNO stick file was not found"
+  NODE=$(cat $ZKDUMP | $JPATH 'affinity.hosts[0].id')
+  test "$NODE" = 'node-a' || {
+    echo "$LINENO affinity.hosts[0].id error"
     exit 1
   }
 
@@ -275,6 +277,54 @@ test_stick()
   unset DCRON_STICK
 }
 
+test_agent_user()
+{
+  local sock=$LIBDIR/dcrond.sock
+  local evil=$(mktemp -d)
+  local victim=$(mktemp)
+  chmod 777 $evil
+
+  rm -f $ZKDUMP
+  # dcrond is root, its own DCRON_ZKDUMP and DCRON_LIBDIR are the ones used
+  DCRON_AGENT=$sock $DCROND &
+  local dcrond=$!
+  sleep 1
+
+  # an unprivileged client names paths that root would chown or write
+  local taskid=$(date +%Y%m%d_%H%M%S)
+  ln -s $victim $evil/blackbox.$taskid.fifo
+  su -s /bin/bash nobody -c "DCRON_AGENT=$sock DCRON_LIBDIR=$evil DCRON_LOGDIR=$evil \
+    DCRON_ZKDUMP=$evil/zkdump DCRON_TRACE=$evil/trace DCRON_TEST_CRASH=1 DCRON_ID=node-a \
+    $DCRON $BINDIR/dumb.sh agent_user"
+  local code=$?
+
+  kill $dcrond
+  wait $dcrond 2>/dev/null
+
+  test $code = 0 || {
+    echo "$LINENO exit status error $code"
+    exit 1
+  }
+
+  test "$(stat -c %U $victim)" = "root" || {
+    echo "$LINENO $victim was chowned through the symlink"
+    exit 1
+  }
+
+  test -z "$(ls $evil | grep -v "blackbox.$taskid.fifo")" || {
+    echo "$LINENO dcrond wrote into the DCRON_LIBDIR of the client, $(ls $evil)"
+    exit 1
+  }
+
+  STATUS=$(cat $ZKDUMP | $JPATH 'status.status')
+  test "$STATUS" = 0 || {
+    echo "$LINENO status.status error"
+    exit 1
+  }
+
+  rm -rf $evil $victim
+}
+
 test "$TESTCASE" != "" && {
   $TESTCASE
   exit 0
@@ -307,6 +357,10 @@ echo "TEST DCRON_RLIMIT_AS"
 sleep 2
 test_rlimit_as
 
+echo "TEST dcrond nobody"
+sleep 2
+test_agent_user
+
 echo "TEST DCRON_LLAP"
 sleep 2
 test_llap
@@ -47,6 +47,26 @@ test_setuid()
   fi
 }
 
+test_agent_user()
+{
+  local user=$(id -n -u)
+  test "$user" = "nobody" || {
+    echo "user expects nobody, got $user"
+    exit 1
+  }
+
+  case "$DCRON_FIFO" in
+    "$DCRON_LIBDIR"/*)
+      echo "fifo $DCRON_FIFO is in the DCRON_LIBDIR of the client"
+      exit 1 ;;
+  esac
+
+  echo "DUMB_01=01" > $DCRON_FIFO || {
+    echo "fifo can not be written by nobody"
+    exit 1
+  }
+}
+
 test_stick()
 {
   test "$DCRON_TEST_STICK" = "node-a" || {
@@ -92,6 +112,7 @@ case $cmd in
   "fifo_set" ) test_fifo_set ;;
   "fifo_get" ) test_fifo_get ;;
   "setuid" )   test_setuid ;;
+  "agent_user" ) test_agent_user ;;
   "stick" )    test_stick ;;
   "abexit" )   test_abexit ;;
   "exit0" )    test_exit0 ;;
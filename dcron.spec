@@ -6,8 +6,10 @@ Group:     dcron
 License:   Apache2
 Source0:   dcron-1.0.0.tar.gz
 BuildRoot: /var/tmp/tail2kafka
+BuildRequires: zlib-devel
 #BuildRequires: libcurl-devel >= 7.19.7
 #BuildRequires: openssl-devel >= 1.0.1e-30
+Requires: zlib
 #Requires: libcurl >= 7.19.7
 #Requires: openssl >= 1.0.1e-30
 AutoReqProv: no
@@ -25,10 +27,15 @@ make
 %install
 mkdir -p $RPM_BUILD_ROOT/usr/local/bin
 cp build/dcron  $RPM_BUILD_ROOT/usr/local/bin
+cp build/dcrond $RPM_BUILD_ROOT/usr/local/bin
+cp build/dcron-logcat $RPM_BUILD_ROOT/usr/local/bin
+mkdir -p $RPM_BUILD_ROOT/usr/local/include
+cp src/dcron_ring.h $RPM_BUILD_ROOT/usr/local/include
 
 %files
 %defattr(-,root,root)
 /usr/local/bin
+/usr/local/include/dcron_ring.h
 
 %post
 mkdir -p /var/lib/dcron
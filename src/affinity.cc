@@ -0,0 +1,113 @@
+#include <cstdio>
+#include <ctime>
+#include <json/json.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "affinity.h"
+#include "zkpipeline.h"
+
+#define AFFINITY_RETRY 3
+
+bool Affinity::load()
+{
+  ZkPipeline pipe(zh_);
+  size_t get = pipe.get(node_);
+  pipe.wait();
+
+  hosts_.clear();
+  version_ = -1;
+
+  int rc = pipe.rc(get);
+  if (rc == ZNONODE) return true;
+  if (rc != ZOK) {
+    log_error(0, "zoo_get %s error, %s", node_.c_str(), zerror(rc));
+    return false;
+  }
+
+  version_ = pipe.stat(get).version;
+  return parse(pipe.value(get));
+}
+
+bool Affinity::parse(const std::string &data)
+{
+  if (data.empty()) return true;
+
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(data, root) || !root.isObject() || !root["hosts"].isArray()) {
+    log_error(0, "%s content %s error", node_.c_str(), data.c_str());
+    return false;
+  }
+
+  const Json::Value &hosts = root["hosts"];
+  for (int i = 0; i < (int) hosts.size() && i < AFFINITY_HOSTS; ++i) {
+    Host host;
+    host.id   = hosts[i]["id"].asString();
+    host.runs = hosts[i]["runs"].asInt();
+    host.time = (long) hosts[i]["time"].asInt64();
+    hosts_.push_back(host);
+  }
+  return true;
+}
+
+int Affinity::rank(const char *id, int window) const
+{
+  if (hosts_.empty() || time(0) - hosts_[0].time >= window) return -1;
+
+  for (size_t i = 0; i < hosts_.size(); ++i) {
+    if (hosts_[i].id == id) return (int) i;
+  }
+  return -1;
+}
+
+bool Affinity::record(const char *id)
+{
+  for (int i = 0; i < AFFINITY_RETRY; ++i) {
+    Host host = {id, 1, (long) time(0)};
+    for (size_t j = 0; j < hosts_.size(); ++j) {
+      if (hosts_[j].id != id) continue;
+      if (j == 0) host.runs = hosts_[0].runs + 1;
+      hosts_.erase(hosts_.begin() + j);
+      break;
+    }
+    hosts_.insert(hosts_.begin(), host);
+    if (hosts_.size() > AFFINITY_HOSTS) hosts_.resize(AFFINITY_HOSTS);
+
+    int rc = write();
+    if (rc == ZOK) return true;
+
+    log_error(0, "%s record %s error, %s", node_.c_str(), id, zerror(rc));
+    if (rc != ZBADVERSION && rc != ZNODEEXISTS && rc != ZNONODE && rc != ZCONNECTIONLOSS) break;
+    if (!load()) break;
+  }
+  return false;
+}
+
+/* create if there was no node, set if it is still version_ */
+int Affinity::write()
+{
+  Json::Value root(Json::objectValue);
+  root["hosts"] = Json::Value(Json::arrayValue);
+  for (size_t i = 0; i < hosts_.size(); ++i) {
+    Json::Value obj(Json::objectValue);
+    obj["id"]   = hosts_[i].id;
+    obj["runs"] = hosts_[i].runs;
+    obj["time"] = (Json::Int64) hosts_[i].time;
+    root["hosts"].append(obj);
+  }
+
+  std::string json = Json::FastWriter().write(root);
+  if (json[json.size()-1] == '\n') json.resize(json.size()-1);
+
+  if (version_ < 0) {
+    int rc = ZK_TIMED(OP_CREATE, zoo_create(zh_, node_.c_str(), json.c_str(), json.size(), acl_, 0, 0, 0));
+    if (rc == ZOK) version_ = 0;
+    return rc;
+  }
+
+  struct Stat stat;
+  int rc = ZK_TIMED(OP_SET, zoo_set2(zh_, node_.c_str(), json.c_str(), json.size(), version_, &stat));
+  if (rc == ZOK) version_ = stat.version;
+  return rc;
+}
@@ -0,0 +1,58 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <string>
+#include <vector>
+#include <zookeeper/zookeeper.h>
+
+#define AFFINITY_HOSTS 4   // the last runner and its fallbacks
+
+/* where a task ran, DCRON_STICK, a sibling of llap
+ *
+ *   affinity   {"hosts":[{"id":..,"runs":n,"time":t},...]}
+ *
+ * hosts[0] ran the task last, runs counts its consecutive runs, how warm
+ * its caches are. the others ran before it, the most recent first, they
+ * are the fallbacks if the last runner is gone. while the last run ended
+ * less than DCRON_STICK seconds ago, rank is the position of a host in
+ * hosts and its candidate score, the election prefers them in that order
+ *
+ * record is a compare and set on the version last read, a concurrent
+ * writer makes it read again and retry
+ */
+class Affinity {
+public:
+  Affinity(zhandle_t *zh, struct ACL_vector *acl, const std::string &node)
+    : zh_(zh), acl_(acl), node_(node), version_(-1) {}
+
+  /* no node is an empty affinity */
+  bool load();
+
+  /* 0 for the last runner, -1 if id is not in hosts or the window is over */
+  int rank(const char *id, int window) const;
+
+  /* id of the last runner, empty if none */
+  std::string last() const { return hosts_.empty() ? std::string() : hosts_[0].id; }
+
+  /* id ran the task now, it moves to the front */
+  bool record(const char *id);
+
+private:
+  struct Host {
+    std::string id;
+    int         runs;
+    long        time;   // the end of its last run
+  };
+
+  bool parse(const std::string &data);
+  int  write();
+
+  zhandle_t         *zh_;
+  struct ACL_vector *acl_;
+  std::string        node_;
+
+  std::vector<Host>  hosts_;
+  int                version_;  // -1 if there is no node
+};
+
+#endif
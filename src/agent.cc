@@ -0,0 +1,356 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "agent.h"
+#include "trace.h"
+
+#define ERRBUF_MAX      1024
+#define AGENT_REQ_MAX   (4 * 1024 * 1024)
+
+extern char **environ;
+
+static bool readn(int fd, void *buf, size_t n)
+{
+  char *ptr = (char *) buf;
+  while (n > 0) {
+    ssize_t nn = read(fd, ptr, n);
+    if (nn == -1 && errno == EINTR) continue;
+    if (nn <= 0) return false;
+    ptr += nn;
+    n -= nn;
+  }
+  return true;
+}
+
+static bool writen(int fd, const void *buf, size_t n)
+{
+  const char *ptr = (const char *) buf;
+  while (n > 0) {
+    ssize_t nn = send(fd, ptr, n, MSG_NOSIGNAL);
+    if (nn == -1 && errno == EINTR) continue;
+    if (nn <= 0) return false;
+    ptr += nn;
+    n -= nn;
+  }
+  return true;
+}
+
+inline void appendField(std::string *s, const char *field)
+{
+  s->append(field).append(1, '\0');
+}
+
+inline void appendField(std::string *s, long field)
+{
+  char buffer[32];
+  snprintf(buffer, 32, "%ld", field);
+  appendField(s, buffer);
+}
+
+bool agentCall(const char *sock, int argc, char *argv[], time_t now, int *status)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock) >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, sock);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return false;
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return false;
+  }
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, PATH_MAX)) cwd[0] = '\0';
+
+  std::string payload;
+  appendField(&payload, (long) now);
+  appendField(&payload, cwd);
+  appendField(&payload, (long) argc);
+  for (int i = 0; i < argc; ++i) appendField(&payload, argv[i]);
+
+  long envc = 0;
+  while (environ[envc]) ++envc;
+  appendField(&payload, envc);
+  for (long i = 0; i < envc; ++i) appendField(&payload, environ[i]);
+
+  uint32_t len = payload.size();
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+
+  struct iovec iov = {&len, sizeof(len)};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len) || !writen(fd, payload.data(), payload.size())) {
+    close(fd);
+    return false;
+  }
+
+  /* dcrond got the task, it can not be run here any more */
+  int32_t code;
+  *status = readn(fd, &code, sizeof(code)) ? code : EXIT_FAILURE;
+  close(fd);
+  return true;
+}
+
+struct AgentTask {
+  Agent *agent;
+  int    conn;
+  uid_t  uid;
+  int    fds[3];
+
+  time_t      now;
+  std::string cwd;
+  std::vector<char *> argv;
+  std::vector<char *> envp;
+  std::string payload;
+
+  AgentTask(Agent *a, int fd) : agent(a), conn(fd), uid(-1), now(0) {
+    fds[0] = fds[1] = fds[2] = -1;
+  }
+
+  ~AgentTask() {
+    for (int i = 0; i < 3; ++i) if (fds[i] != -1) close(fds[i]);
+    close(conn);
+  }
+
+  bool recv();
+  bool decode();
+  int  run();
+};
+
+bool AgentTask::recv()
+{
+  struct ucred cred;
+  socklen_t credLen = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1) {
+    log_error(errno, "agent SO_PEERCRED error");
+    return false;
+  }
+  uid = cred.uid;
+
+  uint32_t len;
+  struct iovec iov = {&len, sizeof(len)};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(len)) {
+    log_error(errno, "agent recvmsg error");
+    return false;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  }
+
+  if (len == 0 || len > AGENT_REQ_MAX) {
+    log_error(0, "agent request length %u error", len);
+    return false;
+  }
+
+  payload.resize(len);
+  if (!readn(conn, &payload[0], len)) {
+    log_error(errno, "agent read request error");
+    return false;
+  }
+  return decode();
+}
+
+bool AgentTask::decode()
+{
+  if (payload[payload.size()-1] != '\0') return false;
+
+  std::vector<char *> fields;
+  for (size_t pos = 0; pos < payload.size(); pos += strlen(&payload[pos]) + 1) {
+    fields.push_back(&payload[pos]);
+  }
+
+  size_t idx = 0;
+  if (fields.size() < 4) return false;
+  now = atol(fields[idx++]);
+  cwd = fields[idx++];
+
+  long argc = atol(fields[idx++]);
+  if (argc <= 0 || idx + argc >= fields.size()) return false;
+  argv.assign(fields.begin() + idx, fields.begin() + idx + argc);
+  argv.push_back(0);
+  idx += argc;
+
+  long envc = atol(fields[idx++]);
+  if (envc < 0 || idx + envc != fields.size()) return false;
+  envp.assign(fields.begin() + idx, fields.end());
+  envp.push_back(0);
+  return true;
+}
+
+int AgentTask::run()
+{
+  char errbuf[ERRBUF_MAX];
+  int argc = argv.size() - 1;
+  int envc = 1;
+
+  int64_t begin = Trace::nowUs();
+  /* dcrond is root, the files of an unprivileged client are its own */
+  std::auto_ptr<ConfigOpt> cnf(ConfigOpt::create(argc, &argv[0], &envc, errbuf, &envp[0], now, uid != 0));
+  if (!cnf.get() || !cnf->runAs(uid, errbuf)) {
+    log_error(0, "agent config error %s", errbuf);
+    if (fds[2] != -1) dprintf(fds[2], "config error %s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  /* of this task thread only */
+  Trace trace(cnf->trace(), cnf->name(), cnf->id());
+  trace.span("ConfigOpt::create", begin, Trace::nowUs());
+
+  cnf->setCwd(cwd);
+  cnf->setStdio(fds);
+  return agent->run(cnf.get(), argc - envc, &argv[envc]);
+}
+
+static void *taskRoutine(void *data)
+{
+  std::auto_ptr<AgentTask> task((AgentTask *) data);
+  if (!task->recv()) return 0;
+
+  int32_t status = task->run();
+  if (!writen(task->conn, &status, sizeof(status))) {
+    log_error(errno, "agent reply status %d error", status);
+  }
+  return 0;
+}
+
+Agent *Agent::create(const char *sock, char *errbuf)
+{
+  std::auto_ptr<Agent> agent(new Agent);
+  agent->sock_ = sock;
+  pthread_mutex_init(&agent->mutex_, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock) >= sizeof(addr.sun_path)) {
+    snprintf(errbuf, ERRBUF_MAX, "socket path %s too long", sock);
+    return 0;
+  }
+  strcpy(addr.sun_path, sock);
+
+  agent->fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (agent->fd_ == -1) {
+    snprintf(errbuf, ERRBUF_MAX, "socket error, %s", strerror(errno));
+    return 0;
+  }
+
+  unlink(sock);
+  if (bind(agent->fd_, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    snprintf(errbuf, ERRBUF_MAX, "bind %s error, %s", sock, strerror(errno));
+    return 0;
+  }
+
+  /* any user may run dcron, the task runs as the peer user and the
+   * files of a task are the ones of dcrond, see ConfigOpt::create
+   */
+  if (chmod(sock, 0666) == -1 || listen(agent->fd_, 128) == -1) {
+    snprintf(errbuf, ERRBUF_MAX, "listen %s error, %s", sock, strerror(errno));
+    return 0;
+  }
+  return agent.release();
+}
+
+ZkSession *Agent::session(const char *zkhost, int timeout, char *errbuf)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "@%d", timeout);
+  std::string name = zkhost + std::string(key);
+
+  pthread_mutex_lock(&mutex_);
+
+  ZkSession *session = 0;
+  std::map<std::string, ZkSession *>::iterator pos = sessions_.find(name);
+  if (pos != sessions_.end() && !pos->second->expired()) {
+    session = pos->second;
+  } else {
+    if (pos != sessions_.end()) {
+      log_error(0, "agent zk session %s expired, reconnect", zkhost);
+      pos->second->release();
+      sessions_.erase(pos);
+    }
+
+    session = ZkSession::create(zkhost, timeout, errbuf);
+    if (session) sessions_[name] = session;
+  }
+
+  if (session) session->retain();
+  pthread_mutex_unlock(&mutex_);
+  return session;
+}
+
+int Agent::run(ConfigOpt *cnf, int argc, char *argv[])
+{
+  char errbuf[ERRBUF_MAX];
+  ZkSession *zkSession = session(cnf->zkhost(), cnf->zkTimeout(), errbuf);
+  if (!zkSession) {
+    log_fatal(0, "%s create ZkMgr error, %s", cnf->name(), errbuf);
+    return EXIT_FAILURE;
+  }
+
+  int status = ZkMgr::run(cnf, zkSession, argc, argv);
+  zkSession->release();
+  return status;
+}
+
+void Agent::loop()
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (true) {
+    int conn = accept4(fd_, 0, 0, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno != EINTR) log_error(errno, "agent accept error");
+      continue;
+    }
+
+    pthread_t tid;
+    AgentTask *task = new AgentTask(this, conn);
+    if (pthread_create(&tid, &attr, taskRoutine, task) != 0) {
+      log_error(errno, "agent pthread_create error");
+      delete task;
+    }
+  }
+}
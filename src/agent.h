@@ -0,0 +1,45 @@
+#ifndef _AGENT_H_
+#define _AGENT_H_
+
+#include <string>
+#include <map>
+#include <pthread.h>
+#include <time.h>
+
+class ZkSession;
+class ConfigOpt;
+
+/* dcron hands the task to dcrond over a unix socket
+ * request:  uint32_t length, then NUL terminated now, cwd, argc, argv..., envc, envp...
+ *           stdin, stdout and stderr of dcron are passed by SCM_RIGHTS
+ * response: int32_t exit code of the task
+ *
+ * returns false if dcrond is not running, dcron runs the task itself
+ */
+bool agentCall(const char *sock, int argc, char *argv[], time_t now, int *status);
+
+/* dcrond, runs the tasks of many dcron clients over one zookeeper session
+ * per DCRON_ZK and DCRON_ZK_TIMEOUT, every task is supervised by a thread
+ */
+class Agent {
+public:
+  static Agent *create(const char *sock, char *errbuf);
+  void loop();
+
+  /* returns a retained session, the caller releases it */
+  ZkSession *session(const char *zkhost, int timeout, char *errbuf);
+
+  /* runs the task on the shared session, returns the exit code */
+  int run(ConfigOpt *cnf, int argc, char *argv[]);
+
+private:
+  Agent() : fd_(-1) {}
+
+  int fd_;
+  std::string sock_;
+
+  pthread_mutex_t mutex_;
+  std::map<std::string, ZkSession *> sessions_;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "cgroup.h"
+
+#define CPU_PERIOD 100000  // us
+
+inline bool writeFile(const std::string &file, const std::string &value)
+{
+  int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  bool ok = ::write(fd, value.data(), value.size()) == (ssize_t) value.size();
+  int eno = errno;
+  close(fd);
+  errno = eno;
+  return ok;
+}
+
+/* the value of "key value" lines of cpu.stat and memory.events */
+inline bool statValue(const std::string &data, const char *key, unsigned long long *value)
+{
+  std::string line = std::string(key) + " ";
+  for (size_t pos = 0; pos != std::string::npos && pos < data.size(); /**/) {
+    if (data.compare(pos, line.size(), line) == 0) {
+      *value = strtoull(data.c_str() + pos + line.size(), 0, 10);
+      return true;
+    }
+    pos = data.find('\n', pos);
+    if (pos != std::string::npos) ++pos;
+  }
+  return false;
+}
+
+/* the sum of key=value of all the devices of io.stat */
+inline unsigned long long ioSum(const std::string &data, const char *key)
+{
+  unsigned long long sum = 0;
+  std::string field = std::string(" ") + key + "=";
+  for (size_t pos = data.find(field); pos != std::string::npos; pos = data.find(field, pos + 1)) {
+    sum += strtoull(data.c_str() + pos + field.size(), 0, 10);
+  }
+  return sum;
+}
+
+bool Cgroup::create(const std::string &parent, const std::string &leaf, int cpu, int mem, const std::string &io)
+{
+  remove();
+
+  if (mkdir(parent.c_str(), 0755) == -1 && errno != EEXIST) {
+    log_error(errno, "mkdir cgroup %s error", parent.c_str());
+    return false;
+  }
+
+  /* a controller missing above fails the limit that needs it */
+  static const char *CONTROLLERS[] = {"+cpu", "+memory", "+io"};
+  for (int i = 0; i < 3; ++i) writeFile(parent + "/cgroup.subtree_control", CONTROLLERS[i]);
+
+  /* a leaf left by a crash is emptied by now, its counters are not */
+  path_ = parent + "/" + leaf;
+  if (mkdir(path_.c_str(), 0755) == -1 && errno == EEXIST && rmdir(path_.c_str()) == 0) {
+    mkdir(path_.c_str(), 0755);
+  }
+
+  procsFd_ = open((path_ + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+  if (procsFd_ == -1) {
+    log_error(errno, "cgroup %s error, the task is not isolated", path_.c_str());
+    path_.clear();
+    return false;
+  }
+
+  char value[64];
+  if (cpu) {
+    snprintf(value, sizeof(value), "%d %d", cpu, CPU_PERIOD);
+    write("cpu.max", value);
+  }
+  if (mem) {
+    snprintf(value, sizeof(value), "%lld", (long long) mem * 1024 * 1024);
+    write("memory.max", value);
+  }
+  for (size_t pos = 0; pos < io.size(); /**/) {
+    size_t comma = io.find(',', pos);
+    if (comma == std::string::npos) comma = io.size();
+    if (comma > pos) write("io.max", io.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+  return true;
+}
+
+void Cgroup::usage(Json::Value *obj) const
+{
+  if (path_.empty()) return;
+
+  std::string data;
+  unsigned long long value;
+  if (read("cpu.stat", &data)) {
+    if (statValue(data, "usage_usec", &value)) (*obj)["cpu_usec"] = (Json::UInt64) value;
+    if (statValue(data, "user_usec", &value)) (*obj)["user_usec"] = (Json::UInt64) value;
+    if (statValue(data, "system_usec", &value)) (*obj)["system_usec"] = (Json::UInt64) value;
+  }
+
+  /* memory.peak is from linux 5.19 */
+  if (read("memory.peak", &data)) (*obj)["mem_peak"] = (Json::UInt64) strtoull(data.c_str(), 0, 10);
+  if (read("memory.events", &data) && statValue(data, "oom_kill", &value)) (*obj)["oom_kill"] = (Json::UInt64) value;
+
+  if (read("io.stat", &data)) {
+    (*obj)["io_rbytes"] = (Json::UInt64) ioSum(data, "rbytes");
+    (*obj)["io_wbytes"] = (Json::UInt64) ioSum(data, "wbytes");
+  }
+}
+
+void Cgroup::remove()
+{
+  if (procsFd_ != -1) close(procsFd_);
+  procsFd_ = -1;
+
+  if (path_.empty()) return;
+  if (rmdir(path_.c_str()) == -1 && errno != ENOENT) {
+    if (errno == EBUSY) log_info(0, "cgroup %s is kept, a process of the task is still in it", path_.c_str());
+    else log_error(errno, "rmdir cgroup %s error", path_.c_str());
+  }
+  path_.clear();
+}
+
+bool Cgroup::write(const char *file, const std::string &value) const
+{
+  if (writeFile(path_ + "/" + file, value)) return true;
+  log_error(errno, "write %s to %s/%s error", value.c_str(), path_.c_str(), file);
+  return false;
+}
+
+bool Cgroup::read(const char *file, std::string *value) const
+{
+  int fd = open((path_ + "/" + file).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  char buffer[4096];
+  ssize_t nn;
+  value->clear();
+  while ((nn = ::read(fd, buffer, sizeof(buffer))) > 0) value->append(buffer, nn);
+  close(fd);
+  return nn == 0;
+}
@@ -0,0 +1,44 @@
+#ifndef _CGROUP_H_
+#define _CGROUP_H_
+
+#include <string>
+#include <json/json.h>
+
+/* a cgroup v2 leaf for one run of the task, DCRON_CGROUP/<name>-<retry>
+ *
+ * the limits are written before the task joins, cpu.max from DCRON_CPU,
+ * memory.max from DCRON_MEM and io.max from DCRON_IO. the child of
+ * Spawner joins by writing 0 to cgroup.procs, so the task is accounted
+ * from its first instruction and dcron itself is not limited
+ *
+ * usage reads cpu.stat, memory.peak, memory.events and io.stat after
+ * the task exits, the leaf is removed unless a descendant of the task
+ * is still in it
+ */
+class Cgroup {
+public:
+  Cgroup() : procsFd_(-1) {}
+  ~Cgroup() { remove(); }
+
+  /* cpu is in 1/100000 of a cpu, 0 is max, mem in MB, 0 is max,
+   * io is the io.max lines separated by ','
+   */
+  bool create(const std::string &parent, const std::string &leaf, int cpu, int mem, const std::string &io);
+
+  /* the child writes 0 to it, -1 without a leaf */
+  int procs() const { return procsFd_; }
+
+  /* cpu_usec, user_usec, system_usec, mem_peak, oom_kill, io_rbytes, io_wbytes */
+  void usage(Json::Value *obj) const;
+
+  void remove();
+
+private:
+  bool write(const char *file, const std::string &value) const;
+  bool read(const char *file, std::string *value) const;
+
+  std::string path_;
+  int         procsFd_;
+};
+
+#endif
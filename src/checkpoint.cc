@@ -0,0 +1,282 @@
+#include <cstdio>
+#include <algorithm>
+#include <zlib.h>
+#include <json/json.h>
+
+#include "logger.h"
+#include "checkpoint.h"
+#include "zktxn.h"
+#include "zkpipeline.h"
+
+#define CHUNK_RAW_MAX (128 * 1024)
+
+inline uint32_t crc(const std::string &s)
+{
+  return crc32(0, (const Bytef *) s.data(), s.size());
+}
+
+std::string Checkpoint::chunkNode(size_t i) const
+{
+  char name[32];
+  snprintf(name, 32, "/chunk-%010d", (int) i);
+  return node_ + name;
+}
+
+bool Checkpoint::load()
+{
+  ZkPipeline pipe(zh_);
+  size_t manifest = pipe.get(node_);
+  pipe.wait();
+
+  int rc = pipe.rc(manifest);
+  if (rc != ZOK && rc != ZNONODE) {
+    log_fatal(0, "zoo_get %s error, %s", node_.c_str(), zerror(rc));
+    return false;
+  }
+  return load(pipe.value(manifest), rc == ZOK ? pipe.stat(manifest).version : -1);
+}
+
+bool Checkpoint::load(const std::string &manifest, int version)
+{
+  items_.clear();
+  chunks_.clear();
+  seq_     = 0;
+  legacy_  = false;
+  version_ = version;
+  loaded_  = false;
+  lastFencing_ = 0;
+
+  if (manifest.empty()) return loaded_ = true;
+
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(manifest, root) || !(root.isArray() || root.isObject())) {
+    log_fatal(0, "%s content %s error", node_.c_str(), manifest.c_str());
+    return false;
+  }
+
+  if (root.isArray()) {
+    legacy_ = true;
+    for (int i = 0; i < (int) root.size(); ++i) {
+      Item &item = items_[root[i]["k"].asString()];
+      item.value = root[i]["v"].asString();
+      item.seq   = ++seq_;
+    }
+    return loaded_ = true;
+  }
+
+  seq_ = root["seq"].asInt64();
+  lastFencing_ = root["fencing"].asInt64();
+  if (fencing_ && lastFencing_ > fencing_ && !fenced_) {
+    log_fatal(0, "%s is written by a newer master, fencing %lld > %lld", node_.c_str(),
+              (long long) lastFencing_, (long long) fencing_);
+    fenced_ = true;
+  }
+  const Json::Value &chunks = root["chunks"];
+  for (int i = 0; i < (int) chunks.size(); ++i) {
+    Chunk chunk;
+    chunk.crc = chunks[i]["crc"].asUInt();
+    chunk.len = chunks[i]["len"].asUInt();
+    chunks_.push_back(chunk);
+  }
+
+  /* all the chunks in one round trip */
+  ZkPipeline pipe(zh_);
+  for (size_t i = 0; i < chunks_.size(); ++i) pipe.get(chunkNode(i));
+  pipe.wait();
+
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    if (pipe.rc(i) != ZOK) {
+      log_fatal(0, "zoo_get %s error, %s", chunkNode(i).c_str(), zerror(pipe.rc(i)));
+      return false;
+    }
+    if (!parseChunk(i, pipe.value(i))) return false;
+  }
+  return loaded_ = true;
+}
+
+bool Checkpoint::parseChunk(size_t i, const std::string &data)
+{
+  std::string raw(chunks_[i].len, '\0');
+  uLongf rawLen = raw.size();
+  if (raw.empty() || uncompress((Bytef *) &raw[0], &rawLen, (const Bytef *) data.data(), data.size()) != Z_OK ||
+      rawLen != raw.size() || crc(raw) != chunks_[i].crc) {
+    log_fatal(0, "%s is corrupted", chunkNode(i).c_str());
+    return false;
+  }
+
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(raw, root) || !root.isObject()) {
+    log_fatal(0, "%s content %s error", chunkNode(i).c_str(), raw.c_str());
+    return false;
+  }
+
+  Json::Value::Members keys = root.getMemberNames();
+  for (size_t j = 0; j < keys.size(); ++j) {
+    Item &item = items_[keys[j]];
+    item.value = root[keys[j]][0].asString();
+    item.seq   = root[keys[j]][1].asInt64();
+  }
+  return true;
+}
+
+/* the least recently updated keys go first */
+void Checkpoint::evict()
+{
+  if (items_.size() <= maxKeys_) return;
+
+  std::vector<std::pair<int64_t, std::string> > order;
+  for (std::map<std::string, Item>::iterator ite = items_.begin(); ite != items_.end(); ++ite) {
+    order.push_back(std::make_pair(ite->second.seq, ite->first));
+  }
+  std::sort(order.begin(), order.end());
+
+  size_t n = items_.size() - maxKeys_;
+  for (size_t i = 0; i < n; ++i) items_.erase(order[i].second);
+  log_info(0, "%s drops %d least recently updated keys", node_.c_str(), (int) n);
+}
+
+bool Checkpoint::merge(const Env &update)
+{
+  bool changed = legacy_;
+  for (Env::const_iterator ite = update.begin(); ite != update.end(); ++ite) {
+    std::map<std::string, Item>::iterator pos = items_.find(ite->first);
+    if (pos != items_.end() && pos->second.value == ite->second) continue;
+
+    Item &item = items_[ite->first];
+    item.value = ite->second;
+    item.seq   = ++seq_;
+    changed    = true;
+  }
+  if (changed) evict();
+  return changed;
+}
+
+void Checkpoint::setFencing(const std::string &masterNode, int64_t fencing)
+{
+  masterNode_ = masterNode;
+  fencing_    = fencing;
+  fenced_     = fencing_ && lastFencing_ > fencing_;
+}
+
+/* the master node is of our session and of our fencing */
+bool Checkpoint::stillMaster()
+{
+  struct Stat stat;
+  int rc = zoo_exists(zh_, masterNode_.c_str(), 0, &stat);
+  if (rc == ZOK) return stat.ephemeralOwner == zoo_client_id(zh_)->client_id && stat.czxid == fencing_;
+  if (rc != ZNONODE) log_error(0, "zoo_exists %s error, %s", masterNode_.c_str(), zerror(rc));
+  return rc != ZNONODE;   // unknown, the next save checks again
+}
+
+bool Checkpoint::save(const Env &update)
+{
+  if (!loaded_ && !load()) return false;
+  if (fenced_) return false;
+  if (!merge(update)) return true;
+
+  int rc = write();
+  if (rc == ZOK) return true;
+
+  loaded_ = false;   // unknown what is in zookeeper
+  if (rc == ZBADVERSION) {
+    log_error(0, "%s version %d is stale, written by another master", node_.c_str(), version_);
+    load();
+  }
+  if (rc == ZBADVERSION || rc == ZNONODE) {
+    if (fencing_ && !fenced_ && !stillMaster()) {
+      log_fatal(0, "%s master %s is not ours, fencing %lld", node_.c_str(), masterNode_.c_str(),
+                (long long) fencing_);
+      fenced_ = true;
+    }
+  }
+  return false;
+}
+
+/* the chunks changed and the manifest, if the manifest is still version_ */
+int Checkpoint::write()
+{
+  size_t raw = 0;
+  for (std::map<std::string, Item>::iterator ite = items_.begin(); ite != items_.end(); ++ite) {
+    raw += ite->first.size() + ite->second.value.size() + 32;
+  }
+  size_t n = 1;
+  while (raw / n > CHUNK_RAW_MAX) n *= 2;
+
+  std::vector<Json::Value> objs(n, Json::Value(Json::objectValue));
+  for (std::map<std::string, Item>::iterator ite = items_.begin(); ite != items_.end(); ++ite) {
+    Json::Value pair(Json::arrayValue);
+    pair.append(ite->second.value);
+    pair.append((Json::Int64) ite->second.seq);
+    objs[crc(ite->first) % n][ite->first] = pair;
+  }
+
+  /* the version first, a stale writer fails on it and not on a chunk
+   * the other writer created or deleted, then our master node
+   */
+  ZkTxn txn(zh_, acl_);
+  txn.check(node_, version_);
+  if (fencing_) txn.check(masterNode_, -1);
+  Json::Value manifest(Json::objectValue);
+  manifest["seq"]    = (Json::Int64) seq_;
+  if (fencing_ || lastFencing_) manifest["fencing"] = (Json::Int64) (fencing_ ? fencing_ : lastFencing_);
+  manifest["chunks"] = Json::Value(Json::arrayValue);
+
+  std::vector<Chunk> chunks(n);
+  for (size_t i = 0; i < n; ++i) {
+    std::string json = Json::FastWriter().write(objs[i]);
+    if (json[json.size()-1] == '\n') json.resize(json.size()-1);
+
+    chunks[i].crc = crc(json);
+    chunks[i].len = json.size();
+
+    Json::Value obj(Json::objectValue);
+    obj["crc"] = chunks[i].crc;
+    obj["len"] = (Json::UInt) chunks[i].len;
+    manifest["chunks"].append(obj);
+
+    if (i < chunks_.size() && chunks_[i].crc == chunks[i].crc && chunks_[i].len == chunks[i].len) continue;
+
+    std::string data(compressBound(json.size()), '\0');
+    uLongf dataLen = data.size();
+    if (compress((Bytef *) &data[0], &dataLen, (const Bytef *) json.data(), json.size()) != Z_OK) {
+      log_fatal(0, "compress %s error", chunkNode(i).c_str());
+      return ZSYSTEMERROR;
+    }
+    data.resize(dataLen);
+
+    if (i < chunks_.size()) txn.set(chunkNode(i), data);
+    else txn.create(chunkNode(i), data);
+  }
+  for (size_t i = n; i < chunks_.size(); ++i) txn.del(chunkNode(i));
+
+  std::string json = Json::FastWriter().write(manifest);
+  if (json[json.size()-1] == '\n') json.resize(json.size()-1);
+  txn.set(node_, json, version_);
+
+  log_info(0, "zoo_multi llap %s %d keys, %d of %d chunks", node_.c_str(), (int) items_.size(),
+           (int) txn.size() - (fencing_ ? 3 : 2), (int) n);
+
+  int rc = txn.commit();
+  if (rc == ZBADVERSION && txn.failed() == 0) return rc;
+  if (rc == ZNONODE && fencing_ && txn.failed() == 1) return rc;
+  if (rc != ZOK) {
+    log_fatal(0, "zoo_multi %s error, %s", txn.path(txn.failed() == -1 ? txn.size() - 1 : txn.failed()).c_str(),
+              zerror(rc));
+    return rc;
+  }
+
+  chunks_ = chunks;
+  legacy_ = false;
+  if (fencing_) lastFencing_ = fencing_;
+  ++version_;
+  return ZOK;
+}
+
+void Checkpoint::env(Env *env) const
+{
+  for (std::map<std::string, Item>::const_iterator ite = items_.begin(); ite != items_.end(); ++ite) {
+    (*env)[ite->first] = ite->second.value;
+  }
+}
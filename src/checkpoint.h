@@ -0,0 +1,96 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <zookeeper/zookeeper.h>
+
+/* the llap checkpoint, the KEY=VALUE records a task writes to DCRON_FIFO,
+ * the next instance gets them as DCRON_KEY=VALUE
+ *
+ *   llap                    manifest {"seq":n,"fencing":f,"chunks":[{"crc":c,"len":l},...]}
+ *   llap/chunk-0000000000   deflated {"KEY":["VALUE",seq],...}
+ *
+ * a key lives in chunk crc32(key) % chunks, the chunks double when they
+ * grow beyond CHUNK_RAW_MAX. save writes the changed chunks and the manifest
+ * in one zoo_multi, a reader never sees half a checkpoint. seq orders the
+ * updates, the least recently updated keys are dropped beyond maxKeys
+ *
+ * the llap node of old versions is [{"k":..,"v":..}], it is still read,
+ * the first save converts it
+ *
+ * the checkpoint last read or written is cached with the version of the
+ * manifest, a save sets the manifest only if the version is unchanged.
+ * a mismatch means another writer, the save fails and the checkpoint is
+ * read again
+ *
+ * fencing is the czxid of the master node of the writer, the manifest
+ * keeps the one of its last writer. the zoo_multi checks the manifest
+ * version, so the fencing read is the one replaced, and that the master
+ * node exists. a master whose fencing is below the one read, or whose
+ * master node is gone or of another session, is fenced, it never writes
+ * again. a master of an expired session cannot write at all
+ */
+class Checkpoint {
+public:
+  typedef std::map<std::string, std::string> Env;
+
+  Checkpoint(zhandle_t *zh, struct ACL_vector *acl, const std::string &node, size_t maxKeys)
+    : zh_(zh), acl_(acl), node_(node), maxKeys_(maxKeys), seq_(0), legacy_(false),
+      version_(-1), loaded_(false), fencing_(0), lastFencing_(0), fenced_(false) {}
+
+  /* reads the manifest and all the chunks, manifest is one read already */
+  bool load();
+  bool load(const std::string &manifest, int version);
+
+  /* merges update into the checkpoint in zookeeper, no write if no value
+   * changed, no read unless the cache is stale
+   */
+  bool save(const Env &update);
+
+  /* of the master node, a save fails for good once fenced */
+  void setFencing(const std::string &masterNode, int64_t fencing);
+  bool fenced() const { return fenced_; }
+
+  void env(Env *env) const;
+  size_t size() const { return items_.size(); }
+
+private:
+  struct Item {
+    std::string value;
+    int64_t     seq;
+  };
+
+  struct Chunk {
+    uint32_t crc;   // of the raw content
+    size_t   len;
+  };
+
+  std::string chunkNode(size_t i) const;
+  bool parseChunk(size_t i, const std::string &data);
+  bool merge(const Env &update);
+  void evict();
+  int  write();
+  bool stillMaster();
+
+  zhandle_t         *zh_;
+  struct ACL_vector *acl_;
+  std::string        node_;
+  size_t             maxKeys_;
+
+  std::map<std::string, Item> items_;
+  int64_t            seq_;
+  std::vector<Chunk> chunks_;   // as in zookeeper
+  bool               legacy_;
+  int                version_;  // of the manifest
+  bool               loaded_;
+
+  std::string        masterNode_;
+  int64_t            fencing_;      // ours, 0 is not fenced
+  int64_t            lastFencing_;  // of the manifest
+  bool               fenced_;
+};
+
+#endif
@@ -16,9 +16,23 @@
 
 #include "configopt.h"
 
+extern char **environ;
+
+int ConfigOpt::maxRetryCap_ = 5;
+
+static const char *findEnv(char **envp, const char *name)
+{
+  size_t len = strlen(name);
+  for (char **ptr = envp; ptr && *ptr; ++ptr) {
+    if (strncmp(*ptr, name, len) == 0 && (*ptr)[len] == '=') return *ptr + len+1;
+  }
+  return 0;
+}
+
 class Env {
 public:
-  Env(int argc, char *argv[]) : argv_(argv) {
+  Env(int argc, char *argv[], char **envp, bool confined)
+    : argv_(argv), envp_(envp), confined_(confined) {
     argc_ = 0;
     for (int i = 1; i < argc; ++i) {
       if (strcmp(argv_[i], "--") == 0) {
@@ -34,11 +48,15 @@ public:
     for (int i = 1; i < argc_; ++i) {
       int pos;
       for (pos = 0; name[pos] && argv_[i][pos] && name[pos] == argv_[i][pos]; ++pos);
-      if (pos != 0 && argv_[i][pos] == '=') return argv_[i] + pos+1;
+      if (pos != 0 && !name[pos] && argv_[i][pos] == '=') return argv_[i] + pos+1;
     }
     return getenv(name);
   }
 
+  const char *getenv(const char *name) const {
+    return findEnv(envp_, name);
+  }
+
   bool get(const char *name, std::string *value) {
     const char *ptr = get(name);
     if (!ptr) return false;
@@ -54,6 +72,21 @@ public:
     else value->assign(def);
   }
 
+  /* a confined client names no file dcrond writes as root, the option
+   * comes from the environment of dcrond itself
+   */
+  void getOwn(const char *name, std::string *value, const std::string &def) {
+    const char *ptr = confined_ ? findEnv(environ, name) : get(name);
+
+    if (ptr) value->assign(ptr);
+    else value->assign(def);
+  }
+
+  void getOwn(const char *name, bool *b, bool def) {
+    const char *ptr = confined_ ? findEnv(environ, name) : get(name);
+    *b = ptr ? strcmp(ptr, "true") == 0 || strcmp(ptr, "1") == 0 : def;
+  }
+
   template <class IntType>
   bool get(const char *name, IntType *value, IntType def) {
     const char *ptr = get(name);
@@ -69,7 +102,7 @@ public:
   }
 
   bool get(const char *name, bool *b, bool def) {
-    const char *ptr = getenv(name);
+    const char *ptr = get(name);
     if (ptr) {
       if (strcmp(ptr, "true") == 0 || strcmp(ptr, "1") == 0) {
         *b = true;
@@ -87,6 +120,8 @@ public:
 private:
   int argc_;
   char **argv_;
+  char **envp_;
+  bool confined_;
 };
 
 bool getIpByEth(const char *eth, std::string *ip)
@@ -113,6 +148,11 @@ bool getIpByEth(const char *eth, std::string *ip)
 }
 
 #define ERRBUF_MAX 256
+#define RING_SIZE_MIN (64 * 1024)
+#define RING_SIZE_MAX (1024 * 1024 * 1024)
+#define STDIO_SEGMENT_MAX (64 * 1024)   // MB
+#define STDIO_TAIL_MAX    (64 * 1024)   // the result node stays small
+#define CPU_MAX           4096
 
 bool ConfigOpt::parseUser(const char *username, char *errbuf)
 {
@@ -144,12 +184,60 @@ bool ConfigOpt::parseUser(const char *username, char *errbuf)
   return true;
 }
 
-ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
+bool ConfigOpt::runAs(uid_t uid, char *errbuf)
+{
+  if (uid == 0) return true;
+
+  if (user_.empty()) {
+    struct passwd *pwd = getpwuid(uid);
+    if (!pwd) {
+      snprintf(errbuf, ERRBUF_MAX, "getpwuid(%d) error, %s", (int) uid, strerror(errno));
+      return false;
+    }
+    uid_  = pwd->pw_uid;
+    gid_  = pwd->pw_gid;
+    user_ = pwd->pw_name;
+  } else if ((uid_t) uid_ != uid) {
+    snprintf(errbuf, ERRBUF_MAX, "DCRON_USER %s requires root", user_.c_str());
+    return false;
+  }
+  return true;
+}
+
+const char *ConfigOpt::getenv(const char *name) const
+{
+  return findEnv(envp_, name);
+}
+
+bool ConfigOpt::which(const char *file, std::string *fullPath) const
+{
+  fullPath->assign(file);
+  if (access(fullPath->c_str(), X_OK) == 0) return true;
+
+  const char *pathEnv = getenv("PATH");
+  if (!pathEnv) return false;
+
+  const char *colon = strchr(pathEnv, ':');
+  while (colon) {
+    fullPath->assign(pathEnv, colon - pathEnv).append(1, '/').append(file);
+    if (access(fullPath->c_str(), X_OK) == 0) return true;
+    pathEnv = colon + 1;
+    colon = strchr(pathEnv, ':');
+  }
+
+  fullPath->assign(pathEnv).append(1, '/').append(file);
+  if (access(fullPath->c_str(), X_OK) == 0) return true;
+  return false;
+}
+
+ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf, char **envp, time_t now,
+                             bool confined)
 {
   std::auto_ptr<ConfigOpt> opt(new ConfigOpt);
   std::string str;
 
-  Env env(argc, argv);
+  opt->envp_ = envp ? envp : environ;
+  Env env(argc, argv, opt->envp_, confined);
 
   if (!env.get("DCRON_ID", &opt->id_) && !getIpByEth("eth0", &opt->id_)) {
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_ID get default eth0 ip failed, %s", strerror(errno));
@@ -161,11 +249,21 @@ ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
     return 0;
   }
 
+  if (!env.get("DCRON_FAST_FAILOVER", &opt->fastFailover_, false)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_FAST_FAILOVER is not a boolean");
+    return 0;
+  }
+
+  if (!env.get("DCRON_ZK_TIMEOUT", &opt->zkTimeout_, opt->fastFailover_ ? 2000 : 15000) || opt->zkTimeout_ <= 0) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_ZK_TIMEOUT is not a positive number");
+    return 0;
+  }
+
   if (!env.get("DCRON_MAXRETRY", &opt->maxRetry_, 2)) {
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_MAXRETRY is not a number");
     return 0;
   }
-  if (opt->maxRetry_ > 5) opt->maxRetry_ = 5;
+  if (opt->maxRetry_ > maxRetryCap_) opt->maxRetry_ = maxRetryCap_;
 
   env.get("DCRON_RETRYON", &str, "CRASH");
   if (str == "CRASH") {
@@ -181,18 +279,103 @@ ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
     return 0;
   }
 
+  if (!env.get("DCRON_LLAP_KEYS", &opt->llapKeys_, 4096) || opt->llapKeys_ <= 0) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_LLAP_KEYS is not a positive number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_FLUSH_INTERVAL", &opt->flushInterval_, 500)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_FLUSH_INTERVAL is not a number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_FLUSH_BYTES", &opt->flushBytes_, 256 * 1024)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_FLUSH_BYTES is not a number");
+    return 0;
+  }
+
+  int ringSize;
+  if (!env.get("DCRON_RING_SIZE", &ringSize, 0) || ringSize < 0 || ringSize > RING_SIZE_MAX) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_RING_SIZE is not a number between 0 and %d", RING_SIZE_MAX);
+    return 0;
+  }
+  for (opt->ringSize_ = ringSize ? RING_SIZE_MIN : 0; opt->ringSize_ < (size_t) ringSize; opt->ringSize_ *= 2) {}
+
+  if (!env.get("DCRON_LOG_ASYNC", &opt->logAsync_, 256)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_LOG_ASYNC is not a number");
+    return 0;
+  }
+
+  env.get("DCRON_LOG_OVERFLOW", &str, "DROP");
+  if (str == "DROP") {
+    opt->logBlock_ = false;
+  } else if (str == "BLOCK") {
+    opt->logBlock_ = true;
+  } else {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_LOG_OVERFLOW is not DROP or BLOCK");
+    return 0;
+  }
+
+  env.get("DCRON_LOG_FORMAT", &str, "TEXT");
+  if (str == "TEXT") {
+    opt->logBinary_ = false;
+  } else if (str == "BINARY") {
+    opt->logBinary_ = true;
+  } else {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_LOG_FORMAT is not TEXT or BINARY");
+    return 0;
+  }
+
   if (!env.get("DCRON_STICK", &opt->stick_, opt->llap_ ? 90 : 0)) {
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STICK is not a number");
     return 0;
   }
 
+  if (!env.get("DCRON_ELECT_WAIT", &opt->electWait_, 2000)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_ELECT_WAIT is not a number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_KEEP", &opt->keep_, 1440)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_KEEP is not a number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_KEEP_DAYS", &opt->keepDays_, 7)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_KEEP_DAYS is not a number");
+    return 0;
+  }
+
   if (!env.get("DCRON_STDIOCAP", &opt->captureStdio_, !opt->llap_)) {
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STDIOCAP is not a boolean");
     return 0;
   }
 
-  env.get("DCRON_LIBDIR", &opt->libdir_, "/var/lib/dcron");
-  env.get("DCRON_LOGDIR", &opt->logdir_, "/var/log/dcron");
+  if (!env.get("DCRON_STDIO_SEGMENT", &opt->stdioSegment_, 64) || opt->stdioSegment_ < 0 ||
+      opt->stdioSegment_ > STDIO_SEGMENT_MAX) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STDIO_SEGMENT is not a number between 0 and %d", STDIO_SEGMENT_MAX);
+    return 0;
+  }
+
+  if (!env.get("DCRON_STDIO_ROTATE", &opt->stdioRotate_, 0)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STDIO_ROTATE is not a number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_STDIO_KEEP", &opt->stdioKeep_, 4)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STDIO_KEEP is not a number");
+    return 0;
+  }
+
+  if (!env.get("DCRON_STDIO_TAIL", &opt->stdioTail_, 4096) || opt->stdioTail_ < 0 || opt->stdioTail_ > STDIO_TAIL_MAX) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_STDIO_TAIL is not a number between 0 and %d", STDIO_TAIL_MAX);
+    return 0;
+  }
+
+  env.getOwn("DCRON_LIBDIR", &opt->libdir_, "/var/lib/dcron");
+  env.getOwn("DCRON_LOGDIR", &opt->logdir_, "/var/log/dcron");
+  env.getOwn("DCRON_AGENT", &opt->agent_, opt->libdir_ + "/dcrond.sock");
+  if (opt->agent_ == "none") opt->agent_.clear();
 
   struct stat st;
   if (stat(opt->libdir_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
@@ -213,6 +396,41 @@ ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
     return 0;
   }
 
+  /* DCRON_CPU is a number of cpus, 1.5 is 150000 of every 100000us */
+  env.get("DCRON_CPU", &str, "");
+  char *endptr;
+  double cpu = str.empty() ? 0 : strtod(str.c_str(), &endptr);
+  if (!str.empty() && (*endptr != '\0' || cpu <= 0 || cpu > CPU_MAX)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_CPU is not a number of cpus between 0 and %d", CPU_MAX);
+    return 0;
+  }
+  opt->cpu_ = cpu * 100000;
+  if (str.size() && opt->cpu_ < 1000) opt->cpu_ = 1000;
+
+  if (!env.get("DCRON_MEM", &opt->mem_, 0)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_MEM is not a number");
+    return 0;
+  }
+  env.get("DCRON_IO", &opt->io_, "");
+
+  /* without a limit the leaves are made only if the parent is there */
+  env.getOwn("DCRON_CGROUP", &opt->cgroup_, "/sys/fs/cgroup/dcron");
+  bool limited = opt->cpu_ || opt->mem() || !opt->io_.empty();
+  if (opt->cgroup_ == "none" || (!limited && (stat(opt->cgroup_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)))) {
+    opt->cgroup_.clear();
+  }
+
+  if (!env.get("DCRON_ZKPIPELINE", &opt->zkPipeline_, true)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_ZKPIPELINE is not a boolean");
+    return 0;
+  }
+
+  if (!env.get("DCRON_METRICS", &opt->metrics_, true)) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_METRICS is not a boolean");
+    return 0;
+  }
+  env.getOwn("DCRON_TRACE", &opt->trace_, "");
+
   if (!env.get("DCRON_NAME", &str)) {
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_NAME is required");
     return 0;
@@ -220,7 +438,7 @@ ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
 
   if (opt->llap_) str.append(".%Y%m%d_%H%M");
 
-  time_t now = time(0);
+  if (now == 0) now = time(0);
   struct tm ltm;
   localtime_r(&now, &ltm);
   char buffer[128];
@@ -233,20 +451,27 @@ ConfigOpt *ConfigOpt::create(int argc, char *argv[], int *envc, char *errbuf)
     snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_NAME must contain taskid, like .%%Y%%m%%d_%%H%%M");
     return 0;
   }
+
+  /* the name is a file of DCRON_LIBDIR and DCRON_LOGDIR */
+  if (strchr(buffer, '/')) {
+    snprintf(errbuf, ERRBUF_MAX, "ENV DCRON_NAME %s must not contain /", buffer);
+    return 0;
+  }
   opt->name_.assign(buffer);
 
   /* parameter correction */
   opt->fifo_ = opt->libdir_ + "/" + opt->name_ + ".fifo";
   if (opt->llap_) opt->retryStrategy_ = RETRY_ON_CRASH;
 
-  /* DEBUG conf */
-  env.get("DCRON_ZKDUMP", &opt->zkdump_);
-  env.get("DCRON_TEST_CRASH", &opt->tcrash_, false);
+  /* DEBUG conf, a confined client would abort or fault dcrond */
+  env.getOwn("DCRON_ZKDUMP", &opt->zkdump_, "");
+  env.getOwn("DCRON_TEST_CRASH", &opt->tcrash_, false);
 
-  env.get("DCRON_TEST_CONNECTIONLOSS_WHEN_COMPETE_MASTER_SUCCESS",
+  env.getOwn("DCRON_TEST_CONNECTIONLOSS_WHEN_COMPETE_MASTER_SUCCESS",
     &opt->testConnectionLossWhenCompeteMasterSuccess_, false);
-  env.get("DCRON_TEST_CONNECTIONLOSS_WHEN_COMPETE_MASTER_FAILURE",
+  env.getOwn("DCRON_TEST_CONNECTIONLOSS_WHEN_COMPETE_MASTER_FAILURE",
     &opt->testConnectionLossWhenCompeteMasterFailure_, false);
+  env.getOwn("DCRON_ZKFAULT", &opt->zkFault_, "");
 
   *envc = env.getc();
   return opt.release();
@@ -2,15 +2,36 @@
 #define _CONFIGOPT_H_
 
 #include <string>
+#include <time.h>
+#include <sys/types.h>
 
 class ConfigOpt {
 public:
   enum RetryStrategy { RETRY_ON_CRASH, RETRY_ON_ABEXIT, RETRY_NOTHING };
-  static ConfigOpt *create(int argc, char *argv[], int *envc, char *errbuf);
+
+  /* envp and now default to the environ and time of this process,
+   * dcrond passes the ones of the dcron client. a confined client is not
+   * root, the files and the test hooks are the ones of dcrond, see getOwn
+   */
+  static ConfigOpt *create(int argc, char *argv[], int *envc, char *errbuf,
+                           char **envp = 0, time_t now = 0, bool confined = false);
+
+  /* DCRON_MAXRETRY is capped, 5 by default, a bench of more candidates
+   * raises it, there is no env or option for it
+   */
+  static void setMaxRetryCap(int cap) { maxRetryCap_ = cap; }
 
   const char *id() const { return id_.c_str(); }
   const char *name() const { return name_.c_str(); }
   const char *zkhost() const { return zkhost_.c_str(); }
+
+  /* ms, the session timeout asked of zookeeper */
+  int zkTimeout() const { return zkTimeout_; }
+
+  /* the master stops the task once zookeeper is lost for a third of the
+   * session timeout, before a standby can take over
+   */
+  bool fastFailover() const { return fastFailover_; }
   const char *fifo() const { return fifo_.c_str(); }
 
   const char *zkdump() const { return zkdump_.empty() ? 0 : zkdump_.c_str(); }
@@ -23,15 +44,70 @@ public:
   RetryStrategy retryStrategy() const { return retryStrategy_; }
 
   int stick() const { return stick_ > 0 ? stick_ : 0; }
+  int electWait() const { return electWait_ > 0 ? electWait_ : 0; }
+
+  /* the finished instances of the task kept in zookeeper, 0 is no limit */
+  int keep() const { return keep_ > 0 ? keep_ : 0; }
+  int keepDays() const { return keepDays_ > 0 ? keepDays_ : 0; }
   bool llap() const { return llap_; }
+  size_t llapKeys() const { return llapKeys_; }
+  int flushInterval() const { return flushInterval_ > 0 ? flushInterval_ : 0; }
+  size_t flushBytes() const { return flushBytes_ > 0 ? flushBytes_ : 0; }
+  size_t ringSize() const { return ringSize_; }
+  size_t logAsync() const { return logAsync_ > 0 ? logAsync_ : 0; }
+  bool logBlock() const { return logBlock_; }
+  bool logBinary() const { return logBinary_; }
   bool captureStdio() const { return captureStdio_; }
+  size_t stdioSegment() const { return stdioSegment_ > 0 ? (size_t) stdioSegment_ * 1024 * 1024 : 0; }
+  int stdioRotate() const { return stdioRotate_ > 0 ? stdioRotate_ : 0; }
+  int stdioKeep() const { return stdioKeep_ > 0 ? stdioKeep_ : 0; }
+  size_t stdioTail() const { return stdioTail_ > 0 ? stdioTail_ : 0; }
 
-  const char *user() const { return user_.c_str(); }
+  const char *user() const { return user_.empty() ? 0 : user_.c_str(); }
   int uid() const { return uid_; }
   int gid() const { return gid_; }
 
+  /* the task of an unprivileged dcron client runs as that client */
+  bool runAs(uid_t uid, char *errbuf);
+
+  char **envp() const { return envp_; }
+  const char *getenv(const char *name) const;
+
+  /* resolves file by PATH of envp */
+  bool which(const char *file, std::string *fullPath) const;
+  const char *agent() const { return agent_.empty() ? 0 : agent_.c_str(); }
+
+  const char *cwd() const { return cwd_.empty() ? 0 : cwd_.c_str(); }
+  void setCwd(const std::string &cwd) { cwd_ = cwd; }
+
+  /* -1 means inherit the stdio of dcron */
+  int stdio(int fileno) const { return fileno >= 0 && fileno < 3 ? stdio_[fileno] : -1; }
+  void setStdio(const int fds[3]) { for (int i = 0; i < 3; ++i) stdio_[i] = fds[i]; }
+
   int rlimitAs() const { return rlimitAs_; }
 
+  /* empty without cgroup, cpu in 1/100000 of a cpu */
+  const std::string &cgroup() const { return cgroup_; }
+  int cpu() const { return cpu_; }
+  int mem() const { return mem_ > 0 ? mem_ : 0; }
+  const std::string &io() const { return io_; }
+
+  /* pipelines the zookeeper requests of startup */
+  bool zkPipeline() const { return zkPipeline_; }
+
+  /* the textfile of the metrics and their summary in status */
+  bool metrics() const { return metrics_; }
+
+  /* the chrome trace file or directory, 0 without */
+  const char *trace() const { return trace_.empty() ? 0 : trace_.c_str(); }
+
+  /* the faults injected under the zoo_* calls, 0 without */
+  const char *zkFault() const { return zkFault_.empty() ? 0 : zkFault_.c_str(); }
+
+  bool testConnectionLoss() const {
+    return testConnectionLossWhenCompeteMasterSuccess_ || testConnectionLossWhenCompeteMasterFailure_;
+  }
+
   bool testConnectionLossWhenCompeteMasterSuccess() {
     bool r = testConnectionLossWhenCompeteMasterSuccess_;
     testConnectionLossWhenCompeteMasterSuccess_ = false;
@@ -45,19 +121,36 @@ public:
   }
 
 private:
-  ConfigOpt() {}
+  ConfigOpt() : uid_(-1), gid_(-1), envp_(0) { stdio_[0] = stdio_[1] = stdio_[2] = -1; }
   bool parseUser(const char *user, char *errbuf);
 
   std::string id_;
   std::string zkhost_;
   std::string name_;
+  int  zkTimeout_;
+  bool fastFailover_;
 
   int maxRetry_;
+  static int maxRetryCap_;
   RetryStrategy retryStrategy_;
 
   bool llap_;
+  int  llapKeys_;
+  int  flushInterval_;
+  int  flushBytes_;
+  size_t ringSize_;   // 0 or a power of 2
+  int  logAsync_;     // slots of the async logger, 0 is synchronous
+  bool logBlock_;
+  bool logBinary_;
   int  stick_;
+  int  electWait_;
+  int  keep_;
+  int  keepDays_;
   bool captureStdio_;
+  int  stdioSegment_;  // MB
+  int  stdioRotate_;   // seconds
+  int  stdioKeep_;
+  int  stdioTail_;
 
   std::string user_;
   int uid_;
@@ -66,13 +159,26 @@ private:
   std::string libdir_;
   std::string logdir_;
   std::string fifo_;
+  std::string agent_;
+
+  char **envp_;
+  std::string cwd_;
+  int stdio_[3];
 
   std::string zkdump_;
   bool tcrash_;
   bool testConnectionLossWhenCompeteMasterSuccess_;
   bool testConnectionLossWhenCompeteMasterFailure_;
+  std::string zkFault_;
 
   int rlimitAs_;
+  std::string cgroup_;
+  int cpu_;
+  int mem_;   // MB
+  std::string io_;
+  bool zkPipeline_;
+  bool metrics_;
+  std::string trace_;
 };
 
 #endif
@@ -2,56 +2,18 @@
 #include <cstdio>
 #include <cstring>
 #include <errno.h>
-#include <sys/resource.h>
+#include <time.h>
 
 #include "logger.h"
 #include "configopt.h"
 #include "zkmgr.h"
+#include "agent.h"
+#include "trace.h"
+#include "zkfault.h"
+#include "reaper.h"
 
 LOGGER_INIT();
 
-inline bool dump(const char *file, const std::string &content)
-{
-  FILE *fp = fopen(file, "w");
-  if (!fp) return false;
-
-  fwrite(content.c_str(), content.size(), 1, fp);
-  fclose(fp);
-  return true;
-}
-
-static bool which(const char *file, std::string *fullPath)
-{
-  fullPath->assign(file);
-  if (access(fullPath->c_str(), X_OK) == 0) return true;
-
-  const char *pathEnv = getenv("PATH");
-  if (!pathEnv) return false;
-
-  const char *colon = strchr(pathEnv, ':');
-  while (colon) {
-    fullPath->assign(pathEnv, colon - pathEnv).append(1, '/').append(file);
-    if (access(fullPath->c_str(), X_OK) == 0) return true;
-    pathEnv = colon + 1;
-    colon = strchr(pathEnv, ':');
-  }
-
-  fullPath->assign(pathEnv).append(1, '/').append(file);
-  if (access(fullPath->c_str(), X_OK) == 0) return true;
-  return false;
-}
-
-inline bool setRlimitAs(int limit)
-{
-  if (limit < 500) limit = 500;
-
-  struct rlimit rlmt;
-  rlmt.rlim_cur = limit * 1024 * 1024;
-  rlmt.rlim_max = limit * 1024 * 1024;
-
-  return setrlimit(RLIMIT_AS, &rlmt) != -1;
-}
-
 int main(int argc, char *argv[])
 {
   if (argc == 1) {
@@ -62,14 +24,17 @@ int main(int argc, char *argv[])
 
   int envc = 1;
   char errbuf[1024];
-  ConfigOpt *cnf = ConfigOpt::create(argc, argv, &envc, errbuf);
+  time_t now = time(0);
+  int64_t begin = Trace::nowUs();
+  ConfigOpt *cnf = ConfigOpt::create(argc, argv, &envc, errbuf, 0, now);
+  int64_t end = Trace::nowUs();
   if (!cnf) {
     fprintf(stderr, "config error %s\n", errbuf);
     return EXIT_FAILURE;
   }
 
   std::string command;
-  if (!which(argv[envc], &command)) {
+  if (!cnf->which(argv[envc], &command)) {
     fprintf(stderr, "command %s notfound", argv[envc]);
     return EXIT_FAILURE;
   }
@@ -77,45 +42,39 @@ int main(int argc, char *argv[])
 
   if (cnf->llap()) daemon(1, 1);
 
-  if (cnf->rlimitAs() && !setRlimitAs(cnf->rlimitAs())) {
-    fprintf(stderr, "%d:%s setrlimit(RLIMIT_AS) error", errno, strerror(errno));
-    return EXIT_FAILURE;
-  }
+  int status;
+  if (cnf->agent() && agentCall(cnf->agent(), argc, argv, now, &status)) return status;
 
-  if (!Logger::create(cnf->logdir() + "/dcron.log", Logger::DAY, true)) {
+  if (!Logger::create(cnf->logdir() + (cnf->logBinary() ? "/dcron.blog" : "/dcron.log"), Logger::DAY, true)) {
     fprintf(stderr, "%d:%s init logger error\n", errno, strerror(errno));
     return EXIT_FAILURE;
   }
+  Logger::defLogger->setBinary(cnf->logBinary());
 
   // redirect stderr to logger
   Logger::defLogger->bindStderr();
 
-  ZkMgr *zkMgr = ZkMgr::create(cnf, errbuf);
-  if (!zkMgr) {
-    log_fatal(0, "%s create ZkMgr error, %s", cnf->name(), errbuf);
-    return EXIT_FAILURE;
+  if (!Logger::defLogger->setAsync(cnf->logAsync(), cnf->logBlock() ? Logger::BLOCK : Logger::DROP)) {
+    log_error(0, "%s start log writer error, log synchronously", cnf->name());
   }
 
-  int status;
-  do {
-    log_info(0, "%s %s status %s", cnf->id(), cnf->name(), ZkMgr::statusToString(zkMgr->status()));
-    if (zkMgr->status() == ZkMgr::MASTER) {
-      status = zkMgr->exec(argc-envc, argv+envc);
-      break;
-    } else if (zkMgr->status() == ZkMgr::SLAVE) {
-      zkMgr->suspend();
-    } else if (zkMgr->status() == ZkMgr::OUT) {
-      return EXIT_SUCCESS;
-    } else {
-      return EXIT_FAILURE;
-    }
-  } while (true);
+  /* written when main returns, the config is read before the trace is known */
+  Trace trace(cnf->trace(), cnf->name(), cnf->id());
+  trace.span("ConfigOpt::create", begin, end);
+
+  if (cnf->zkFault() && !ZkFault::configure(cnf->zkFault(), errbuf)) {
+    log_fatal(0, "%s %s", cnf->name(), errbuf);
+    return EXIT_FAILURE;
+  }
 
-  if (cnf->zkdump()) {
-    sleep(1);   // wait negotiate timeout
-    std::string json;
-    if (zkMgr->dump(&json)) dump(cnf->zkdump(), json);
+  ZkSession *session = ZkSession::create(cnf->zkhost(), cnf->zkTimeout(), errbuf);
+  if (!session) {
+    log_fatal(0, "%s create ZkMgr error, %s", cnf->name(), errbuf);
+    return EXIT_FAILURE;
   }
 
+  status = ZkMgr::run(cnf, session, argc-envc, argv+envc);
+  Reaper::drain();
+  session->release();
   return status;
 }
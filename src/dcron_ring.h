@@ -0,0 +1,395 @@
+#ifndef _DCRON_RING_H_
+#define _DCRON_RING_H_
+
+/* the llap checkpoint without syscalls, DCRON_RING_SIZE > 0 gives the task
+ * a shared memory ring, DCRON_RING is its fd. the task puts KEY=VALUE
+ * records, dcron consumes them in batches, the same as the fifo records.
+ * DCRON_RING_BELL is an eventfd, a put or a barrier writes it only when
+ * dcron sleeps waiting for one, at most once a sleep
+ *
+ *   struct dcron_ring ring;
+ *   if (dcron_ring_open(&ring) == 0) {
+ *     dcron_ring_put(&ring, "OFFSET", "12345");
+ *   }
+ *
+ * single producer, single consumer. the producer writes the record after
+ * head and publishes it by moving head, the consumer reads up to head and
+ * frees the space by moving tail. only one thread of the task may put,
+ * threads sharing a ring need a lock of their own
+ *
+ * a full ring never blocks, put fails with EAGAIN and the record is
+ * counted in dropped. the last value of a key wins, a task may simply
+ * put the next offset later
+ *
+ * put returns before the record is in zookeeper, commit blocks until
+ * everything put so far is written to llap. the barriers seen by one poll
+ * of dcron share one zookeeper write, a task may also split it
+ *
+ *   dcron_ring_put(&ring, "OFFSET", "12345");
+ *   uint64_t barrier = dcron_ring_barrier(&ring);
+ *   ... send the next batch ...
+ *   dcron_ring_wait(&ring, barrier, 5000);
+ *
+ * header only, C and C++, gcc >= 4.7
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define DCRON_RING_MAGIC   0x474e4952u   /* "RING" */
+#define DCRON_RING_VERSION 1
+#define DCRON_RING_SKIP    0xffffffffu   /* the rest of the ring is unused, wrap */
+
+/* what dcron sleeps for, a put or only a barrier and a half full ring */
+#define DCRON_RING_WAKE_PUT     1
+#define DCRON_RING_WAKE_BARRIER 2
+
+/* head and tail on their own cache lines */
+struct dcron_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t offset;    /* of the data */
+  uint32_t size;      /* of the data, a power of 2 */
+  uint32_t dropped;   /* records put failed with EAGAIN */
+  char     pad0[44];
+  uint64_t head;      /* bytes published, written by the producer */
+  uint64_t barrier;   /* head when commit was last called */
+  uint32_t waiters;   /* threads in dcron_ring_wait */
+  char     pad1[44];
+  uint64_t tail;      /* bytes consumed, written by the consumer */
+  uint64_t acked;     /* bytes written to zookeeper */
+  uint32_t ackWake;   /* futex, changes with acked */
+  uint32_t sleeping;  /* DCRON_RING_WAKE_*, 0 when dcron is awake */
+  char     pad2[40];
+};
+
+/* a record is a uint32_t length and KEY=VALUE, padded to 8 bytes. the
+ * header is writable by the task, the size of the data is the one checked
+ * at attach and never read again
+ */
+struct dcron_ring {
+  struct dcron_ring_header *hdr;
+  char    *data;
+  size_t   mapLen;
+  uint64_t size;
+  int      bell;   /* the eventfd of DCRON_RING_BELL, -1 without */
+};
+
+static inline uint64_t dcron_ring_align(uint64_t n)
+{
+  return (n + 7) & ~(uint64_t) 7;
+}
+
+/* maps a ring made by dcron_ring_init, without the bell dcron reads it
+ * only at its other events
+ */
+static inline int dcron_ring_attach(struct dcron_ring *ring, int fd)
+{
+  struct stat st;
+  void *addr;
+  struct dcron_ring_header *hdr;
+
+  if (fstat(fd, &st) == -1) return -1;
+  if ((size_t) st.st_size < sizeof(struct dcron_ring_header)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) return -1;
+
+  hdr = (struct dcron_ring_header *) addr;
+  if (hdr->magic != DCRON_RING_MAGIC || hdr->version != DCRON_RING_VERSION || hdr->size < 8 ||
+      (hdr->size & (hdr->size - 1)) != 0 || (uint64_t) hdr->offset + hdr->size > (uint64_t) st.st_size) {
+    munmap(addr, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ring->hdr    = hdr;
+  ring->data   = (char *) addr + hdr->offset;
+  ring->mapLen = st.st_size;
+  ring->size   = hdr->size;
+  ring->bell   = -1;
+  return 0;
+}
+
+/* the ring of DCRON_RING, ENOENT if dcron gave none */
+static inline int dcron_ring_open(struct dcron_ring *ring)
+{
+  const char *env = getenv("DCRON_RING");
+  const char *bell = getenv("DCRON_RING_BELL");
+  if (!env || !*env) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (dcron_ring_attach(ring, atoi(env)) == -1) return -1;
+  if (bell && *bell) ring->bell = atoi(bell);
+  return 0;
+}
+
+static inline void dcron_ring_close(struct dcron_ring *ring)
+{
+  if (ring->hdr) munmap(ring->hdr, ring->mapLen);
+  ring->hdr  = 0;
+  ring->data = 0;
+  ring->bell = -1;
+}
+
+/* wakes dcron if it sleeps for a wake of level, the first one to see it
+ * asleep writes the bell
+ */
+static inline void dcron_ring_ring(struct dcron_ring *ring, uint32_t level)
+{
+  uint32_t sleeping = __atomic_load_n(&ring->hdr->sleeping, __ATOMIC_SEQ_CST);
+  uint64_t one = 1;
+  ssize_t rc;
+
+  if (ring->bell == -1 || sleeping == 0 || level < sleeping) return;
+  if (__atomic_exchange_n(&ring->hdr->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    rc = write(ring->bell, &one, sizeof(one));
+    (void) rc;
+  }
+}
+
+/* the producer, 0 or -1 with errno
+ *   EINVAL   key is empty or has '=' or '\n'
+ *   EMSGSIZE the record is larger than half of the ring
+ *   EAGAIN   the ring is full, dcron has not consumed it yet
+ */
+static inline int dcron_ring_put2(struct dcron_ring *ring, const char *key, size_t keyLen,
+                                  const char *value, size_t valueLen)
+{
+  struct dcron_ring_header *hdr = ring->hdr;
+  uint64_t size = ring->size;
+  uint64_t head = hdr->head;
+  uint64_t tail, pos, need, skip;
+  uint32_t len;
+
+  if (keyLen == 0 || memchr(key, '=', keyLen) || memchr(key, '\n', keyLen)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  need = dcron_ring_align(sizeof(uint32_t) + keyLen + 1 + valueLen);
+  if (need > size / 2) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pos  = head & (size - 1);
+  skip = need > size - pos ? size - pos : 0;
+
+  tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+  if (head + skip + need - tail > size) {
+    __atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (skip) {
+    len = DCRON_RING_SKIP;
+    memcpy(ring->data + pos, &len, sizeof(len));
+    head += skip;
+    pos   = 0;
+  }
+
+  len = (uint32_t) (keyLen + 1 + valueLen);
+  memcpy(ring->data + pos, &len, sizeof(len));
+  memcpy(ring->data + pos + sizeof(len), key, keyLen);
+  ring->data[pos + sizeof(len) + keyLen] = '=';
+  memcpy(ring->data + pos + sizeof(len) + keyLen + 1, value, valueLen);
+
+  /* published before sleeping is read, dcron reads head after setting it */
+  __atomic_store_n(&hdr->head, head + need, __ATOMIC_SEQ_CST);
+  dcron_ring_ring(ring, head + need - tail > size / 2 ? DCRON_RING_WAKE_BARRIER : DCRON_RING_WAKE_PUT);
+  return 0;
+}
+
+static inline int dcron_ring_put(struct dcron_ring *ring, const char *key, const char *value)
+{
+  return dcron_ring_put2(ring, key, strlen(key), value, strlen(value));
+}
+
+/* asks dcron to write everything put so far at once, returns the
+ * position to wait for
+ */
+static inline uint64_t dcron_ring_barrier(struct dcron_ring *ring)
+{
+  uint64_t head = ring->hdr->head;
+  __atomic_store_n(&ring->hdr->barrier, head, __ATOMIC_SEQ_CST);
+  dcron_ring_ring(ring, DCRON_RING_WAKE_BARRIER);
+  return head;
+}
+
+/* blocks until barrier is in zookeeper, any thread may wait. timeout in
+ * milliseconds, -1 forever. 0 or -1 with ETIMEDOUT, the records are not
+ * lost, a later commit covers them
+ */
+static inline int dcron_ring_wait(struct dcron_ring *ring, uint64_t barrier, int timeout)
+{
+  struct dcron_ring_header *hdr = ring->hdr;
+  struct timespec now, end, ts;
+  uint32_t wake;
+  int rc = 0;
+
+  if (timeout >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec  += timeout / 1000;
+    end.tv_nsec += (long) (timeout % 1000) * 1000000;
+    if (end.tv_nsec >= 1000000000) {
+      end.tv_sec  += 1;
+      end.tv_nsec -= 1000000000;
+    }
+  }
+
+  /* dcron wakes us only if it sees waiters after moving acked */
+  __atomic_fetch_add(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    wake = __atomic_load_n(&hdr->ackWake, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->acked, __ATOMIC_ACQUIRE) >= barrier) break;
+
+    if (timeout >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      ts.tv_sec  = end.tv_sec - now.tv_sec;
+      ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+      if (ts.tv_nsec < 0) {
+        ts.tv_sec  -= 1;
+        ts.tv_nsec += 1000000000;
+      }
+      if (ts.tv_sec < 0) {
+        errno = ETIMEDOUT;
+        rc = -1;
+        break;
+      }
+    }
+    syscall(SYS_futex, &hdr->ackWake, FUTEX_WAIT, wake, timeout >= 0 ? &ts : 0, 0, 0);
+  }
+  __atomic_fetch_sub(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  return rc;
+}
+
+static inline int dcron_ring_commit(struct dcron_ring *ring, int timeout)
+{
+  return dcron_ring_wait(ring, dcron_ring_barrier(ring), timeout);
+}
+
+/* the consumer side, used by dcron */
+
+/* sizes fd, a memfd or a file, for a ring of size bytes and maps it */
+static inline int dcron_ring_init(struct dcron_ring *ring, int fd, uint32_t size)
+{
+  struct dcron_ring_header hdr;
+  if (size < 8 || (size & (size - 1)) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic   = DCRON_RING_MAGIC;
+  hdr.version = DCRON_RING_VERSION;
+  hdr.offset  = sizeof(hdr);
+  hdr.size    = size;
+
+  if (ftruncate(fd, sizeof(hdr) + size) == -1) return -1;
+  if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) return -1;
+  return dcron_ring_attach(ring, fd);
+}
+
+typedef void (*dcron_ring_fn)(const char *record, size_t len, void *ctx);
+
+/* calls fn for every record published, frees them at once at the end.
+ * returns the number of records, -1 if the producer corrupted the ring,
+ * the records in it are lost
+ */
+static inline long dcron_ring_consume(struct dcron_ring *ring, dcron_ring_fn fn, void *ctx)
+{
+  struct dcron_ring_header *hdr = ring->hdr;
+  uint64_t size = ring->size;
+  uint64_t tail = hdr->tail;
+  uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  uint64_t pos, need;
+  uint32_t len;
+  long n = 0;
+
+  if (head - tail > size || (head & 7) != 0 || (tail & 7) != 0) goto corrupted;
+
+  while (tail != head) {
+    pos = tail & (size - 1);
+    memcpy(&len, ring->data + pos, sizeof(len));
+    if (len == DCRON_RING_SKIP) {
+      tail += size - pos;
+      if (tail > head) goto corrupted;
+      continue;
+    }
+
+    need = dcron_ring_align(sizeof(len) + (uint64_t) len);
+    if (need > size - pos || need > head - tail) goto corrupted;
+
+    fn(ring->data + pos + sizeof(len), len, ctx);
+    tail += need;
+    ++n;
+  }
+
+  __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+  return n;
+
+corrupted:
+  __atomic_store_n(&hdr->tail, head, __ATOMIC_RELEASE);
+  return -1;
+}
+
+/* before dcron blocks, 0 if the producer rings the bell for a wake of
+ * level, -1 if there is such work already. a barrier counts only until
+ * it is consumed, a save that failed is retried by the timer of dcron
+ */
+static inline int dcron_ring_sleep(struct dcron_ring *ring, uint32_t level)
+{
+  struct dcron_ring_header *hdr = ring->hdr;
+  uint64_t head, tail, barrier;
+
+  __atomic_store_n(&hdr->sleeping, level, __ATOMIC_SEQ_CST);
+  head    = __atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST);
+  barrier = __atomic_load_n(&hdr->barrier, __ATOMIC_SEQ_CST);
+  tail    = hdr->tail;
+  if ((barrier > tail && barrier <= head) || head - tail > (level == DCRON_RING_WAKE_PUT ? 0 : ring->size / 2)) {
+    __atomic_store_n(&hdr->sleeping, 0, __ATOMIC_SEQ_CST);
+    return -1;
+  }
+  return 0;
+}
+
+static inline void dcron_ring_awake(struct dcron_ring *ring)
+{
+  __atomic_store_n(&ring->hdr->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/* a commit is waiting for records not yet in zookeeper */
+static inline int dcron_ring_barrier_pending(struct dcron_ring *ring)
+{
+  return __atomic_load_n(&ring->hdr->barrier, __ATOMIC_ACQUIRE) > ring->hdr->acked;
+}
+
+/* the records consumed up to pos are in zookeeper */
+static inline void dcron_ring_ack(struct dcron_ring *ring, uint64_t pos)
+{
+  struct dcron_ring_header *hdr = ring->hdr;
+  if (pos <= hdr->acked) return;
+
+  __atomic_store_n(&hdr->acked, pos, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&hdr->ackWake, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &hdr->ackWake, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+  }
+}
+
+#endif
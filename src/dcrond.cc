@@ -0,0 +1,84 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "agent.h"
+#include "scheduler.h"
+#include "zkfault.h"
+
+LOGGER_INIT();
+
+inline const char *getenv(const char *name, const char *def)
+{
+  const char *value = getenv(name);
+  return value && *value ? value : def;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 1) {
+    fprintf(stderr, "usage: %s, configured by DCRON_AGENT, DCRON_LOGDIR and DCRON_CRONTAB\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *sock = getenv("DCRON_AGENT", "/var/lib/dcron/dcrond.sock");
+  std::string logdir = getenv("DCRON_LOGDIR", "/var/log/dcron");
+  const char *crontab = getenv("DCRON_CRONTAB", 0);
+
+  bool binary = strcmp(getenv("DCRON_LOG_FORMAT", "TEXT"), "BINARY") == 0;
+  if (!Logger::create(logdir + (binary ? "/dcron.blog" : "/dcron.log"), Logger::DAY, true)) {
+    fprintf(stderr, "%d:%s init logger error\n", errno, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  Logger::defLogger->setBinary(binary);
+
+  // a client may go away at any time
+  signal(SIGPIPE, SIG_IGN);
+
+  /* task threads inherit the mask, SIGCHLD then waits for their signalfd
+   * when pidfd is not supported
+   */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &mask, 0);
+
+  char errbuf[1024];
+  const char *zkFault = getenv("DCRON_ZKFAULT", 0);
+  if (zkFault && !ZkFault::configure(zkFault, errbuf)) {
+    fprintf(stderr, "%s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  Agent *agent = Agent::create(sock, errbuf);
+  if (!agent) {
+    fprintf(stderr, "create agent error, %s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  if (crontab) {
+    Scheduler *scheduler = Scheduler::create(agent, crontab, errbuf);
+    if (!scheduler || !scheduler->start(errbuf)) {
+      fprintf(stderr, "create scheduler error, %s\n", errbuf);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // redirect stderr to logger
+  Logger::defLogger->bindStderr();
+
+  Logger::Overflow overflow = strcmp(getenv("DCRON_LOG_OVERFLOW", "DROP"), "BLOCK") == 0 ? Logger::BLOCK : Logger::DROP;
+  int slots = atoi(getenv("DCRON_LOG_ASYNC", "256"));
+  if (!Logger::defLogger->setAsync(slots > 0 ? slots : 0, overflow)) {
+    log_error(0, "start log writer error, log synchronously");
+  }
+
+  log_info(0, "dcrond listen on %s, crontab %s", sock, crontab ? crontab : "none");
+  agent->loop();
+  return EXIT_SUCCESS;
+}
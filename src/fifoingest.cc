@@ -0,0 +1,91 @@
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "fifoingest.h"
+
+#ifndef F_SETPIPE_SZ
+# define F_SETPIPE_SZ 1031
+#endif
+
+#define RECORD_MAX (1024 * 1024)
+
+/* unprivileged processes are limited by /proc/sys/fs/pipe-max-size,
+ * halve the size until it is accepted
+ */
+int FifoIngest::enlarge(int fd, int size)
+{
+  for (/**/; size >= 64 * 1024; size /= 2) {
+    int rc = fcntl(fd, F_SETPIPE_SZ, size);
+    if (rc != -1) return rc;
+    if (errno != EPERM && errno != EBUSY) break;
+  }
+  return -1;
+}
+
+bool FifoIngest::read(int fd)
+{
+  char buffer[64 * 1024];
+  ssize_t nn;
+  while ((nn = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    bytes_ += nn;
+    parse(buffer, nn);
+  }
+  return nn == 0 || errno == EAGAIN || errno == EINTR;
+}
+
+void FifoIngest::parse(const char *ptr, size_t len)
+{
+  const char *end = ptr + len;
+  while (ptr < end) {
+    const char *nl = (const char *) memchr(ptr, '\n', end - ptr);
+    if (!nl) {
+      if (dropped_ || carry_.size() + (end - ptr) > RECORD_MAX) {
+        dropped_ += carry_.size() + (end - ptr);
+        carry_.clear();
+      } else {
+        carry_.append(ptr, end - ptr);
+      }
+      return;
+    }
+
+    if (dropped_) {
+      log_error(0, "fifo record of %d bytes is dropped, larger than %d", (int) (dropped_ + (nl - ptr)), RECORD_MAX);
+      dropped_ = 0;
+    } else if (carry_.empty()) {
+      record(ptr, nl - ptr);
+    } else {
+      carry_.append(ptr, nl - ptr);
+      record(carry_.data(), carry_.size());
+      carry_.clear();
+    }
+    ptr = nl + 1;
+  }
+}
+
+/* the key ends at the first '=', the value may contain '=' */
+void FifoIngest::record(const char *ptr, size_t len)
+{
+  const char *eq = (const char *) memchr(ptr, '=', len);
+  if (!eq || eq == ptr) {
+    log_error(0, "fifo record %.*s is not KEY=VALUE", (int) (len > 128 ? 128 : len), ptr);
+    return;
+  }
+  pending_[std::string(ptr, eq - ptr)].assign(eq + 1, ptr + len - (eq + 1));
+}
+
+void FifoIngest::take(Env *env)
+{
+  env->swap(pending_);
+  pending_.clear();
+  bytes_ = 0;
+}
+
+void FifoIngest::restore(const Env &env)
+{
+  for (Env::const_iterator ite = env.begin(); ite != env.end(); ++ite) {
+    pending_.insert(*ite);
+  }
+}
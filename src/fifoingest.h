@@ -0,0 +1,50 @@
+#ifndef _FIFOINGEST_H_
+#define _FIFOINGEST_H_
+
+#include <string>
+#include <map>
+
+/* KEY=VALUE\n records the task writes to DCRON_FIFO
+ * the fifo is drained whenever it is readable so the writer never blocks,
+ * a record split across two reads is carried over, the last value of a
+ * key wins until the records are taken for a flush
+ */
+class FifoIngest {
+public:
+  typedef std::map<std::string, std::string> Env;
+
+  FifoIngest() : bytes_(0), dropped_(0), flushBytes_(0) {}
+
+  /* flush at once after flushBytes of records */
+  void setFlushBytes(size_t flushBytes) { flushBytes_ = flushBytes; }
+
+  /* enlarges the pipe of the fifo, returns the size in effect */
+  static int enlarge(int fd, int size);
+
+  /* reads until EAGAIN, false on read error */
+  bool read(int fd);
+
+  /* a record without '\n', from DCRON_RING */
+  void add(const char *ptr, size_t len) { bytes_ += len + 1; record(ptr, len); }
+
+  bool empty() const { return pending_.empty(); }
+  bool full() const { return bytes_ >= flushBytes_; }
+
+  /* moves the coalesced records out */
+  void take(Env *env);
+
+  /* puts back the records of a failed flush, newer values are kept */
+  void restore(const Env &env);
+
+private:
+  void parse(const char *ptr, size_t len);
+  void record(const char *ptr, size_t len);
+
+  std::string carry_;     // the tail of the last read without '\n'
+  Env         pending_;
+  size_t      bytes_;     // read since the last take
+  size_t      dropped_;   // bytes of a record too large
+  size_t      flushBytes_;
+};
+
+#endif
@@ -0,0 +1,330 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <map>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <json/json.h>
+
+#include "logger.h"
+
+/* dcron-logcat renders the binary log of DCRON_LOG_FORMAT=BINARY as the
+ * text of the text log, or one json object per line. text between the
+ * records, what is written to stderr, is passed through
+ */
+
+struct Def {
+  std::string file;
+  int         line;
+  std::string fmt;
+};
+
+/* pid and id */
+typedef std::pair<uint64_t, uint64_t> DefKey;
+typedef std::map<DefKey, Def> DefMap;
+
+static const char *LEVELS[] = {"", "", "DEBUG", "INFO", "ERROR", "FATAL"};
+static const uint32_t RECORD_MAX = 1024 * 1024;
+
+inline bool readAll(FILE *fp, std::string *data)
+{
+  char buffer[64 * 1024];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) data->append(buffer, n);
+  return !ferror(fp);
+}
+
+/* a record at pos, 0 if the bytes are not one */
+inline const LogBinHead *record(const std::string &data, size_t pos)
+{
+  if (pos + sizeof(LogBinHead) > data.size() || (uint8_t) data[pos] != LOG_BIN_MARK) return 0;
+
+  const LogBinHead *head = (const LogBinHead *) (data.data() + pos);
+  if (head->type != LOG_BIN_DEF && head->type != LOG_BIN_LINE) return 0;
+  if (head->len > RECORD_MAX || pos + sizeof(LogBinHead) + head->len > data.size()) return 0;
+  return head;
+}
+
+class Args {
+public:
+  explicit Args(const LogBinHead *head)
+    : ptr_((const char *) (head + 1)), end_((const char *) (head + 1) + head->len) {}
+
+  bool var(uint64_t *value) { return logGetVar(&ptr_, end_, value); }
+  bool number(int64_t *value) { return logGetInt(&ptr_, end_, value); }
+
+  bool real(double *value) {
+    if ((size_t) (end_ - ptr_) < sizeof(*value)) return false;
+    memcpy(value, ptr_, sizeof(*value));
+    ptr_ += sizeof(*value);
+    return true;
+  }
+
+  bool bytes(uint64_t len, std::string *value) {
+    if ((uint64_t) (end_ - ptr_) < len) return false;
+    value->assign(ptr_, len);
+    ptr_ += len;
+    return true;
+  }
+
+  bool string(std::string *value, bool *null) {
+    uint64_t len;
+    if (!var(&len)) return false;
+    *null = len == 0;
+    return *null || bytes(len - 1, value);
+  }
+
+  /* the rest of the record */
+  std::string rest() {
+    std::string value(ptr_, end_ - ptr_);
+    ptr_ = end_;
+    return value;
+  }
+
+private:
+  const char *ptr_;
+  const char *end_;
+};
+
+inline bool parseDef(const LogBinHead *head, DefKey *key, Def *def)
+{
+  Args args(head);
+  uint64_t fileLen;
+  int64_t  line;
+  if (!args.var(&key->first) || !args.var(&key->second) || !args.number(&line) || !args.var(&fileLen) ||
+      !args.bytes(fileLen, &def->file)) {
+    return false;
+  }
+  def->line = line;
+  def->fmt  = args.rest();
+  return true;
+}
+
+/* the spec with '*' replaced and the length made to match the decoded type */
+inline std::string specFormat(const LogSpec &spec, int width, int precision, const char *length)
+{
+  std::string fmt("%");
+  for (const char *ptr = spec.begin + 1; ptr < spec.end && strchr("-+ #0'", *ptr); ++ptr) fmt.append(1, *ptr);
+
+  char buffer[32];
+  if (width != -1) {
+    snprintf(buffer, 32, "%d", width);
+    fmt.append(buffer);
+  }
+  if (precision != -1) {
+    snprintf(buffer, 32, ".%d", precision);
+    fmt.append(buffer);
+  }
+  fmt.append(length).append(1, spec.conv);
+  return fmt;
+}
+
+/* the int of hh and h is stored whole, printf converts it to char or short */
+inline int64_t narrow(const LogSpec &spec, int64_t number)
+{
+  bool sign = spec.conv == 'd' || spec.conv == 'i';
+  if (spec.length == LogSpec::HH) return sign ? (int64_t) (signed char) number : (int64_t) (unsigned char) number;
+  if (spec.length == LogSpec::H) return sign ? (int64_t) (short) number : (int64_t) (unsigned short) number;
+  return number;
+}
+
+/* the arguments are cut when the line was longer than a record */
+inline std::string format(const std::string &fmt, Args *args)
+{
+  std::string out;
+  char buffer[ERR_STR + 1];
+  const char *text = fmt.c_str();
+
+  LogSpec spec;
+  for (const char *pos = logSpec(text, &spec); pos; pos = logSpec(text, &spec)) {
+    for (const char *ptr = text; ptr < pos; ++ptr) {
+      out.append(1, *ptr);
+      if (ptr[0] == '%' && ptr[1] == '%') ++ptr;
+    }
+    text = spec.end;
+
+    int64_t width = spec.width, precision = spec.precision;
+    if ((spec.width == -2 && !args->number(&width)) || (spec.precision == -2 && !args->number(&precision))) {
+      out.append("<?>");
+      continue;
+    }
+
+    int64_t number;
+    bool    ok = true;
+    switch (spec.conv) {
+    case 'd': case 'i': case 'c': case 'o': case 'u': case 'x': case 'X':
+      if ((ok = args->number(&number))) {
+        number = narrow(spec, number);
+        snprintf(buffer, sizeof(buffer), specFormat(spec, width, precision, spec.conv == 'c' ? "" : "ll").c_str(),
+                 spec.conv == 'c' ? (int) number : (long long) number);
+      }
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+      double value;
+      if ((ok = args->real(&value))) {
+        snprintf(buffer, sizeof(buffer), specFormat(spec, width, precision, "").c_str(), value);
+      }
+      break;
+    }
+    case 'p':
+      if ((ok = args->number(&number))) {
+        snprintf(buffer, sizeof(buffer), specFormat(spec, width, precision, "").c_str(), (void *) (intptr_t) number);
+      }
+      break;
+    case 's': {
+      std::string str;
+      bool null;
+      if ((ok = args->string(&str, &null))) {
+        snprintf(buffer, sizeof(buffer), specFormat(spec, width, precision, "").c_str(), null ? "(null)" : str.c_str());
+      }
+      break;
+    }
+    case 'n':
+      buffer[0] = '\0';
+      break;
+    default:
+      ok = false;
+    }
+    out.append(ok ? buffer : "<?>");
+  }
+
+  for (const char *ptr = text; *ptr; ++ptr) {
+    out.append(1, *ptr);
+    if (ptr[0] == '%' && ptr[1] == '%') ++ptr;
+  }
+  return out;
+}
+
+class Cat {
+public:
+  explicit Cat(bool json) : json_(json) {}
+
+  void raw(const char *ptr, size_t len) {
+    if (!json_) {
+      fwrite(ptr, 1, len, stdout);
+      return;
+    }
+
+    const char *end = ptr + len;
+    while (ptr < end) {
+      const char *nl = (const char *) memchr(ptr, '\n', end - ptr);
+      if (!nl) nl = end;
+      if (nl > ptr) {
+        Json::Value obj(Json::objectValue);
+        obj["raw"] = std::string(ptr, nl - ptr);
+        fputs(writer_.write(obj).c_str(), stdout);
+      }
+      ptr = nl + 1;
+    }
+  }
+
+  /* args is after the pid and the id */
+  void line(const LogBinHead *head, uint64_t pid, Args *args, const Def *def) {
+    uint64_t sec, usec;
+    int64_t  eno;
+    if (!args->var(&sec) || !args->var(&usec) || !args->number(&eno)) return;
+
+    char timestr[32];
+    struct tm ltm;
+    time_t now = sec;
+    localtime_r(&now, &ltm);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &ltm);
+
+    const char *level = head->level < 6 ? LEVELS[head->level] : "";
+    std::string msg = def ? format(def->fmt, args) : "<unknown format>";
+
+    if (json_) {
+      Json::Value obj(Json::objectValue);
+      obj["time"]  = timestr;
+      obj["ts"]    = (Json::UInt) sec;
+      obj["usec"]  = (Json::UInt) usec;
+      obj["level"] = level;
+      obj["pid"]   = (Json::UInt) pid;
+      obj["file"]  = def ? def->file : "";
+      obj["line"]  = def ? def->line : 0;
+      obj["errno"] = (int) eno;
+      obj["error"] = eno ? strerror(eno) : "";
+      obj["msg"]   = msg;
+      fputs(writer_.write(obj).c_str(), stdout);
+    } else {
+      printf("%s [%s] #%d #%s@%d \"%d:%s\" %s\n", timestr, level, (int) usec, def ? def->file.c_str() : "",
+             def ? def->line : 0, (int) eno, eno ? strerror(eno) : "", msg.c_str());
+    }
+  }
+
+  /* a definition is looked up as of the line, then anywhere in the file,
+   * a line of another thread may get in front of it at rotation
+   */
+  void cat(const std::string &data) {
+    DefMap defs, anywhere;
+    for (size_t pos = 0; pos < data.size(); ++pos) {
+      const LogBinHead *head = record(data, pos);
+      DefKey key;
+      Def def;
+      if (head && head->type == LOG_BIN_DEF && parseDef(head, &key, &def)) anywhere.insert(std::make_pair(key, def));
+      if (head) pos += sizeof(LogBinHead) + head->len - 1;
+    }
+
+    size_t pos = 0;
+    while (pos < data.size()) {
+      const LogBinHead *head = record(data, pos);
+      if (!head) {
+        size_t next = data.find((char) LOG_BIN_MARK, pos + 1);
+        if (next == std::string::npos) next = data.size();
+        raw(data.data() + pos, next - pos);
+        pos = next;
+        continue;
+      }
+
+      DefKey key;
+      Def def;
+      Args args(head);
+      if (head->type == LOG_BIN_DEF) {
+        if (parseDef(head, &key, &def)) defs[key] = def;
+      } else if (args.var(&key.first) && args.var(&key.second)) {
+        const Def *found = 0;
+        DefMap::iterator ite = defs.find(key);
+        if (ite != defs.end()) found = &ite->second;
+        else if ((ite = anywhere.find(key)) != anywhere.end()) found = &ite->second;
+        line(head, key.first, &args, found);
+      }
+      pos += sizeof(LogBinHead) + head->len;
+    }
+  }
+
+private:
+  bool json_;
+  Json::FastWriter writer_;
+};
+
+int main(int argc, char *argv[])
+{
+  bool json = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j")) != -1) {
+    if (opt == 'j') {
+      json = true;
+    } else {
+      fprintf(stderr, "usage: %s [-j] [file...], -j one json object per line\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Cat cat(json);
+  int rc = EXIT_SUCCESS;
+  for (int i = optind; i < argc || i == optind; ++i) {
+    bool stdinput = i >= argc || strcmp(argv[i], "-") == 0;
+    FILE *fp = stdinput ? stdin : fopen(argv[i], "r");
+    std::string data;
+    if (!fp || !readAll(fp, &data)) {
+      fprintf(stderr, "read %s error, %s\n", stdinput ? "stdin" : argv[i], strerror(errno));
+      rc = EXIT_FAILURE;
+    } else {
+      cat.cat(data);
+    }
+    if (fp && !stdinput) fclose(fp);
+  }
+  return rc;
+}
@@ -5,6 +5,8 @@
 #include <cstdlib>
 #include <cerrno>
 #include <cstring>
+#include <cctype>
+#include <cstddef>
 #include <cassert>
 #include <string>
 #include <memory>
@@ -17,11 +19,17 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 
 #define LOGGER_INIT() Logger *Logger::defLogger = 0;
 
 static const size_t ERR_STR = 4095;
+static const size_t LOG_SLOT_BYTES = 512;   // longer lines are copied to the heap
+static const int    LOG_IOV_MAX    = 64;
+static const size_t LOG_SLOTS_MAX  = 64 * 1024;
 static pthread_mutex_t LOGGER_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 
 static const int   DEBUG_INT = 2;
@@ -34,6 +42,136 @@ static const char *INFO_PTR  = "INFO";
 static const char *ERROR_PTR = "ERROR";
 static const char *FATAL_PTR = "FATAL";
 
+/* a log_* call site, in binary mode the format and the place are written
+ * once per file as a LOG_BIN_DEF record, a line is a LOG_BIN_LINE record
+ * of the id and the raw arguments, formatted by dcron-logcat
+ */
+struct LogSite {
+  const char *fmt;
+  const char *file;
+  int         line;
+  uint32_t    id;     // 0 until first logged
+  LogSite    *next;   // of all the sites logged
+};
+
+/* a record is the head and varints, 0xFF never starts a text line, the
+ * text of stderr bound to the log stays readable between the records
+ *   LOG_BIN_DEF   pid, id, line, file length, file, fmt
+ *   LOG_BIN_LINE  pid, id, sec, usec, errno, arguments
+ * a signed number is zigzag encoded, a double is 8 bytes native endian, a
+ * string is its length + 1, 0 if null, and the bytes
+ */
+static const uint8_t LOG_BIN_MARK = 0xFF;
+static const uint8_t LOG_BIN_DEF  = 1;
+static const uint8_t LOG_BIN_LINE = 2;
+
+struct LogBinHead {
+  uint8_t  mark;
+  uint8_t  type;
+  uint8_t  level;
+  uint8_t  pad;
+  uint32_t len;   // of the record after the head
+};
+
+inline bool logPutVar(char **ptr, char *end, uint64_t value)
+{
+  do {
+    if (*ptr == end) return false;
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    *(*ptr)++ = byte | (value ? 0x80 : 0);
+  } while (value);
+  return true;
+}
+
+inline bool logGetVar(const char **ptr, const char *end, uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; *ptr < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*ptr)++;
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+inline bool logPutInt(char **ptr, char *end, int64_t value)
+{
+  return logPutVar(ptr, end, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+inline bool logGetInt(const char **ptr, const char *end, int64_t *value)
+{
+  uint64_t zigzag;
+  if (!logGetVar(ptr, end, &zigzag)) return false;
+  *value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+  return true;
+}
+
+/* a conversion of a printf format, width and precision -1 when absent,
+ * -2 when '*'
+ */
+struct LogSpec {
+  enum { NONE, HH, H, L, LL, J, Z, T, LD };
+
+  const char *begin;
+  const char *end;
+  int  width;
+  int  precision;
+  int  length;
+  char conv;
+};
+
+/* the next conversion of fmt, "%%" is not one, 0 at the end */
+inline const char *logSpec(const char *fmt, LogSpec *spec)
+{
+  for (const char *ptr = strchr(fmt, '%'); ptr; ptr = strchr(ptr, '%')) {
+    if (ptr[1] == '%') {
+      ptr += 2;
+      continue;
+    }
+
+    spec->begin = ptr++;
+    while (*ptr && strchr("-+ #0'", *ptr)) ++ptr;
+
+    spec->width = -1;
+    if (*ptr == '*') {
+      spec->width = -2;
+      ++ptr;
+    } else if (isdigit(*ptr)) {
+      spec->width = strtol(ptr, (char **) &ptr, 10);
+    }
+
+    spec->precision = -1;
+    if (*ptr == '.') {
+      ++ptr;
+      if (*ptr == '*') {
+        spec->precision = -2;
+        ++ptr;
+      } else {
+        spec->precision = strtol(ptr, (char **) &ptr, 10);
+      }
+    }
+
+    spec->length = LogSpec::NONE;
+    if (ptr[0] == 'h' && ptr[1] == 'h') spec->length = LogSpec::HH, ptr += 2;
+    else if (ptr[0] == 'l' && ptr[1] == 'l') spec->length = LogSpec::LL, ptr += 2;
+    else if (*ptr == 'h') spec->length = LogSpec::H, ++ptr;
+    else if (*ptr == 'l') spec->length = LogSpec::L, ++ptr;
+    else if (*ptr == 'q') spec->length = LogSpec::LL, ++ptr;
+    else if (*ptr == 'j') spec->length = LogSpec::J, ++ptr;
+    else if (*ptr == 'z') spec->length = LogSpec::Z, ++ptr;
+    else if (*ptr == 't') spec->length = LogSpec::T, ++ptr;
+    else if (*ptr == 'L') spec->length = LogSpec::LD, ++ptr;
+
+    if (!*ptr) return 0;
+    spec->conv = *ptr;
+    spec->end  = ptr + 1;
+    return spec->begin;
+  }
+  return 0;
+}
+
 class Logger {
 public:
   enum Level { DEBUG, INFO, ERROR, FATAL };
@@ -41,6 +179,14 @@ public:
 
   static Logger *defLogger;
 
+  /* async mode, log copies the line into a ring of slots and a writer
+   * thread writes them out with writev. no lock, no syscall unless the
+   * writer sleeps. a full ring drops the line, counted in the log, or
+   * blocks the caller. fatal always blocks and returns after its line and
+   * every line before it are written
+   */
+  enum Overflow { DROP, BLOCK };
+
   static Logger *create(const std::string &file, Rotate rotate, bool def = false, time_t *nowPtr = 0) {
     if (def && defLogger) return defLogger;
 
@@ -74,47 +220,103 @@ public:
     return dup2(handle_, STDERR_FILENO) != -1;
   }
 
-  bool debug(const char *file, int line, int eno, const char *fmt, ...) {
+  bool debug(LogSite *site, int eno, ...) {
     if (level_ > DEBUG_INT) return true;
 
     va_list ap;
-    va_start(ap, fmt);
-    bool rc = log(DEBUG_INT, DEBUG_PTR, file, line, eno, fmt, ap);
+    va_start(ap, eno);
+    bool rc = log(DEBUG_INT, DEBUG_PTR, site, eno, ap);
     va_end(ap);
     return rc;
   }
 
-  bool info(const char *file, int line, int eno, const char *fmt, ...) {
+  bool info(LogSite *site, int eno, ...) {
     if (level_ > INFO_INT) return true;
 
     va_list ap;
-    va_start(ap, fmt);
-    bool rc = log(INFO_INT, INFO_PTR, file, line, eno, fmt, ap);
+    va_start(ap, eno);
+    bool rc = log(INFO_INT, INFO_PTR, site, eno, ap);
     va_end(ap);
     return rc;
   }
 
-  bool error(const char *file, int line, int eno, const char *fmt, ...) {
+  bool error(LogSite *site, int eno, ...) {
     if (level_ > ERROR_INT) return true;
 
     va_list ap;
-    va_start(ap, fmt);
-    bool rc = log(ERROR_INT, ERROR_PTR, file, line, eno, fmt, ap);
+    va_start(ap, eno);
+    bool rc = log(ERROR_INT, ERROR_PTR, site, eno, ap);
     va_end(ap);
     return rc;
   }
 
-  bool fatal(const char *file, int line, int eno, const char *fmt, ...) {
+  bool fatal(LogSite *site, int eno, ...) {
     if (level_ > FATAL_INT) return true;
 
     va_list ap;
-    va_start(ap, fmt);
-    bool rc = log(FATAL_INT, FATAL_PTR, file, line, eno, fmt, ap);
+    va_start(ap, eno);
+    bool rc = log(FATAL_INT, FATAL_PTR, site, eno, ap);
     va_end(ap);
     return rc;
   }
 
+  /* slots is rounded up to a power of 2, the default logger also flushes
+   * at exit, fork children of it log synchronously
+   */
+  bool setAsync(size_t slots, Overflow overflow) {
+    if (async_ || slots == 0) return true;
+    if (slots > LOG_SLOTS_MAX) slots = LOG_SLOTS_MAX;
+
+    size_t n = 2;
+    while (n < slots) n *= 2;
+    slots_ = new Slot[n];
+    for (size_t i = 0; i < n; ++i) {
+      slots_[i].seq  = i;
+      slots_[i].heap = 0;
+    }
+    mask_     = n - 1;
+    overflow_ = overflow;
+
+    if (pthread_create(&writer_, 0, writerThread, this) != 0) {
+      delete[] slots_;
+      slots_ = 0;
+      return false;
+    }
+    pthread_detach(writer_);
+    __atomic_store_n(&async_, true, __ATOMIC_RELEASE);
+
+    if (this == defLogger) {
+      atFork();
+      atexit(flushDefault);
+    }
+    return true;
+  }
+
+  /* waits until every line logged so far is written */
+  void flush() {
+    if (!async_) return;
+
+    size_t target = __atomic_load_n(&enqueuePos_, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&written_, __ATOMIC_ACQUIRE) < target) {
+      wakeWriter();
+      usleep(100);
+    }
+  }
+
+  /* LogSite records instead of text, see dcron-logcat */
+  void setBinary(bool binary) {
+    if (binary && !binary_) defsOwed_ = true;
+    binary_ = binary;
+    if (binary && this == defLogger) atFork();
+  }
+
   bool print(const char *ptr, int len, bool autonl) {
+    if (async_) {
+      std::string line(ptr, len);
+      if (autonl) line.append(1, '\n');
+      return enqueue(line.data(), line.size());
+    }
+
     if (autonl) {
       struct iovec iovs[2] = {{(void *) ptr, static_cast<size_t>(len)}, {(void*) "\n", 1}};
       return writev(handle_, iovs, 2) != -1;
@@ -124,9 +326,18 @@ public:
   }
 
 private:
+  struct Slot {
+    size_t  seq;    // pos when free, pos + 1 when the line is in
+    size_t  len;
+    char   *heap;
+    char    buf[LOG_SLOT_BYTES];
+  };
+
   Logger(const std::string &file, Rotate rotate, time_t *nowPtr)
     : rotate_(rotate), reopen_(false), nowPtr_(nowPtr),
-      bindStdout_(false), bindStderr_(false), handle_(-1), file_(file) {
+      bindStdout_(false), bindStderr_(false), handle_(-1), file_(file),
+      async_(false), overflow_(DROP), slots_(0), mask_(0), enqueuePos_(0),
+      dequeuePos_(0), written_(0), dropped_(0), sleeping_(0), binary_(false), defsOwed_(false), pid_(getpid()) {
 #if _DEBUG_
     setLevel(DEBUG);
 #else
@@ -170,6 +381,13 @@ private:
     int fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT,
                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd != -1) {
+      /* a line of a new file never goes before the definition of its site */
+      if (binary_) {
+        for (LogSite *site = __atomic_load_n(&sites(), __ATOMIC_ACQUIRE); site; site = site->next) {
+          writeDef(fd, site, site->id);
+        }
+      }
+
       int tmp = handle_;
       handle_ = fd;
       close(tmp);
@@ -184,42 +402,336 @@ private:
     }
   }
 
-  bool safeOpenFile(time_t now, struct tm *tm) {
+  bool safeOpenFile(time_t now) {
+    struct tm ltm;
+    localtime_r(&now, &ltm);
+
     bool rc = true;
     pthread_mutex_lock(&LOGGER_MUTEX);
-    if (canRotate(now)) rc = openFile(now, tm);
+    if (canRotate(now)) rc = openFile(now, &ltm);
     pthread_mutex_unlock(&LOGGER_MUTEX);
     return rc;
   }
 
+  /* "%Y-%m-%d %H:%M:%S ", localtime_r once a second per thread */
+  static size_t timePrefix(time_t now, char *buffer) {
+    static __thread time_t cachedTime = -1;
+    static __thread char   cached[32];
+    static __thread size_t cachedLen;
+
+    if (now != cachedTime) {
+      struct tm ltm;
+      localtime_r(&now, &ltm);
+      cachedLen  = strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S ", &ltm);
+      cachedTime = now;
+    }
+    memcpy(buffer, cached, cachedLen);
+    return cachedLen;
+  }
+
   static int microseconds() {
     struct timeval now;
     gettimeofday(&now, 0);
     return now.tv_usec;
   }
 
-  bool log(int level, const char *levelPtr, const char *file, int line, int eno, const char *fmt, va_list ap) {
-    struct tm ltm;
+  bool log(int level, const char *levelPtr, LogSite *site, int eno, va_list ap) {
     time_t now = nowPtr_ ? *nowPtr_ : time(0);
-    localtime_r(&now, &ltm);
 
-    if (canRotate(now)) safeOpenFile(now, &ltm);
+    /* the writer rotates in async mode */
+    if (!async_ && canRotate(now)) safeOpenFile(now);
+
+    if (binary_) return logBinary(level, site, now, eno, ap);
 
     /* one more for '\n' */
     char errstr[ERR_STR + 1];
     size_t n = 0;
 
     int micros = level == DEBUG_INT ? microseconds() : 0;
-    n = strftime(errstr, ERR_STR, "%Y-%m-%d %H:%M:%S ", &ltm);
+    n = timePrefix(now, errstr);
     n += snprintf(errstr + n, ERR_STR - n, "[%s] #%d #%s@%d \"%d:%s\" ",
-                  levelPtr, micros, file, line, eno, eno ? strerror(eno) : "");
+                  levelPtr, micros, site->file, site->line, eno, eno ? strerror(eno) : "");
 
-    n += vsnprintf(errstr + n, ERR_STR - n, fmt, ap);
+    n += vsnprintf(errstr + n, ERR_STR - n, site->fmt, ap);
 
     if (n >= ERR_STR) n = ERR_STR;
     errstr[n++] = '\n';
 
-    return (write(handle_, errstr, n) != -1);
+    return emit(level, errstr, n);
+  }
+
+  bool emit(int level, const char *ptr, size_t len) {
+    if (!async_) return (write(handle_, ptr, len) != -1);
+
+    /* a fatal line is never dropped */
+    bool rc = enqueue(ptr, len, level == FATAL_INT);
+    if (level == FATAL_INT) flush();
+    return rc;
+  }
+
+  static uint32_t &lastId() {
+    static uint32_t id = 0;
+    return id;
+  }
+
+  static LogSite *&sites() {
+    static LogSite *head = 0;
+    return head;
+  }
+
+  /* buffer of ERR_STR + 1 bytes */
+  size_t encodeDef(char *buffer, LogSite *site, uint32_t id) {
+    char *end = buffer + ERR_STR + 1;
+    char *ptr = buffer + sizeof(LogBinHead);
+    size_t fileLen = strnlen(site->file, 1024);
+    logPutVar(&ptr, end, pid_);
+    logPutVar(&ptr, end, id);
+    logPutInt(&ptr, end, site->line);
+    logPutVar(&ptr, end, fileLen);
+    put(&ptr, end, site->file, fileLen);
+    put(&ptr, end, site->fmt, strnlen(site->fmt, end - ptr));
+
+    LogBinHead head = {LOG_BIN_MARK, LOG_BIN_DEF, 0, 0, (uint32_t) (ptr - buffer - sizeof(LogBinHead))};
+    memcpy(buffer, &head, sizeof(head));
+    return ptr - buffer;
+  }
+
+  void writeDef(int fd, LogSite *site, uint32_t id) {
+    char buffer[ERR_STR + 1];
+    size_t n = encodeDef(buffer, site, id);
+    if (write(fd, buffer, n) == -1) return;
+  }
+
+  /* the definition goes before the id is published, no line of another
+   * thread goes before it
+   */
+  uint32_t siteId(int level, LogSite *site) {
+    uint32_t id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (id) return id;
+
+    uint32_t newId = __atomic_add_fetch(&lastId(), 1, __ATOMIC_RELAXED);
+    char buffer[ERR_STR + 1];
+    emit(level, buffer, encodeDef(buffer, site, newId));
+
+    if (!__atomic_compare_exchange_n(&site->id, &id, newId, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) return id;
+
+    site->next = __atomic_load_n(&sites(), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sites(), &site->next, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    return newId;
+  }
+
+  static bool put(char **ptr, char *end, const void *data, size_t len) {
+    if ((size_t) (end - *ptr) < len) return false;
+    memcpy(*ptr, data, len);
+    *ptr += len;
+    return true;
+  }
+
+  template <class IntType>
+  static bool putInt(char **ptr, char *end, IntType value) {
+    return logPutInt(ptr, end, (int64_t) value);
+  }
+
+  /* the arguments raw, a string is cut at the precision */
+  static char *encodeArgs(char *ptr, char *end, const char *fmt, va_list ap) {
+    LogSpec spec;
+    bool ok = true;
+    for (const char *pos = logSpec(fmt, &spec); pos && ok; pos = logSpec(spec.end, &spec)) {
+      if (spec.width == -2) ok = putInt(&ptr, end, va_arg(ap, int));
+      if (spec.precision == -2) {
+        spec.precision = va_arg(ap, int);
+        ok = ok && putInt(&ptr, end, spec.precision);
+      }
+      if (!ok) break;
+
+      switch (spec.conv) {
+      case 'd': case 'i': case 'c':
+        if (spec.length == LogSpec::L) ok = putInt(&ptr, end, va_arg(ap, long));
+        else if (spec.length == LogSpec::LL) ok = putInt(&ptr, end, va_arg(ap, long long));
+        else if (spec.length == LogSpec::J) ok = putInt(&ptr, end, va_arg(ap, intmax_t));
+        else if (spec.length == LogSpec::Z) ok = putInt(&ptr, end, va_arg(ap, ssize_t));
+        else if (spec.length == LogSpec::T) ok = putInt(&ptr, end, va_arg(ap, ptrdiff_t));
+        else ok = putInt(&ptr, end, va_arg(ap, int));
+        break;
+      case 'o': case 'u': case 'x': case 'X':
+        if (spec.length == LogSpec::L) ok = putInt(&ptr, end, va_arg(ap, unsigned long));
+        else if (spec.length == LogSpec::LL) ok = putInt(&ptr, end, va_arg(ap, unsigned long long));
+        else if (spec.length == LogSpec::J) ok = putInt(&ptr, end, va_arg(ap, uintmax_t));
+        else if (spec.length == LogSpec::Z) ok = putInt(&ptr, end, va_arg(ap, size_t));
+        else if (spec.length == LogSpec::T) ok = putInt(&ptr, end, va_arg(ap, ptrdiff_t));
+        else ok = putInt(&ptr, end, va_arg(ap, unsigned int));
+        break;
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+        double v = spec.length == LogSpec::LD ? (double) va_arg(ap, long double) : va_arg(ap, double);
+        ok = put(&ptr, end, &v, sizeof(v));
+        break;
+      }
+      case 'p':
+        ok = putInt(&ptr, end, (intptr_t) va_arg(ap, void *));
+        break;
+      case 'n':
+        va_arg(ap, void *);
+        break;
+      case 's': {
+        const char *str = va_arg(ap, const char *);
+        size_t len = str ? strnlen(str, spec.precision >= 0 ? (size_t) spec.precision : ERR_STR) : 0;
+        if (len + 4 > (size_t) (end - ptr)) len = end - ptr > 4 ? end - ptr - 4 : 0;
+        ok = logPutVar(&ptr, end, str ? len + 1 : 0) && (!str || put(&ptr, end, str, len));
+        break;
+      }
+      default:
+        ok = false;
+      }
+    }
+    return ptr;
+  }
+
+  bool logBinary(int level, LogSite *site, time_t now, int eno, va_list ap) {
+    if (__atomic_load_n(&defsOwed_, __ATOMIC_RELAXED) && __atomic_exchange_n(&defsOwed_, false, __ATOMIC_ACQ_REL)) {
+      char buffer[ERR_STR + 1];
+      for (LogSite *known = __atomic_load_n(&sites(), __ATOMIC_ACQUIRE); known; known = known->next) {
+        emit(level, buffer, encodeDef(buffer, known, known->id));
+      }
+    }
+    uint32_t id = siteId(level, site);
+
+    char buffer[ERR_STR + 1];
+    char *end = buffer + sizeof(buffer);
+    char *ptr = buffer + sizeof(LogBinHead);
+    logPutVar(&ptr, end, pid_);
+    logPutVar(&ptr, end, id);
+    logPutVar(&ptr, end, now);
+    logPutVar(&ptr, end, microseconds());
+    logPutInt(&ptr, end, eno);
+    ptr = encodeArgs(ptr, end, site->fmt, ap);
+
+    LogBinHead head = {LOG_BIN_MARK, LOG_BIN_LINE, (uint8_t) level, 0, (uint32_t) (ptr - buffer - sizeof(LogBinHead))};
+    memcpy(buffer, &head, sizeof(head));
+    return emit(level, buffer, ptr - buffer);
+  }
+
+  /* the bounded MPMC queue of Vyukov with one consumer, a producer owns
+   * slot pos once it moves enqueuePos_ past it
+   */
+  bool enqueue(const char *ptr, size_t len, bool block = false) {
+    size_t pos = __atomic_load_n(&enqueuePos_, __ATOMIC_RELAXED);
+    Slot *slot;
+    for (;;) {
+      slot = &slots_[pos & mask_];
+      intptr_t dif = (intptr_t) __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+      if (dif == 0) {
+        if (__atomic_compare_exchange_n(&enqueuePos_, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      } else if (dif < 0) {   // full
+        if (overflow_ == DROP && !block) {
+          __atomic_fetch_add(&dropped_, 1, __ATOMIC_RELAXED);
+          return false;
+        }
+        wakeWriter();
+        sched_yield();
+        pos = __atomic_load_n(&enqueuePos_, __ATOMIC_RELAXED);
+      } else {
+        pos = __atomic_load_n(&enqueuePos_, __ATOMIC_RELAXED);
+      }
+    }
+
+    slot->heap = len > LOG_SLOT_BYTES ? (char *) malloc(len) : 0;
+    if (len > LOG_SLOT_BYTES && !slot->heap) {   // truncated
+      memcpy(slot->buf, ptr, LOG_SLOT_BYTES - 1);
+      slot->buf[LOG_SLOT_BYTES - 1] = '\n';
+      len = LOG_SLOT_BYTES;
+    } else {
+      memcpy(slot->heap ? slot->heap : slot->buf, ptr, len);
+    }
+    slot->len = len;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping_, __ATOMIC_SEQ_CST)) wakeWriter();
+    return true;
+  }
+
+  void wakeWriter() {
+    if (__atomic_exchange_n(&sleeping_, 0, __ATOMIC_SEQ_CST)) {
+      syscall(SYS_futex, &sleeping_, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    }
+  }
+
+  static void *writerThread(void *data) {
+    Logger *logger = (Logger *) data;
+    for (;;) logger->drain();
+    return 0;
+  }
+
+  /* writes the slots ready in order, sleeps at most a second when none,
+   * the file still rotates on time
+   */
+  void drain() {
+    struct iovec iovs[LOG_IOV_MAX + 1];
+    int n = 0;
+    for (/**/; n < LOG_IOV_MAX; ++n) {
+      Slot *slot = &slots_[(dequeuePos_ + n) & mask_];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != dequeuePos_ + n + 1) break;
+      iovs[n].iov_base = slot->heap ? slot->heap : slot->buf;
+      iovs[n].iov_len  = slot->len;
+    }
+
+    time_t now = nowPtr_ ? *nowPtr_ : time(0);
+    if (canRotate(now)) safeOpenFile(now);
+
+    char dropped[64];
+    size_t drops = __atomic_exchange_n(&dropped_, 0, __ATOMIC_RELAXED);
+    if (drops) {
+      size_t len = timePrefix(now, dropped);
+      len += snprintf(dropped + len, sizeof(dropped) - len, "[ERROR] %d log lines dropped\n", (int) drops);
+      iovs[n].iov_base = dropped;
+      iovs[n].iov_len  = len > sizeof(dropped) - 1 ? sizeof(dropped) - 1 : len;
+    }
+
+    if (n == 0 && drops == 0) {
+      idle();
+      return;
+    }
+    writev(handle_, iovs, n + (drops ? 1 : 0));
+
+    for (int i = 0; i < n; ++i) {
+      Slot *slot = &slots_[dequeuePos_ & mask_];
+      free(slot->heap);
+      __atomic_store_n(&slot->seq, dequeuePos_ + mask_ + 1, __ATOMIC_RELEASE);
+      ++dequeuePos_;
+    }
+    __atomic_store_n(&written_, dequeuePos_, __ATOMIC_RELEASE);
+  }
+
+  /* a producer wakes us only if it sees sleeping_ after its slot is in */
+  void idle() {
+    __atomic_store_n(&sleeping_, 1, __ATOMIC_SEQ_CST);
+    Slot *slot = &slots_[dequeuePos_ & mask_];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == dequeuePos_ + 1) {
+      __atomic_store_n(&sleeping_, 0, __ATOMIC_SEQ_CST);
+      return;
+    }
+
+    struct timespec timeout = {1, 0};
+    syscall(SYS_futex, &sleeping_, FUTEX_WAIT_PRIVATE, 1, &timeout, 0, 0);
+    __atomic_store_n(&sleeping_, 0, __ATOMIC_SEQ_CST);
+  }
+
+  /* the writer is not forked, the lines of the child are of another pid */
+  static void forkChild() {
+    if (defLogger) {
+      defLogger->async_    = false;
+      defLogger->pid_      = getpid();
+      defLogger->defsOwed_ = defLogger->binary_;
+    }
+  }
+
+  static void atFork() {
+    static bool registered = false;
+    if (!registered) pthread_atfork(0, 0, forkChild);
+    registered = true;
+  }
+
+  static void flushDefault() {
+    if (defLogger) defLogger->flush();
   }
 
 private:
@@ -236,6 +748,21 @@ private:
 
   long   gmtOff_;
   time_t fileTime_;
+
+  bool      async_;
+  Overflow  overflow_;
+  Slot     *slots_;
+  size_t    mask_;
+  size_t    enqueuePos_;   // next slot of producers
+  size_t    dequeuePos_;   // next slot of the writer
+  size_t    written_;      // slots before it are written
+  size_t    dropped_;
+  int       sleeping_;     // futex, the writer waits on it
+
+  bool      binary_;
+  bool      defsOwed_;     // the sites known have no definition of pid_ in the file
+  uint32_t  pid_;          // of binary records
+  pthread_t writer_;
 };
 
 // extern Logger *Logger::defLogger = 0;
@@ -261,10 +788,15 @@ private:
 
 #else
 
-# define log_fatal(eno, fmt, args...) Logger::defLogger->fatal(__FILE__, __LINE__, eno, fmt, ##args)
-# define log_error(eno, fmt, args...) Logger::defLogger->error(__FILE__, __LINE__, eno, fmt, ##args)
-# define log_info(eno, fmt, args...)  Logger::defLogger->info(__FILE__, __LINE__, eno, fmt, ##args)
-# define log_debug(eno, fmt, args...) Logger::defLogger->debug(__FILE__, __LINE__, eno, fmt, ##args)
+# define LOG_SITE(level, eno, fmt, args...) ({                       \
+  static LogSite logSite__ = {fmt, __FILE__, __LINE__, 0, 0};          \
+  Logger::defLogger->level(&logSite__, eno, ##args);                   \
+})
+
+# define log_fatal(eno, fmt, args...) LOG_SITE(fatal, eno, fmt, ##args)
+# define log_error(eno, fmt, args...) LOG_SITE(error, eno, fmt, ##args)
+# define log_info(eno, fmt, args...)  LOG_SITE(info,  eno, fmt, ##args)
+# define log_debug(eno, fmt, args...) LOG_SITE(debug, eno, fmt, ##args)
 # define log_opaque(ptr, len, autonl) Logger::defLogger->print(ptr, len, autonl);
 
 #endif
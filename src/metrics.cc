@@ -0,0 +1,189 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+const int64_t Histogram::BOUNDS[Histogram::BUCKETS - 1] = {
+  500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 30000000, 60000000, 300000000, 1800000000, 3600000000LL
+};
+
+__thread Metrics *Metrics::current_ = 0;
+
+Histogram::Histogram() : count_(0), sum_(0), max_(0)
+{
+  memset(buckets_, 0, sizeof(buckets_));
+}
+
+void Histogram::observe(int64_t us)
+{
+  if (us < 0) us = 0;
+
+  int i = 0;
+  while (i < BUCKETS - 1 && us > BOUNDS[i]) ++i;
+  __atomic_fetch_add(&buckets_[i], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&count_, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sum_, (uint64_t) us, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&max_, __ATOMIC_RELAXED);
+  while ((uint64_t) us > max &&
+         !__atomic_compare_exchange_n(&max_, &max, (uint64_t) us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int64_t Metrics::nowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+const char *Metrics::phaseToString(Phase phase)
+{
+  switch (phase) {
+  case START:     return "start";
+  case WORKDIR:   return "workdir";
+  case ELECT:     return "elect";
+  case JOIN:      return "join";
+  case SPAWN:     return "spawn";
+  case TASK:      return "task";
+  case FLUSH:     return "flush";
+  case PHASE_MAX: break;
+  }
+  return "unknown";
+}
+
+const char *Metrics::opToString(ZkOp op)
+{
+  switch (op) {
+  case OP_GET:      return "get";
+  case OP_SET:      return "set";
+  case OP_CREATE:   return "create";
+  case OP_DELETE:   return "delete";
+  case OP_EXISTS:   return "exists";
+  case OP_CHILDREN: return "children";
+  case OP_MULTI:    return "multi";
+  case OP_MAX:      break;
+  }
+  return "unknown";
+}
+
+const char *Metrics::opToCall(ZkOp op)
+{
+  switch (op) {
+  case OP_GET:      return "zoo_get";
+  case OP_SET:      return "zoo_set";
+  case OP_CREATE:   return "zoo_create";
+  case OP_DELETE:   return "zoo_delete";
+  case OP_EXISTS:   return "zoo_wexists";
+  case OP_CHILDREN: return "zoo_get_children";
+  case OP_MULTI:    return "zoo_multi";
+  case OP_MAX:      break;
+  }
+  return "unknown";
+}
+
+void Metrics::summary(Json::Value *obj) const
+{
+  for (int i = 0; i < PHASE_MAX; ++i) {
+    if (phases_[i].count() == 0) continue;
+    (*obj)[std::string(phaseToString((Phase) i)) + "_us"] = (Json::UInt64) phases_[i].sum();
+  }
+
+  uint64_t calls = 0, sum = 0, max = 0;
+  for (int i = 0; i < OP_MAX; ++i) {
+    calls += zk_[i].count();
+    sum   += zk_[i].sum();
+    if (zk_[i].max() > max) max = zk_[i].max();
+  }
+  (*obj)["zk_calls"]  = (Json::UInt64) calls;
+  (*obj)["zk_us"]     = (Json::UInt64) sum;
+  (*obj)["zk_max_us"] = (Json::UInt64) max;
+  (*obj)["flushes"]   = flushes_;
+  (*obj)["retries"]   = retries_;
+}
+
+/* \, " and newline are escaped in a label value */
+inline std::string labelValue(const std::string &value)
+{
+  std::string escaped;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '\\' || value[i] == '"') escaped.append(1, '\\').append(1, value[i]);
+    else if (value[i] == '\n') escaped.append("\\n");
+    else escaped.append(1, value[i]);
+  }
+  return escaped;
+}
+
+static void appendHistogram(std::string *text, const char *name, const std::string &labels, const Histogram &histogram)
+{
+  char value[64];
+  uint64_t cumulative = 0;
+  for (int i = 0; i < Histogram::BUCKETS; ++i) {
+    cumulative += histogram.bucket(i);
+    if (i < Histogram::BUCKETS - 1) snprintf(value, sizeof(value), "%g", Histogram::BOUNDS[i] / 1e6);
+    else strcpy(value, "+Inf");
+    text->append(name).append("_bucket{").append(labels).append(",le=\"").append(value).append("\"} ");
+    snprintf(value, sizeof(value), "%llu\n", (unsigned long long) cumulative);
+    text->append(value);
+  }
+
+  snprintf(value, sizeof(value), "%.6f\n", histogram.sum() / 1e6);
+  text->append(name).append("_sum{").append(labels).append("} ").append(value);
+  snprintf(value, sizeof(value), "%llu\n", (unsigned long long) histogram.count());
+  text->append(name).append("_count{").append(labels).append("} ").append(value);
+}
+
+static void appendGauge(std::string *text, const char *name, const char *help, const std::string &labels, long value)
+{
+  char number[32];
+  snprintf(number, sizeof(number), "%ld\n", value);
+  text->append("# HELP ").append(name).append(1, ' ').append(help).append("\n# TYPE ").append(name).append(" gauge\n");
+  text->append(name).append(1, '{').append(labels).append("} ").append(number);
+}
+
+bool Metrics::writeTextfile(const std::string &file, const std::string &task, const std::string &id,
+                            int exitStatus) const
+{
+  std::string labels = "task=\"" + labelValue(task) + "\",id=\"" + labelValue(id) + "\"";
+  std::string text;
+
+  text.append("# HELP dcron_phase_seconds Duration of the phases of a dcron run.\n"
+              "# TYPE dcron_phase_seconds histogram\n");
+  for (int i = 0; i < PHASE_MAX; ++i) {
+    appendHistogram(&text, "dcron_phase_seconds", labels + ",phase=\"" + phaseToString((Phase) i) + "\"", phases_[i]);
+  }
+
+  text.append("# HELP dcron_zk_call_seconds Latency of the zookeeper calls of a dcron run.\n"
+              "# TYPE dcron_zk_call_seconds histogram\n");
+  for (int i = 0; i < OP_MAX; ++i) {
+    appendHistogram(&text, "dcron_zk_call_seconds", labels + ",op=\"" + opToString((ZkOp) i) + "\"", zk_[i]);
+  }
+
+  appendGauge(&text, "dcron_run_flushes", "Checkpoint writes of the fifo records in the last run.", labels, flushes_);
+  appendGauge(&text, "dcron_run_retries", "Retries of the task in the last run.", labels, retries_);
+  appendGauge(&text, "dcron_run_exit_status", "Exit status of the last run.", labels, exitStatus);
+  appendGauge(&text, "dcron_run_timestamp_seconds", "End of the last run.", labels, time(0));
+
+  std::string tmp = file + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd == -1) return false;
+
+  bool ok = fchmod(fd, 0644) == 0 && write(fd, text.data(), text.size()) == (ssize_t) text.size();
+  int eno = errno;
+  if (close(fd) != 0 && ok) {
+    ok = false;
+    eno = errno;
+  }
+  if (ok && rename(tmp.c_str(), file.c_str()) != 0) {
+    ok = false;
+    eno = errno;
+  }
+  if (!ok) unlink(tmp.c_str());
+  errno = eno;
+  return ok;
+}
@@ -0,0 +1,106 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <string>
+#include <stdint.h>
+#include <json/json.h>
+#include "trace.h"
+#include "zkfault.h"
+
+/* a histogram of durations in fixed buckets, from 0.5ms to 1h, the
+ * buckets are the same for every dcron so they add up across the fleet.
+ * observe may run on the zookeeper thread, the counters are atomic
+ */
+class Histogram {
+public:
+  static const int BUCKETS = 20;   // the last is +Inf
+  static const int64_t BOUNDS[BUCKETS - 1];   // us
+
+  Histogram();
+
+  void observe(int64_t us);
+
+  uint64_t bucket(int i) const { return __atomic_load_n(&buckets_[i], __ATOMIC_RELAXED); }
+  uint64_t count() const { return __atomic_load_n(&count_, __ATOMIC_RELAXED); }
+  uint64_t sum() const { return __atomic_load_n(&sum_, __ATOMIC_RELAXED); }   // us
+  uint64_t max() const { return __atomic_load_n(&max_, __ATOMIC_RELAXED); }   // us
+
+private:
+  uint64_t buckets_[BUCKETS];  // not cumulative
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+/* the timing of one ZkMgr, the phases of the run and every zoo_* call
+ *
+ * the calls are timed where they are made, zktxn and checkpoint know
+ * nothing of ZkMgr, so the Metrics of the ZkMgr of this thread is found
+ * by current(). a request of ZkPipeline is timed from zoo_a* to its
+ * completion, the pipeline takes current() when it is queued
+ *
+ * the textfile is for the textfile collector of node_exporter, it is
+ * written to a temporary file and renamed, a scrape never sees half
+ */
+class Metrics {
+public:
+  enum Phase { START, WORKDIR, ELECT, JOIN, SPAWN, TASK, FLUSH, PHASE_MAX };
+  enum ZkOp { OP_GET, OP_SET, OP_CREATE, OP_DELETE, OP_EXISTS, OP_CHILDREN, OP_MULTI, OP_MAX };
+
+  Metrics() : flushes_(0), retries_(0) {}
+
+  static int64_t nowUs();   // CLOCK_MONOTONIC
+
+  static Metrics *current() { return current_; }
+  static void setCurrent(Metrics *metrics) { current_ = metrics; }
+  /* of current(), 0 without one */
+  static Histogram *zkCall(ZkOp op) { return current_ ? &current_->zk_[op] : 0; }
+
+  Histogram *phase(Phase phase) { return &phases_[phase]; }
+  Histogram *zk(ZkOp op) { return &zk_[op]; }
+  void flushed() { ++flushes_; }
+  void retried() { ++retries_; }
+
+  /* start_us, workdir_us, elect_us, join_us, spawn_us, task_us, flush_us, zk_calls,
+   * zk_us, zk_max_us, flushes, retries
+   */
+  void summary(Json::Value *obj) const;
+
+  /* labels are task and id, false with errno */
+  bool writeTextfile(const std::string &file, const std::string &task, const std::string &id, int exitStatus) const;
+
+  static const char *phaseToString(Phase phase);
+  static const char *opToString(ZkOp op);
+  static const char *opToCall(ZkOp op);   // zoo_get ..., the name of the span
+
+private:
+  Histogram phases_[PHASE_MAX];
+  Histogram zk_[OP_MAX];
+  int       flushes_;
+  int       retries_;
+
+  static __thread Metrics *current_;
+};
+
+/* observes the time until the end of the scope, nothing without a histogram */
+class MetricsTimer {
+public:
+  explicit MetricsTimer(Histogram *histogram) : histogram_(histogram), begin_(histogram ? Metrics::nowUs() : 0) {}
+  ~MetricsTimer() { if (histogram_) histogram_->observe(Metrics::nowUs() - begin_); }
+
+private:
+  Histogram *histogram_;
+  int64_t    begin_;
+};
+
+/* the value of a synchronous zoo_* call, timed as op, traced and
+ * faulted by DCRON_ZKFAULT
+ *   int rc = ZK_TIMED(OP_GET, zoo_get(zh, path, 0, buffer, &len, 0));
+ */
+#define ZK_TIMED(op, call) ({                                  \
+  TraceSpan zkSpan__(Metrics::opToCall(Metrics::op));          \
+  MetricsTimer zkTimer__(Metrics::zkCall(Metrics::op));        \
+  ZK_FAULTED(call);                                            \
+})
+
+#endif
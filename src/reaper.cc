@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "reaper.h"
+#include "zkmgr.h"
+#include "zktxn.h"
+#include "zkpipeline.h"
+
+#define REAP_MAX   64    // instances deleted by a pass
+#define REAP_BATCH 16    // instances of a zoo_multi
+#define REAP_SLEEP 100   // ms between the zoo_multi of a pass
+
+struct ReapPass {
+  ZkSession  *session;
+  std::string taskPath;
+  int         keep;
+  int         keepDays;
+};
+
+static pthread_mutex_t REAP_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  REAP_COND  = PTHREAD_COND_INITIALIZER;
+static std::map<std::string, ReapPass> REAP_PASSES;   // by zkhost and task dir
+static bool REAP_THREAD = false;
+static bool REAP_BUSY   = false;
+
+void Reaper::submit(ZkSession *session, const std::string &taskPath, int keep, int keepDays)
+{
+  std::string key = session->zkhost() + taskPath.substr(0, taskPath.rfind('/'));
+
+  pthread_mutex_lock(&REAP_MUTEX);
+  if (!REAP_THREAD) {
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int rc = pthread_create(&tid, &attr, loopRoutine, 0);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+      pthread_mutex_unlock(&REAP_MUTEX);
+      log_error(rc, "reaper pthread_create error");
+      return;
+    }
+    REAP_THREAD = true;
+  }
+
+  std::map<std::string, ReapPass>::iterator pos = REAP_PASSES.find(key);
+  if (pos == REAP_PASSES.end()) {
+    session->retain();
+    pos = REAP_PASSES.insert(std::make_pair(key, ReapPass())).first;
+    pos->second.session = session;
+  }
+  pos->second.taskPath = taskPath;
+  pos->second.keep     = keep;
+  pos->second.keepDays = keepDays;
+
+  pthread_cond_broadcast(&REAP_COND);
+  pthread_mutex_unlock(&REAP_MUTEX);
+}
+
+void Reaper::drain()
+{
+  pthread_mutex_lock(&REAP_MUTEX);
+  while (!REAP_PASSES.empty() || REAP_BUSY) pthread_cond_wait(&REAP_COND, &REAP_MUTEX);
+  pthread_mutex_unlock(&REAP_MUTEX);
+}
+
+void *Reaper::loopRoutine(void *)
+{
+  pthread_mutex_lock(&REAP_MUTEX);
+  for ( ;; ) {
+    while (REAP_PASSES.empty()) pthread_cond_wait(&REAP_COND, &REAP_MUTEX);
+
+    ReapPass pass = REAP_PASSES.begin()->second;
+    REAP_PASSES.erase(REAP_PASSES.begin());
+    REAP_BUSY = true;
+    pthread_mutex_unlock(&REAP_MUTEX);
+
+    if (!pass.session->expired()) reap(pass.session->handle(), pass.taskPath, pass.keep, pass.keepDays);
+    pass.session->release();
+
+    pthread_mutex_lock(&REAP_MUTEX);
+    REAP_BUSY = false;
+    pthread_cond_broadcast(&REAP_COND);
+  }
+  return 0;
+}
+
+/* the children of every instance, then the instance */
+static int deleteInstances(zhandle_t *zh, const std::vector<std::vector<std::string> > &instances)
+{
+  ZkTxn txn(zh, 0);
+  for (size_t i = 0; i < instances.size(); ++i) {
+    for (size_t j = 0; j < instances[i].size(); ++j) txn.del(instances[i][j]);
+  }
+  return txn.commit();
+}
+
+int Reaper::reap(zhandle_t *zh, const std::string &taskPath, int keep, int keepDays)
+{
+  size_t slash = taskPath.rfind('/');
+  std::string taskDir = taskPath.substr(0, slash);
+  std::string current = taskPath.substr(slash + 1);
+
+  struct String_vector children;
+  int rc = ZK_TIMED(OP_CHILDREN, zoo_get_children(zh, taskDir.c_str(), 0, &children));
+  if (rc != ZOK) {
+    log_error(0, "zoo_get_children %s error, %s", taskDir.c_str(), zerror(rc));
+    return 0;
+  }
+
+  std::vector<std::string> instances;
+  for (int i = 0; i < children.count; ++i) {
+    if (strcmp(children.data[i], "llap") == 0 || strcmp(children.data[i], "affinity") == 0) continue;
+    instances.push_back(children.data[i]);
+  }
+  deallocate_String_vector(&children);
+  std::sort(instances.begin(), instances.end());
+
+  /* the instances before beyond are over the count, the others go by age */
+  size_t beyond = keep > 0 && instances.size() > (size_t) keep ? instances.size() - keep : 0;
+  int64_t expire = ((int64_t) time(0) - (int64_t) keepDays * 86400) * 1000;
+
+  int deleted = 0;
+  bool young = false;
+  for (size_t begin = 0; !young && begin < instances.size() && deleted < REAP_MAX; begin += REAP_BATCH) {
+    size_t end = std::min(begin + REAP_BATCH, instances.size());
+    if (begin > 0) usleep(REAP_SLEEP * 1000);
+
+    ZkPipeline pipe(zh);
+    for (size_t i = begin; i < end; ++i) {
+      std::string node = taskDir + "/" + instances[i];
+      pipe.children(node);
+      pipe.get(node + "/status");
+      pipe.exists(node + "/master", 0, 0);
+    }
+    pipe.wait();
+
+    std::vector<std::vector<std::string> > batch;
+    std::vector<std::string> names;
+    for (size_t i = begin; i < end; ++i) {
+      size_t list = (i - begin) * 3, status = list + 1, master = list + 2;
+      if (pipe.rc(list) != ZOK || pipe.rc(status) != ZOK) continue;
+
+      bool old = keepDays > 0 && pipe.stat(status).mtime < expire;
+      if (i >= beyond && !old) {
+        young = true;
+        break;
+      }
+      /* running, or not yet done and may be starting */
+      if (instances[i] == current || pipe.rc(master) != ZNONODE) continue;
+      if (pipe.value(status).empty() && !old) continue;
+
+      std::string node = taskDir + "/" + instances[i];
+      std::vector<std::string> nodes;
+      const std::vector<std::string> &strings = pipe.strings(list);
+      for (size_t j = 0; j < strings.size(); ++j) nodes.push_back(node + "/" + strings[j]);
+      nodes.push_back(node);
+
+      batch.push_back(nodes);
+      names.push_back(instances[i]);
+    }
+    if (batch.empty()) continue;
+
+    rc = deleteInstances(zh, batch);
+    if (rc == ZOK) {
+      deleted += batch.size();
+      continue;
+    }
+
+    /* one busy instance fails the batch, the others go one by one */
+    for (size_t i = 0; i < batch.size(); ++i) {
+      rc = deleteInstances(zh, std::vector<std::vector<std::string> >(1, batch[i]));
+      if (rc == ZOK) ++deleted;
+      else log_info(0, "reap %s/%s skipped, %s", taskDir.c_str(), names[i].c_str(), zerror(rc));
+    }
+  }
+
+  if (deleted > 0) log_info(0, "reap %s deleted %d instances", taskDir.c_str(), deleted);
+  return deleted;
+}
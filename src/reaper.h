@@ -0,0 +1,43 @@
+#ifndef _REAPER_H_
+#define _REAPER_H_
+
+#include <string>
+#include <zookeeper/zookeeper.h>
+
+class ZkSession;
+
+/* deletes the finished instances of a task, the <taskid> dirs beside the
+ * one that just ran, DCRON_KEEP and DCRON_KEEP_DAYS
+ *
+ *   /x/y/llap, /x/y/affinity   never touched
+ *   /x/y/<taskid>              oldest first by name, the taskid is the
+ *                              strftime of DCRON_NAME
+ *
+ * an instance beyond the newest keep, or whose status was last written
+ * keepDays ago, is deleted with its children in a zoo_multi. an instance
+ * with a master is running and skipped, a worker or a candidate under it
+ * fails the zoo_multi with ZNOTEMPTY, a running instance is never deleted.
+ * an instance without status may be starting, only its age deletes it
+ *
+ * the master submits a pass after the task, the passes run one at a time
+ * on a thread of the process, a task submitted again before its pass is
+ * reaped once. a pass deletes at most REAP_MAX instances, REAP_BATCH per
+ * zoo_multi with REAP_SLEEP between them, a backlog drains over the next
+ * runs. zookeeper 3.4 has no ttl or container nodes to do it
+ */
+class Reaper {
+public:
+  /* the session is retained until the pass is done */
+  static void submit(ZkSession *session, const std::string &taskPath, int keep, int keepDays);
+
+  /* waits for the passes submitted, dcron before it exits */
+  static void drain();
+
+  /* one pass, returns the number of instances deleted */
+  static int reap(zhandle_t *zh, const std::string &taskPath, int keep, int keepDays);
+
+private:
+  static void *loopRoutine(void *data);
+};
+
+#endif
@@ -0,0 +1,548 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <memory>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "agent.h"
+#include "scheduler.h"
+
+#define ERRBUF_MAX      1024
+#define RELOAD_INTERVAL 60     // seconds
+#define NEXT_YEARS_MAX  5
+
+extern char **environ;
+
+static const char *MONTH_NAMES[] = {
+  "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec", 0
+};
+static const char *DOW_NAMES[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat", 0};
+
+static bool parseNumber(const std::string &s, int min, const char **names, int *n)
+{
+  if (s.empty()) return false;
+
+  if (names && isalpha(s[0])) {
+    for (int i = 0; names[i]; ++i) {
+      if (strcasecmp(s.c_str(), names[i]) == 0) {
+        *n = min + i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  char *end;
+  long l = strtol(s.c_str(), &end, 10);
+  if (*end != '\0') return false;
+  *n = l;
+  return true;
+}
+
+/* a,b-c,d-e/n,*\/n -> bits */
+static bool parseField(const std::string &field, int min, int max, const char **names,
+                       uint64_t *bits, bool *star)
+{
+  *bits = 0;
+  *star = field == "*";
+
+  size_t start = 0;
+  while (start <= field.size()) {
+    size_t comma = field.find(',', start);
+    if (comma == std::string::npos) comma = field.size();
+    std::string item = field.substr(start, comma - start);
+    start = comma + 1;
+
+    int step = 1;
+    size_t slash = item.find('/');
+    if (slash != std::string::npos) {
+      if (!parseNumber(item.substr(slash+1), 0, 0, &step) || step <= 0) return false;
+      item.resize(slash);
+    }
+
+    int lo, hi;
+    if (item == "*") {
+      lo = min;
+      hi = max;
+    } else {
+      size_t dash = item.find('-');
+      if (dash == std::string::npos) {
+        if (!parseNumber(item, min, names, &lo)) return false;
+        hi = slash == std::string::npos ? lo : max;
+      } else {
+        if (!parseNumber(item.substr(0, dash), min, names, &lo)) return false;
+        if (!parseNumber(item.substr(dash+1), min, names, &hi)) return false;
+      }
+    }
+
+    if (lo < min || hi > max || lo > hi) return false;
+    for (int i = lo; i <= hi; i += step) *bits |= (uint64_t) 1 << i;
+  }
+  return *bits != 0;
+}
+
+bool CronExpr::parse(const std::string &expr, char *errbuf)
+{
+  std::string s = expr;
+  if (s == "@yearly" || s == "@annually") s = "0 0 1 1 *";
+  else if (s == "@monthly")                s = "0 0 1 * *";
+  else if (s == "@weekly")                 s = "0 0 * * 0";
+  else if (s == "@daily" || s == "@midnight") s = "0 0 * * *";
+  else if (s == "@hourly")                 s = "0 * * * *";
+
+  char f[5][64];
+  char extra[2];
+  if (sscanf(s.c_str(), "%63s %63s %63s %63s %63s %1s", f[0], f[1], f[2], f[3], f[4], extra) != 5) {
+    snprintf(errbuf, ERRBUF_MAX, "schedule %s must have 5 fields", expr.c_str());
+    return false;
+  }
+
+  uint64_t minute, hour, dom, month, dow;
+  bool star;
+  if (!parseField(f[0], 0, 59, 0, &minute, &star) ||
+      !parseField(f[1], 0, 23, 0, &hour, &star) ||
+      !parseField(f[2], 1, 31, 0, &dom, &domStar_) ||
+      !parseField(f[3], 1, 12, MONTH_NAMES, &month, &star) ||
+      !parseField(f[4], 0, 7, DOW_NAMES, &dow, &dowStar_)) {
+    snprintf(errbuf, ERRBUF_MAX, "schedule %s error", expr.c_str());
+    return false;
+  }
+
+  if (dow & ((uint64_t) 1 << 7)) dow |= 1;   // 7 is sunday too
+
+  minute_ = minute;
+  hour_   = hour;
+  dom_    = dom;
+  month_  = month;
+  dow_    = dow;
+  return true;
+}
+
+bool CronExpr::match(const struct tm &ltm) const
+{
+  bool dom = dom_ & ((uint32_t) 1 << ltm.tm_mday);
+  bool dow = dow_ & ((uint32_t) 1 << ltm.tm_wday);
+  return (domStar_ || dowStar_) ? (dom && dow) : (dom || dow);
+}
+
+inline void normalize(struct tm *ltm)
+{
+  ltm->tm_isdst = -1;
+  time_t t = mktime(ltm);
+  localtime_r(&t, ltm);
+}
+
+time_t CronExpr::next(time_t t) const
+{
+  time_t start = t - t % 60 + 60;
+  struct tm ltm;
+  localtime_r(&start, &ltm);
+  ltm.tm_sec = 0;
+
+  int yearMax = ltm.tm_year + NEXT_YEARS_MAX;
+  while (ltm.tm_year <= yearMax) {
+    if (!(month_ & ((uint32_t) 1 << (ltm.tm_mon + 1)))) {
+      ltm.tm_mon++;
+      ltm.tm_mday = 1;
+      ltm.tm_hour = ltm.tm_min = 0;
+    } else if (!match(ltm)) {
+      ltm.tm_mday++;
+      ltm.tm_hour = ltm.tm_min = 0;
+    } else if (!(hour_ & ((uint32_t) 1 << ltm.tm_hour))) {
+      ltm.tm_hour++;
+      ltm.tm_min = 0;
+    } else if (!(minute_ & ((uint64_t) 1 << ltm.tm_min))) {
+      ltm.tm_min++;
+    } else {
+      /* ltm is normalized, its own isdst picks the right one of a
+       * repeated hour, -1 may go back an hour
+       */
+      return mktime(&ltm);
+    }
+    normalize(&ltm);
+  }
+  return -1;
+}
+
+struct CronEntry {
+  TimerNode   timer;
+  std::string key;     // environment and line, identity across reloads
+  std::string line;
+  CronExpr    expr;
+  uid_t       uid;
+  std::string home;
+  std::vector<std::string> args;   // dcron command line
+  std::vector<std::string> env;
+
+  int running;
+  int refs;
+
+  CronEntry() : uid(0), running(0), refs(1) { timer.data = this; }
+};
+
+struct CronJob {
+  Agent     *agent;
+  CronEntry *entry;
+  int        devnull;
+
+  std::auto_ptr<ConfigOpt> cnf;
+  std::string command;
+  std::vector<char *> argv;
+  std::vector<char *> envp;
+
+  CronJob(Agent *a, CronEntry *e) : agent(a), entry(e), devnull(-1) {
+    for (size_t i = 0; i < e->args.size(); ++i) argv.push_back((char *) e->args[i].c_str());
+    argv.push_back(0);
+    for (size_t i = 0; i < e->env.size(); ++i) envp.push_back((char *) e->env[i].c_str());
+    envp.push_back(0);
+  }
+
+  ~CronJob() {
+    if (devnull != -1) close(devnull);
+  }
+};
+
+inline std::string trim(const std::string &s)
+{
+  size_t start = s.find_first_not_of(" \t\r\n");
+  if (start == std::string::npos) return std::string();
+  size_t end = s.find_last_not_of(" \t\r\n");
+  return s.substr(start, end - start + 1);
+}
+
+/* NAME=value, NAME = "value" */
+static bool parseEnvLine(const std::string &line, std::string *name, std::string *value)
+{
+  size_t eq = line.find('=');
+  if (eq == std::string::npos) return false;
+
+  *name = trim(line.substr(0, eq));
+  if (name->empty() || !(isalpha((*name)[0]) || (*name)[0] == '_')) return false;
+  for (size_t i = 1; i < name->size(); ++i) {
+    if (!isalnum((*name)[i]) && (*name)[i] != '_') return false;
+  }
+
+  *value = trim(line.substr(eq + 1));
+  if (value->size() >= 2 && ((*value)[0] == '"' || (*value)[0] == '\'') &&
+      (*value)[value->size()-1] == (*value)[0]) {
+    *value = value->substr(1, value->size() - 2);
+  }
+  return true;
+}
+
+/* whitespace separated, quotes group words, \% is % as in crontab */
+static bool splitLine(const std::string &line, std::vector<std::string> *tokens)
+{
+  std::string token;
+  bool inToken = false;
+  char quote = 0;
+
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quote) {
+      if (c == quote) quote = 0;
+      else if (c == '\\' && quote == '"' && i+1 < line.size() && (line[i+1] == '"' || line[i+1] == '\\')) token.append(1, line[++i]);
+      else token.append(1, c);
+    } else if (c == ' ' || c == '\t') {
+      if (inToken) tokens->push_back(token);
+      token.clear();
+      inToken = false;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      inToken = true;
+    } else if (c == '\\' && i+1 < line.size() && line[i+1] == '%') {
+      token.append(1, '%');
+      inToken = true;
+      ++i;
+    } else {
+      token.append(1, c);
+      inToken = true;
+    }
+  }
+
+  if (inToken) tokens->push_back(token);
+  return quote == 0;
+}
+
+static bool isDcron(const std::string &s)
+{
+  size_t slash = s.rfind('/');
+  return s.compare(slash == std::string::npos ? 0 : slash + 1, std::string::npos, "dcron") == 0;
+}
+
+bool Scheduler::load(std::vector<CronEntry *> *entries, char *errbuf)
+{
+  FILE *fp = fopen(crontab_.c_str(), "r");
+  if (!fp) {
+    snprintf(errbuf, ERRBUF_MAX, "open %s error, %s", crontab_.c_str(), strerror(errno));
+    return false;
+  }
+
+  std::map<std::string, std::string> vars;
+  std::string envKey;
+
+  bool rc = true;
+  char buffer[8192];
+  for (int lineno = 1; fgets(buffer, sizeof(buffer), fp); ++lineno) {
+    std::string line = trim(buffer);
+    if (line.empty() || line[0] == '#') continue;
+
+    std::string name, value;
+    if (line[0] != '@' && !isdigit(line[0]) && line[0] != '*' && parseEnvLine(line, &name, &value)) {
+      vars[name] = value;
+      envKey.append(name).append(1, '=').append(value).append(1, '\n');
+      continue;
+    }
+
+    std::vector<std::string> tokens;
+    if (!splitLine(line, &tokens)) {
+      snprintf(errbuf, ERRBUF_MAX, "%s:%d unterminated quote", crontab_.c_str(), lineno);
+      rc = false;
+      break;
+    }
+
+    size_t nexpr = line[0] == '@' ? 1 : 5;
+    size_t idx = nexpr + 1;
+    if (idx < tokens.size() && isDcron(tokens[idx])) ++idx;
+    if (idx >= tokens.size()) {
+      snprintf(errbuf, ERRBUF_MAX, "%s:%d expect <schedule> <user> <dcron args>", crontab_.c_str(), lineno);
+      rc = false;
+      break;
+    }
+
+    std::auto_ptr<CronEntry> entry(new CronEntry);
+    entry->key  = envKey + line;
+    entry->line = line;
+
+    std::string expr = tokens[0];
+    for (size_t i = 1; i < nexpr; ++i) expr.append(1, ' ').append(tokens[i]);
+    if (!entry->expr.parse(expr, errbuf)) {
+      rc = false;
+      break;
+    }
+
+    struct passwd *pwd = getpwnam(tokens[nexpr].c_str());
+    if (!pwd) {
+      snprintf(errbuf, ERRBUF_MAX, "%s:%d user %s notfound", crontab_.c_str(), lineno, tokens[nexpr].c_str());
+      rc = false;
+      break;
+    }
+    entry->uid  = pwd->pw_uid;
+    entry->home = pwd->pw_dir;
+
+    entry->args.push_back("dcron");
+    entry->args.insert(entry->args.end(), tokens.begin() + idx, tokens.end());
+
+    for (char **ptr = environ; *ptr; ++ptr) {
+      const char *eq = strchr(*ptr, '=');
+      if (eq && vars.find(std::string(*ptr, eq - *ptr)) == vars.end()) entry->env.push_back(*ptr);
+    }
+    for (std::map<std::string, std::string>::iterator ite = vars.begin(); ite != vars.end(); ++ite) {
+      entry->env.push_back(ite->first + "=" + ite->second);
+    }
+
+    entries->push_back(entry.release());
+  }
+  fclose(fp);
+
+  if (!rc) {
+    for (size_t i = 0; i < entries->size(); ++i) delete (*entries)[i];
+    entries->clear();
+  }
+  return rc;
+}
+
+Scheduler *Scheduler::create(Agent *agent, const char *crontab, char *errbuf)
+{
+  time_t now = time(0);
+  std::auto_ptr<Scheduler> scheduler(new Scheduler(agent, now));
+  scheduler->crontab_ = crontab;
+
+  struct stat st;
+  if (stat(crontab, &st) == 0) scheduler->mtime_ = st.st_mtime;
+
+  if (!scheduler->load(&scheduler->entries_, errbuf)) return 0;
+  for (size_t i = 0; i < scheduler->entries_.size(); ++i) {
+    scheduler->schedule(scheduler->entries_[i], now);
+  }
+  return scheduler.release();
+}
+
+bool Scheduler::start(char *errbuf)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  int rc = pthread_create(&tid, &attr, loopRoutine, this);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    snprintf(errbuf, ERRBUF_MAX, "pthread_create error, %s", strerror(rc));
+    return false;
+  }
+  return true;
+}
+
+void Scheduler::reload()
+{
+  struct stat st;
+  if (stat(crontab_.c_str(), &st) != 0 || st.st_mtime == mtime_) return;
+  mtime_ = st.st_mtime;
+
+  char errbuf[ERRBUF_MAX];
+  std::vector<CronEntry *> entries;
+  if (!load(&entries, errbuf)) {
+    log_error(0, "crontab reload error, %s", errbuf);
+    return;
+  }
+
+  /* unchanged entries keep their timer and running instances */
+  std::map<std::string, CronEntry *> old;
+  for (size_t i = 0; i < entries_.size(); ++i) old[entries_[i]->key] = entries_[i];
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    std::map<std::string, CronEntry *>::iterator pos = old.find(entries[i]->key);
+    if (pos != old.end()) {
+      delete entries[i];
+      entries[i] = pos->second;
+      old.erase(pos);
+    } else {
+      schedule(entries[i], wheel_.current());
+    }
+  }
+
+  for (std::map<std::string, CronEntry *>::iterator ite = old.begin(); ite != old.end(); ++ite) {
+    wheel_.del(&ite->second->timer);
+    unref(ite->second);
+  }
+
+  entries_.swap(entries);
+  log_info(0, "crontab %s reloaded, %d entries", crontab_.c_str(), (int) entries_.size());
+}
+
+void Scheduler::schedule(CronEntry *entry, time_t now)
+{
+  time_t next = entry->expr.next(now);
+  if (next == -1) {
+    log_error(0, "crontab %s never fires", entry->line.c_str());
+    return;
+  }
+
+  entry->timer.expire = next;
+  wheel_.add(&entry->timer);
+}
+
+void Scheduler::fire(CronEntry *entry, time_t when)
+{
+  char errbuf[ERRBUF_MAX];
+  std::auto_ptr<CronJob> job(new CronJob(agent_, entry));
+
+  int argc = job->argv.size() - 1;
+  int envc = 1;
+  job->cnf.reset(ConfigOpt::create(argc, &job->argv[0], &envc, errbuf, &job->envp[0], when));
+  if (!job->cnf.get() || !job->cnf->runAs(entry->uid, errbuf)) {
+    log_error(0, "crontab %s config error %s", entry->line.c_str(), errbuf);
+    return;
+  }
+
+  /* the llap instance, master or standby, is still registered */
+  if (job->cnf->llap() && __sync_fetch_and_add(&entry->running, 0) > 0) return;
+
+  if (envc >= argc || !job->cnf->which(job->argv[envc], &job->command)) {
+    log_error(0, "crontab %s command notfound", entry->line.c_str());
+    return;
+  }
+  job->argv[envc] = (char *) job->command.c_str();
+  job->argv.erase(job->argv.begin(), job->argv.begin() + envc);
+
+  job->devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+  int fds[3] = {job->devnull, job->devnull, job->devnull};
+  job->cnf->setStdio(fds);
+  job->cnf->setCwd(entry->home);
+
+  __sync_fetch_and_add(&entry->running, 1);
+  __sync_fetch_and_add(&entry->refs, 1);
+
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  int rc = pthread_create(&tid, &attr, fireRoutine, job.get());
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    log_error(rc, "crontab %s pthread_create error", entry->line.c_str());
+    __sync_fetch_and_sub(&entry->running, 1);
+    unref(entry);
+  } else {
+    job.release();
+  }
+}
+
+void *Scheduler::fireRoutine(void *data)
+{
+  std::auto_ptr<CronJob> job((CronJob *) data);
+  CronEntry *entry = job->entry;
+
+  int argc = job->argv.size() - 1;
+  int status = job->agent->run(job->cnf.get(), argc, &job->argv[0]);
+  log_info(0, "crontab %s %s exit %d", job->cnf->id(), job->cnf->name(), status);
+
+  job.reset();
+  __sync_fetch_and_sub(&entry->running, 1);
+  unref(entry);
+  return 0;
+}
+
+void Scheduler::unref(CronEntry *entry)
+{
+  if (__sync_sub_and_fetch(&entry->refs, 1) == 0) delete entry;
+}
+
+void *Scheduler::loopRoutine(void *data)
+{
+  ((Scheduler *) data)->loop();
+  return 0;
+}
+
+void Scheduler::loop()
+{
+  time_t lastReload = wheel_.current();
+  std::vector<TimerNode *> expired;
+
+  while (true) {
+    struct timespec ts = {wheel_.current() + 1, 0};
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, 0) == EINTR) {}
+
+    time_t now = time(0);
+    if (now < wheel_.current()) {
+      log_error(0, "clock went back %lds, reschedule", (long) (wheel_.current() - now));
+      for (size_t i = 0; i < entries_.size(); ++i) wheel_.del(&entries_[i]->timer);
+      wheel_.reset(now);
+      for (size_t i = 0; i < entries_.size(); ++i) schedule(entries_[i], now);
+      continue;
+    }
+
+    expired.clear();
+    wheel_.advance(now, &expired);
+    for (size_t i = 0; i < expired.size(); ++i) {
+      CronEntry *entry = (CronEntry *) expired[i]->data;
+      fire(entry, entry->timer.expire);
+      schedule(entry, now);
+    }
+
+    if (now - lastReload >= RELOAD_INTERVAL) {
+      reload();
+      lastReload = now;
+    }
+  }
+}
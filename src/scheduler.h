@@ -0,0 +1,74 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "timerwheel.h"
+
+class Agent;
+
+/* crontab schedule, minute hour day-of-month month day-of-week
+ * supports *, a-b, a/n, a-b/n, lists, month and weekday names and
+ * @yearly @monthly @weekly @daily @hourly
+ */
+class CronExpr {
+public:
+  bool parse(const std::string &expr, char *errbuf);
+
+  /* the first matching minute after t, -1 if none in 5 years */
+  time_t next(time_t t) const;
+
+private:
+  bool match(const struct tm &ltm) const;
+
+  uint64_t minute_;
+  uint32_t hour_;
+  uint32_t dom_;
+  uint32_t month_;
+  uint32_t dow_;
+  bool     domStar_;
+  bool     dowStar_;
+};
+
+struct CronEntry;
+
+/* DCRON_CRONTAB of dcrond, a system crontab whose command is the dcron
+ * command line, "dcron" itself may be omitted
+ *   DCRON_ZK=zk1:2181/dcron
+ *   0 4 * * * root DCRON_NAME=dbbackup.%F -- dbbackup
+ *   * * * * * root DCRON_NAME=mysql2kafka DCRON_LLAP=true -- mysql2kafka
+ *
+ * every fire runs as a dcron client in dcrond, an llap entry is fired
+ * again only after its last instance, master or standby, is gone
+ * the crontab is reloaded when it changes
+ */
+class Scheduler {
+public:
+  static Scheduler *create(Agent *agent, const char *crontab, char *errbuf);
+  bool start(char *errbuf);
+
+private:
+  Scheduler(Agent *agent, time_t now) : agent_(agent), mtime_(0), wheel_(now) {}
+
+  bool load(std::vector<CronEntry *> *entries, char *errbuf);
+  void reload();
+  void schedule(CronEntry *entry, time_t now);
+  void fire(CronEntry *entry, time_t when);
+  void loop();
+
+  static void *loopRoutine(void *data);
+  static void *fireRoutine(void *data);
+  static void unref(CronEntry *entry);
+
+  Agent      *agent_;
+  std::string crontab_;
+  time_t      mtime_;
+
+  TimerWheel  wheel_;
+  std::vector<CronEntry *> entries_;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "spawner.h"
+
+#ifndef CLONE_PIDFD
+# define CLONE_PIDFD 0x00001000
+#endif
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+#define SPAWN_GROUPS_MAX 65536
+
+Spawner::Spawner()
+  : envDirty_(true), cgroupFd_(-1), rlimitAs_(0), setUser_(false), uid_(-1), gid_(-1), stack_(SPAWN_STACK_SIZE),
+    argv_(0), step_(NONE), errno_(0)
+{
+  sigemptyset(&mask_);
+}
+
+void Spawner::clearEnv()
+{
+  arena_.clear();
+  offsets_.clear();
+  envDirty_ = true;
+}
+
+void Spawner::addEnv(const std::string &name, const std::string &value)
+{
+  offsets_.push_back(arena_.size());
+  arena_.insert(arena_.end(), name.begin(), name.end());
+  arena_.push_back('=');
+  arena_.insert(arena_.end(), value.begin(), value.end());
+  arena_.push_back('\0');
+  envDirty_ = true;
+}
+
+void Spawner::addEnv(const char *entry)
+{
+  offsets_.push_back(arena_.size());
+  arena_.insert(arena_.end(), entry, entry + strlen(entry) + 1);
+  envDirty_ = true;
+}
+
+char * const *Spawner::envp()
+{
+  if (envDirty_) {
+    envp_.resize(offsets_.size() + 1);
+    for (size_t i = 0; i < offsets_.size(); ++i) envp_[i] = &arena_[offsets_[i]];
+    envp_[offsets_.size()] = 0;
+    envDirty_ = false;
+  }
+  return &envp_[0];
+}
+
+void Spawner::clearFds()
+{
+  dups_.clear();
+  inherits_.clear();
+}
+
+void Spawner::dup(int fd, int target)
+{
+  dups_.push_back(std::make_pair(fd, target));
+}
+
+void Spawner::inherit(int fd)
+{
+  inherits_.push_back(fd);
+}
+
+/* getgrouplist reads /etc/group or nss, the child must not */
+bool Spawner::setUser(const char *user, int uid, int gid)
+{
+  setUser_ = false;
+  groups_.clear();
+  if (!user || geteuid() != 0) return true;
+
+  int n = 64;
+  groups_.resize(n);
+  while (getgrouplist(user, gid, &groups_[0], &n) == -1) {
+    if (n <= (int) groups_.size() || n > SPAWN_GROUPS_MAX) return false;
+    groups_.resize(n);
+  }
+  groups_.resize(n);
+
+  setUser_ = true;
+  uid_ = uid;
+  gid_ = gid;
+  return true;
+}
+
+const char *Spawner::stepToString(Step step)
+{
+  switch (step) {
+  case NONE:    return "none";
+  case CGROUP:  return "write cgroup.procs";
+  case DUP:     return "dup2";
+  case CHDIR:   return "chdir";
+  case RLIMIT:  return "setrlimit(RLIMIT_AS)";
+  case SETUID:  return "setuid";
+  case INHERIT: return "fcntl(FD_CLOEXEC)";
+  case EXEC:    return "execve";
+  }
+  return "unknown";
+}
+
+/* all the signals are blocked while the child runs on the stack_,
+ * the parent is suspended until it calls execve or exits
+ */
+pid_t Spawner::spawn(char *argv[], int *pidfd)
+{
+  argv_  = argv;
+  envp();
+  step_  = NONE;
+  errno_ = 0;
+  *pidfd = -1;
+
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &mask_);
+
+  char *stack = (char *) ((uintptr_t) (&stack_[0] + stack_.size()) & ~(uintptr_t) 15);
+  int flags = CLONE_VM | CLONE_VFORK | SIGCHLD;
+  pid_t pid = clone(child, stack, flags | CLONE_PIDFD, this, pidfd);
+  if (pid == -1 && errno == EINVAL) {
+    *pidfd = -1;
+    pid = clone(child, stack, flags, this);
+  }
+
+  int eno = errno;
+  pthread_sigmask(SIG_SETMASK, &mask_, 0);
+  errno = eno;
+  return pid;
+}
+
+void Spawner::fail(Step step)
+{
+  errno_ = errno;
+  step_  = step;
+  _exit(EXIT_FAILURE);
+}
+
+/* system calls only, the memory is the parent's */
+int Spawner::child(void *ctx)
+{
+  Spawner *spawner = (Spawner *) ctx;
+
+  /* accounted from here on */
+  if (spawner->cgroupFd_ != -1 && write(spawner->cgroupFd_, "0", 1) != 1) spawner->fail(CGROUP);
+
+  for (size_t i = 0; i < spawner->dups_.size(); ++i) {
+    int fd = spawner->dups_[i].first, target = spawner->dups_[i].second;
+    if (fd == target ? fcntl(fd, F_SETFD, 0) == -1 : dup2(fd, target) == -1) spawner->fail(DUP);
+  }
+
+  if (!spawner->cwd_.empty() && chdir(spawner->cwd_.c_str()) == -1) spawner->fail(CHDIR);
+
+  if (spawner->rlimitAs_) {
+    struct rlimit rlmt;
+    rlmt.rlim_cur = (rlim_t) spawner->rlimitAs_ * 1024 * 1024;
+    rlmt.rlim_max = (rlim_t) spawner->rlimitAs_ * 1024 * 1024;
+    if (setrlimit(RLIMIT_AS, &rlmt) == -1) spawner->fail(RLIMIT);
+  }
+
+  if (spawner->setUser_ &&
+      (syscall(SYS_setgroups, spawner->groups_.size(), &spawner->groups_[0]) == -1 ||
+       syscall(SYS_setgid, spawner->gid_) == -1 || syscall(SYS_setuid, spawner->uid_) == -1)) {
+    spawner->fail(SETUID);
+  }
+
+  for (size_t i = 0; i < spawner->inherits_.size(); ++i) {
+    if (fcntl(spawner->inherits_[i], F_SETFD, 0) == -1) spawner->fail(INHERIT);
+  }
+
+  /* SIGCHLD is blocked in dcron for the signalfd */
+  sigset_t mask = spawner->mask_;
+  sigdelset(&mask, SIGCHLD);
+  sigprocmask(SIG_SETMASK, &mask, 0);
+
+  execve(spawner->argv_[0], spawner->argv_, &spawner->envp_[0]);
+  spawner->fail(EXEC);
+  return 0;
+}
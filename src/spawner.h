@@ -0,0 +1,82 @@
+#ifndef _SPAWNER_H_
+#define _SPAWNER_H_
+
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <sys/types.h>
+
+/* starts the task by clone(CLONE_VM | CLONE_VFORK), the child runs on a
+ * stack of its own in the memory of dcron until execve, no page table is
+ * copied however large dcron is, and no fork handler of libzookeeper_mt
+ * or the logger runs
+ *
+ * the child may only make system calls, it does not allocate, lock or
+ * log. everything it needs is prepared by the parent: the environment
+ * is built once in an arena and reused by every retry, the groups of the
+ * user are looked up before, setuid is the raw system call, glibc would
+ * signal the threads of dcron. a failure of the child is written to the
+ * shared memory before it exits EXIT_FAILURE, the parent reports it
+ *
+ * the pidfd of the child comes with clone on kernels with CLONE_PIDFD
+ */
+class Spawner {
+public:
+  /* the step of the child that failed */
+  enum Step { NONE, CGROUP, DUP, CHDIR, RLIMIT, SETUID, INHERIT, EXEC };
+
+  Spawner();
+
+  /* the environment, KEY=VALUE, kept until clearEnv */
+  void clearEnv();
+  void addEnv(const std::string &name, const std::string &value);
+  void addEnv(const char *entry);
+  bool envEmpty() const { return offsets_.empty(); }
+
+  /* the attributes of the next spawn, kept until clearFds */
+  void clearFds();
+  void dup(int fd, int target);   // dup2 in the child, in the order added
+  void inherit(int fd);           // FD_CLOEXEC is cleared in the child
+
+  void setCwd(const char *cwd) { cwd_ = cwd ? cwd : ""; }
+  void setCgroup(int procsFd) { cgroupFd_ = procsFd; }  // cgroup.procs the child joins, -1 none
+  void setRlimitAs(int mb) { rlimitAs_ = mb; }
+  /* the groups are looked up here, false if they can not be */
+  bool setUser(const char *user, int uid, int gid);
+
+  /* the pid, -1 if clone failed. pidfd is -1 unless CLONE_PIDFD is supported,
+   * a child that failed before execve has exited, step() and error() say why
+   */
+  pid_t spawn(char *argv[], int *pidfd);
+  Step step() const { return step_; }
+  int  error() const { return errno_; }
+  static const char *stepToString(Step step);
+
+private:
+  static int child(void *ctx);
+  void fail(Step step);
+  char * const *envp();
+
+  std::vector<char>   arena_;    // KEY=VALUE\0...
+  std::vector<size_t> offsets_;
+  std::vector<char *> envp_;     // into arena_, rebuilt when the arena grows
+  bool                envDirty_;
+
+  std::vector<std::pair<int, int> > dups_;
+  std::vector<int>    inherits_;
+  std::string         cwd_;
+  int                 cgroupFd_;
+  int                 rlimitAs_;
+  bool                setUser_;
+  int                 uid_;
+  int                 gid_;
+  std::vector<gid_t>  groups_;
+
+  std::vector<char>   stack_;
+  char              **argv_;
+  sigset_t            mask_;     // of the parent, restored in the child
+  volatile Step       step_;
+  volatile int        errno_;
+};
+
+#endif
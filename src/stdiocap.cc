@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "logger.h"
+#include "stdiocap.h"
+#include "fifoingest.h"
+
+#define CAPTURE_PIPE_SIZE (1024 * 1024)
+#define CAPTURE_MOVE_MAX  (1024 * 1024)
+
+StdioCapture::StdioCapture()
+  : segment_(0), interval_(0), keep_(0), tail_(0), pipeFd_(-1), writerFd_(-1), fileFd_(-1), size_(0),
+    opened_(0), splice_(true), failed_(false), started_(false), running_(false)
+{
+  pthread_mutex_init(&mutex_, 0);
+}
+
+StdioCapture::~StdioCapture()
+{
+  close();
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool StdioCapture::open(const std::string &file, size_t segment, int interval, int keep, size_t tail)
+{
+  close();
+
+  /* not O_APPEND, splice refuses it; read for tail() */
+  fileFd_ = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fileFd_ == -1) return false;
+
+  struct stat st;
+  size_ = fstat(fileFd_, &st) == 0 ? st.st_size : 0;
+  lseek(fileFd_, 0, SEEK_END);
+
+  file_     = file;
+  segment_  = segment;
+  interval_ = interval;
+  keep_     = keep;
+  tail_     = tail;
+  opened_   = time(0);
+  splice_   = true;
+  failed_   = false;
+  tailPrev_.clear();
+  return true;
+}
+
+/* only the read end is nonblocking, the task writes as to a file */
+bool StdioCapture::pipe()
+{
+  stop();
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) return false;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  FifoIngest::enlarge(fds[0], CAPTURE_PIPE_SIZE);
+
+  pipeFd_   = fds[0];
+  writerFd_ = fds[1];
+  return true;
+}
+
+void StdioCapture::closeWriter()
+{
+  if (writerFd_ != -1) ::close(writerFd_);
+  writerFd_ = -1;
+}
+
+bool StdioCapture::drain()
+{
+  if (pipeFd_ == -1) return false;
+
+  while (true) {
+    if ((segment_ && size_ >= segment_) || (interval_ && size_ && time(0) - opened_ >= interval_)) rotate();
+
+    size_t len = CAPTURE_MOVE_MAX;
+    if (segment_ && segment_ - size_ < len) len = segment_ - size_;
+
+    ssize_t nn = move(len);
+    if (nn == 0) return false;
+    if (nn == -1) return errno == EAGAIN || errno == EINTR;
+  }
+}
+
+/* a write error drops the output, the task must never block on the pipe */
+ssize_t StdioCapture::move(size_t len)
+{
+  if (splice_) {
+    ssize_t nn = splice(pipeFd_, 0, fileFd_, 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nn > 0) {
+      size_  += nn;
+      failed_ = false;
+    }
+    if (nn != -1 || errno == EAGAIN || errno == EINTR) return nn;
+    if (errno == EINVAL) splice_ = false;
+  }
+
+  char buffer[64 * 1024];
+  ssize_t nn = read(pipeFd_, buffer, std::min(len, sizeof(buffer)));
+  if (nn <= 0) return nn;
+
+  ssize_t wn = 0;
+  while (wn < nn) {
+    ssize_t n = write(fileFd_, buffer + wn, nn - wn);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    wn += n;
+  }
+  size_ += wn;
+
+  if (wn < nn && !failed_) log_error(errno, "write %s error, the output is dropped", file_.c_str());
+  failed_ = wn < nn;
+  return nn;
+}
+
+void StdioCapture::stop()
+{
+  if (pipeFd_ != -1) {
+    drain();
+    ::close(pipeFd_);
+    pipeFd_ = -1;
+  }
+  closeWriter();
+}
+
+void StdioCapture::close()
+{
+  stop();
+
+  if (started_) pthread_join(thread_, 0);
+  started_ = false;
+
+  if (fileFd_ != -1) {
+    ::close(fileFd_);
+    if (size_ == 0) unlink(file_.c_str());
+  }
+  fileFd_ = -1;
+}
+
+std::string StdioCapture::tail() const
+{
+  if (fileFd_ == -1) return "";
+
+  size_t n = std::min(size_, tail_);
+  std::string tail(n, '\0');
+  if (n && pread(fileFd_, &tail[0], n, size_ - n) != (ssize_t) n) tail.clear();
+
+  n = std::min(tail_ - tail.size(), tailPrev_.size());
+  return tailPrev_.substr(tailPrev_.size() - n) + tail;
+}
+
+/* a failed rename keeps the file, it is tried again after another segment */
+void StdioCapture::rotate()
+{
+  time_t now = time(0);
+  size_t n   = std::min(size_, tail_);
+  tailPrev_.assign(n, '\0');
+  if (n && pread(fileFd_, &tailPrev_[0], n, size_ - n) != (ssize_t) n) tailPrev_.clear();
+
+  char stamp[32];
+  struct tm ltm;
+  localtime_r(&now, &ltm);
+  strftime(stamp, sizeof(stamp), ".%Y%m%d-%H%M%S", &ltm);
+
+  std::string segment = file_ + stamp;
+  for (int i = 1; access(segment.c_str(), F_OK) == 0 || access((segment + ".gz").c_str(), F_OK) == 0; ++i) {
+    char seq[16];
+    snprintf(seq, sizeof(seq), "_%03d", i);
+    segment = file_ + stamp + seq;
+  }
+
+  size_   = 0;
+  opened_ = now;
+  if (rename(file_.c_str(), segment.c_str()) == -1) {
+    log_error(errno, "rename %s to %s error", file_.c_str(), segment.c_str());
+    return;
+  }
+
+  int fd = ::open(file_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log_error(errno, "open %s error, %s is written on", file_.c_str(), segment.c_str());
+    return;
+  }
+  ::close(fileFd_);
+  fileFd_ = fd;
+
+  /* one compressor at a time, it takes the segments closed meanwhile */
+  pthread_mutex_lock(&mutex_);
+  segments_.push_back(segment);
+  bool start = !running_;
+  running_ = true;
+  pthread_mutex_unlock(&mutex_);
+  if (!start) return;
+
+  if (started_) pthread_join(thread_, 0);
+  started_ = pthread_create(&thread_, 0, compressor, this) == 0;
+  if (!started_) {
+    log_error(errno, "%s compressor thread error, %s is not compressed", file_.c_str(), segment.c_str());
+    pthread_mutex_lock(&mutex_);
+    segments_.clear();
+    running_ = false;
+    pthread_mutex_unlock(&mutex_);
+  }
+}
+
+void *StdioCapture::compressor(void *ctx)
+{
+  StdioCapture *capture = (StdioCapture *) ctx;
+
+  pthread_mutex_lock(&capture->mutex_);
+  while (!capture->segments_.empty()) {
+    std::string segment = capture->segments_.front();
+    capture->segments_.erase(capture->segments_.begin());
+    pthread_mutex_unlock(&capture->mutex_);
+
+    capture->compress(segment);
+    capture->prune();
+
+    pthread_mutex_lock(&capture->mutex_);
+  }
+  capture->running_ = false;
+  pthread_mutex_unlock(&capture->mutex_);
+  return 0;
+}
+
+/* the segment is kept when it can not be compressed */
+void StdioCapture::compress(const std::string &segment)
+{
+  std::string gz = segment + ".gz";
+  int fd   = ::open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+  int gzfd = fd == -1 ? -1 : ::open(gz.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  gzFile out = gzfd == -1 ? 0 : gzdopen(gzfd, "wb");
+  if (!out && gzfd != -1) ::close(gzfd);
+
+  bool ok = out != 0;
+  char buffer[64 * 1024];
+  ssize_t nn = 0;
+  while (ok && (nn = read(fd, buffer, sizeof(buffer))) > 0) ok = gzwrite(out, buffer, nn) == nn;
+  if (nn == -1) ok = false;
+  if (out && gzclose(out) != Z_OK) ok = false;
+  if (fd != -1) ::close(fd);
+
+  if (ok) {
+    unlink(segment.c_str());
+  } else {
+    log_error(errno, "compress %s error", segment.c_str());
+    if (gzfd != -1) unlink(gz.c_str());
+  }
+}
+
+/* the names sort by the time of the segment, .gz and _001 after the bare time */
+void StdioCapture::prune()
+{
+  size_t slash = file_.rfind('/');
+  std::string dir    = slash == std::string::npos ? "." : file_.substr(0, slash);
+  std::string prefix = file_.substr(slash == std::string::npos ? 0 : slash + 1) + ".";
+
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) return;
+
+  std::vector<std::string> names;
+  struct dirent *ent;
+  while ((ent = readdir(dp))) {
+    if (strncmp(ent->d_name, prefix.c_str(), prefix.size()) == 0 && isdigit(ent->d_name[prefix.size()])) {
+      names.push_back(ent->d_name);
+    }
+  }
+  closedir(dp);
+
+  std::sort(names.begin(), names.end());
+  for (size_t i = 0; i + keep_ < names.size(); ++i) unlink((dir + "/" + names[i]).c_str());
+}
@@ -0,0 +1,79 @@
+#ifndef _STDIOCAP_H_
+#define _STDIOCAP_H_
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include <pthread.h>
+
+/* stdout or stderr of the task, DCRON_STDIOCAP
+ * the task writes to a pipe, the supervisor splices the pipe into
+ * <logdir>/<name>.stdout without a copy through user space
+ *
+ * the file is closed as a segment when it reaches the segment size or is
+ * older than the rotate interval, renamed to <name>.stdout.<time> and
+ * deflated to .gz by a background thread, the oldest segments beyond
+ * keep are removed. the last tail bytes are there for a failure report,
+ * read back from the file, the end of the last closed segment is kept
+ * in memory
+ */
+class StdioCapture {
+public:
+  StdioCapture();
+  ~StdioCapture();
+
+  /* the file is appended, segment 0 is never rotated by size, interval 0 by time */
+  bool open(const std::string &file, size_t segment, int interval, int keep, size_t tail);
+  bool opened() const { return fileFd_ != -1; }
+
+  /* a pipe for the next child, the read end is fd(), the write end
+   * writer(), which the parent closes by closeWriter() after fork
+   */
+  bool pipe();
+  int  fd() const { return pipeFd_; }
+  int  writer() const { return writerFd_; }
+  void closeWriter();
+
+  /* splices until EAGAIN, false at EOF, when every writer is gone */
+  bool drain();
+
+  /* drains and closes the pipe */
+  void stop();
+
+  /* stops, waits for the compression, removes the file if empty */
+  void close();
+
+  std::string tail() const;
+
+private:
+  ssize_t move(size_t len);
+  void rotate();
+
+  static void *compressor(void *ctx);
+  void compress(const std::string &segment);
+  void prune();
+
+  std::string file_;
+  size_t      segment_;
+  int         interval_;
+  int         keep_;
+  size_t      tail_;
+
+  int         pipeFd_;
+  int         writerFd_;
+  int         fileFd_;
+  size_t      size_;       // of the file
+  time_t      opened_;     // the segment
+  bool        splice_;     // false when the file system does not support it
+  bool        failed_;     // a write error is logged once a segment
+  std::string tailPrev_;   // the end of the last closed segment
+
+  /* closed segments waiting for the compressor */
+  pthread_mutex_t          mutex_;
+  std::vector<std::string> segments_;
+  pthread_t                thread_;
+  bool                     started_;
+  bool                     running_;
+};
+
+#endif
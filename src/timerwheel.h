@@ -0,0 +1,103 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <vector>
+#include <time.h>
+
+struct TimerNode {
+  TimerNode *prev;
+  TimerNode *next;
+  time_t     expire;
+  void      *data;
+
+  TimerNode() : prev(0), next(0), expire(0), data(0) {}
+  bool pending() const { return next != 0; }
+};
+
+/* hierarchical timer wheel with one second resolution
+ * level n has 64 slots of 64^n seconds, 4 levels cover 194 days, a later
+ * timer is parked in the last level and re-inserted when it comes round
+ * add, del and a tick are O(1), a slot cascades to the lower level when
+ * the lower level wraps
+ */
+class TimerWheel {
+public:
+  enum { LEVELS = 4, BITS = 6, SLOTS = 1 << BITS, MASK = SLOTS - 1 };
+
+  explicit TimerWheel(time_t now) : current_(now) {
+    for (int l = 0; l < LEVELS; ++l) {
+      for (int s = 0; s < SLOTS; ++s) slots_[l][s].prev = slots_[l][s].next = &slots_[l][s];
+    }
+  }
+
+  time_t current() const { return current_; }
+
+  /* the wall clock went back, all timers must be deleted first */
+  void reset(time_t now) { current_ = now; }
+
+  void add(TimerNode *node) {
+    if (node->pending()) del(node);
+    insert(node, current_ + 1);  // the current slot is done
+  }
+
+  void del(TimerNode *node) {
+    if (!node->pending()) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = 0;
+  }
+
+  /* moves the wheel to now, expired nodes are appended to expired */
+  void advance(time_t now, std::vector<TimerNode *> *expired) {
+    while (current_ < now) {
+      ++current_;
+      for (int l = 1; l < LEVELS; ++l) {
+        if ((current_ & ((1L << (BITS * l)) - 1)) != 0) break;
+        cascade(&slots_[l][index(current_, l)]);
+      }
+
+      TimerNode *head = &slots_[0][index(current_, 0)];
+      while (head->next != head) {
+        TimerNode *node = head->next;
+        del(node);
+        if (node->expire > current_) insert(node, current_ + 1);  // parked timer
+        else expired->push_back(node);
+      }
+    }
+  }
+
+private:
+  static int index(time_t t, int level) { return (t >> (BITS * level)) & MASK; }
+
+  void insert(TimerNode *node, time_t earliest) {
+    time_t expire = node->expire < earliest ? earliest : node->expire;
+
+    long delta = expire - current_;
+    if (delta >= (1L << (BITS * LEVELS))) {
+      delta  = (1L << (BITS * LEVELS)) - 1;
+      expire = current_ + delta;
+    }
+
+    int level = 0;
+    while (delta >= (1L << (BITS * (level + 1)))) ++level;
+
+    TimerNode *head = &slots_[level][index(expire, level)];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+  }
+
+  void cascade(TimerNode *head) {
+    while (head->next != head) {
+      TimerNode *node = head->next;
+      del(node);
+      insert(node, current_);  // level 0 of current_ is not done yet
+    }
+  }
+
+  time_t    current_;
+  TimerNode slots_[LEVELS][SLOTS];
+};
+
+#endif
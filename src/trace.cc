@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstdlib>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "logger.h"
+#include "trace.h"
+
+#define TRACE_EVENT_MAX 65536
+
+__thread Trace *Trace::current_ = 0;
+
+Trace::Trace(const char *path, const char *name, const char *id) : name_(name), id_(id), tid_(0), dropped_(0)
+{
+  if (!path || !*path) return;
+
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.json", getpid());
+    file_ = std::string(path) + "/" + name + suffix;
+  } else {
+    file_ = path;
+  }
+
+  tid_ = syscall(SYS_gettid);
+  events_.reserve(256);
+  current_ = this;
+}
+
+Trace::~Trace()
+{
+  if (file_.empty()) return;
+  if (current_ == this) current_ = 0;
+
+  if (!write()) log_error(errno, "%s write trace %s error", name_.c_str(), file_.c_str());
+}
+
+int64_t Trace::nowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void Trace::span(const char *name, int64_t begin, int64_t end, const char *argName, long arg)
+{
+  if (file_.empty()) return;
+  if (events_.size() >= TRACE_EVENT_MAX) {
+    ++dropped_;
+    return;
+  }
+
+  Event event;
+  event.name    = name;
+  event.begin   = begin;
+  event.dur     = end - begin;
+  event.argName = argName;
+  event.arg     = arg;
+  events_.push_back(event);
+}
+
+/* the name and the id are from the config, the span names are literals */
+inline void writeString(FILE *fp, const std::string &value)
+{
+  fputc('"', fp);
+  for (size_t i = 0; i < value.size(); ++i) {
+    unsigned char c = value[i];
+    if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+    else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+    else fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+bool Trace::write() const
+{
+  FILE *fp = fopen(file_.c_str(), "w");
+  if (!fp) return false;
+
+  int pid = getpid();
+  fprintf(fp, "{\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, tid_);
+  writeString(fp, "dcron " + name_);
+  fprintf(fp, "}}");
+
+  for (size_t i = 0; i < events_.size(); ++i) {
+    const Event &event = events_[i];
+    fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"dcron\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+            event.name, (long long) event.begin, (long long) event.dur, pid, tid_);
+    if (event.argName) fprintf(fp, ",\"args\":{\"%s\":%ld}", event.argName, event.arg);
+    fputc('}', fp);
+  }
+
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"task\":");
+  writeString(fp, name_);
+  fprintf(fp, ",\"id\":");
+  writeString(fp, id_);
+  fprintf(fp, ",\"dropped\":%lu}}\n", (unsigned long) dropped_);
+
+  bool ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = false;
+  return ok;
+}
@@ -0,0 +1,75 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* the spans of one run in chrome trace-event json, DCRON_TRACE
+ *
+ * a span is appended to a buffer in memory when it ends, nothing is
+ * formatted or written until the Trace is destroyed at the end of the
+ * run. the names are string literals, only the pointer is kept. the
+ * buffer holds TRACE_EVENT_MAX spans, later ones are counted as dropped
+ *
+ * the spans are of the thread of the Trace, found by current() as the
+ * Metrics, the completions on the zookeeper thread are not traced.
+ * open the file in chrome://tracing or https://ui.perfetto.dev
+ */
+class Trace {
+public:
+  /* path is a file, or a directory for <name>.<pid>.json, 0 traces nothing */
+  Trace(const char *path, const char *name, const char *id);
+  ~Trace();   // writes the file
+
+  static int64_t nowUs();   // CLOCK_REALTIME, the times of the log
+
+  static Trace *current() { return current_; }
+
+  /* nothing without a path */
+  void span(const char *name, int64_t begin, int64_t end, const char *argName = 0, long arg = 0);
+
+private:
+  struct Event {
+    const char *name;
+    int64_t     begin;
+    int64_t     dur;
+    const char *argName;
+    long        arg;
+  };
+
+  bool write() const;
+
+  Trace(const Trace &);
+  Trace &operator=(const Trace &);
+
+  std::string file_;
+  std::string name_;
+  std::string id_;
+  pid_t       tid_;
+  std::vector<Event> events_;
+  size_t      dropped_;
+
+  static __thread Trace *current_;
+};
+
+/* a span from here to the end of the scope, nothing without a Trace */
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name)
+    : trace_(Trace::current()), name_(name), begin_(trace_ ? Trace::nowUs() : 0), argName_(0), arg_(0) {}
+  ~TraceSpan() { if (trace_) trace_->span(name_, begin_, Trace::nowUs(), argName_, arg_); }
+
+  /* one number shown with the span */
+  void arg(const char *name, long value) { argName_ = name; arg_ = value; }
+
+private:
+  Trace      *trace_;
+  const char *name_;
+  int64_t     begin_;
+  const char *argName_;
+  long        arg_;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <zookeeper/zookeeper.h>
+
+#include "logger.h"
+#include "zkfault.h"
+
+#define ERRBUF_MAX 1024
+
+enum Latency { LATENCY_NONE, LATENCY_FIXED, LATENCY_UNIFORM, LATENCY_EXP };
+
+/* written once by configure before any session */
+static Latency LATENCY      = LATENCY_NONE;
+static double  LATENCY_LOW  = 0;   // ms, the mean of LATENCY_EXP
+static double  LATENCY_HIGH = 0;
+static double  LOSS         = 0;
+static double  EXPIRE       = 0;
+static double  DROP_WATCH   = 0;
+static unsigned SEED        = 0;
+
+bool   ZkFault::enabled_ = false;
+void (*ZkFault::expire_)() = 0;
+
+inline bool parseProbability(const std::string &value, double *p)
+{
+  char *endptr;
+  *p = strtod(value.c_str(), &endptr);
+  return !value.empty() && *endptr == '\0' && *p >= 0 && *p <= 1;
+}
+
+static bool parseLatency(const std::string &value)
+{
+  char *endptr;
+  if (value.compare(0, 4, "exp:") == 0) {
+    LATENCY = LATENCY_EXP;
+    LATENCY_LOW = strtod(value.c_str() + 4, &endptr);
+  } else {
+    LATENCY_LOW = strtod(value.c_str(), &endptr);
+    if (*endptr == '-') {
+      LATENCY = LATENCY_UNIFORM;
+      LATENCY_HIGH = strtod(endptr + 1, &endptr);
+      if (LATENCY_HIGH < LATENCY_LOW) return false;
+    } else {
+      LATENCY = LATENCY_FIXED;
+    }
+  }
+  return *endptr == '\0' && LATENCY_LOW >= 0;
+}
+
+bool ZkFault::configure(const char *spec, char *errbuf)
+{
+  std::string s(spec);
+  for (size_t pos = 0; pos < s.size(); /**/) {
+    size_t comma = s.find(',', pos);
+    if (comma == std::string::npos) comma = s.size();
+    std::string item = s.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    size_t eq = item.find('=');
+    std::string key = item.substr(0, eq);
+    std::string value = eq == std::string::npos ? std::string() : item.substr(eq + 1);
+
+    bool ok;
+    if (key == "latency") {
+      ok = parseLatency(value);
+    } else if (key == "loss") {
+      ok = parseProbability(value, &LOSS);
+    } else if (key == "expire") {
+      ok = parseProbability(value, &EXPIRE);
+    } else if (key == "dropwatch") {
+      ok = parseProbability(value, &DROP_WATCH);
+    } else if (key == "seed") {
+      char *endptr;
+      SEED = strtoul(value.c_str(), &endptr, 10);
+      ok = !value.empty() && *endptr == '\0';
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      snprintf(errbuf, ERRBUF_MAX, "DCRON_ZKFAULT %s is invalid", item.c_str());
+      return false;
+    }
+  }
+
+  if (SEED == 0) SEED = time(0) ^ getpid();
+  enabled_ = LATENCY != LATENCY_NONE || LOSS > 0 || EXPIRE > 0 || DROP_WATCH > 0;
+  return true;
+}
+
+/* every thread draws from its own sequence, the seed makes a run repeatable */
+double ZkFault::random()
+{
+  static unsigned threads = 0;
+  static __thread unsigned state = 0;
+  if (state == 0) state = SEED + __sync_add_and_fetch(&threads, 1) * 7919;
+  return rand_r(&state) / (RAND_MAX + 1.0);
+}
+
+int ZkFault::inject()
+{
+  double milli = 0;
+  if (LATENCY == LATENCY_FIXED) milli = LATENCY_LOW;
+  else if (LATENCY == LATENCY_UNIFORM) milli = LATENCY_LOW + (LATENCY_HIGH - LATENCY_LOW) * random();
+  else if (LATENCY == LATENCY_EXP) milli = -LATENCY_LOW * log(1 - random());
+
+  if (milli > 0) {
+    struct timespec spec = { (time_t) (milli / 1000), (long) (fmod(milli, 1000) * 1000 * 1000) };
+    while (nanosleep(&spec, &spec) == -1 && errno == EINTR);
+  }
+
+  if (EXPIRE > 0 && random() < EXPIRE) {
+    log_error(0, "zkfault expire the sessions");
+    if (expire_) expire_();
+    return ZCONNECTIONLOSS;
+  }
+  if (LOSS > 0 && random() < LOSS) return ZCONNECTIONLOSS;
+  return 0;
+}
+
+bool ZkFault::dropWatch()
+{
+  if (!enabled_ || DROP_WATCH <= 0 || random() >= DROP_WATCH) return false;
+
+  log_error(0, "zkfault drop a watch event");
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _ZKFAULT_H_
+#define _ZKFAULT_H_
+
+/* faults injected under every zoo_* call of the process, DCRON_ZKFAULT
+ *
+ *   latency=5           ms before every call
+ *   latency=1-20        uniform between 1 and 20 ms
+ *   latency=exp:5       exponential with a mean of 5 ms
+ *   loss=0.01           a call fails with ZCONNECTIONLOSS, it is not sent
+ *   expire=0.001        a call expires the sessions of the process, like
+ *                       a partition longer than the session timeout
+ *   dropwatch=0.1       a node event of a watch is lost
+ *   seed=7
+ *
+ * the items are separated by ',', a probability is of one call. nothing
+ * is injected without DCRON_ZKFAULT, the cost is a load of enabled()
+ *
+ * the synchronous calls are faulted by ZK_TIMED, the requests of
+ * ZkPipeline by ZK_FAULTED, the watchers of ZkMgr ask dropWatch()
+ */
+class ZkFault {
+public:
+  static bool configure(const char *spec, char *errbuf);
+  static bool enabled() { return enabled_; }
+
+  /* sleeps the latency, returns 0 or the rc of the call not sent */
+  static int inject();
+
+  /* true if the event must not be delivered */
+  static bool dropWatch();
+
+  /* expires the sessions of the process, set by ZkSession */
+  static void setExpire(void (*expire)()) { expire_ = expire; }
+
+private:
+  static double random();
+
+  static bool   enabled_;
+  static void (*expire_)();
+};
+
+/* the value of a zoo_* call, or the fault injected in its place */
+#define ZK_FAULTED(call) ({                                    \
+  int zkFault__ = ZkFault::enabled() ? ZkFault::inject() : 0;  \
+  zkFault__ != 0 ? zkFault__ : (call);                         \
+})
+
+#endif
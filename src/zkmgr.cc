@@ -1,34 +1,70 @@
 #include <cstdio>
 #include <cstring>
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <dirent.h>
 #include <sys/types.h>
-#include <grp.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include <json/json.h>
 
 #include "logger.h"
 #include "zkmgr.h"
+#include "zktxn.h"
+#include "zkpipeline.h"
+#include "checkpoint.h"
+#include "affinity.h"
+#include "reaper.h"
+#include "zkfault.h"
 
 #define ERRBUF_MAX      1024
 #define ZKRETRY_MAX     100
 #define ZKRETRY_SLEEP   500  // ms
-#define RENV_ITEM_MAX   5
 #define RENV_BUFFER_LEN PIPE_BUF * 6
-
-
-extern char **environ;
-static std::string ENV_STICK;
-#define dump_stick(id) ENV_STICK.assign("DCRON_TEST_STICK=").append((id))
-
-static pthread_mutex_t PTHREAD_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  PTHREAD_COND  = PTHREAD_COND_INITIALIZER;
-
-inline void millisleep(int milli)
+#define EPOLL_EVENT_MAX 8
+#define SIGCHLD_TIMEOUT 1000 // ms, shared signalfd may miss a wakeup
+#define FIFO_PIPE_SIZE  (1024 * 1024)
+#define LEASE_POLL_MIN     10 // ms, DCRON_FAST_FAILOVER
+
+#ifndef __NR_pidfd_open
+# define __NR_pidfd_open 434
+#endif
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC       0x0001U
+# define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+# define F_ADD_SEALS   1033
+# define F_SEAL_SEAL   0x0001
+# define F_SEAL_SHRINK 0x0002
+# define F_SEAL_GROW   0x0004
+#endif
+
+
+#define dump_stick(mgr, id) (mgr)->envStick_.assign("DCRON_TEST_STICK=").append((id))
+
+/* ZkMgr alive, indexed by serial_, guarded by LIVE_MUTEX */
+static pthread_mutex_t LIVE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static std::map<long, ZkMgr *> LIVE_MGRS;
+static long LIVE_SERIAL = 0;
+
+inline void millisleep(long milli)
 {
-  struct timespec spec = { 0, milli * 1000 * 1000 };
+  TraceSpan span("millisleep");
+  span.arg("ms", milli);
+  struct timespec spec = { milli / 1000, (milli % 1000) * 1000 * 1000 };
   nanosleep(&spec, 0);
 }
 
@@ -52,7 +88,7 @@ static struct ACL_vector ZOO_DCRON_ALL_ACL = {1, _DCRON_ALL_ACL};
 inline bool createNodeIfNotExist(zhandle_t *zh, const char *node, char *errbuf)
 {
   for (int i = 0; /**/; /**/) {
-    int rc = zoo_create(zh, node, 0, -1, &ZOO_DCRON_ALL_ACL, 0, 0, 0);
+    int rc = ZK_TIMED(OP_CREATE, zoo_create(zh, node, 0, -1, &ZOO_DCRON_ALL_ACL, 0, 0, 0));
     if (rc == ZOK || rc == ZNODEEXISTS) {
       return true;
     } else if (rc != ZCONNECTIONLOSS) {
@@ -64,39 +100,6 @@ inline bool createNodeIfNotExist(zhandle_t *zh, const char *node, char *errbuf)
   return false;
 }
 
-static bool createStickFile(const std::string &libdir, const char *name)
-{
-  const char *dot = strrchr(name, '.');
-  if (!dot) return false;
-
-  std::string stickFile = libdir + "/" + std::string(name, dot - name) + ".stick";
-  FILE *fp = fopen(stickFile.c_str(), "w");
-  if (!fp) return false;
-
-  fprintf(fp, "%ld", (long) time(0));
-  fclose(fp);
-  return true;
-}
-
-static bool getStickFile(const std::string &libdir, const char *name, int stick)
-{
-  const char *dot = strrchr(name, '.');
-  assert(dot);
-
-  std::string stickFile = libdir + "/" + std::string(name, dot - name) + ".stick";
-  FILE *fp = fopen(stickFile.c_str(), "r");
-  if (!fp) return false;
-
-  bool rc = false;
-  long lastExecTime = 0;
-  if (fscanf(fp, "%ld", &lastExecTime) == 1 && time(0) - lastExecTime < stick) {
-    rc = true;
-  }
-  fclose(fp);
-  unlink(stickFile.c_str());
-  return rc;
-}
-
 const char *ZkMgr::statusToString(NodeStatus status)
 {
   switch (status) {
@@ -113,11 +116,12 @@ const char *ZkMgr::statusToString(NodeStatus status)
 /* x.y.<taskid> -> /x/y/<taskid>
  * - /x/y/llap  persistent data across sessions
  * - <taskid>/master   EPHEMERAL
- * - <taskid>/workers
- * - <taskid>/status
+ * - <taskid>/workers/<id>-<seq> EPHEMERAL|SEQUENCE
+ * - <taskid>/candidates/<score>-<id> EPHEMERAL
+ * - <taskid>/status   empty until the task is done
  * - <taskid>/result   ZOO_SEQUENCE
  */
-bool ZkMgr::createWorkDir(char *errbuf)
+void ZkMgr::workDirPaths()
 {
   taskPath_.assign(1, '/');
   for (const char *ptr = cnf_->name(); *ptr; ++ptr) {
@@ -125,127 +129,459 @@ bool ZkMgr::createWorkDir(char *errbuf)
     else taskPath_.append(1, *ptr);
   }
 
-  for (size_t i = 2; i < taskPath_.size(); ++i) {
-    if (taskPath_[i] != '/') continue;
-
-    taskPath_[i] = '\0';
-    bool rc = createNodeIfNotExist(zh_, taskPath_.data(), errbuf);
-    taskPath_[i] = '/';
-
-    if (!rc) return rc;
-  }
-
-  bool rc = createNodeIfNotExist(zh_, taskPath_.data(), errbuf);
-  if (!rc) return rc;
-
   masterNode_  = taskPath_ + "/master";
   workersNode_ = taskPath_ + "/workers";
   statusNode_  = taskPath_ + "/status";
   resultNode_  = taskPath_ + "/result";
+  candidatesNode_ = taskPath_ + "/candidates";
 
   size_t slash = taskPath_.rfind('/');
   assert(slash != 1 && slash != std::string::npos);
 
-  llapNode_ = taskPath_.substr(0, slash) + "/llap";
-
-  if (!createNodeIfNotExist(zh_, workersNode_.c_str(), errbuf)) return false;
-  if (!createNodeIfNotExist(zh_, llapNode_.c_str(), errbuf)) return false;
-  return true;
+  llapNode_     = taskPath_.substr(0, slash) + "/llap";
+  affinityNode_ = taskPath_.substr(0, slash) + "/affinity";
 }
 
-ZkMgr::NodeStatus ZkMgr::joinWorkers(bool master, char *errbuf)
+bool ZkMgr::createWorkDir(char *errbuf)
 {
-  char buffer[1024];
-  struct Stat stat;
+  TraceSpan span("createWorkDir");
+  size_t slash = taskPath_.rfind('/');
+
+  /* the taskid dir is created at once by the first node, status is empty
+   * until the task is done. the parents are created only the first time
+   * the task runs
+   */
+  ZkTxn txn(zh_, &ZOO_DCRON_ALL_ACL);
+  txn.create(taskPath_).create(workersNode_).create(candidatesNode_).create(statusNode_);
 
+  bool parents = false;
   for (int i = 0; /**/; /**/) {
-    do {
-      int bufferLen = 1024;
-      int rc = zoo_get(zh_, workersNode_.c_str(), 0, buffer, &bufferLen, &stat);
-      if (rc == ZCONNECTIONLOSS) break;
+    int rc = txn.commit();
+    if (rc == ZOK || (rc == ZNODEEXISTS && txn.failed() == 0)) {
+      return true;
+    } else if (rc == ZNONODE && txn.failed() == 0 && !parents) {
+      for (size_t j = 2; j < slash; ++j) {
+        if (taskPath_[j] != '/') continue;
+        if (!createNodeIfNotExist(zh_, taskPath_.substr(0, j).c_str(), errbuf)) return false;
+      }
+      if (!createNodeIfNotExist(zh_, taskPath_.substr(0, slash).c_str(), errbuf)) return false;
+      if (!createNodeIfNotExist(zh_, llapNode_.c_str(), errbuf)) return false;
+      parents = true;
+      continue;
+    } else if (rc == ZCONNECTIONLOSS) {
+      if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+      else return false;
+      continue;
+    }
 
-      if (rc != ZOK) {
-        if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_get %s error, %s", workersNode_.c_str(), zerror(rc));
-        else log_fatal(0, "zoo_get %s error, %s", workersNode_.c_str(), zerror(rc));
+    snprintf(errbuf, ERRBUF_MAX, "zoo_multi %s error, %s", taskPath_.c_str(), zerror(rc));
+    return false;
+  }
+}
 
-        return ZKFATAL;
-      }
+struct Capacity {
+  double load;      // 1 minute load average per cpu
+  int    freemem;   // available memory in percent
+  int    running;   // dcron tasks running on this host
 
-      Json::Value array;
-      if (bufferLen <= 0) {
-        array = Json::Value(Json::arrayValue);
-      } else {
-        Json::Reader reader;
-        if (!reader.parse(buffer, buffer + bufferLen, array)) {
-          if (errbuf) snprintf(errbuf, ERRBUF_MAX, "%s content %s error", workersNode_.c_str(), buffer);
-          else log_fatal(0, "%s content %s error", workersNode_.c_str(), buffer);
+  /* lower is better, fits in the %010ld candidate name */
+  long score() const {
+    long s = (long) (load * 1000) + running * 100 + (100 - freemem) * 10;
+    if (s < AFFINITY_HOSTS) s = AFFINITY_HOSTS;  // the ranks of DCRON_STICK go first
+    return s > 999999999L ? 999999999L : s;
+  }
+};
 
-          return ZKFATAL;
-        }
-      }
+/* every running task owns a fifo in libdir */
+static int runningTasks(const std::string &libdir)
+{
+  DIR *dir = opendir(libdir.c_str());
+  if (!dir) return 0;
+
+  int n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    size_t len = strlen(ent->d_name);
+    if (len > 5 && strcmp(ent->d_name + len - 5, ".fifo") == 0) ++n;
+  }
+  closedir(dir);
+  return n;
+}
 
-      if (!master && array.size() >= cnf_->maxRetry()) return OUT;
-      array.append(cnf_->id());
+static int availableMemory()
+{
+  FILE *fp = fopen("/proc/meminfo", "r");
+  if (!fp) return 100;
+
+  long total = 0, avail = -1;
+  char line[128];
+  while (fgets(line, 128, fp)) {
+    sscanf(line, "MemTotal: %ld kB", &total);
+    sscanf(line, "MemAvailable: %ld kB", &avail);
+  }
+  fclose(fp);
 
-      std::string json = Json::FastWriter().write(array);
-      if (json[json.size()-1] == '\n') json.resize(json.size()-1);
+  if (total <= 0 || avail < 0) return 100;
+  return (int) (avail * 100 / total);
+}
 
-      if (errbuf) fprintf(stderr, "zoo_set workers %s %s\n", workersNode_.c_str(), json.c_str());
-      else log_info(0, "zoo_set workers %s %s", workersNode_.c_str(), json.c_str());
+static void getCapacity(const std::string &libdir, Capacity *cap)
+{
+  double load[1];
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (getloadavg(load, 1) != 1) load[0] = 0;
 
-      rc = zoo_set(zh_, workersNode_.c_str(), json.c_str(), json.size(), stat.version);
-      if (rc == ZOK) {
-        return master ? MASTER : SLAVE;
-      } else if (rc == ZCONNECTIONLOSS) {
-        break;
-      } else if (rc != ZBADVERSION) {
-        if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_set %s error, %s", workersNode_.c_str(), zerror(rc));
-        else log_fatal(0, "zoo_set %s error, %s", workersNode_.c_str(), zerror(rc));
+  cap->load    = load[0] / (ncpu > 0 ? ncpu : 1);
+  cap->freemem = availableMemory();
+  cap->running = runningTasks(libdir);
+}
 
-        return ZKFATAL;
+/* the candidate name starts with the score, so one zoo_get_children
+ * ranks all candidates, the hosts of the affinity score their rank
+ */
+std::string ZkMgr::capacity(int rank)
+{
+  Capacity cap;
+  getCapacity(cnf_->libdir(), &cap);
+
+  long score = rank >= 0 ? rank : cap.score();
+  char name[32];
+  snprintf(name, 32, "/%010ld-", score);
+  candidateNode_ = candidatesNode_ + name + cnf_->id();
+
+  Json::Value obj(Json::objectValue);
+  obj["id"]      = cnf_->id();
+  obj["load"]    = cap.load;
+  obj["freemem"] = cap.freemem;
+  obj["running"] = cap.running;
+  obj["score"]   = (int) score;
+
+  std::string json = Json::FastWriter().write(obj);
+  if (json[json.size()-1] == '\n') json.resize(json.size()-1);
+  return json;
+}
+
+/* the rank of this host in the affinity of the task within DCRON_STICK,
+ * the other hosts keep the candidate node the last runner will publish
+ */
+int ZkMgr::affinityRank()
+{
+  Affinity affinity(zh_, &ZOO_DCRON_ALL_ACL, affinityNode_);
+  if (!affinity.load()) return -1;
+
+  int rank = affinity.rank(cnf_->id(), cnf_->stick());
+  if (rank != 0 && affinity.rank(affinity.last().c_str(), cnf_->stick()) == 0) {
+    lastRunner_ = candidatesNode_ + "/0000000000-" + affinity.last();
+  }
+  return rank;
+}
+
+bool ZkMgr::publishCapacity(int rank, char *errbuf)
+{
+  TraceSpan span("publishCapacity");
+  std::string json = capacity(rank);
+  for (int i = 0; /**/; /**/) {
+    int rc = ZK_TIMED(OP_CREATE, zoo_create(zh_, candidateNode_.c_str(), json.c_str(), json.size(),
+                                            &ZOO_DCRON_ALL_ACL, ZOO_EPHEMERAL, 0, 0));
+    if (rc == ZOK || rc == ZNODEEXISTS) {
+      return true;
+    } else if (rc != ZCONNECTIONLOSS) {
+      snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", candidateNode_.c_str(), zerror(rc));
+      return false;
+    }
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  }
+  return false;
+}
+
+bool ZkMgr::bestCandidate(std::string *best, char *errbuf, bool watch)
+{
+  TraceSpan span("bestCandidate");
+  for (int i = 0; /**/; /**/) {
+    struct String_vector children;
+    int rc = watch ? ZK_TIMED(OP_CHILDREN, zoo_wget_children(zh_, candidatesNode_.c_str(), watchElection,
+                                                             (void *) serial_, &children))
+                   : ZK_TIMED(OP_CHILDREN, zoo_get_children(zh_, candidatesNode_.c_str(), 0, &children));
+    if (rc == ZOK) {
+      const char *min = 0;
+      for (int j = 0; j < children.count; ++j) {
+        if (!min || strcmp(children.data[j], min) < 0) min = children.data[j];
       }
-    } while (true);
+      if (min) best->assign(candidatesNode_).append(1, '/').append(min);
+      else best->assign(candidateNode_);
 
+      deallocate_String_vector(&children);
+      return true;
+    } else if (rc != ZCONNECTIONLOSS) {
+      snprintf(errbuf, ERRBUF_MAX, "zoo_get_children %s error, %s", candidatesNode_.c_str(), zerror(rc));
+      return false;
+    }
     if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
   }
-  return ZKFATAL;
+  return false;
+}
+
+/* the hosts of one minute publish their candidates some ms apart, the
+ * first to arrive must not win before a better one is there. the list is
+ * ranked once no candidate came for a tenth of DCRON_ELECT_WAIT, or
+ * DCRON_ELECT_WAIT passed, or master is created, or the last runner of
+ * DCRON_STICK is the best, none can be better
+ */
+bool ZkMgr::collectCandidates(std::string *best, char *errbuf)
+{
+  TraceSpan span("collectCandidates");
+  int settle = cnf_->electWait() / 10;
+  if (settle == 0) return bestCandidate(best, errbuf);
+
+  int64_t deadline = Metrics::nowUs() + cnf_->electWait() * 1000LL;
+  int rounds = 0;
+  for (;;) {
+    electWake_ = false;
+    if (!bestCandidate(best, errbuf, true)) return false;
+    ++rounds;
+
+    int rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, masterNode_.c_str(), watchElection, (void *) serial_, 0));
+    int64_t left = (deadline - Metrics::nowUs()) / 1000;
+    if (rc == ZOK || *best == lastRunner_ || left <= 0 || !waitWake(std::min((int64_t) settle, left))) break;
+  }
+
+  log_info(0, "%s %s collect candidates %s after %d lists", cnf_->id(), cnf_->name(), best->c_str(), rounds);
+  return true;
+}
+
+/* returns with LIVE_MUTEX held if the ZkMgr is still alive */
+ZkMgr *ZkMgr::acquire(void *watcherCtx)
+{
+  pthread_mutex_lock(&LIVE_MUTEX);
+  std::map<long, ZkMgr *>::iterator pos = LIVE_MGRS.find((long) watcherCtx);
+  if (pos != LIVE_MGRS.end()) return pos->second;
+
+  pthread_mutex_unlock(&LIVE_MUTEX);
+  return 0;
+}
+
+void ZkMgr::unacquire()
+{
+  pthread_mutex_unlock(&LIVE_MUTEX);
+}
+
+void ZkMgr::watchElection(zhandle_t *, int type, int, const char *, void *watcherCtx)
+{
+  if (type != ZOO_SESSION_EVENT && ZkFault::dropWatch()) return;
+
+  ZkMgr *mgr = acquire(watcherCtx);
+  if (!mgr) return;
+
+  pthread_mutex_lock(&mgr->mutex_);
+  mgr->electWake_ = true;
+  pthread_mutex_unlock(&mgr->mutex_);
+
+  pthread_cond_signal(&mgr->cond_);
+  unacquire();
+}
+
+/* give the best candidate a chance to become master, wake up when the
+ * master is created, the best candidate goes away or DCRON_ELECT_WAIT passes
+ */
+void ZkMgr::waitElection(const std::string &best)
+{
+  TraceSpan span("waitElection");
+  electWake_ = false;
+
+  int rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, masterNode_.c_str(), watchElection, (void *) serial_, 0));
+  if (rc != ZNONODE) return;
+
+  rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, best.c_str(), watchElection, (void *) serial_, 0));
+  if (rc == ZOK) waitElectionWake(best);
+}
+
+/* the last runner may start later than us, it has DCRON_ELECT_WAIT to
+ * publish its candidate or to win master before the candidates are ranked
+ */
+void ZkMgr::waitAffinity()
+{
+  TraceSpan span("waitAffinity");
+  electWake_ = false;
+
+  int rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, masterNode_.c_str(), watchElection, (void *) serial_, 0));
+  if (rc != ZNONODE) return;
+
+  rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, lastRunner_.c_str(), watchElection, (void *) serial_, 0));
+  if (rc == ZNONODE) waitElectionWake(lastRunner_);
+}
+
+void ZkMgr::waitElectionWake(const std::string &best)
+{
+  bool wake = waitWake(cnf_->electWait());
+  log_info(0, "%s %s wait election %s %s", cnf_->id(), cnf_->name(), best.c_str(), wake ? "wake up" : "timeout");
+}
+
+/* true if watchElection fired within milli */
+bool ZkMgr::waitWake(int milli)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec  += milli / 1000;
+  deadline.tv_nsec += (milli % 1000) * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+    deadline.tv_sec  += 1;
+    deadline.tv_nsec -= 1000 * 1000 * 1000;
+  }
+
+  pthread_mutex_lock(&mutex_);
+  while (!electWake_) {
+    if (pthread_cond_timedwait(&cond_, &mutex_, &deadline) == ETIMEDOUT) break;
+  }
+  bool wake = electWake_;
+  pthread_mutex_unlock(&mutex_);
+  return wake;
+}
+
+/* <id>-<seq> -> seq, -1 if the child is not created by id */
+static long workerSeq(const char *child, const char *id)
+{
+  size_t len = strlen(id);
+  if (strncmp(child, id, len) != 0 || child[len] != '-') return -1;
+
+  const char *ptr = child + len + 1;
+  if (strlen(ptr) != 10 || strspn(ptr, "0123456789") != 10) return -1;
+  return atol(ptr);
+}
+
+/* the sequence of any worker, -1 if child is not one */
+static long childSeq(const std::string &child)
+{
+  size_t dash = child.rfind('-');
+  if (dash == std::string::npos || child.size() - dash != 11) return -1;
+  if (child.find_first_not_of("0123456789", dash + 1) != std::string::npos) return -1;
+  return atol(child.c_str() + dash + 1);
+}
+
+/* a connection loss may hide a successful create, look for our child */
+static int findWorker(zhandle_t *zh, const std::string &workersNode, const char *id, std::string *workerNode)
+{
+  struct String_vector children;
+  int rc = ZK_TIMED(OP_CHILDREN, zoo_get_children(zh, workersNode.c_str(), 0, &children));
+  if (rc != ZOK) return rc;
+
+  workerNode->clear();
+  for (int i = 0; i < children.count; ++i) {
+    if (workerSeq(children.data[i], id) != -1) {
+      workerNode->assign(workersNode).append(1, '/').append(children.data[i]);
+      break;
+    }
+  }
+
+  deallocate_String_vector(&children);
+  return ZOK;
+}
+
+long ZkMgr::joinedWorkers(const std::string &workerNode)
+{
+  workerNode_ = workerNode;
+  long seq = workerSeq(workerNode_.c_str() + workersNode_.size() + 1, cnf_->id());
+
+  log_info(0, "join workers %s seq %ld", workerNode_.c_str(), seq);
+  return seq;
+}
+
+/* every worker creates <taskid>/workers/<id>-<seq> EPHEMERAL|SEQUENCE, one
+ * round trip without contention. the master always joins, a slave joins
+ * only if less than DCRON_MAXRETRY live workers are before it
+ */
+ZkMgr::NodeStatus ZkMgr::joinWorkers(bool master, char *errbuf)
+{
+  TraceSpan span("joinWorkers");
+  MetricsTimer timer(metrics_.phase(Metrics::JOIN));
+  std::string prefix = workersNode_ + "/" + cnf_->id() + "-";
+  char path[1024];
+
+  for (int i = 0; /**/; /**/) {
+    int rc = ZK_TIMED(OP_CREATE, zoo_create(zh_, prefix.c_str(), cnf_->id(), strlen(cnf_->id()), &ZOO_DCRON_ALL_ACL,
+                                            ZOO_EPHEMERAL | ZOO_SEQUENCE, path, sizeof(path)));
+    if (rc == ZOK) {
+      workerNode_ = path;
+      break;
+    } else if (rc == ZCONNECTIONLOSS) {
+      if (findWorker(zh_, workersNode_, cnf_->id(), &workerNode_) == ZOK && !workerNode_.empty()) break;
+    } else {
+      if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", prefix.c_str(), zerror(rc));
+      else log_fatal(0, "zoo_create %s error, %s", prefix.c_str(), zerror(rc));
+
+      return ZKFATAL;
+    }
+
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+    else return ZKFATAL;
+  }
+
+  joinedWorkers(workerNode_);
+  return master ? MASTER : admitWorker(0, errbuf);
+}
+
+/* the sequence is the cversion of workers, a delete bumps it too, so it
+ * is not the number of workers before us. the rank among the children
+ * is, a crashed worker or an OUT one that left does not count
+ */
+ZkMgr::NodeStatus ZkMgr::admitWorker(const std::vector<std::string> *workers, char *errbuf)
+{
+  std::vector<std::string> children;
+  if (workers) {
+    children = *workers;
+  } else {
+    NodeStatus status = listWorkers(&children, errbuf);
+    if (status != ZKOK) return status;
+  }
+
+  long seq = childSeq(workerNode_);
+  size_t rank = 0;
+  for (std::vector<std::string>::iterator ite = children.begin(); ite != children.end(); ++ite) {
+    long n = childSeq(*ite);
+    if (n != -1 && n < seq) ++rank;
+  }
+
+  if (rank >= cnf_->maxRetry()) {
+    log_info(0, "join workers %s rank %d, out", workerNode_.c_str(), (int) rank);
+    ZK_TIMED(OP_DELETE, zoo_delete(zh_, workerNode_.c_str(), -1));
+    workerNode_.clear();
+    return OUT;
+  }
+  return SLAVE;
 }
 
 ZkMgr::NodeStatus ZkMgr::competeMaster(bool first, char *errbuf)
 {
+  TraceSpan span("competeMaster");
+  /* the first time, master and worker are created in one zoo_multi */
+  ZkTxn txn(zh_, &ZOO_DCRON_ALL_ACL);
+  txn.create(masterNode_, cnf_->id(), ZOO_EPHEMERAL);
+  if (first) txn.create(workersNode_ + "/" + cnf_->id() + "-", cnf_->id(), ZOO_EPHEMERAL | ZOO_SEQUENCE);
+
   do {
     int rc;
     if (cnf_->testConnectionLossWhenCompeteMasterFailure()) {
       rc = ZCONNECTIONLOSS;
     } else {
-      rc = zoo_create(zh_, masterNode_.c_str(), cnf_->id(), strlen(cnf_->id()), &ZOO_DCRON_ALL_ACL,
-                      ZOO_EPHEMERAL, 0, 0);
+      rc = txn.commit();
+      if (rc != ZOK && rc != ZCONNECTIONLOSS && txn.failed() != 0) {
+        /* -1 if the batch was not applied at all, an expired session */
+        const std::string &path = txn.path(txn.failed() == -1 ? 0 : txn.failed());
+        if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_multi %s error, %s", path.c_str(), zerror(rc));
+        else log_fatal(0, "zoo_multi %s error, %s", path.c_str(), zerror(rc));
+
+        return ZKFATAL;
+      }
+      if (rc == ZOK && first) joinedWorkers(txn.created(1));
       if (cnf_->testConnectionLossWhenCompeteMasterSuccess()) rc = ZCONNECTIONLOSS;
     }
 
     if (rc == ZOK) {
-      return first ? joinWorkers(true, errbuf) : MASTER;
+      return MASTER;
     } else if (rc == ZNODEEXISTS) {
       return first ? joinWorkers(false, errbuf) : SLAVE;
     } else if (rc == ZCONNECTIONLOSS) {
-      int bufferLen = RENV_BUFFER_LEN;
-      std::auto_ptr<char> buffer(new char[RENV_BUFFER_LEN]);
-
-      for (int i = 0; /**/; /**/) {
-        rc = zoo_get(zh_, masterNode_.c_str(), 0, buffer.get(), &bufferLen, 0);
-        if (rc == ZOK) {
-          if (strncmp(buffer.get(), cnf_->id(), bufferLen) == 0) return first ? joinWorkers(true, errbuf) : MASTER;
-          else return first ? joinWorkers(false, errbuf) : SLAVE;
-        } else if (rc == ZNONODE) {
-          break;
-        } else if (rc != ZCONNECTIONLOSS) {
-          if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_get %s error, %s", masterNode_.c_str(), zerror(rc));
-          else log_fatal(0, "zoo_get %s error, %s", masterNode_.c_str(), zerror(rc));
-
-          return ZKFATAL;
-        }
-        if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
-      }
+      NodeStatus status = recoverMaster(first, errbuf);
+      if (status != ZKAGAIN) return status;
     } else {
       if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", masterNode_.c_str(), zerror(rc));
       else log_fatal(0, "zoo_create %s error, %s", masterNode_.c_str(), zerror(rc));
@@ -257,6 +593,39 @@ ZkMgr::NodeStatus ZkMgr::competeMaster(bool first, char *errbuf)
   return ZKFATAL;
 }
 
+/* the create of master may have been applied before the connection was
+ * lost, master holds our id if so. ZKAGAIN means master is not there
+ */
+ZkMgr::NodeStatus ZkMgr::recoverMaster(bool first, char *errbuf)
+{
+  TraceSpan span("recoverMaster");
+  int bufferLen = RENV_BUFFER_LEN;
+  std::auto_ptr<char> buffer(new char[RENV_BUFFER_LEN]);
+
+  for (int i = 0; /**/; /**/) {
+    int rc = ZK_TIMED(OP_GET, zoo_get(zh_, masterNode_.c_str(), 0, buffer.get(), &bufferLen, 0));
+    if (rc == ZOK) {
+      if (strncmp(buffer.get(), cnf_->id(), bufferLen) == 0) {
+        if (first && workerNode_.empty() &&
+            (findWorker(zh_, workersNode_, cnf_->id(), &workerNode_) != ZOK || workerNode_.empty())) {
+          return joinWorkers(true, errbuf);
+        }
+        return MASTER;
+      }
+      else return first ? joinWorkers(false, errbuf) : SLAVE;
+    } else if (rc == ZNONODE) {
+      return ZKAGAIN;
+    } else if (rc != ZCONNECTIONLOSS) {
+      if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_get %s error, %s", masterNode_.c_str(), zerror(rc));
+      else log_fatal(0, "zoo_get %s error, %s", masterNode_.c_str(), zerror(rc));
+
+      return ZKFATAL;
+    }
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  }
+  return ZKFATAL;
+}
+
 inline const char *zkTypeToString(int type)
 {
   if (type == ZOO_CREATED_EVENT)     return "zoo_created_event";
@@ -268,129 +637,774 @@ inline const char *zkTypeToString(int type)
   return 0;
 }
 
-inline const char *zkStateToString(int state)
-{
-  if (state == ZOO_EXPIRED_SESSION_STATE) return "zoo_expired_session_state";
-  if (state == ZOO_AUTH_FAILED_STATE)     return "zoo_auth_failed_state";
-  if (state == ZOO_CONNECTING_STATE)      return "zoo_connecting_state";
-  if (state == ZOO_ASSOCIATING_STATE)     return "zoo_associating_state";
-  if (state == ZOO_CONNECTED_STATE)       return "zoo_connected_state";
-  return 0;
-}
+inline const char *zkStateToString(int state)
+{
+  if (state == ZOO_EXPIRED_SESSION_STATE) return "zoo_expired_session_state";
+  if (state == ZOO_AUTH_FAILED_STATE)     return "zoo_auth_failed_state";
+  if (state == ZOO_CONNECTING_STATE)      return "zoo_connecting_state";
+  if (state == ZOO_ASSOCIATING_STATE)     return "zoo_associating_state";
+  if (state == ZOO_CONNECTED_STATE)       return "zoo_connected_state";
+  return 0;
+}
+
+/* watchNode_ is gone, the master node or the standby before us */
+void ZkMgr::watchMasterNode(zhandle_t *, int type, int state, const char *path, void *watcherCtx)
+{
+  if (type != ZOO_SESSION_EVENT && ZkFault::dropWatch()) return;
+
+  ZkMgr *mgr = acquire(watcherCtx);
+  if (!mgr) return;
+
+  if (type == ZOO_DELETED_EVENT || (type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE)) {
+    if (type == ZOO_DELETED_EVENT) {
+      mgr->setZkStatus(MASTER_GONE);
+    } else {
+      mgr->setZkStatus(SESSION_GONE);
+    }
+
+    pthread_cond_signal(&mgr->cond_);
+    mgr->notifyEvent();
+  } else {
+    log_error(0, "zk watch type %d, state %d, path %s", type, state, path ? path : "null");
+  }
+  unacquire();
+}
+
+/* standbys form a chain in the order of their workers, the first one
+ * watches the master node and every other one the worker before it. a
+ * lost master wakes the first standby only, a lost standby the one after
+ * it, nobody races a herd for the master node
+ */
+std::string ZkMgr::predecessor(const std::vector<std::string> &workers) const
+{
+  long seq = workerNode_.empty() ? -1 : childSeq(workerNode_);
+  long prev = -1;
+  const std::string *node = 0;
+  for (std::vector<std::string>::const_iterator ite = workers.begin(); ite != workers.end(); ++ite) {
+    long n = childSeq(*ite);
+    if (n > prev && n < seq) {
+      prev = n;
+      node = &(*ite);
+    }
+  }
+  return node ? workersNode_ + "/" + *node : masterNode_;
+}
+
+ZkMgr::NodeStatus ZkMgr::listWorkers(std::vector<std::string> *workers, char *errbuf)
+{
+  for (int i = 0; /**/; /**/) {
+    struct String_vector children;
+    int rc = ZK_TIMED(OP_CHILDREN, zoo_get_children(zh_, workersNode_.c_str(), 0, &children));
+    if (rc == ZOK) {
+      workers->assign(children.data, children.data + children.count);
+      deallocate_String_vector(&children);
+      return ZKOK;
+    } else if (rc != ZCONNECTIONLOSS) {
+      if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_get_children %s error, %s", workersNode_.c_str(), zerror(rc));
+      else log_fatal(0, "zoo_get_children %s error, %s", workersNode_.c_str(), zerror(rc));
+
+      return ZKFATAL;
+    }
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  }
+  return ZKFATAL;
+}
+
+ZkMgr::NodeStatus ZkMgr::setWatch(char *errbuf, const std::vector<std::string> *workers)
+{
+  TraceSpan span("setWatch");
+  std::vector<std::string> children;
+  if (workers) children = *workers;
+
+  for (int i = 0; /**/; /**/) {
+    if (!workers) {
+      NodeStatus status = listWorkers(&children, errbuf);
+      if (status != ZKOK) return status;
+    }
+    workers = 0;
+
+    watchNode_ = predecessor(children);
+    int rc = ZK_TIMED(OP_EXISTS, zoo_wexists(zh_, watchNode_.c_str(), watchMasterNode, (void *) serial_, 0));
+    if (rc == ZOK) {
+      return ZKOK;
+    } else if (rc == ZNONODE && watchNode_ == masterNode_) {  // master had gone before set watch
+      return ZKAGAIN;
+    } else if (rc == ZNONODE) {  // so had the standby before us, look again
+      continue;
+    } else if (rc != ZCONNECTIONLOSS) {
+      if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_wexists %s error, %s", watchNode_.c_str(), zerror(rc));
+      else log_fatal(0, "zoo_wexists %s error, %s", watchNode_.c_str(), zerror(rc));
+
+      return ZKFATAL;
+    }
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  }
+  return ZKFATAL;
+}
+
+void ZkMgr::setZkStatus(ZkStatus status)
+{
+  pthread_mutex_lock(&mutex_);
+  if (zkStatus_ != SESSION_GONE) zkStatus_ = status;
+  pthread_mutex_unlock(&mutex_);
+}
+
+/* the master node must still be ours, a lost one is taken over already */
+bool ZkMgr::fetchFencing()
+{
+  for (int i = 0; i < ZKRETRY_MAX; ++i) {
+    struct Stat stat;
+    int rc = ZK_TIMED(OP_EXISTS, zoo_exists(zh_, masterNode_.c_str(), 0, &stat));
+    if (rc == ZOK && stat.ephemeralOwner == zoo_client_id(zh_)->client_id) {
+      fencing_ = stat.czxid;
+      return true;
+    } else if (rc == ZOK || rc == ZNONODE) {
+      log_fatal(0, "%s master %s is not ours", cnf_->name(), masterNode_.c_str());
+      return false;
+    } else if (rc != ZCONNECTIONLOSS) {
+      log_fatal(0, "zoo_exists %s error, %s", masterNode_.c_str(), zerror(rc));
+      return false;
+    }
+    millisleep(ZKRETRY_SLEEP);
+  }
+  return false;
+}
+
+/* the client pings every third of the timeout, the server expires the
+ * session a timeout after the last one it saw. a master cut off for a
+ * third of the timeout has lost its master node or is about to
+ */
+bool ZkMgr::leaseExpired() const
+{
+  return session_->disconnected() >= zoo_recv_timeout(zh_) / 3;
+}
+
+void ZkMgr::sessionGone()
+{
+  setZkStatus(SESSION_GONE);
+
+  pthread_cond_signal(&cond_);
+  notifyEvent();
+}
+
+void ZkSession::globalWatcher(zhandle_t *, int type, int state, const char *path, void *watcherCtx)
+{
+  const char *typeString  = zkTypeToString(type);
+  const char *stateString = zkStateToString(state);
+
+  if (typeString && stateString) {
+    log_info(0, "globak zookeeper type %s(%d) state %s(%d) path %s",
+             typeString, type, stateString, state, path ? path : "null");
+  } else {
+    log_info(0, "globak zookeeper type %d state %d path %s", type, state, path ? path : "null");
+  }
+
+  ZkSession *session = (ZkSession *) watcherCtx;
+  if (type == ZOO_SESSION_EVENT && state == ZOO_CONNECTED_STATE) {
+    session->disconnectedAt_ = 0;
+  } else if (type == ZOO_SESSION_EVENT && (state == ZOO_CONNECTING_STATE || state == ZOO_ASSOCIATING_STATE)) {
+    if (session->disconnectedAt_ == 0) session->disconnectedAt_ = Metrics::nowUs();
+  }
+
+  if (type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE) {
+    session->expired_ = true;
+
+    pthread_mutex_lock(&LIVE_MUTEX);
+    for (std::map<long, ZkMgr *>::iterator ite = LIVE_MGRS.begin(); ite != LIVE_MGRS.end(); ++ite) {
+      if (ite->second->session_ == session) ite->second->sessionGone();
+    }
+    pthread_mutex_unlock(&LIVE_MUTEX);
+  }
+}
+
+int64_t ZkSession::disconnected() const
+{
+  int64_t at = disconnectedAt_;
+  return at ? (Metrics::nowUs() - at) / 1000 : 0;
+}
+
+inline zhandle_t *zookeeperInit(const char *zkhost, int timeout, watcher_fn fn, void *ctx)
+{
+  TraceSpan span("zookeeperInit");
+  for (int i = 0; /**/; /**/) {
+    zhandle_t *zh = zookeeper_init(zkhost, fn, timeout, 0, ctx, 0);
+    if (zh) return zh;
+    if (errno != ZCONNECTIONLOSS) return 0;
+    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  }
+  return 0;
+}
+
+inline int pidfdOpen(pid_t pid)
+{
+  return syscall(__NR_pidfd_open, pid, 0);
+}
+
+inline bool pidfdSupported()
+{
+  int fd = pidfdOpen(getpid());
+  if (fd == -1) return false;
+
+  close(fd);
+  return true;
+}
+
+/* without pidfd, SIGCHLD must be blocked before zookeeperInit, the mask is
+ * inherited by the zookeeper threads, otherwise they may consume the signal
+ */
+ZkSession *ZkSession::create(const char *zkhost, int timeout, char *errbuf)
+{
+  std::auto_ptr<ZkSession> session(new ZkSession);
+  session->zkhost_ = zkhost;
+
+  if (!pidfdSupported()) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+  }
+
+  zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+  zoo_set_log_stream(stderr);
+
+  session->zh_ = zookeeperInit(zkhost, timeout, globalWatcher, session.get());
+  if (!session->zh_) {
+    snprintf(errbuf, ERRBUF_MAX, "zk connect %s error, %s", zkhost, zerror(errno));
+    return 0;
+  }
+  ZkFault::setExpire(expireAll);
+  return session.release();
+}
+
+/* the sessions in use by a ZkMgr, a fault is injected on the thread of one */
+void ZkSession::expireAll()
+{
+  std::vector<ZkSession *> sessions;
+  pthread_mutex_lock(&LIVE_MUTEX);
+  for (std::map<long, ZkMgr *>::iterator ite = LIVE_MGRS.begin(); ite != LIVE_MGRS.end(); ++ite) {
+    ZkSession *session = ite->second->session_;
+    if (std::find(sessions.begin(), sessions.end(), session) != sessions.end()) continue;
+    session->retain();
+    sessions.push_back(session);
+  }
+  pthread_mutex_unlock(&LIVE_MUTEX);
+
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    sessions[i]->expire();
+    sessions[i]->release();
+  }
+}
+
+struct ExpireWait {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  bool            connected;
+};
+
+static void expireWatcher(zhandle_t *, int type, int state, const char *, void *watcherCtx)
+{
+  ExpireWait *wait = (ExpireWait *) watcherCtx;
+  if (type != ZOO_SESSION_EVENT || state != ZOO_CONNECTED_STATE) return;
+
+  pthread_mutex_lock(&wait->mutex);
+  wait->connected = true;
+  pthread_cond_signal(&wait->cond);
+  pthread_mutex_unlock(&wait->mutex);
+}
+
+/* a second handle joins the session and closes it, the server ends the
+ * session and our handle sees ZOO_EXPIRED_SESSION_STATE when it reconnects
+ */
+void ZkSession::expire()
+{
+  if (expired_) return;
+
+  ExpireWait wait;
+  pthread_mutex_init(&wait.mutex, 0);
+  pthread_cond_init(&wait.cond, 0);
+  wait.connected = false;
+
+  int timeout = zoo_recv_timeout(zh_);
+  zhandle_t *zh = zookeeper_init(zkhost_.c_str(), expireWatcher, timeout, zoo_client_id(zh_), &wait, 0);
+  if (zh) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000 + 1;
+
+    pthread_mutex_lock(&wait.mutex);
+    while (!wait.connected) {
+      if (pthread_cond_timedwait(&wait.cond, &wait.mutex, &deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&wait.mutex);
+
+    log_error(0, "zkfault expire zk session %s%s", zkhost_.c_str(), wait.connected ? "" : " timeout");
+    zookeeper_close(zh);
+  }
+
+  pthread_mutex_destroy(&wait.mutex);
+  pthread_cond_destroy(&wait.cond);
+}
+
+void ZkSession::retain()
+{
+  __sync_fetch_and_add(&refs_, 1);
+}
+
+void ZkSession::release()
+{
+  if (__sync_sub_and_fetch(&refs_, 1) == 0) {
+    zookeeper_close(zh_);
+    delete this;
+  }
+}
+
+bool ZkMgr::initEventLoop(char *errbuf)
+{
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ == -1) {
+    snprintf(errbuf, ERRBUF_MAX, "epoll_create error, %s", strerror(errno));
+    return false;
+  }
+
+  eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (eventFd_ == -1 || !addEvent(eventFd_)) {
+    snprintf(errbuf, ERRBUF_MAX, "eventfd error, %s", strerror(errno));
+    return false;
+  }
+
+  if (pidfdSupported()) return true;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigFd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigFd_ == -1 || !addEvent(sigFd_)) {
+    snprintf(errbuf, ERRBUF_MAX, "signalfd error, %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool ZkMgr::addEvent(int fd)
+{
+  struct epoll_event ev;
+  ev.events  = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void ZkMgr::delEvent(int fd)
+{
+  struct epoll_event ev;
+  epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/* pidfd becomes readable when the child exits, returns -1 when sigFd_ is used */
+int ZkMgr::childEventFd(pid_t pid, int pidfd)
+{
+  if (sigFd_ != -1) {
+    if (pidfd != -1) close(pidfd);
+    return -1;
+  }
+
+  int fd = pidfd != -1 ? pidfd : pidfdOpen(pid);
+  if (fd == -1) {
+    log_fatal(errno, "%s pidfd_open %d error", cnf_->name(), (int) pid);
+  } else if (!addEvent(fd)) {
+    log_fatal(errno, "%s epoll_ctl pidfd error", cnf_->name());
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+void ZkMgr::notifyEvent()
+{
+  uint64_t one = 1;
+  if (write(eventFd_, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    log_fatal(errno, "%s eventfd write error", cnf_->name());
+  }
+}
+
+inline void drainFd(int fd, size_t size)
+{
+  char buffer[sizeof(struct signalfd_siginfo) * 4];
+  while (read(fd, buffer, size) > 0);
+}
+
+ZkMgr *ZkMgr::create(ConfigOpt *cnf, ZkSession *session, char *errbuf)
+{
+  TraceSpan span("ZkMgr::create");
+  std::auto_ptr<ZkMgr> mgr(new ZkMgr);
+  Metrics::setCurrent(&mgr->metrics_);
+  MetricsTimer timer(mgr->metrics_.phase(Metrics::START));
+  mgr->cnf_ = cnf;
+  mgr->fifoFd_  = -1;
+  mgr->timerFd_ = -1;
+  mgr->flushArmed_ = false;
+  mgr->ringFd_  = -1;
+  mgr->bellFd_  = -1;
+  mgr->ring_.hdr = 0;
+  mgr->epollFd_ = -1;
+  mgr->eventFd_ = -1;
+  mgr->sigFd_   = -1;
+  mgr->status_  = ZKFATAL;
+  mgr->taskBegin_ = 0;
+  mgr->taskTraceBegin_ = 0;
+
+  mgr->zkStatus_ = MASTER_GONE;
+  mgr->electWake_ = false;
+  mgr->llapFetched_ = false;
+  mgr->checkpoint_  = 0;
+  mgr->fencing_     = 0;
+  pthread_mutex_init(&mgr->mutex_, 0);
+  pthread_cond_init(&mgr->cond_, 0);
+
+  session->retain();
+  mgr->session_ = session;
+  mgr->zh_      = session->handle();
+
+  pthread_mutex_lock(&LIVE_MUTEX);
+  mgr->serial_ = ++LIVE_SERIAL;
+  LIVE_MGRS[mgr->serial_] = mgr.get();
+  pthread_mutex_unlock(&LIVE_MUTEX);
+
+  if (!mgr->initEventLoop(errbuf)) return 0;
+
+  if (session->expired()) {
+    snprintf(errbuf, ERRBUF_MAX, "%s zk session %s expired", cnf->name(), cnf->zkhost());
+    return 0;
+  }
+
+  mgr->workDirPaths();
+  mgr->checkpoint_ = new Checkpoint(mgr->zh_, &ZOO_DCRON_ALL_ACL, mgr->llapNode_, cnf->llapKeys());
+
+  int rank = cnf->stick() ? mgr->affinityRank() : -1;
+  if ((rank == 0 || cnf->tcrash()) && cnf->zkdump()) dump_stick(mgr, cnf->id());
+
+  if (cnf->zkPipeline()) {
+    if (!mgr->startPipelined(rank, errbuf)) return 0;
+  } else {
+    if (!mgr->startSerial(rank, errbuf)) return 0;
+  }
+  return mgr.release();
+}
+
+bool ZkMgr::startSerial(int rank, char *errbuf)
+{
+  int64_t begin = Metrics::nowUs();
+  if (!createWorkDir(errbuf)) return false;
+  metrics_.phase(Metrics::WORKDIR)->observe(Metrics::nowUs() - begin);
+  if (!publishCapacity(rank, errbuf)) return false;
+
+  if (rank != 0 && !cnf_->tcrash()) {
+    MetricsTimer timer(metrics_.phase(Metrics::ELECT));
+    std::string best;
+    if (!lastRunner_.empty()) waitAffinity();
+    if (!collectCandidates(&best, errbuf)) return false;
+    if (best != candidateNode_) waitElection(best);
+  }
+
+  do {
+    status_ = competeMaster(workerNode_.empty(), errbuf);
+
+    if (status_ == MASTER) {
+      setZkStatus(MASTER_WAIT);
+    } else if (status_ == SLAVE) {
+      if (cnf_->retryStrategy() == ConfigOpt::RETRY_NOTHING) {
+        status_ = OUT;
+      } else {
+        setZkStatus(WORKER_SUSPEND);
+        NodeStatus status = setWatch(errbuf);
+        if (status != ZKOK) status_ = status;
+      }
+    }
+  } while (status_ == ZKAGAIN);
+  return true;
+}
+
+inline bool connectionLoss(const ZkPipeline &pipe)
+{
+  for (size_t i = 0; i < pipe.size(); ++i) {
+    if (pipe.rc(i) == ZCONNECTIONLOSS || pipe.rc(i) == ZOPERATIONTIMEOUT) return true;
+  }
+  return false;
+}
+
+/* the startup of startSerial as a state machine, every state sends its
+ * independent requests in one pipeline and costs one round trip
+ *   WORKDIR  the workdir zoo_multi, our candidate, the candidates list
+ *   PARENTS  all the parents of the taskid dir and llap, first run only
+ *   ELECT    watches master and the best candidate, waits for the election
+ *   COMPETE  master and worker zoo_multi, then the llap checkpoint
+ *   JOIN     worker and the watch of master, slave only
+ * the llap checkpoint is read after master is won, no master before us
+ * can change it any more. a connection loss in COMPETE or JOIN leaves it
+ * unknown what was applied, the serial calls find it out
+ */
+static const char *START_STATES[] = {"START_WORKDIR", "START_PARENTS", "START_ELECT", "START_COMPETE", "START_JOIN"};
+
+bool ZkMgr::startPipelined(int rank, char *errbuf)
+{
+  std::string json = capacity(rank);
+  std::string best;
+  std::string workerPrefix = workersNode_ + "/" + cnf_->id() + "-";
+  bool parents = false;
+  int retry = 0;
+  int64_t begin = Metrics::nowUs();
+
+  StartState state = START_WORKDIR;
+  while (state != START_DONE) {
+    TraceSpan span(START_STATES[state]);
+    ZkPipeline pipe(zh_);
+    StartState next = START_DONE;
+
+    if (state == START_WORKDIR) {
+      ZkTxn txn(zh_, &ZOO_DCRON_ALL_ACL);
+      txn.create(taskPath_).create(workersNode_).create(candidatesNode_).create(statusNode_);
+
+      size_t multi = pipe.multi(&txn);
+      size_t cand  = pipe.create(candidateNode_, json, ZOO_EPHEMERAL, &ZOO_DCRON_ALL_ACL);
+      size_t list  = pipe.children(candidatesNode_);
+      pipe.wait();
+
+      int rc = pipe.rc(multi);
+      if (rc == ZNONODE && txn.failed() == 0 && !parents) {
+        next = START_PARENTS;
+      } else if (connectionLoss(pipe)) {
+        next = START_WORKDIR;
+      } else if (rc != ZOK && !(rc == ZNODEEXISTS && txn.failed() == 0)) {
+        snprintf(errbuf, ERRBUF_MAX, "zoo_multi %s error, %s", taskPath_.c_str(), zerror(rc));
+        return false;
+      } else if (pipe.rc(cand) != ZOK && pipe.rc(cand) != ZNODEEXISTS) {
+        snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", candidateNode_.c_str(), zerror(pipe.rc(cand)));
+        return false;
+      } else if (pipe.rc(list) != ZOK) {
+        snprintf(errbuf, ERRBUF_MAX, "zoo_get_children %s error, %s", candidatesNode_.c_str(), zerror(pipe.rc(list)));
+        return false;
+      } else {
+        const std::vector<std::string> &children = pipe.strings(list);
+        std::vector<std::string>::const_iterator min = std::min_element(children.begin(), children.end());
+        if (min != children.end()) best.assign(candidatesNode_).append(1, '/').append(*min);
+        else best.assign(candidateNode_);
+        metrics_.phase(Metrics::WORKDIR)->observe(Metrics::nowUs() - begin);
+        next = START_ELECT;
+      }
+    } else if (state == START_PARENTS) {
+      /* a create after the create of its parent sees the parent */
+      size_t slash = taskPath_.rfind('/');
+      for (size_t j = 2; j <= slash; ++j) {
+        if (j == slash || taskPath_[j] == '/') pipe.create(taskPath_.substr(0, j), std::string(), 0, &ZOO_DCRON_ALL_ACL);
+      }
+      pipe.create(llapNode_, std::string(), 0, &ZOO_DCRON_ALL_ACL);
+      pipe.wait();
+
+      if (connectionLoss(pipe)) {
+        next = START_PARENTS;
+      } else {
+        for (size_t i = 0; i < pipe.size(); ++i) {
+          if (pipe.rc(i) != ZOK && pipe.rc(i) != ZNODEEXISTS) {
+            snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", taskPath_.c_str(), zerror(pipe.rc(i)));
+            return false;
+          }
+        }
+        parents = true;
+        next = START_WORKDIR;
+      }
+    } else if (state == START_ELECT) {
+      if (rank != 0 && !cnf_->tcrash()) {
+        MetricsTimer timer(metrics_.phase(Metrics::ELECT));
+        /* the last runner is not among the candidates yet, wait for its turn. the list
+         * of WORKDIR is of the first to arrive, the candidates are ranked again
+         */
+        if (!lastRunner_.empty() && best != lastRunner_) waitAffinity();
+        if (!collectCandidates(&best, errbuf)) return false;
+        if (best != candidateNode_) {
+          electWake_ = false;
+          size_t master = pipe.exists(masterNode_, watchElection, (void *) serial_);
+          size_t wexist = pipe.exists(best, watchElection, (void *) serial_);
+          pipe.wait();
+
+          if (pipe.rc(master) == ZNONODE && pipe.rc(wexist) == ZOK) waitElectionWake(best);
+        }
+      }
+      next = START_COMPETE;
+    } else if (state == START_COMPETE) {
+      bool first = workerNode_.empty();
+      NodeStatus status;
+
+      if (cnf_->testConnectionLoss()) {
+        status = competeMaster(first, errbuf);
+      } else {
+        ZkTxn txn(zh_, &ZOO_DCRON_ALL_ACL);
+        txn.create(masterNode_, cnf_->id(), ZOO_EPHEMERAL);
+        if (first) txn.create(workerPrefix, cnf_->id(), ZOO_EPHEMERAL | ZOO_SEQUENCE);
+
+        size_t multi = pipe.multi(&txn);
+        size_t llap  = pipe.get(llapNode_);
+        pipe.wait();
 
-void ZkMgr::watchMasterNode(zhandle_t *, int type, int state, const char *path, void *watcherCtx)
-{
-  ZkMgr *mgr = (ZkMgr *) watcherCtx;
+        int rc = pipe.rc(multi);
+        if (rc == ZOK) {
+          if (first) joinedWorkers(txn.created(1));
+          llapFetched_ = pipe.rc(llap) == ZOK;
+          llapEnv_     = pipe.value(llap);
+          llapVersion_ = pipe.stat(llap).version;
+          status = MASTER;
+        } else if (rc == ZNODEEXISTS && txn.failed() == 0) {
+          status = SLAVE;
+        } else if (rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT) {
+          status = recoverMaster(first, errbuf);
+        } else {
+          snprintf(errbuf, ERRBUF_MAX, "zoo_multi %s error, %s",
+                   txn.path(txn.failed() == -1 ? 0 : txn.failed()).c_str(), zerror(rc));
+          status = ZKFATAL;
+        }
+      }
 
-  if (type == ZOO_DELETED_EVENT || (type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE)) {
-    pthread_mutex_lock(mgr->mutex_);
-    if (type == ZOO_DELETED_EVENT) {
-      mgr->zkStatus_ = MASTER_GONE;
-    } else {
-      mgr->zkStatus_ = SESSION_GONE;
+      status_ = status;
+      if (status == MASTER) {
+        setZkStatus(MASTER_WAIT);
+      } else if (status == SLAVE) {
+        next = START_JOIN;
+      } else if (status == ZKAGAIN) {
+        next = START_COMPETE;
+      }
+    } else if (state == START_JOIN) {
+      int64_t joinBegin = Metrics::nowUs();
+      bool watch = cnf_->retryStrategy() != ConfigOpt::RETRY_NOTHING;
+      size_t worker = workerNode_.empty() ? pipe.create(workerPrefix, cnf_->id(), ZOO_EPHEMERAL | ZOO_SEQUENCE,
+                                                        &ZOO_DCRON_ALL_ACL) : (size_t) -1;
+      size_t list   = watch ? pipe.children(workersNode_) : (size_t) -1;
+      pipe.wait();
+
+      if (worker != (size_t) -1) {
+        int rc = pipe.rc(worker);
+        if (rc == ZOK) {
+          joinedWorkers(pipe.value(worker));
+          /* without a watch the slave is OUT anyway */
+          if (watch) status_ = admitWorker(pipe.rc(list) == ZOK ? &pipe.strings(list) : 0, errbuf);
+          metrics_.phase(Metrics::JOIN)->observe(Metrics::nowUs() - joinBegin);
+        } else if (rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT) {
+          status_ = joinWorkers(false, errbuf);
+        } else {
+          snprintf(errbuf, ERRBUF_MAX, "zoo_create %s error, %s", workerPrefix.c_str(), zerror(rc));
+          status_ = ZKFATAL;
+        }
+      }
+
+      if (status_ == SLAVE) {
+        if (!watch) {
+          status_ = OUT;
+        } else {
+          /* the children are listed after our worker is created, we are in them */
+          setZkStatus(WORKER_SUSPEND);
+          NodeStatus status = setWatch(errbuf, pipe.rc(list) == ZOK ? &pipe.strings(list) : 0);
+          if (status == ZKAGAIN) next = START_COMPETE;
+          else if (status != ZKOK) status_ = status;
+        }
+      }
     }
-    pthread_mutex_unlock(mgr->mutex_);
 
-    pthread_cond_signal(mgr->cond_);
-  } else {
-    log_error(0, "zk watch type %d, state %d, path %s", type, state, path ? path : "null");
+    /* the states before COMPETE are idempotent, they are sent again */
+    if (next == state && state != START_COMPETE) {
+      if (++retry >= ZKRETRY_MAX) {
+        snprintf(errbuf, ERRBUF_MAX, "%s zk connection loss", taskPath_.c_str());
+        return false;
+      }
+      millisleep(ZKRETRY_SLEEP);
+    }
+    state = next;
   }
+  return true;
 }
 
-ZkMgr::NodeStatus ZkMgr::setWatch(char *errbuf)
+/* the session of a dcrond task outlives it, remove its ephemeral nodes
+ * so the other candidates do not wait for the session to expire
+ */
+void ZkMgr::leave()
 {
-  for (int i = 0; /**/; /**/) {
-    int rc = zoo_wexists(zh_, masterNode_.c_str(), watchMasterNode, this, 0);
-    if (rc == ZOK) {
-      return ZKOK;
-    } else if (rc == ZNONODE) {  // master had gone before set watch
-      return ZKAGAIN;
-    } else if (rc != ZCONNECTIONLOSS) {
-      if (errbuf) snprintf(errbuf, ERRBUF_MAX, "zoo_wexists %s error, %s", masterNode_.c_str(), zerror(rc));
-      else log_fatal(0, "zoo_wexists %s error, %s", masterNode_.c_str(), zerror(rc));
+  if (session_->expired()) return;
 
-      return ZKFATAL;
-    }
-    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
+  ZkTxn txn(zh_, &ZOO_DCRON_ALL_ACL);
+  if (status_ == MASTER) txn.del(masterNode_);
+  if (!candidateNode_.empty()) txn.del(candidateNode_);
+  if (!workerNode_.empty()) txn.del(workerNode_);
+
+  /* one of them may be gone already */
+  if (txn.commit() != ZOK) {
+    for (size_t i = 0; i < txn.size(); ++i) ZK_TIMED(OP_DELETE, zoo_delete(zh_, txn.path(i).c_str(), -1));
   }
-  return ZKFATAL;
 }
 
-void ZkMgr::globalWatcher(zhandle_t *, int type, int state, const char *path, void *watcherCtx)
+ZkMgr::~ZkMgr()
 {
-  const char *typeString  = zkTypeToString(type);
-  const char *stateString = zkStateToString(state);
+  pthread_mutex_lock(&LIVE_MUTEX);
+  LIVE_MGRS.erase(serial_);
+  pthread_mutex_unlock(&LIVE_MUTEX);
 
-  if (typeString && stateString) {
-    log_info(0, "globak zookeeper type %s(%d) state %s(%d) path %s",
-             typeString, type, stateString, state, path ? path : "null");
-  } else {
-    log_info(0, "globak zookeeper type %d state %d path %s", type, state, path ? path : "null");
-  }
+  leave();
+  delete checkpoint_;
 
-  ZkMgr *mgr = (ZkMgr *) watcherCtx;
-  if (type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE) {
-    mgr->zkStatus_ = SESSION_GONE;
-  }
-}
+  if (fifoFd_  != -1) close(fifoFd_);
+  if (timerFd_ != -1) close(timerFd_);
+  closeRing();
+  if (epollFd_ != -1) close(epollFd_);
+  if (eventFd_ != -1) close(eventFd_);
+  if (sigFd_   != -1) close(sigFd_);
 
-inline zhandle_t *zookeeperInit(const char *zkhost, watcher_fn fn, void *ctx)
-{
-  for (int i = 0; /**/; /**/) {
-    zhandle_t *zh = zookeeper_init(zkhost, fn, 15000, 0, ctx, 0);
-    if (zh) return zh;
-    if (errno != ZCONNECTIONLOSS) return 0;
-    if (++i < ZKRETRY_MAX) millisleep(ZKRETRY_SLEEP);
-  }
-  return 0;
+  pthread_mutex_destroy(&mutex_);
+  pthread_cond_destroy(&cond_);
+  session_->release();
+
+  if (Metrics::current() == &metrics_) Metrics::setCurrent(0);
 }
 
-ZkMgr *ZkMgr::create(ConfigOpt *cnf, char *errbuf)
+inline bool dumpFile(const char *file, const std::string &content)
 {
-  std::auto_ptr<ZkMgr> mgr(new ZkMgr);
-  mgr->cnf_ = cnf;
-  mgr->fifoFd_ = -1;
-
-  mgr->zkStatus_ = MASTER_GONE;
-  mgr->mutex_    = &PTHREAD_MUTEX;
-  mgr->cond_     = &PTHREAD_COND;
+  FILE *fp = fopen(file, "w");
+  if (!fp) return false;
 
-  zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-  zoo_set_log_stream(stderr);
+  fwrite(content.c_str(), content.size(), 1, fp);
+  fclose(fp);
+  return true;
+}
 
-  mgr->zh_ = zookeeperInit(cnf->zkhost(), globalWatcher, mgr.get());
-  if (!mgr->zh_) {
-    snprintf(errbuf, ERRBUF_MAX, "%s zk connect %s error, %s", cnf->name(), cnf->zkhost(), zerror(errno));
-    return 0;
+int ZkMgr::run(ConfigOpt *cnf, ZkSession *session, int argc, char *argv[])
+{
+  char errbuf[ERRBUF_MAX];
+  std::auto_ptr<ZkMgr> zkMgr(ZkMgr::create(cnf, session, errbuf));
+  if (!zkMgr.get()) {
+    log_fatal(0, "%s create ZkMgr error, %s", cnf->name(), errbuf);
+    return EXIT_FAILURE;
   }
 
-  if (!mgr->createWorkDir(errbuf)) return 0;
-
-  bool stick = getStickFile(cnf->libdir(), cnf->name(), cnf->stick());
+  int status;
   do {
-    if (stick || cnf->tcrash()) {
-      if (cnf->zkdump()) dump_stick(cnf->id());
-
-      mgr->status_ = mgr->competeMaster(true, errbuf);
+    log_info(0, "%s %s status %s", cnf->id(), cnf->name(), ZkMgr::statusToString(zkMgr->status()));
+    if (zkMgr->status() == ZkMgr::MASTER) {
+      status = zkMgr->exec(argc, argv);
+      if (cnf->keep() || cnf->keepDays()) Reaper::submit(session, zkMgr->taskPath_, cnf->keep(), cnf->keepDays());
+      break;
+    } else if (zkMgr->status() == ZkMgr::SLAVE) {
+      zkMgr->suspend();
+    } else if (zkMgr->status() == ZkMgr::OUT) {
+      zkMgr->exportMetrics(EXIT_SUCCESS);
+      return EXIT_SUCCESS;
     } else {
-      millisleep(200 + random() % 999999);
-      mgr->status_ = mgr->competeMaster(true, errbuf);
+      zkMgr->exportMetrics(EXIT_FAILURE);
+      return EXIT_FAILURE;
     }
+  } while (true);
+  zkMgr->exportMetrics(status);
 
-    if (mgr->status_ == MASTER) {
-      mgr->zkStatus_ = MASTER_WAIT;
-    } else if (mgr->status_ == SLAVE) {
-      if (cnf->retryStrategy() == ConfigOpt::RETRY_NOTHING) {
-        mgr->status_ = OUT;
-      } else {
-        mgr->zkStatus_ = WORKER_SUSPEND;
-        NodeStatus status = mgr->setWatch(errbuf);
-        if (status != ZKOK) mgr->status_ = status;
-      }
-    }
-  } while (mgr->status_ == ZKAGAIN);
+  if (cnf->zkdump()) {
+    sleep(1);   // wait negotiate timeout
+    std::string json;
+    if (zkMgr->dump(&json)) dumpFile(cnf->zkdump(), json);
+  }
 
-  return mgr.release();
+  return status;
 }
 
 inline std::string join(size_t n, char *parray[])
@@ -403,9 +1417,10 @@ inline std::string join(size_t n, char *parray[])
   return s;
 }
 
-void ZkMgr::setStatus(int exitStatus)
+void ZkMgr::setStatus(int exitStatus, const Json::Value &report)
 {
-  Json::Value obj(Json::objectValue);
+  TraceSpan span("setStatus");
+  Json::Value obj(report);
   obj["status"] = exitStatus;
   obj["id"] = cnf_->id();
 
@@ -413,18 +1428,20 @@ void ZkMgr::setStatus(int exitStatus)
   if (json[json.size()-1] == '\n') json.resize(json.size()-1);
 
   log_info(0, "zoo_set status %s %s", statusNode_.c_str(), json.c_str());
-  int rc = zoo_create(zh_, statusNode_.c_str(), json.c_str(), json.size(), &ZOO_DCRON_ALL_ACL, 0, 0, 0);
-  if (rc == ZNODEEXISTS) {
-    rc = zoo_set(zh_, statusNode_.c_str(), json.c_str(), json.size(), -1);
+  int rc = ZK_TIMED(OP_SET, zoo_set(zh_, statusNode_.c_str(), json.c_str(), json.size(), -1));
+  if (rc == ZNONODE) {
+    rc = ZK_TIMED(OP_CREATE, zoo_create(zh_, statusNode_.c_str(), json.c_str(), json.size(), &ZOO_DCRON_ALL_ACL,
+                                        0, 0, 0));
   }
   if (rc != ZOK) {
     log_fatal(0, "zoo_create/zoo_set %s error, %s", statusNode_.c_str(), zerror(rc));
   }
 }
 
-void ZkMgr::setResult(int retry, int exitStatus, const char *error)
+void ZkMgr::setResult(int retry, int exitStatus, const char *error, const Json::Value &report)
 {
-  Json::Value obj(Json::objectValue);
+  TraceSpan span("setResult");
+  Json::Value obj(report);
   obj["status"] = exitStatus;
   obj["id"] = cnf_->id();
   obj["retry"] = retry;
@@ -434,160 +1451,84 @@ void ZkMgr::setResult(int retry, int exitStatus, const char *error)
   if (json[json.size()-1] == '\n') json.resize(json.size()-1);
 
   log_info(0, "zoo_set result %s%010d %s", resultNode_.c_str(), retry, json.c_str());
-  int rc = zoo_create(zh_, resultNode_.c_str(), json.c_str(), json.size(), &ZOO_DCRON_ALL_ACL, ZOO_SEQUENCE, 0, 0);
+  int rc = ZK_TIMED(OP_CREATE, zoo_create(zh_, resultNode_.c_str(), json.c_str(), json.size(), &ZOO_DCRON_ALL_ACL,
+                                          ZOO_SEQUENCE, 0, 0));
   if (rc != ZOK) {
     log_fatal(errno, "zoo_create %s error, %s", resultNode_.c_str(), zerror(rc));
   }
 }
 
-#define MAX_ENVP_NUM 511
-inline char * const *buildEnv(ConfigOpt *cnf, const std::map<std::string, std::string> &env)
+/* once for all the retries, the environment of the task */
+void ZkMgr::buildEnv(const std::map<std::string, std::string> &env)
 {
-  static char *envp[MAX_ENVP_NUM+1];
-  int i = 0;
-
-  static char fifoPtr[512];
-  snprintf(fifoPtr, 512, "DCRON_FIFO=%s", cnf->fifo());
-  envp[i++] = fifoPtr;
+  spawner_.clearEnv();
+  spawner_.addEnv("DCRON_FIFO", cnf_->fifo());
+  if (ringFd_ != -1) {
+    char ring[32];
+    snprintf(ring, 32, "%d", ringFd_);
+    spawner_.addEnv("DCRON_RING", ring);
+    snprintf(ring, 32, "%d", bellFd_);
+    spawner_.addEnv("DCRON_RING_BELL", ring);
+  }
+  if (fencing_) {
+    char fencing[32];
+    snprintf(fencing, 32, "%lld", (long long) fencing_);
+    spawner_.addEnv("DCRON_FENCING", fencing);
+  }
 
   for (std::map<std::string, std::string>::const_iterator ite = env.begin(); ite != env.end(); ++ite) {
-    char *ptr = new char[4096];
-    snprintf(ptr, 4096, "DCRON_%s=%s", ite->first.c_str(), ite->second.c_str());
-    envp[i++] = ptr;
+    spawner_.addEnv("DCRON_" + ite->first, ite->second);
   }
 
   /* used for test */
-  if (!ENV_STICK.empty()) envp[i++] = (char *) ENV_STICK.c_str();
-
-  for (int j = 0; i < MAX_ENVP_NUM && environ[j]; ++j) envp[i++] = environ[j];
-  envp[i++] = 0;
-  return envp;
-}
-
-static bool getRomoteEnv(zhandle_t *zh, const char *path, std::map<std::string, std::string> *env)
-{
-  int bufferLen = RENV_BUFFER_LEN;
-  std::auto_ptr<char> buffer(new char[RENV_BUFFER_LEN]);
-  int rc = zoo_get(zh, path, 0, buffer.get(), &bufferLen, 0);
-  if (rc != ZOK) {
-    log_fatal(0, "zoo_get %s error, %s", path, zerror(rc));
-    return false;
-  }
-
-  if (bufferLen <= 0) return true;
-
-  Json::Value array;
-  Json::Reader reader;
-  if (!reader.parse(buffer.get(), buffer.get() + bufferLen, array)) {
-    log_fatal(0, "%s content %s error", path, buffer.get());
-    return false;
-  }
+  if (!envStick_.empty()) spawner_.addEnv(envStick_.c_str());
 
-  int len = array.size();
-  for (int i = 0; i < len; ++i) {
-    (*env)[array[i]["k"].asString()] = array[i]["v"].asString();
-  }
-  return true;
+  char **cenvp = cnf_->envp();
+  for (int j = 0; cenvp[j]; ++j) spawner_.addEnv(cenvp[j]);
 }
 
-static bool setRemoteEnv(zhandle_t *zh, const char *path, std::map<std::string, std::string> *env)
+#define INTERNAL_ERROR_STATUS 254
+#define RLIMIT_AS_MIN         500  // MB
+pid_t ZkMgr::exec(int argc, char *argv[], int cnt, int *pidfd)
 {
-  int bufferLen = RENV_BUFFER_LEN;
-  std::auto_ptr<char> buffer(new char[RENV_BUFFER_LEN]);
-  int rc = zoo_get(zh, path, 0, buffer.get(), &bufferLen, 0);
-  if (rc != ZOK) {
-    log_fatal(0, "zoo_get %s error, %s", path, zerror(rc));
-    return false;
-  }
-
-  Json::Value array;
-  if (bufferLen <= 0) {
-    array = Json::Value(Json::arrayValue);
-  } else {
-    Json::Reader reader;
-    if (!reader.parse(buffer.get(), buffer.get() + bufferLen, array)) {
-      log_fatal(0, "%s content %s error", path, buffer.get());
-      return false;
-    }
-  }
-
-  for (size_t i = 0; i < array.size(); ++i) {
-    const Json::Value &obj = array[(int) i];
-    env->insert(std::make_pair(obj["k"].asString(), obj["v"].asString()));
+  /* stdio of the dcron client when run by dcrond, then the capture pipes */
+  spawner_.clearFds();
+  for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+    if (cnf_->stdio(fd) != -1) spawner_.dup(cnf_->stdio(fd), fd);
   }
-  while (env->size() > RENV_ITEM_MAX) env->erase(env->begin());
-
-  array.resize(0);
-  for (std::map<std::string, std::string>::iterator ite = env->begin(); ite != env->end(); ++ite) {
-    Json::Value obj(Json::objectValue);
-    obj["k"] = ite->first;
-    obj["v"] = ite->second;
-    array.append(obj);
+  for (int i = 0; i < 2; ++i) {
+    if (capture_[i].writer() != -1) spawner_.dup(capture_[i].writer(), STDOUT_FILENO + i);
   }
 
-  std::string json = Json::FastWriter().write(array);
-  if (json[json.size()-1] == '\n') json.resize(json.size()-1);
-
-  log_info(0, "zoo_set llap %s %s", path, json.c_str());
-
-  rc = zoo_set(zh, path, json.c_str(), json.size(), -1);
-  if (rc != ZOK) {
-    log_fatal(0, "zoo_set %s error, %s", path, zerror(rc));
-    return false;
-  } else {
-    return true;
+  /* the ring and its bell are inherited by the task only */
+  if (ringFd_ != -1) {
+    spawner_.inherit(ringFd_);
+    spawner_.inherit(bellFd_);
   }
-}
 
-inline bool setuid(const char *user, int uid, int gid)
-{
-  if (user && geteuid() == 0) {
-    if (setgid(gid) == -1) return false;
-    if (initgroups(user, gid) == -1) return false;
-    if (setuid(uid) == -1) return false;
-  }
-  return true;
-}
+  spawner_.setCgroup(cgroup_.procs());
+  spawner_.setCwd(cnf_->cwd());
+  spawner_.setRlimitAs(cnf_->rlimitAs() ? std::max(cnf_->rlimitAs(), RLIMIT_AS_MIN) : 0);
 
-#define INTERNAL_ERROR_STATUS 254
-pid_t ZkMgr::exec(int argc, char *argv[], const std::map<std::string, std::string> &env, int cnt)
-{
-  if (fifoFd_ > 0) close(fifoFd_);
-  fifoFd_ = open(cnf_->fifo(), O_RDONLY | O_NONBLOCK);
-  if (fifoFd_ == -1) {
-    log_fatal(errno, "open fifo %s error", cnf_->fifo());
-    setResult(cnt, INTERNAL_ERROR_STATUS, "fifo error");
-    return -1;
+  pid_t pid;
+  {
+    TraceSpan span("spawn");
+    MetricsTimer timer(metrics_.phase(Metrics::SPAWN));
+    pid = spawner_.spawn(argv, pidfd);
   }
-
-  pid_t pid = fork();
-  if (pid == 0) {
-    if (cnf_->captureStdio()) {
-      std::string iof = cnf_->logdir() + "/" + cnf_->name() + ".stdout";
-      int logFd = open(iof.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
-      if (logFd != -1) dup2(logFd, STDOUT_FILENO);
-
-      iof = cnf_->logdir() + "/" + cnf_->name() + ".stderr";
-      logFd = open(iof.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
-      if (logFd != -1) dup2(logFd, STDERR_FILENO);
-    }
-
-    if (!setuid(cnf_->user(), cnf_->uid(), cnf_->gid())) {
-      log_fatal(errno, "setuid(%s) error", cnf_->user());
-      exit(EXIT_FAILURE);
-    }
-
-    if (execve(argv[0], argv, buildEnv(cnf_, env)) == -1) {
-      log_fatal(errno, "execve \"%s\" error", join(argc, argv).c_str());
-      exit(EXIT_FAILURE);
-    }
-    exit(EXIT_SUCCESS);  // never be exceuted here
-  } else if (pid < 0) {
-    log_fatal(errno, "fork error when exec %s", join(argc, argv).c_str());
+  taskBegin_ = Metrics::nowUs();
+  taskTraceBegin_ = Trace::nowUs();
+  if (pid < 0) {
+    log_fatal(errno, "clone error when exec %s", join(argc, argv).c_str());
     setResult(cnt, INTERNAL_ERROR_STATUS, "fork error");
     return -1;
   }
 
+  /* the child has exited EXIT_FAILURE, it is waited for as a task */
+  if (spawner_.step() != Spawner::NONE) {
+    log_fatal(spawner_.error(), "%s error when exec \"%s\"", Spawner::stepToString(spawner_.step()),
+              join(argc, argv).c_str());
+  }
   return pid;
 }
 
@@ -598,14 +1539,6 @@ inline int getExitCode(int status)
   else return status;
 }
 
-inline void deleteEmptyFile(const std::string &file)
-{
-  struct stat st;
-  if (stat(file.c_str(), &st) == 0 && st.st_size == 0) {
-    unlink(file.c_str());
-  }
-}
-
 bool ZkMgr::wait(pid_t pid, size_t cnt, bool *retry, int *exitStatus)
 {
   pid_t npid = waitpid(pid, exitStatus, WNOHANG);
@@ -615,67 +1548,257 @@ bool ZkMgr::wait(pid_t pid, size_t cnt, bool *retry, int *exitStatus)
     return true;
   } else if (npid == pid) {
     *exitStatus = getExitCode(*exitStatus);
+    metrics_.phase(Metrics::TASK)->observe(Metrics::nowUs() - taskBegin_);
+    if (Trace::current()) Trace::current()->span("task", taskTraceBegin_, Trace::nowUs(), "status", *exitStatus);
+
+    /* the end of stderr tells why the task failed, the cgroup what it cost,
+     * the metrics where dcron spent its time so far
+     */
+    stopCapture();
+    Json::Value report(Json::objectValue), usage(Json::objectValue);
+    std::string tail = *exitStatus != 0 ? capture_[1].tail() : std::string();
+    if (!tail.empty()) report["stderr"] = tail;
+    cgroup_.usage(&usage);
+    if (!usage.empty()) report["usage"] = usage;
+    cgroup_.remove();
+
+    if (cnf_->metrics()) metrics_.summary(&report["metrics"]);
 
     if (*exitStatus == 0 || cnf_->retryStrategy() == ConfigOpt::RETRY_NOTHING ||
         cnf_->retryStrategy() == ConfigOpt::RETRY_ON_CRASH) {
-      setStatus(*exitStatus);
+      setStatus(*exitStatus, report);
     } else if (cnf_->retryStrategy() == ConfigOpt::RETRY_ON_ABEXIT) {
       if (cnt+1 >= cnf_->maxRetry()) {
-        setStatus(*exitStatus);
+        setStatus(*exitStatus, report);
       } else {
-        setResult(cnt, *exitStatus);
+        setResult(cnt, *exitStatus, 0, report);
         *retry = true;
       }
     }
 
-    if (cnf_->captureStdio()) {
-      deleteEmptyFile(cnf_->logdir() + "/" + cnf_->name() + ".stdout");
-      deleteEmptyFile(cnf_->logdir() + "/" + cnf_->name() + ".stderr");
+    if (cnf_->stick()) {
+      Affinity affinity(zh_, &ZOO_DCRON_ALL_ACL, affinityNode_);
+      if (affinity.load()) affinity.record(cnf_->id());
     }
-
-    if (cnf_->stick()) createStickFile(cnf_->libdir(), cnf_->name());
     return true;
   } else {
     return false;
   }
 }
 
-void ZkMgr::rsyncFifoData()
+/* the fifo and the ring are drained at every event, the task rings the
+ * bell of the ring when dcron sleeps for it, the records are written to zk DCRON_FLUSH_INTERVAL after the first one,
+ * or at once when DCRON_FLUSH_BYTES are read or a ring commit waits, a
+ * task updating its offset 1000 times a second costs one write per
+ * interval, all the commits of one poll one write
+ */
+void ZkMgr::rsyncFifoData(bool flush)
 {
-  char buffer[PIPE_BUF];
-  ssize_t nn;
+  if (!ingest_.read(fifoFd_)) {
+    log_fatal(errno, "%s fifo %s read error", cnf_->name(), cnf_->fifo());
+  }
+  if (ring_.hdr) drainRing();
+
+  /* every record consumed from the ring is saved unless some are pending */
+  bool barrier = ring_.hdr && dcron_ring_barrier_pending(&ring_);
+  uint64_t consumed = ring_.hdr ? ring_.hdr->tail : 0;
+  if (ingest_.empty()) {
+    if (barrier && !checkpoint_->fenced()) dcron_ring_ack(&ring_, consumed);
+    return;
+  }
+
+  if (!flush && !barrier && !ingest_.full()) {
+    if (!flushArmed_) armFlush(cnf_->flushInterval());
+    return;
+  }
+
   std::map<std::string, std::string> env;
-  while ((nn = read(fifoFd_, buffer, PIPE_BUF)) > 0) {
-    int start = 0;
-    int eq = -1;
-    for (int i = 0; i < nn; ++i) {
-      if (buffer[i] == '=') {
-        eq = i;
-      } else if (buffer[i] == '\n' && eq != -1) {
-        env[std::string(buffer + start, eq - start)] = std::string(buffer + eq+1, i - (eq+1));
-        eq = -1;
-        start = i + 1;
-      }
-      if (env.size() > RENV_ITEM_MAX) env.erase(env.begin());
+  ingest_.take(&env);
+
+  /* a fenced master never writes llap again, the fifo is still read */
+  if (checkpoint_->fenced()) return;
+
+  bool saved;
+  {
+    TraceSpan span("rsyncFifoData");
+    span.arg("keys", env.size());
+    MetricsTimer timer(metrics_.phase(Metrics::FLUSH));
+    saved = checkpoint_->save(env);
+  }
+  metrics_.flushed();
+  if (!saved && checkpoint_->fenced()) {
+    log_fatal(0, "%s lost master, %d llap records are dropped", cnf_->name(), (int) env.size());
+  } else if (!saved) {
+    ingest_.restore(env);
+    armFlush(cnf_->flushInterval());
+  } else if (ring_.hdr) {
+    dcron_ring_ack(&ring_, consumed);
+  }
+}
+
+void ZkMgr::armFlush(int milli)
+{
+  if (timerFd_ == -1) return;
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec  = milli / 1000;
+  spec.it_value.tv_nsec = (milli % 1000) * 1000 * 1000 + 1;
+  if (timerfd_settime(timerFd_, 0, &spec, 0) == -1) {
+    log_fatal(errno, "%s timerfd_settime error", cnf_->name());
+  } else {
+    flushArmed_ = true;
+  }
+}
+
+/* a sealed memfd, the task can not shrink it under the mapping of dcron,
+ * an unlinked file of DCRON_LIBDIR on kernels without memfd
+ */
+bool ZkMgr::createRing()
+{
+#ifdef __NR_memfd_create
+  ringFd_ = syscall(__NR_memfd_create, "dcron-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+  if (ringFd_ == -1) {
+    std::string file = cnf_->libdir() + "/" + cnf_->name() + ".ring";
+    ringFd_ = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (ringFd_ != -1) unlink(file.c_str());
+  }
+
+  if (ringFd_ == -1 || dcron_ring_init(&ring_, ringFd_, cnf_->ringSize()) == -1) {
+    log_fatal(errno, "%s ring of %d bytes error, DCRON_RING is not set", cnf_->name(), (int) cnf_->ringSize());
+    closeRing();
+    return false;
+  }
+
+  bellFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (bellFd_ == -1 || !addEvent(bellFd_)) {
+    log_fatal(errno, "%s ring bell error, DCRON_RING is not set", cnf_->name());
+    closeRing();
+    return false;
+  }
+  fcntl(ringFd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  ringDropped_  = 0;
+  ringReported_ = 0;
+  return true;
+}
+
+inline void ringRecord(const char *record, size_t len, void *ctx)
+{
+  ((FifoIngest *) ctx)->add(record, len);
+}
+
+void ZkMgr::drainRing()
+{
+  if (dcron_ring_consume(&ring_, ringRecord, &ingest_) == -1) {
+    log_error(0, "%s ring is corrupted, the records in it are lost", cnf_->name());
+  }
+
+  /* a task retrying a full ring fails every put, once a second is enough */
+  uint32_t dropped = __atomic_load_n(&ring_.hdr->dropped, __ATOMIC_RELAXED);
+  if (dropped != ringDropped_ && time(0) != ringReported_) {
+    log_error(0, "%s ring is full, %u records are dropped", cnf_->name(), dropped - ringDropped_);
+    ringDropped_  = dropped;
+    ringReported_ = time(0);
+  }
+}
+
+void ZkMgr::closeRing()
+{
+  if (ring_.hdr) dcron_ring_close(&ring_);
+  if (ringFd_ != -1) close(ringFd_);
+  ringFd_ = -1;
+  if (bellFd_ != -1) {
+    delEvent(bellFd_);
+    close(bellFd_);
+  }
+  bellFd_ = -1;
+}
+
+/* the task inherits the stdio of dcron when the file can not be opened */
+void ZkMgr::openCapture()
+{
+  static const char *SUFFIX[] = {".stdout", ".stderr"};
+  for (int i = 0; i < 2; ++i) {
+    std::string file = cnf_->logdir() + "/" + cnf_->name() + SUFFIX[i];
+    if (!capture_[i].open(file, cnf_->stdioSegment(), cnf_->stdioRotate(), cnf_->stdioKeep(), cnf_->stdioTail())) {
+      log_fatal(errno, "%s open %s error", cnf_->name(), file.c_str());
     }
   }
+}
 
-  if (nn == -1 && errno != EAGAIN) {
-    log_fatal(errno, "%s fifo %s read error", cnf_->name(), cnf_->fifo());
+/* new pipes for every child, the last one may have left a writer behind */
+void ZkMgr::startCapture()
+{
+  for (int i = 0; i < 2; ++i) {
+    if (!capture_[i].opened()) continue;
+    if (!capture_[i].pipe() || !addEvent(capture_[i].fd())) {
+      log_fatal(errno, "%s stdio capture pipe error", cnf_->name());
+      capture_[i].stop();
+    }
+  }
+}
+
+/* a leaf for every run, the usage of a retry is its own */
+void ZkMgr::createCgroup(int cnt)
+{
+  char retry[16];
+  snprintf(retry, sizeof(retry), "-%d", cnt);
+  std::string leaf = cnf_->name() + std::string(retry);
+  std::replace(leaf.begin(), leaf.end(), '/', '_');
+  cgroup_.create(cnf_->cgroup(), leaf, cnf_->cpu(), cnf_->mem(), cnf_->io());
+}
+
+/* <logdir>/dcron_<task>.prom, the task is the name without the taskid,
+ * every run of the task on this node replaces it
+ */
+void ZkMgr::exportMetrics(int exitStatus)
+{
+  if (!cnf_->metrics()) return;
+
+  std::string task = cnf_->name();
+  size_t dot = task.rfind('.');
+  if (dot != std::string::npos) task.resize(dot);
+
+  std::string file = cnf_->logdir() + "/dcron_" + task + ".prom";
+  if (!metrics_.writeTextfile(file, task, cnf_->id(), exitStatus)) {
+    log_error(errno, "%s write metrics %s error", cnf_->name(), file.c_str());
   }
+}
 
-  if (!env.empty()) setRemoteEnv(zh_, llapNode_.c_str(), &env);
+void ZkMgr::stopCapture()
+{
+  for (int i = 0; i < 2; ++i) {
+    if (capture_[i].fd() != -1) delEvent(capture_[i].fd());
+    capture_[i].stop();
+  }
 }
 
 int ZkMgr::exec(int argc, char *argv[])
 {
+  TraceSpan span("exec");
   if (cnf_->tcrash()) abort();
 
   std::map<std::string, std::string> env;
-  if (!getRomoteEnv(zh_, llapNode_.c_str(), &env)) {
+  bool envOk = llapFetched_ ? checkpoint_->load(llapEnv_, llapVersion_) : checkpoint_->load();
+  llapFetched_ = false;
+  if (!envOk) {
     setResult(0, INTERNAL_ERROR_STATUS, "zk error");
     return INTERNAL_ERROR_STATUS;
   }
+  checkpoint_->env(&env);
+
+  if (!fetchFencing()) {
+    setResult(0, INTERNAL_ERROR_STATUS, "lost master");
+    return INTERNAL_ERROR_STATUS;
+  }
+  checkpoint_->setFencing(masterNode_, fencing_);
+
+  if (!spawner_.setUser(cnf_->user(), cnf_->uid(), cnf_->gid())) {
+    log_fatal(errno, "getgrouplist(%s) error", cnf_->user());
+    setResult(0, INTERNAL_ERROR_STATUS, "setuid error");
+    return INTERNAL_ERROR_STATUS;
+  }
 
   if (mkfifo(cnf_->fifo(), 0644) != 0 && errno != EEXIST) {
     log_fatal(errno, "mkfifo %s error", cnf_->fifo());
@@ -683,38 +1806,152 @@ int ZkMgr::exec(int argc, char *argv[])
     return INTERNAL_ERROR_STATUS;
   }
 
-  if (cnf_->user() && chown(cnf_->fifo(), cnf_->uid(), cnf_->gid()) == -1) {
+  /* O_RDWR keeps a writer on the fifo, so epoll never sees EPOLLHUP.
+   * a symlink or a file left in place of the fifo is never chowned
+   */
+  struct stat st;
+  fifoFd_ = open(cnf_->fifo(), O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+  if (fifoFd_ == -1 || fstat(fifoFd_, &st) == -1 || !S_ISFIFO(st.st_mode) || !addEvent(fifoFd_)) {
+    log_fatal(errno, "open fifo %s error", cnf_->fifo());
+    setResult(0, INTERNAL_ERROR_STATUS, "fifo error");
+    unlink(cnf_->fifo());
+    return INTERNAL_ERROR_STATUS;
+  }
+
+  if (cnf_->user() && fchown(fifoFd_, cnf_->uid(), cnf_->gid()) == -1) {
     log_fatal(errno, "chown %s error", cnf_->fifo());
     setResult(0, INTERNAL_ERROR_STATUS, "chown error");
     return INTERNAL_ERROR_STATUS;
   }
+  if (FifoIngest::enlarge(fifoFd_, FIFO_PIPE_SIZE) == -1) {
+    log_error(errno, "%s fifo %s F_SETPIPE_SZ error", cnf_->name(), cnf_->fifo());
+  }
+  ingest_.setFlushBytes(cnf_->flushBytes());
+
+  /* without the timer every read is flushed at once */
+  timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerFd_ != -1 && !addEvent(timerFd_)) {
+    close(timerFd_);
+    timerFd_ = -1;
+  }
+  if (timerFd_ == -1) {
+    log_fatal(errno, "%s timerfd error", cnf_->name());
+    ingest_.setFlushBytes(0);
+  }
+
+  /* the task falls back to the fifo without DCRON_RING */
+  if (cnf_->ringSize()) createRing();
+  if (cnf_->captureStdio()) openCapture();
+  buildEnv(env);
 
   bool retry = true;
   int exitStatus;
   for (int cnt = 0; retry; ++cnt) {
     retry = false;
+    if (cnt > 0) metrics_.retried();
 
-    pid_t pid = exec(argc, argv, env, cnt);
+    if (!cnf_->cgroup().empty()) createCgroup(cnt);
+    startCapture();
+    int pidfd;
+    pid_t pid = exec(argc, argv, cnt, &pidfd);
+    for (int i = 0; i < 2; ++i) capture_[i].closeWriter();
     if (pid < 0) {
+      stopCapture();
+      cgroup_.remove();
       exitStatus = INTERNAL_ERROR_STATUS;
       break;
     }
 
+    int childFd = childEventFd(pid, pidfd);
+    int timeout = childFd == -1 ? SIGCHLD_TIMEOUT : -1;
+
+    /* the lost connection raises no event of its own when it lasts */
+    if (cnf_->fastFailover()) {
+      int poll = std::max(zoo_recv_timeout(zh_) / 12, LEASE_POLL_MIN);
+      if (timeout == -1 || timeout > poll) timeout = poll;
+    }
+
     do {
-      bool childExit = wait(pid, cnt, &retry, &exitStatus);
-      rsyncFifoData();
+      /* a put wakes us until the flush is armed, then a commit or a
+       * half full ring, the timer does the rest
+       */
+      int waitMs = timeout;
+      if (ring_.hdr && dcron_ring_sleep(&ring_, flushArmed_ ? DCRON_RING_WAKE_BARRIER : DCRON_RING_WAKE_PUT) == -1) {
+        waitMs = 0;
+      }
+
+      struct epoll_event events[EPOLL_EVENT_MAX];
+      int nfds = epoll_wait(epollFd_, events, EPOLL_EVENT_MAX, waitMs);
+      if (nfds == -1 && errno != EINTR) {
+        log_fatal(errno, "%s epoll_wait error", cnf_->name());
+        millisleep(10);
+      }
+      if (ring_.hdr) dcron_ring_awake(&ring_);
+
+      bool childEvent = nfds == 0 && waitMs != 0;
+      for (int i = 0; i < nfds; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == fifoFd_) {
+          rsyncFifoData(false);
+        } else if (fd == timerFd_) {
+          drainFd(timerFd_, sizeof(uint64_t));
+          flushArmed_ = false;
+          rsyncFifoData(true);
+        } else if (fd == eventFd_) {
+          drainFd(eventFd_, sizeof(uint64_t));
+        } else if (fd == bellFd_) {
+          drainFd(bellFd_, sizeof(uint64_t));
+        } else if (fd == sigFd_) {
+          drainFd(sigFd_, sizeof(struct signalfd_siginfo));
+          childEvent = true;
+        } else if (fd == childFd) {
+          childEvent = true;
+        } else if (fd == capture_[0].fd() || fd == capture_[1].fd()) {
+          StdioCapture &capture = capture_[fd == capture_[0].fd() ? 0 : 1];
+          if (!capture.drain()) {  // every writer is gone
+            delEvent(fd);
+            capture.stop();
+          }
+        }
+      }
+      if (ring_.hdr) rsyncFifoData(false);
 
-      if (childExit) {
+      if (childEvent && wait(pid, cnt, &retry, &exitStatus)) {
+        rsyncFifoData(true);
         break;
       } else if (zkStatus_ == SESSION_GONE) {  // session expired
         kill(pid, SIGTERM);
         log_error(0, "zookeeper session expired, had lost master, exit");
+        exitStatus = INTERNAL_ERROR_STATUS;
+        break;
+      } else if (cnf_->fastFailover() && leaseExpired()) {
+        kill(pid, SIGTERM);
+        log_error(0, "%s zookeeper lost for %d ms, lease expired, exit", cnf_->name(), (int) session_->disconnected());
+        setZkStatus(SESSION_GONE);
+        exitStatus = INTERNAL_ERROR_STATUS;
         break;
-      } else {
-        millisleep(10);
       }
     } while (true);
+    stopCapture();
+    cgroup_.remove();
+
+    if (childFd != -1) {
+      delEvent(childFd);
+      close(childFd);
+    }
+  }
+
+  delEvent(fifoFd_);
+  close(fifoFd_);
+  fifoFd_ = -1;
+
+  if (timerFd_ != -1) {
+    delEvent(timerFd_);
+    close(timerFd_);
+    timerFd_ = -1;
   }
+  closeRing();
+  for (int i = 0; i < 2; ++i) capture_[i].close();
 
   unlink(cnf_->fifo());
   return exitStatus;
@@ -723,7 +1960,7 @@ int ZkMgr::exec(int argc, char *argv[])
 inline bool zooGetJson(zhandle_t *zh, const char *node, char *buffer, Json::Value *root)
 {
   int bufferLen = RENV_BUFFER_LEN;
-  int rc = zoo_get(zh, node, 0, buffer, &bufferLen, 0);
+  int rc = ZK_TIMED(OP_GET, zoo_get(zh, node, 0, buffer, &bufferLen, 0));
   if (rc != ZOK && rc != ZNONODE) {
     log_fatal(0, "zoo_get %s error, %s", node, zerror(rc));
     return false;
@@ -740,22 +1977,47 @@ void ZkMgr::suspend()
 {
   log_info(0, "%s %s suspend", cnf_->id(), cnf_->name());
 
-  pthread_mutex_lock(mutex_);
-  if (zkStatus_ == WORKER_SUSPEND) pthread_cond_wait(cond_, mutex_);
-  pthread_mutex_unlock(mutex_);
+  while (true) {
+    {
+      TraceSpan span("suspend");
+      pthread_mutex_lock(&mutex_);
+      while (zkStatus_ == WORKER_SUSPEND) pthread_cond_wait(&cond_, &mutex_);
+      pthread_mutex_unlock(&mutex_);
+    }
 
-  if (zkStatus_ == SESSION_GONE) return;  // session expired
+    if (zkStatus_ == SESSION_GONE) return;  // session expired
+    if (watchNode_ == masterNode_) break;
+
+    /* the worker before us is gone, follow the one before it. the first
+     * standby competes at once, the worker may have been the master's
+     */
+    std::vector<std::string> workers;
+    setZkStatus(WORKER_SUSPEND);
+    NodeStatus stat = listWorkers(&workers, 0);
+    if (stat == ZKOK && predecessor(workers) == masterNode_) break;
+    if (stat == ZKOK) stat = setWatch(0, &workers);
+    if (stat == ZKAGAIN) break;
+    if (stat != ZKOK) {
+      status_ = stat;
+      return;
+    }
+  }
 
   log_info(0, "%s %s wake up", cnf_->id(), cnf_->name());
+  TraceSpan span("wakeUp");
 
   if (!cnf_->llap()) {
     int bufferLen = RENV_BUFFER_LEN;
     std::auto_ptr<char> buffer(new char[bufferLen]);
-    int rc = zoo_get(zh_, statusNode_.c_str(), 0, buffer.get(), &bufferLen, 0);
+    int rc = ZK_TIMED(OP_GET, zoo_get(zh_, statusNode_.c_str(), 0, buffer.get(), &bufferLen, 0));
 
+    /* status is created empty with the taskid */
     if (cnf_->retryStrategy() == ConfigOpt::RETRY_ON_ABEXIT) {
-      if (rc == ZOK) status_ = OUT;
-      else if (rc != ZNONODE) status_ = ZKFATAL;
+      if (rc == ZOK) {
+        if (bufferLen > 0) status_ = OUT;
+      } else if (rc != ZNONODE) {
+        status_ = ZKFATAL;
+      }
     } else {   // ConfigOpt::RETRY_ON_CRASH
       if (rc == ZOK) {
         Json::Reader reader;
@@ -778,9 +2040,9 @@ void ZkMgr::suspend()
     do {
       status_ = competeMaster(false, 0);
       if (status_ == MASTER) {
-        zkStatus_ = MASTER_WAIT;
+        setZkStatus(MASTER_WAIT);
       } else if (status_ == SLAVE) {
-        zkStatus_ = WORKER_SUSPEND;
+        setZkStatus(WORKER_SUSPEND);
 
         NodeStatus stat = setWatch(0);
         if (stat != ZKOK) status_ = stat;
@@ -794,16 +2056,45 @@ bool ZkMgr::dump(std::string *json) const
   Json::Value obj(Json::objectValue);
   std::auto_ptr<char> buffer(new char[RENV_BUFFER_LEN]);
 
-  Json::Value root = Json::Value(Json::objectValue);
-  if (zooGetJson(zh_, llapNode_.c_str(), buffer.get(), &root)) obj["llap"] = root;
+  Checkpoint checkpoint(zh_, &ZOO_DCRON_ALL_ACL, llapNode_, cnf_->llapKeys());
+  if (checkpoint.load()) {
+    std::map<std::string, std::string> env;
+    checkpoint.env(&env);
+
+    obj["llap"] = Json::Value(Json::arrayValue);
+    for (std::map<std::string, std::string>::iterator ite = env.begin(); ite != env.end(); ++ite) {
+      Json::Value item(Json::objectValue);
+      item["k"] = ite->first;
+      item["v"] = ite->second;
+      obj["llap"].append(item);
+    }
+  }
+
+  Json::Value root;
+
+  obj["workers"] = Json::Value(Json::arrayValue);
+  struct String_vector children;
+  if (ZK_TIMED(OP_CHILDREN, zoo_get_children(zh_, workersNode_.c_str(), 0, &children)) == ZOK) {
+    std::map<std::string, std::string> workers;  // in join order
+    for (int i = 0; i < children.count; ++i) {
+      const char *dash = strrchr(children.data[i], '-');
+      if (dash) workers[dash + 1].assign(children.data[i], dash - children.data[i]);
+    }
+    deallocate_String_vector(&children);
 
-  root = Json::Value(Json::arrayValue);
-  if (zooGetJson(zh_, workersNode_.c_str(), buffer.get(), &root)) obj["workers"] = root;
+    for (std::map<std::string, std::string>::iterator ite = workers.begin(); ite != workers.end(); ++ite) {
+      obj["workers"].append(ite->second);
+    }
+  }
 
   root = Json::nullValue;
   zooGetJson(zh_, statusNode_.c_str(), buffer.get(), &root);
   obj["status"] = root;
 
+  root = Json::nullValue;
+  zooGetJson(zh_, affinityNode_.c_str(), buffer.get(), &root);
+  obj["affinity"] = root;
+
   Json::Value array(Json::arrayValue);
   for (int i = 0; i < 10; ++i) {
     root = Json::nullValue;
@@ -820,6 +2111,7 @@ bool ZkMgr::dump(std::string *json) const
   obj["statusNode"]  = statusNode_;
   obj["workersNode"] = workersNode_;
   obj["llapNode"]    = llapNode_;
+  obj["affinityNode"] = affinityNode_;
 
   json->assign(Json::FastWriter().write(obj));
   return true;
@@ -3,36 +3,135 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <pthread.h>
 #include <zookeeper/zookeeper.h>
 #include "configopt.h"
+#include "fifoingest.h"
+#include "dcron_ring.h"
+#include "stdiocap.h"
+#include "spawner.h"
+#include "cgroup.h"
+#include "metrics.h"
+
+class Checkpoint;
+
+/* a zookeeper session, dcron owns one, dcrond shares one among all the
+ * tasks of the same DCRON_ZK
+ */
+class ZkSession {
+public:
+  /* timeout in ms, the server may negotiate another one */
+  static ZkSession *create(const char *zkhost, int timeout, char *errbuf);
+
+  zhandle_t *handle() const { return zh_; }
+  const std::string &zkhost() const { return zkhost_; }
+  bool expired() const { return expired_; }
+
+  /* ms since the connection to zookeeper was lost, 0 while connected */
+  int64_t disconnected() const;
+
+  void retain();
+  void release();  // the last reference closes the session
+
+private:
+  ZkSession() : zh_(0), expired_(false), disconnectedAt_(0), refs_(1) {}
+  static void globalWatcher(zhandle_t *, int type, int state, const char *path, void *watcherCtx);
+
+  /* the expire fault of DCRON_ZKFAULT, the server closes the session */
+  static void expireAll();
+  void expire();
+
+  zhandle_t    *zh_;
+  std::string   zkhost_;
+  volatile bool expired_;
+  volatile int64_t disconnectedAt_;  // Metrics::nowUs()
+  int           refs_;
+};
 
 class ZkMgr {
 public:
   enum NodeStatus {MASTER, SLAVE, OUT, ZKOK, ZKAGAIN, ZKFATAL};
   enum ZkStatus { MASTER_GONE, SESSION_GONE, MASTER_WAIT, WORKER_SUSPEND };
 
-  static ZkMgr *create(ConfigOpt *cnf, char *errbuf);
+  static ZkMgr *create(ConfigOpt *cnf, ZkSession *session, char *errbuf);
   static const char *statusToString(NodeStatus status);
 
+  /* elect, suspend and exec until the task is done, returns the exit code */
+  static int run(ConfigOpt *cnf, ZkSession *session, int argc, char *argv[]);
+
+  ~ZkMgr();
+
   NodeStatus status() const { return status_; }
+  Metrics *metrics() { return &metrics_; }
   int exec(int argc, char *argv[]);
   void suspend();
   bool dump(std::string *json) const;
 
 private:
+  ZkMgr() {}
+
+  static ZkMgr *acquire(void *watcherCtx);
+  static void unacquire();
+  void sessionGone();
+  void setZkStatus(ZkStatus status);
+  void leave();
+
+  /* startup, the serial zoo_* calls or the pipelined state machine */
+  enum StartState { START_WORKDIR, START_PARENTS, START_ELECT, START_COMPETE, START_JOIN, START_DONE };
+  bool startSerial(int rank, char *errbuf);
+  bool startPipelined(int rank, char *errbuf);
+
+  void workDirPaths();
   bool createWorkDir(char *errbuf);
+  int  affinityRank();
+  std::string capacity(int rank);
+  bool publishCapacity(int rank, char *errbuf);
+  /* watch sets watchElection on the candidates */
+  bool bestCandidate(std::string *best, char *errbuf, bool watch = false);
+  bool collectCandidates(std::string *best, char *errbuf);
+  void waitElection(const std::string &best);
+  void waitAffinity();
+  void waitElectionWake(const std::string &best);
+  bool waitWake(int milli);
   NodeStatus competeMaster(bool first, char *errbuf);
+  NodeStatus recoverMaster(bool first, char *errbuf);
   NodeStatus joinWorkers(bool master, char *errbuf);
-  NodeStatus setWatch(char *errbuf);
-  pid_t exec(int argc, char *argv[], const std::map<std::string, std::string> &env, int cnt);
+  long joinedWorkers(const std::string &workerNode);
+  NodeStatus admitWorker(const std::vector<std::string> *workers, char *errbuf);
+  /* workers are the children of workersNode_ if the caller has them */
+  NodeStatus setWatch(char *errbuf, const std::vector<std::string> *workers = 0);
+  NodeStatus listWorkers(std::vector<std::string> *workers, char *errbuf);
+  std::string predecessor(const std::vector<std::string> &workers) const;
+  bool fetchFencing();
+  bool leaseExpired() const;
+  void buildEnv(const std::map<std::string, std::string> &env);
+  pid_t exec(int argc, char *argv[], int cnt, int *pidfd);
   bool wait(pid_t pid, size_t cnt, bool *retry, int *exitStatus);
-  void setStatus(int status);
-  void setResult(int retry, int status, const char *error = 0);
-  void rsyncFifoData();
+  /* report holds more members of the node, the stderr tail and the usage */
+  void setStatus(int status, const Json::Value &report = Json::Value(Json::objectValue));
+  void setResult(int retry, int status, const char *error = 0, const Json::Value &report = Json::Value(Json::objectValue));
+  void rsyncFifoData(bool flush);
+  void armFlush(int milli);
+  bool createRing();
+  void drainRing();
+  void closeRing();
+  void openCapture();
+  void startCapture();
+  void stopCapture();
+  void createCgroup(int cnt);
+  void exportMetrics(int exitStatus);
 
+  bool initEventLoop(char *errbuf);
+  bool addEvent(int fd);
+  void delEvent(int fd);
+  int  childEventFd(pid_t pid, int pidfd);
+  void notifyEvent();
+
+  static void watchElection(zhandle_t *, int type, int state, const char *path, void *watcherCtx);
   static void watchMasterNode(zhandle_t *, int type, int state, const char *path, void *watcherCtx);
-  static void globalWatcher(zhandle_t *, int type, int state, const char *path, void *watcherCtx);
+
+  friend class ZkSession;
 
 private:
   std::string taskPath_;
@@ -41,16 +140,65 @@ private:
   std::string statusNode_;
   std::string resultNode_;
   std::string llapNode_;
+  std::string affinityNode_;
+  std::string candidatesNode_;
+  std::string candidateNode_;
+  std::string lastRunner_;   // its candidate node, DCRON_STICK
+  std::string workerNode_;
 
   int fifoFd_;
+  int timerFd_;       // flushes the fifo records DCRON_FLUSH_INTERVAL after the first
+  bool flushArmed_;
+  FifoIngest ingest_;
 
+  int ringFd_;        // DCRON_RING
+  int bellFd_;        // DCRON_RING_BELL, an eventfd the task writes when we sleep
+  struct dcron_ring ring_;
+  uint32_t ringDropped_;
+  time_t   ringReported_;
+
+  StdioCapture capture_[2];  // stdout and stderr of the task, DCRON_STDIOCAP
+  Spawner      spawner_;
+  Cgroup       cgroup_;      // of the running child, DCRON_CGROUP
+  Metrics      metrics_;     // the current() of the thread of run, DCRON_METRICS
+  int64_t      taskBegin_;
+  int64_t      taskTraceBegin_;  // DCRON_TRACE, the clock of the log
+
+  /* supervision loop, blocks on the child, the fifo and session events
+   * libzookeeper_mt owns the zk socket, watchers wake us up by eventFd_
+   */
+  int epollFd_;
+  int eventFd_;
+  int sigFd_;     // SIGCHLD signalfd when pidfd is not supported
+
+  /* watchers get serial_ as context, a watch may fire after the ZkMgr
+   * of a dcrond task is gone
+   */
+  long        serial_;
+  ZkSession  *session_;
   zhandle_t  *zh_;
   NodeStatus  status_;
   ConfigOpt  *cnf_;
+  std::string envStick_;
+
+  /* the master node, or the worker of the standby before us */
+  std::string watchNode_;
+
+  /* the llap checkpoint read right after winning master, exec needs no
+   * round trip of its own
+   */
+  bool        llapFetched_;
+  std::string llapEnv_;
+  int         llapVersion_;
+  Checkpoint *checkpoint_;
+
+  /* czxid of our master node, DCRON_FENCING, a later master has a greater one */
+  int64_t     fencing_;
 
   ZkStatus zkStatus_;
-  pthread_mutex_t *mutex_;
-  pthread_cond_t  *cond_;
+  bool     electWake_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t  cond_;
 };
 
 #endif
@@ -0,0 +1,151 @@
+#include <cstring>
+#include "zkpipeline.h"
+#include "zktxn.h"
+
+ZkPipeline::ZkPipeline(zhandle_t *zh) : zh_(zh), pending_(0)
+{
+  pthread_mutex_init(&mutex_, 0);
+  pthread_cond_init(&cond_, 0);
+}
+
+ZkPipeline::~ZkPipeline()
+{
+  clear();
+  pthread_mutex_destroy(&mutex_);
+  pthread_cond_destroy(&cond_);
+}
+
+/* pending_ is counted before the request is sent, the completion may
+ * run on the zookeeper thread before zoo_a* returns
+ */
+ZkPipeline::Req *ZkPipeline::add(Histogram *histogram, ZkTxn *txn)
+{
+  Req *req = new Req;
+  req->pipe = this;
+  req->txn  = txn;
+  req->rc   = ZOK;
+  req->histogram = histogram;
+  req->begin = histogram ? Metrics::nowUs() : 0;
+  memset(&req->stat, 0, sizeof(req->stat));
+  reqs_.push_back(req);
+
+  pthread_mutex_lock(&mutex_);
+  ++pending_;
+  pthread_mutex_unlock(&mutex_);
+  return req;
+}
+
+/* the request never reached the wire, no completion will come */
+void ZkPipeline::queued(Req *req, int rc)
+{
+  if (rc != ZOK) done(req, rc);
+}
+
+void ZkPipeline::done(Req *req, int rc)
+{
+  if (req->histogram) req->histogram->observe(Metrics::nowUs() - req->begin);
+  if (req->txn) req->txn->finish(rc);
+
+  pthread_mutex_lock(&mutex_);
+  req->rc = rc;
+  if (--pending_ == 0) pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+size_t ZkPipeline::create(const std::string &path, const std::string &value, int flags, struct ACL_vector *acl)
+{
+  Req *req = add(Metrics::zkCall(Metrics::OP_CREATE));
+  queued(req, ZK_FAULTED(zoo_acreate(zh_, path.c_str(), value.empty() ? 0 : value.data(),
+                                     value.empty() ? -1 : (int) value.size(), acl, flags, stringCompletion, req)));
+  return reqs_.size() - 1;
+}
+
+size_t ZkPipeline::get(const std::string &path)
+{
+  Req *req = add(Metrics::zkCall(Metrics::OP_GET));
+  queued(req, ZK_FAULTED(zoo_aget(zh_, path.c_str(), 0, dataCompletion, req)));
+  return reqs_.size() - 1;
+}
+
+size_t ZkPipeline::exists(const std::string &path, watcher_fn watcher, void *watcherCtx)
+{
+  Req *req = add(Metrics::zkCall(Metrics::OP_EXISTS));
+  queued(req, ZK_FAULTED(zoo_awexists(zh_, path.c_str(), watcher, watcherCtx, statCompletion, req)));
+  return reqs_.size() - 1;
+}
+
+size_t ZkPipeline::children(const std::string &path)
+{
+  Req *req = add(Metrics::zkCall(Metrics::OP_CHILDREN));
+  queued(req, ZK_FAULTED(zoo_aget_children(zh_, path.c_str(), 0, stringsCompletion, req)));
+  return reqs_.size() - 1;
+}
+
+size_t ZkPipeline::multi(ZkTxn *txn)
+{
+  if (txn->size() == 0) {
+    add(0);   // nothing is sent
+    done(reqs_.back(), ZOK);
+    return reqs_.size() - 1;
+  }
+
+  txn->prepare();
+  Req *req = add(Metrics::zkCall(Metrics::OP_MULTI), txn);
+  queued(req, ZK_FAULTED(zoo_amulti(zh_, txn->size(), &txn->zops_[0], &txn->results_[0], voidCompletion, req)));
+  return reqs_.size() - 1;
+}
+
+void ZkPipeline::wait()
+{
+  pthread_mutex_lock(&mutex_);
+  if (pending_ > 0) {
+    TraceSpan span("ZkPipeline::wait");
+    span.arg("requests", reqs_.size());
+    while (pending_ > 0) pthread_cond_wait(&cond_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ZkPipeline::clear()
+{
+  wait();
+  for (size_t i = 0; i < reqs_.size(); ++i) delete reqs_[i];
+  reqs_.clear();
+}
+
+void ZkPipeline::stringCompletion(int rc, const char *value, const void *data)
+{
+  Req *req = (Req *) data;
+  if (rc == ZOK && value) req->value.assign(value);
+  req->pipe->done(req, rc);
+}
+
+void ZkPipeline::dataCompletion(int rc, const char *value, int valueLen, const struct Stat *stat, const void *data)
+{
+  Req *req = (Req *) data;
+  if (rc == ZOK && value && valueLen > 0) req->value.assign(value, valueLen);
+  if (rc == ZOK && stat) req->stat = *stat;
+  req->pipe->done(req, rc);
+}
+
+void ZkPipeline::statCompletion(int rc, const struct Stat *stat, const void *data)
+{
+  Req *req = (Req *) data;
+  if (rc == ZOK && stat) req->stat = *stat;
+  req->pipe->done(req, rc);
+}
+
+void ZkPipeline::stringsCompletion(int rc, const struct String_vector *strings, const void *data)
+{
+  Req *req = (Req *) data;
+  if (rc == ZOK && strings) {
+    for (int i = 0; i < strings->count; ++i) req->strings.push_back(strings->data[i]);
+  }
+  req->pipe->done(req, rc);
+}
+
+void ZkPipeline::voidCompletion(int rc, const void *data)
+{
+  Req *req = (Req *) data;
+  req->pipe->done(req, rc);
+}
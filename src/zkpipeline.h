@@ -0,0 +1,89 @@
+#ifndef _ZKPIPELINE_H_
+#define _ZKPIPELINE_H_
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <zookeeper/zookeeper.h>
+#include "metrics.h"
+
+class ZkTxn;
+
+/* independent zookeeper requests sent back to back without waiting for
+ * the replies, the server answers them in order, so n requests cost one
+ * round trip instead of n
+ *
+ *   ZkPipeline pipe(zh);
+ *   size_t create = pipe.create(candidate, json, ZOO_EPHEMERAL, &acl);
+ *   size_t list   = pipe.children(candidates);
+ *   pipe.wait();
+ *   if (pipe.rc(create) == ZOK) ... pipe.strings(list) ...
+ *
+ * a request depending on an earlier one of the same pipeline sees its
+ * effect, a create after the create of its parent succeeds
+ *
+ * every request is timed into the Metrics of the thread that queued it,
+ * from zoo_a* to its completion
+ */
+class ZkPipeline {
+public:
+  explicit ZkPipeline(zhandle_t *zh);
+  ~ZkPipeline();   // waits for the requests in flight
+
+  /* queue a request, returns its index */
+  size_t create(const std::string &path, const std::string &value, int flags, struct ACL_vector *acl);
+  size_t get(const std::string &path);
+  size_t exists(const std::string &path, watcher_fn watcher, void *watcherCtx);
+  size_t children(const std::string &path);
+  size_t multi(ZkTxn *txn);   // txn must outlive wait()
+
+  /* blocks until every request queued is answered */
+  void wait();
+  void clear();
+
+  size_t size() const { return reqs_.size(); }
+
+  int rc(size_t i) const { return reqs_[i]->rc; }
+
+  /* data of get, the path made by create */
+  const std::string &value(size_t i) const { return reqs_[i]->value; }
+
+  /* children of children */
+  const std::vector<std::string> &strings(size_t i) const { return reqs_[i]->strings; }
+
+  /* stat of get and exists */
+  const struct Stat &stat(size_t i) const { return reqs_[i]->stat; }
+
+private:
+  struct Req {
+    ZkPipeline *pipe;
+    ZkTxn      *txn;
+    int         rc;
+    std::string value;
+    std::vector<std::string> strings;
+    struct Stat stat;
+    Histogram  *histogram;
+    int64_t     begin;
+  };
+
+  Req *add(Histogram *histogram, ZkTxn *txn = 0);
+  void queued(Req *req, int rc);
+  void done(Req *req, int rc);
+
+  static void stringCompletion(int rc, const char *value, const void *data);
+  static void dataCompletion(int rc, const char *value, int valueLen, const struct Stat *stat, const void *data);
+  static void statCompletion(int rc, const struct Stat *stat, const void *data);
+  static void stringsCompletion(int rc, const struct String_vector *strings, const void *data);
+  static void voidCompletion(int rc, const void *data);
+
+  ZkPipeline(const ZkPipeline &);
+  ZkPipeline &operator=(const ZkPipeline &);
+
+  zhandle_t *zh_;
+  std::vector<Req *> reqs_;
+  int pending_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t  cond_;
+};
+
+#endif
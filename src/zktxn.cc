@@ -0,0 +1,95 @@
+#include <cstring>
+#include "zktxn.h"
+#include "metrics.h"
+
+#define ZKPATH_MAX 1024
+
+ZkTxn &ZkTxn::add(OpType type, const std::string &path, const std::string &value, int flags, int version)
+{
+  Op op;
+  op.type    = type;
+  op.path    = path;
+  op.value   = value;
+  op.flags   = flags;
+  op.version = version;
+  ops_.push_back(op);
+  return *this;
+}
+
+ZkTxn &ZkTxn::create(const std::string &path, const std::string &value, int flags)
+{
+  return add(CREATE, path, value, flags, -1);
+}
+
+ZkTxn &ZkTxn::set(const std::string &path, const std::string &value, int version)
+{
+  return add(SET, path, value, 0, version);
+}
+
+ZkTxn &ZkTxn::del(const std::string &path, int version)
+{
+  return add(DELETE, path, std::string(), 0, version);
+}
+
+ZkTxn &ZkTxn::check(const std::string &path, int version)
+{
+  return add(CHECK, path, std::string(), 0, version);
+}
+
+void ZkTxn::prepare()
+{
+  failed_ = -1;
+
+  size_t n = ops_.size();
+  zops_.resize(n);
+  results_.resize(n);
+  paths_.resize(n * ZKPATH_MAX);
+  memset(&results_[0], 0, n * sizeof(zoo_op_result_t));
+
+  for (size_t i = 0; i < n; ++i) {
+    const Op &op = ops_[i];
+    const char *value = op.value.empty() ? 0 : op.value.data();
+    int valueLen = op.value.empty() ? -1 : (int) op.value.size();
+
+    if (op.type == CREATE) {
+      zoo_create_op_init(&zops_[i], op.path.c_str(), value, valueLen, acl_, op.flags,
+                         &paths_[i * ZKPATH_MAX], ZKPATH_MAX);
+    } else if (op.type == SET) {
+      zoo_set_op_init(&zops_[i], op.path.c_str(), op.value.data(), op.value.size(), op.version, 0);
+    } else if (op.type == DELETE) {
+      zoo_delete_op_init(&zops_[i], op.path.c_str(), op.version);
+    } else {
+      zoo_check_op_init(&zops_[i], op.path.c_str(), op.version);
+    }
+  }
+}
+
+int ZkTxn::finish(int rc)
+{
+  size_t n = ops_.size();
+  if (rc == ZOK) {
+    for (size_t i = 0; i < n; ++i) {
+      if (ops_[i].type == CREATE) ops_[i].created.assign(&paths_[i * ZKPATH_MAX]);
+    }
+  } else {
+    /* the ops before the failed one report ZOK, the ones after it
+     * ZRUNTIMEINCONSISTENCY
+     */
+    for (size_t i = 0; i < n; ++i) {
+      if (results_[i].err != ZOK && results_[i].err != ZRUNTIMEINCONSISTENCY) {
+        failed_ = i;
+        break;
+      }
+    }
+  }
+  return rc;
+}
+
+int ZkTxn::commit()
+{
+  failed_ = -1;
+  if (ops_.empty()) return ZOK;
+
+  prepare();
+  return finish(ZK_TIMED(OP_MULTI, zoo_multi(zh_, ops_.size(), &zops_[0], &results_[0])));
+}
@@ -0,0 +1,71 @@
+#ifndef _ZKTXN_H_
+#define _ZKTXN_H_
+
+#include <string>
+#include <vector>
+#include <zookeeper/zookeeper.h>
+
+/* batches dependent zookeeper writes into one zoo_multi, they are applied
+ * atomically in one round trip
+ *
+ *   ZkTxn txn(zh, &acl);
+ *   txn.create(master, id, ZOO_EPHEMERAL).create(worker, id, ZOO_EPHEMERAL | ZOO_SEQUENCE);
+ *   int rc = txn.commit();
+ *   if (rc == ZNODEEXISTS && txn.failed() == 0) ...
+ *
+ * ZCONNECTIONLOSS leaves it unknown whether the whole batch was applied
+ */
+class ZkTxn {
+public:
+  /* acl is used by the create ops */
+  ZkTxn(zhandle_t *zh, struct ACL_vector *acl) : zh_(zh), acl_(acl), failed_(-1) {}
+
+  ZkTxn &create(const std::string &path, const std::string &value = std::string(), int flags = 0);
+  ZkTxn &set(const std::string &path, const std::string &value, int version = -1);
+  ZkTxn &del(const std::string &path, int version = -1);
+  ZkTxn &check(const std::string &path, int version);
+
+  size_t size() const { return ops_.size(); }
+  void clear() { ops_.clear(); failed_ = -1; }
+
+  /* ZOK, or the error of the first failed op */
+  int commit();
+
+  /* index of the op that failed the batch, -1 if none */
+  int failed() const { return failed_; }
+
+  /* the path a create op made, with the sequence suffix */
+  const std::string &created(size_t i) const { return ops_[i].created; }
+
+  const std::string &path(size_t i) const { return ops_[i].path; }
+
+private:
+  friend class ZkPipeline;
+
+  /* zoo_multi and zoo_amulti share the request and the result handling */
+  void prepare();
+  int  finish(int rc);
+
+  enum OpType { CREATE, SET, DELETE, CHECK };
+  struct Op {
+    OpType      type;
+    std::string path;
+    std::string value;
+    int         flags;
+    int         version;
+    std::string created;
+  };
+
+  ZkTxn &add(OpType type, const std::string &path, const std::string &value, int flags, int version);
+
+  zhandle_t *zh_;
+  struct ACL_vector *acl_;
+  std::vector<Op> ops_;
+  int failed_;
+
+  std::vector<zoo_op_t>        zops_;
+  std::vector<zoo_op_result_t> results_;
+  std::vector<char>            paths_;
+};
+
+#endif
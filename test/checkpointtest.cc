@@ -0,0 +1,337 @@
+/* Checkpoint against zksim, the legacy node, chunks and the manifest,
+ * the crc and length check, a stale master and the eviction
+ * usage: checkpointtest, exits 1 at the first failed check
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <json/json.h>
+
+#include "logger.h"
+#include "checkpoint.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+#define LLAP "/task/llap"
+
+static void watcher(zhandle_t *, int, int, const char *, void *) {}
+
+static std::string get(zhandle_t *zh, const std::string &path, struct Stat *stat = 0)
+{
+  std::vector<char> buffer(1024 * 1024);
+  int len = buffer.size();
+  int rc = zoo_get(zh, path.c_str(), 0, &buffer[0], &len, stat);
+  CHECK(rc == ZOK, "zoo_get %s error, %s", path.c_str(), zerror(rc));
+  return std::string(&buffer[0], len > 0 ? len : 0);
+}
+
+static void set(zhandle_t *zh, const std::string &path, const std::string &value)
+{
+  int rc = zoo_set(zh, path.c_str(), value.data(), value.size(), -1);
+  CHECK(rc == ZOK, "zoo_set %s error, %s", path.c_str(), zerror(rc));
+}
+
+static Json::Value manifest(zhandle_t *zh)
+{
+  Json::Value root;
+  CHECK(Json::Reader().parse(get(zh, LLAP), root) && root.isObject(), "manifest is not an object");
+  return root;
+}
+
+static int children(zhandle_t *zh, const std::string &path)
+{
+  struct String_vector strings;
+  CHECK(zoo_get_children(zh, path.c_str(), 0, &strings) == ZOK, "zoo_get_children %s error", path.c_str());
+  int n = strings.count;
+  deallocate_String_vector(&strings);
+  return n;
+}
+
+static Checkpoint::Env loaded(zhandle_t *zh, size_t maxKeys = 4096)
+{
+  Checkpoint cp(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, maxKeys);
+  CHECK(cp.load(), "load error");
+  Checkpoint::Env env;
+  cp.env(&env);
+  return env;
+}
+
+/* the llap node empty, as the first run of the task leaves it */
+static void reset(zhandle_t *zh, const char *content = 0)
+{
+  zksim_reset();
+  zoo_create(zh, "/task", 0, -1, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0);
+  CHECK(zoo_create(zh, LLAP, content, content ? strlen(content) : -1, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0) == ZOK,
+        "create " LLAP " error");
+}
+
+static void testLegacy(zhandle_t *zh)
+{
+  reset(zh, "[{\"k\":\"A\",\"v\":\"1\"},{\"k\":\"B\",\"v\":\"2\"}]");
+
+  Checkpoint::Env env = loaded(zh);
+  CHECK(env.size() == 2 && env["A"] == "1" && env["B"] == "2", "legacy load error");
+
+  /* the first save converts it even without a change */
+  Checkpoint cp(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  CHECK(cp.save(Checkpoint::Env()), "save error");
+
+  Json::Value root = manifest(zh);
+  CHECK(root["chunks"].size() == 1, "chunks %d", (int) root["chunks"].size());
+  CHECK(children(zh, LLAP) == 1, "chunk-0000000000 is not created");
+
+  env = loaded(zh);
+  CHECK(env.size() == 2 && env["A"] == "1" && env["B"] == "2", "converted load error");
+
+  Checkpoint::Env update;
+  update["B"] = "3";
+  update["C"] = "4";
+  CHECK(cp.save(update), "save error");
+  env = loaded(zh);
+  CHECK(env.size() == 3 && env["A"] == "1" && env["B"] == "3" && env["C"] == "4", "update error");
+}
+
+static void testChunks(zhandle_t *zh)
+{
+  reset(zh);
+
+  /* 5000 keys of about 140 raw bytes, 8 chunks of at most 128K */
+  Checkpoint::Env update;
+  std::string value(100, 'v');
+  for (int i = 0; i < 5000; ++i) {
+    char key[16];
+    snprintf(key, sizeof(key), "K%05d", i);
+    update[key] = value + key;
+  }
+
+  Checkpoint cp(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 100000);
+  CHECK(cp.save(update), "save error");
+
+  Json::Value root = manifest(zh);
+  CHECK(root["chunks"].size() == 8, "chunks %d", (int) root["chunks"].size());
+  CHECK(children(zh, LLAP) == 8, "chunk nodes %d", children(zh, LLAP));
+  CHECK(loaded(zh) == update, "load of chunks error");
+
+  /* one key changes one chunk and the manifest, in one zoo_multi */
+  std::vector<int> versions;
+  for (int i = 0; i < 8; ++i) {
+    char node[64];
+    struct Stat stat;
+    snprintf(node, sizeof(node), LLAP "/chunk-%010d", i);
+    get(zh, node, &stat);
+    versions.push_back(stat.version);
+  }
+
+  Checkpoint::Env one;
+  one["K00000"] = "changed";
+  int64_t multi = zksim_op_count(ZKSIM_MULTI);
+  int64_t ops   = zksim_ops();
+  CHECK(cp.save(one), "save error");
+  CHECK(zksim_op_count(ZKSIM_MULTI) == multi + 1 && zksim_ops() == ops + 1, "save is not one zoo_multi");
+
+  int changed = 0;
+  for (int i = 0; i < 8; ++i) {
+    char node[64];
+    struct Stat stat;
+    snprintf(node, sizeof(node), LLAP "/chunk-%010d", i);
+    get(zh, node, &stat);
+    changed += stat.version != versions[i];
+  }
+  CHECK(changed == 1, "%d chunks are written", changed);
+
+  /* no change, no round trip, the cache is fresh */
+  ops = zksim_ops();
+  CHECK(cp.save(one), "save error");
+  CHECK(zksim_ops() == ops, "an unchanged save sent %d requests", (int) (zksim_ops() - ops));
+
+  /* the chunks shrink back to one, the others are deleted */
+  Checkpoint small(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 10);
+  one["K00001"] = "changed";
+  CHECK(small.save(one), "save error");
+  CHECK(manifest(zh)["chunks"].size() == 1, "chunks %d", (int) manifest(zh)["chunks"].size());
+  CHECK(children(zh, LLAP) == 1, "chunk nodes %d", children(zh, LLAP));
+
+  /* the 10 most recently updated keys */
+  Checkpoint::Env env = loaded(zh);
+  CHECK(env.size() == 10, "%d keys", (int) env.size());
+  CHECK(env["K00000"] == "changed" && env["K00001"] == "changed", "updated keys are dropped");
+  for (int i = 4992; i < 5000; ++i) {
+    char key[16];
+    snprintf(key, sizeof(key), "K%05d", i);
+    CHECK(env.find(key) != env.end(), "%s is dropped", key);
+  }
+}
+
+static void testCorrupted(zhandle_t *zh)
+{
+  reset(zh);
+  Checkpoint::Env update;
+  update["A"] = "1";
+  Checkpoint cp(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  CHECK(cp.save(update), "save error");
+
+  std::string good = get(zh, LLAP);
+  Json::Value root = manifest(zh);
+  Json::Value bad = root;
+
+  bad["chunks"][0]["len"] = root["chunks"][0]["len"].asUInt() + 1;
+  set(zh, LLAP, Json::FastWriter().write(bad));
+  CHECK(!Checkpoint(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096).load(), "a wrong len is loaded");
+
+  bad = root;
+  bad["chunks"][0]["crc"] = root["chunks"][0]["crc"].asUInt() ^ 1;
+  set(zh, LLAP, Json::FastWriter().write(bad));
+  CHECK(!Checkpoint(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096).load(), "a wrong crc is loaded");
+
+  /* the same length deflated, another content */
+  set(zh, LLAP, good);
+  std::string raw = "{\"B\":[\"1\",1]}";
+  std::string data(compressBound(raw.size()), '\0');
+  uLongf dataLen = data.size();
+  CHECK(compress((Bytef *) &data[0], &dataLen, (const Bytef *) raw.data(), raw.size()) == Z_OK, "compress error");
+  data.resize(dataLen);
+  set(zh, LLAP "/chunk-0000000000", data);
+  CHECK(!Checkpoint(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096).load(), "another content is loaded");
+
+  set(zh, LLAP "/chunk-0000000000", "not deflated");
+  CHECK(!Checkpoint(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096).load(), "garbage is loaded");
+
+  /* a chunk of the manifest is missing */
+  bad = root;
+  bad["chunks"].append(root["chunks"][0]);
+  set(zh, LLAP, Json::FastWriter().write(bad));
+  CHECK(!Checkpoint(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096).load(), "a missing chunk is loaded");
+}
+
+/* the master node of zh, its czxid is the fencing */
+static int64_t master(zhandle_t *zh)
+{
+  int rc = zoo_create(zh, "/task/master", "node", 4, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, 0, 0);
+  CHECK(rc == ZOK, "create /task/master error, %s", zerror(rc));
+  struct Stat stat;
+  get(zh, "/task/master", &stat);
+  return stat.czxid;
+}
+
+/* a master that has not noticed it lost never writes after the new one */
+static void testStale(zhandle_t *zh)
+{
+  reset(zh);
+  zhandle_t *zh2 = zookeeper_init("sim:2181", watcher, 15000, 0, 0, 0);
+  CHECK(zh2, "zookeeper_init error");
+
+  Checkpoint oldMaster(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  Checkpoint newMaster(zh2, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  oldMaster.setFencing("/task/master", master(zh));
+  CHECK(zoo_delete(zh, "/task/master", -1) == ZOK, "delete /task/master error");
+  newMaster.setFencing("/task/master", master(zh2));
+  CHECK(oldMaster.load() && newMaster.load(), "load error");
+
+  Checkpoint::Env update;
+  update["X"] = "new";
+  CHECK(newMaster.save(update), "save error");
+  CHECK(manifest(zh)["fencing"].asInt64() > 0, "no fencing in the manifest");
+
+  struct Stat before, after;
+  get(zh, LLAP, &before);
+  update["X"] = "old";
+  int64_t multi = zksim_op_count(ZKSIM_MULTI);
+  CHECK(!oldMaster.save(update), "a stale save succeeded");
+  CHECK(oldMaster.fenced(), "the stale writer is not fenced");
+
+  /* fenced for good, a retry does not even try */
+  CHECK(!oldMaster.save(update), "a retry succeeded");
+  CHECK(zksim_op_count(ZKSIM_MULTI) == multi + 1, "%d zoo_multi", (int) (zksim_op_count(ZKSIM_MULTI) - multi));
+  get(zh, LLAP, &after);
+  CHECK(after.version == before.version && after.mzxid == before.mzxid, "the stale save changed the manifest");
+  CHECK(loaded(zh)["X"] == "new", "the stale value is written");
+
+  update["Y"] = "1";
+  CHECK(newMaster.save(update), "the new master is fenced");
+  CHECK(loaded(zh)["X"] == "old" && loaded(zh)["Y"] == "1", "the new master is not written");
+
+  /* the old master node is gone before the old master wrote */
+  reset(zh);
+  Checkpoint zombie(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  zombie.setFencing("/task/master", master(zh));
+  CHECK(zoo_delete(zh, "/task/master", -1) == ZOK, "delete /task/master error");
+  CHECK(zombie.load(), "load error");
+  update.clear();
+  update["Z"] = "zombie";
+  CHECK(!zombie.save(update) && zombie.fenced(), "a save without the master node");
+  CHECK(get(zh, LLAP).empty() && children(zh, LLAP) == 0, "the zombie wrote");
+
+  /* the one of the new master node writes, the zombie never */
+  Checkpoint winner(zh2, &ZOO_OPEN_ACL_UNSAFE, LLAP, 4096);
+  winner.setFencing("/task/master", master(zh2));
+  update["Z"] = "winner";
+  CHECK(winner.save(update), "save error");
+  CHECK(!zombie.save(update), "the zombie wrote after the winner");
+  CHECK(loaded(zh)["Z"] == "winner", "the winner is not written");
+
+  zookeeper_close(zh2);
+}
+
+static void testEvict(zhandle_t *zh)
+{
+  reset(zh);
+  Checkpoint cp(zh, &ZOO_OPEN_ACL_UNSAFE, LLAP, 3);
+
+  const char *keys[] = {"a", "b", "c", "a", "d", 0};
+  for (int i = 0; keys[i]; ++i) {
+    Checkpoint::Env update;
+    update[keys[i]] = keys[i + 1] ? "1" : "2";
+    if (i == 3) update["a"] = "refreshed";
+    CHECK(cp.save(update), "save %s error", keys[i]);
+  }
+
+  CHECK(cp.size() == 3, "%d keys cached", (int) cp.size());
+  Checkpoint::Env env = loaded(zh, 3);
+  CHECK(env.size() == 3 && env.count("a") && env.count("c") && env.count("d"), "b should be dropped");
+  CHECK(env["a"] == "refreshed", "a error");
+
+  /* one save beyond the limit keeps its newest keys */
+  Checkpoint::Env update;
+  update["e"] = "1";
+  update["f"] = "1";
+  update["g"] = "1";
+  update["h"] = "1";
+  CHECK(cp.save(update), "save error");
+  env = loaded(zh, 3);
+  CHECK(env.size() == 3 && env.count("f") && env.count("g") && env.count("h"), "e should be dropped");
+}
+
+int main()
+{
+  zksim_config(0, 1.0);
+  if (!Logger::create("/tmp/checkpointtest.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  zhandle_t *zh = zookeeper_init("sim:2181", watcher, 15000, 0, 0, 0);
+  CHECK(zh, "zookeeper_init error");
+
+  testLegacy(zh);
+  testChunks(zh);
+  testCorrupted(zh);
+  testStale(zh);
+  testEvict(zh);
+
+  zookeeper_close(zh);
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,146 @@
+/* the election of ZkMgr against zksim, a candidate with a worse score that
+ * arrives first must not win before the others are collected, serial and
+ * pipelined, and it does when DCRON_ELECT_WAIT is 0
+ * usage: electtest, exits 1 at the first failed check
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "configopt.h"
+#include "zkmgr.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+#define ERRBUF_MAX 1024
+#define BUSY_TASKS 50   // running tasks of the busy host, 5000 more in its score
+
+struct Candidate {
+  char id[32];
+  char name[64];
+  char libdir[128];
+  char pipeline[32];
+  char electWait[32];
+  int  delay;   // ms before it starts
+
+  ConfigOpt *cnf;
+  ZkSession *session;
+  ZkMgr     *mgr;
+  char       errbuf[ERRBUF_MAX];
+};
+
+static void *candidateRoutine(void *data)
+{
+  Candidate *c = (Candidate *) data;
+  usleep(c->delay * 1000);
+
+  char *argv[] = {(char *) "dcron", c->id, c->name, c->libdir, c->pipeline, c->electWait, (char *) "--",
+                  (char *) "/bin/true", 0};
+  int envc;
+  c->cnf = ConfigOpt::create(8, argv, &envc, c->errbuf);
+  c->session = c->cnf ? ZkSession::create(c->cnf->zkhost(), c->cnf->zkTimeout(), c->errbuf) : 0;
+  c->mgr = c->session ? ZkMgr::create(c->cnf, c->session, c->errbuf) : 0;
+  return 0;
+}
+
+/* a libdir with the fifos of n running tasks */
+static std::string libdir(const char *name, int n)
+{
+  char dir[128];
+  snprintf(dir, sizeof(dir), "/tmp/electtest.%d.%s", (int) getpid(), name);
+  mkdir(dir, 0755);
+  for (int i = 0; i < n; ++i) {
+    char fifo[160];
+    snprintf(fifo, sizeof(fifo), "%s/task%d.fifo", dir, i);
+    FILE *fp = fopen(fifo, "w");
+    CHECK(fp, "create %s error", fifo);
+    fclose(fp);
+  }
+  return dir;
+}
+
+static void init(Candidate *c, const char *id, const std::string &dir, bool pipeline, int electWait, int delay)
+{
+  memset(c, 0, sizeof(*c));
+  snprintf(c->id, sizeof(c->id), "DCRON_ID=%s", id);
+  snprintf(c->name, sizeof(c->name), "DCRON_NAME=electtest.%s%d.%%Y%%m%%d", pipeline ? "pipeline" : "serial", electWait);
+  snprintf(c->libdir, sizeof(c->libdir), "DCRON_LIBDIR=%s", dir.c_str());
+  snprintf(c->pipeline, sizeof(c->pipeline), "DCRON_ZKPIPELINE=%s", pipeline ? "true" : "false");
+  snprintf(c->electWait, sizeof(c->electWait), "DCRON_ELECT_WAIT=%d", electWait);
+  c->delay = delay;
+}
+
+static void release(Candidate *c)
+{
+  delete c->mgr;
+  if (c->session) c->session->release();
+  delete c->cnf;
+}
+
+/* the busy host starts first, the idle one 50ms later, within the window */
+static void elect(bool pipeline, int electWait, ZkMgr::NodeStatus busyStatus, ZkMgr::NodeStatus idleStatus)
+{
+  zksim_reset();
+  Candidate busy, idle;
+  init(&busy, "busy", libdir("busy", BUSY_TASKS), pipeline, electWait, 0);
+  init(&idle, "idle", libdir("idle", 0), pipeline, electWait, 50);
+
+  pthread_t tids[2];
+  pthread_create(&tids[0], 0, candidateRoutine, &busy);
+  pthread_create(&tids[1], 0, candidateRoutine, &idle);
+  pthread_join(tids[0], 0);
+  pthread_join(tids[1], 0);
+
+  const char *mode = pipeline ? "pipeline" : "serial";
+  CHECK(busy.mgr, "%s busy %s", mode, busy.errbuf);
+  CHECK(idle.mgr, "%s idle %s", mode, idle.errbuf);
+  CHECK(busy.mgr->status() == busyStatus && idle.mgr->status() == idleStatus,
+        "%s DCRON_ELECT_WAIT=%d busy %s, idle %s", mode, electWait, ZkMgr::statusToString(busy.mgr->status()),
+        ZkMgr::statusToString(idle.mgr->status()));
+
+  release(&busy);
+  release(&idle);
+}
+
+int main()
+{
+  zksim_config(1000, 1.0);
+  setenv("DCRON_ZK", "sim:2181/electtest", 1);
+  setenv("DCRON_LOGDIR", "/tmp", 1);
+  setenv("DCRON_AGENT", "none", 1);
+  setenv("DCRON_STDIOCAP", "false", 1);
+  setenv("DCRON_CGROUP", "none", 1);
+  setenv("DCRON_METRICS", "false", 1);
+  if (!Logger::create("/tmp/electtest.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  elect(false, 1000, ZkMgr::SLAVE, ZkMgr::MASTER);
+  elect(true, 1000, ZkMgr::SLAVE, ZkMgr::MASTER);
+
+  /* without the window the first to arrive ranks itself alone */
+  elect(false, 0, ZkMgr::MASTER, ZkMgr::SLAVE);
+  elect(true, 0, ZkMgr::MASTER, ZkMgr::SLAVE);
+
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "rm -rf /tmp/electtest.%d.busy /tmp/electtest.%d.idle", (int) getpid(), (int) getpid());
+  CHECK(system(cmd) == 0, "%s error", cmd);
+  printf("OK\n");
+  return 0;
+}
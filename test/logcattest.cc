@@ -0,0 +1,184 @@
+/* the binary log through dcron-logcat, the same log_* calls logged as text
+ * and in DCRON_LOG_FORMAT=BINARY, sync and async, must read the same but
+ * for the time and the microseconds
+ * usage: logcattest, dcron-logcat is beside it, exits 1 at the first
+ * failed check
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <json/json.h>
+
+#include "logger.h"
+
+LOGGER_INIT();
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+/* a forked child logs with its own pid, synchronously, after the lines
+ * the writer of the parent has in its queue
+ */
+static void logChild()
+{
+  Logger::defLogger->flush();
+  pid_t pid = fork();
+  CHECK(pid != -1, "fork error");
+  if (pid == 0) {
+    log_info(0, "child %s", "line");
+    _exit(0);
+  }
+  CHECK(waitpid(pid, 0, 0) == pid, "waitpid error");
+}
+
+/* every conversion the encoder knows */
+static void logAll()
+{
+  const char *nil = 0;
+  void *ptr = (void *) 0x7f001234;
+  std::string longValue(300, 'x');
+
+  log_info(0, "plain line");
+  log_info(0, "%d %i %u %o %x %X %c", -42, 7, 4000000000u, 8, 255, 255, 'z');
+  log_info(0, "%ld %lu %lld %llx %zu %zd %jd %td", -1L, 1UL << 40, -(1LL << 50), 1ULL << 63, (size_t) 12,
+           (ssize_t) -12, (intmax_t) -3, (ptrdiff_t) 5);
+  log_info(0, "%hhd %hhu %hd %hu", 300, 300, 70000, 70000);
+  log_info(0, "%f %5.2f %e %g %G %a %Lf", 1.5, 3.14159, 12345.678, 0.0001, 1e20, 1.0, (long double) 2.25);
+  log_info(0, "%s|%.3s|%10s|%-10s|%s", "value", "abcdef", "right", "left", nil);
+  log_info(0, "%*d|%-*d|%.*s|%*.*f", 6, 42, 6, 42, 2, "abc", 8, 3, 2.5);
+  log_info(0, "%p 100%% %05d %+d % d %#x", ptr, 7, 7, 7, 255);
+  log_info(0, "long %s", longValue.c_str());
+  log_error(ENOENT, "open %s error", "/nonexistent");
+  log_fatal(EACCES, "fatal %d", 1);
+  log_debug(0, "debug %s", "line");
+  log_opaque("stderr text between the records", 31, true);
+  for (int i = 0; i < 3; ++i) log_info(0, "loop %d", i);
+  logChild();
+}
+
+static std::vector<std::string> readLines(FILE *fp)
+{
+  std::vector<std::string> lines;
+  char buffer[8192];
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    size_t len = strlen(buffer);
+    if (len > 0 && buffer[len-1] == '\n') buffer[len-1] = '\0';
+    lines.push_back(buffer);
+  }
+  return lines;
+}
+
+/* without "%Y-%m-%d %H:%M:%S " and the microseconds of "[LEVEL] #usec" */
+static std::string normalize(const std::string &line)
+{
+  int y, m, d, hh, mm, ss;
+  if (line.size() < 20 || sscanf(line.c_str(), "%4d-%2d-%2d %2d:%2d:%2d ", &y, &m, &d, &hh, &mm, &ss) != 6) {
+    return line;
+  }
+  std::string s = line.substr(20);
+  size_t pos = s.find("] #");
+  if (pos == std::string::npos) return s;
+  size_t end = s.find(' ', pos + 3);
+  return s.substr(0, pos + 3) + "0" + s.substr(end);
+}
+
+static std::vector<std::string> logcat(const std::string &bin, const std::string &file, bool json)
+{
+  std::string cmd = bin + (json ? " -j " : " ") + file;
+  FILE *fp = popen(cmd.c_str(), "r");
+  CHECK(fp, "popen %s error", cmd.c_str());
+  std::vector<std::string> lines = readLines(fp);
+  CHECK(pclose(fp) == 0, "%s failed", cmd.c_str());
+  return lines;
+}
+
+/* the default logger */
+static void logger(const std::string &file, bool binary, bool async)
+{
+  unlink(file.c_str());
+  Logger *log = Logger::create(file, Logger::NIL);
+  CHECK(log, "create logger %s error", file.c_str());
+  Logger::defLogger = log;
+  log->setLevel(Logger::DEBUG);
+  log->setBinary(binary);
+  if (async) CHECK(log->setAsync(1024, Logger::BLOCK), "setAsync error");
+}
+
+static void compare(const std::vector<std::string> &text, const std::vector<std::string> &lines, const char *name)
+{
+  CHECK(lines.size() == text.size(), "%s %d lines, text %d lines", name, (int) lines.size(), (int) text.size());
+  for (size_t i = 0; i < text.size(); ++i) {
+    CHECK(normalize(lines[i]) == normalize(text[i]), "%s line %d\n  %s\n  %s", name, (int) i,
+          normalize(lines[i]).c_str(), normalize(text[i]).c_str());
+  }
+}
+
+int main(int, char *argv[])
+{
+  std::string dir(argv[0]);
+  std::string bin = std::string(dirname(&dir[0])) + "/dcron-logcat";
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "/tmp/logcattest.%d", (int) getpid());
+
+  /* text mode never assigns the site ids, the binary loggers see them new */
+  std::string textFile = std::string(prefix) + ".txt";
+  logger(textFile, false, false);
+  logAll();
+  FILE *fp = fopen(textFile.c_str(), "r");
+  CHECK(fp, "open %s error", textFile.c_str());
+  std::vector<std::string> text = readLines(fp);
+  fclose(fp);
+  CHECK(text.size() == 17, "%d text lines", (int) text.size());
+
+  std::string syncFile = std::string(prefix) + ".bin";
+  logger(syncFile, true, false);
+  logAll();
+  compare(text, logcat(bin, syncFile, false), "sync");
+
+  /* the sites are known now, the definitions go in front of the file */
+  std::string asyncFile = std::string(prefix) + ".async.bin";
+  logger(asyncFile, true, true);
+  logAll();
+  Logger::defLogger->flush();
+  compare(text, logcat(bin, asyncFile, false), "async");
+
+  /* the same as json, stdin and a file given twice */
+  std::vector<std::string> json = logcat(bin, "- " + syncFile + " < " + asyncFile, true);
+  CHECK(json.size() == text.size() * 2, "%d json lines", (int) json.size());
+  for (size_t i = 0; i < json.size(); ++i) {
+    Json::Value obj;
+    CHECK(Json::Reader().parse(json[i], obj) && obj.isObject(), "json line %d: %s", (int) i, json[i].c_str());
+
+    const std::string &line = text[i % text.size()];
+    if (obj.isMember("raw")) {
+      CHECK(obj["raw"].asString() == line, "raw %s", obj["raw"].asString().c_str());
+      continue;
+    }
+
+    size_t msg = line.find("\" ");
+    CHECK(msg != std::string::npos && obj["msg"].asString() == line.substr(msg + 2), "msg %s, expect %s",
+          obj["msg"].asString().c_str(), line.c_str());
+    CHECK(line.find("[" + obj["level"].asString() + "]") == 20, "level %s", obj["level"].asString().c_str());
+
+    char place[256];
+    snprintf(place, sizeof(place), "#%s@%d \"%d:", obj["file"].asString().c_str(), obj["line"].asInt(),
+             obj["errno"].asInt());
+    CHECK(line.find(place) != std::string::npos, "%s not in %s", place, line.c_str());
+  }
+
+  unlink(textFile.c_str());
+  unlink(syncFile.c_str());
+  unlink(asyncFile.c_str());
+  printf("OK\n");
+  return 0;
+}
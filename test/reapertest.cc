@@ -0,0 +1,194 @@
+/* Reaper::reap against zksim, DCRON_KEEP, DCRON_KEEP_DAYS and the
+ * instances it must not touch
+ * usage: reapertest, exits 1 at the first failed check
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <set>
+
+#include "logger.h"
+#include "reaper.h"
+#include "zksim.h"
+
+LOGGER_INIT();
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+#define TASKDIR "/dcron/task"
+
+enum { DONE = 0, STARTING = 1, MASTER = 2, CANDIDATE = 4 };
+
+static void watcher(zhandle_t *, int, int, const char *, void *) {}
+
+static void create(zhandle_t *zh, const std::string &path, const char *value = 0)
+{
+  int rc = zoo_create(zh, path.c_str(), value, value ? strlen(value) : -1, &ZOO_OPEN_ACL_UNSAFE, 0, 0, 0);
+  CHECK(rc == ZOK, "create %s error, %s", path.c_str(), zerror(rc));
+}
+
+static std::string instance(int i)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "t%04d", i);
+  return name;
+}
+
+/* an instance as ZkMgr leaves it, days is the age of its status */
+static void add(zhandle_t *zh, int i, int flags = DONE, int days = 0)
+{
+  std::string node = TASKDIR "/" + instance(i);
+  create(zh, node);
+  create(zh, node + "/status", (flags & STARTING) ? 0 : "{\"status\":0}");
+  if (days) zksim_touch((node + "/status").c_str(), ((int64_t) time(0) - days * 86400) * 1000);
+  if (flags & MASTER) create(zh, node + "/master", "node0000");
+  if (flags & CANDIDATE) {
+    create(zh, node + "/candidates");
+    create(zh, node + "/candidates/node0001");
+  }
+}
+
+/* the task dir with the llap checkpoint and the affinity, never reaped */
+static void reset(zhandle_t *zh)
+{
+  zksim_reset();
+  create(zh, "/dcron");
+  create(zh, TASKDIR);
+  create(zh, TASKDIR "/llap", "{\"seq\":1,\"chunks\":[]}");
+  create(zh, TASKDIR "/affinity", "{}");
+  create(zh, TASKDIR "/affinity/node0000");
+}
+
+static std::set<std::string> left(zhandle_t *zh)
+{
+  struct String_vector strings;
+  CHECK(zoo_get_children(zh, TASKDIR, 0, &strings) == ZOK, "zoo_get_children error");
+  std::set<std::string> names(strings.data, strings.data + strings.count);
+  deallocate_String_vector(&strings);
+
+  CHECK(names.erase("llap") && names.erase("affinity"), "llap or affinity is deleted");
+  CHECK(zoo_exists(zh, TASKDIR "/affinity/node0000", 0, 0) == ZOK, "affinity child is deleted");
+  return names;
+}
+
+static std::string ids(const std::set<std::string> &names)
+{
+  std::string s;
+  for (std::set<std::string>::const_iterator ite = names.begin(); ite != names.end(); ++ite) {
+    if (!s.empty()) s += ",";
+    s += *ite;
+  }
+  return s;
+}
+
+static void expect(zhandle_t *zh, const char *want)
+{
+  std::string got = ids(left(zh));
+  CHECK(got == want, "left %s, expect %s", got.c_str(), want);
+}
+
+static std::string taskPath(int i)
+{
+  return TASKDIR "/" + instance(i);
+}
+
+static void testKeep(zhandle_t *zh)
+{
+  reset(zh);
+  for (int i = 0; i < 10; ++i) add(zh, i);
+  CHECK(Reaper::reap(zh, taskPath(9), 3, 0) == 7, "keep 3 of 10");
+  expect(zh, "t0007,t0008,t0009");
+
+  CHECK(Reaper::reap(zh, taskPath(9), 3, 0) == 0, "nothing beyond keep");
+  CHECK(Reaper::reap(zh, taskPath(9), 0, 0) == 0, "0 is no limit");
+  expect(zh, "t0007,t0008,t0009");
+}
+
+static void testSkipped(zhandle_t *zh)
+{
+  reset(zh);
+  for (int i = 0; i < 8; ++i) {
+    int flags = DONE;
+    if (i == 1) flags = MASTER;
+    if (i == 2) flags = STARTING;
+    add(zh, i, flags);
+  }
+
+  /* the current one is older than the newest after the clock went back */
+  CHECK(Reaper::reap(zh, taskPath(3), 1, 0) == 4, "running ones are reaped");
+  expect(zh, "t0001,t0002,t0003,t0007");
+}
+
+static void testKeepDays(zhandle_t *zh)
+{
+  reset(zh);
+  add(zh, 0, DONE, 30);
+  add(zh, 1, MASTER, 30);
+  add(zh, 2, STARTING, 30);   // never finished, its age deletes it
+  add(zh, 3, DONE, 8);
+  add(zh, 4, DONE, 6);
+  add(zh, 5, DONE, 8);        // after a young one, the pass stops there
+  add(zh, 6);
+
+  CHECK(Reaper::reap(zh, taskPath(6), 0, 7) == 3, "keep 7 days");
+  expect(zh, "t0001,t0004,t0005,t0006");
+
+  /* the count deletes what the age keeps */
+  CHECK(Reaper::reap(zh, taskPath(6), 2, 7) == 2, "keep 2 and 7 days");
+  expect(zh, "t0001,t0006");
+}
+
+static void testBatchFails(zhandle_t *zh)
+{
+  reset(zh);
+  for (int i = 0; i < 6; ++i) add(zh, i, i == 1 ? CANDIDATE : DONE);
+
+  int64_t multi = zksim_op_count(ZKSIM_MULTI);
+  CHECK(Reaper::reap(zh, taskPath(5), 2, 0) == 3, "one by one after the batch failed");
+  CHECK(zksim_op_count(ZKSIM_MULTI) == multi + 5, "%d zoo_multi", (int) (zksim_op_count(ZKSIM_MULTI) - multi));
+  expect(zh, "t0001,t0004,t0005");
+  CHECK(zoo_exists(zh, TASKDIR "/t0001/status", 0, 0) == ZOK, "a busy instance is half deleted");
+}
+
+/* a backlog drains over passes */
+static void testMax(zhandle_t *zh)
+{
+  reset(zh);
+  for (int i = 0; i < 100; ++i) add(zh, i);
+
+  CHECK(Reaper::reap(zh, taskPath(99), 1, 0) == 64, "a pass deletes 64");
+  CHECK(left(zh).size() == 36, "%d left", (int) left(zh).size());
+  CHECK(Reaper::reap(zh, taskPath(99), 1, 0) == 35, "the second pass");
+  expect(zh, "t0099");
+}
+
+int main()
+{
+  zksim_config(0, 1.0);
+  if (!Logger::create("/tmp/reapertest.log", Logger::DAY, true)) {
+    fprintf(stderr, "create logger error\n");
+    return EXIT_FAILURE;
+  }
+
+  zhandle_t *zh = zookeeper_init("sim:2181", watcher, 15000, 0, 0, 0);
+  CHECK(zh, "zookeeper_init error");
+
+  testKeep(zh);
+  testSkipped(zh);
+  testKeepDays(zh);
+  testBatchFails(zh);
+  testMax(zh);
+
+  zookeeper_close(zh);
+  printf("OK\n");
+  return 0;
+}
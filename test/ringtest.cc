@@ -0,0 +1,366 @@
+/* the llap ring of dcron_ring.h, a producer mapping of DCRON_RING and the
+ * consumer mapping of dcron, wrapping, a full ring, a corrupted one, the
+ * bell and the wait of a commit for the ack
+ * usage: ringtest, exits 1 at the first failed check
+ */
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "dcron_ring.h"
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+#define RING_SIZE 256
+
+static void collect(const char *record, size_t len, void *ctx)
+{
+  ((std::vector<std::string> *) ctx)->push_back(std::string(record, len));
+}
+
+static long consume(struct dcron_ring *ring, std::vector<std::string> *records)
+{
+  records->clear();
+  return dcron_ring_consume(ring, collect, records);
+}
+
+/* dcron inits the ring, the task opens it by DCRON_RING */
+static void ringOpen(struct dcron_ring *consumer, struct dcron_ring *producer)
+{
+  FILE *fp = tmpfile();
+  CHECK(fp, "tmpfile error, %s", strerror(errno));
+  CHECK(dcron_ring_init(consumer, fileno(fp), RING_SIZE) == 0, "dcron_ring_init error, %s", strerror(errno));
+
+  char fd[16];
+  snprintf(fd, sizeof(fd), "%d", fileno(fp));
+  setenv("DCRON_RING", fd, 1);
+  CHECK(dcron_ring_open(producer) == 0, "dcron_ring_open error, %s", strerror(errno));
+}
+
+static void testAttach()
+{
+  struct dcron_ring ring;
+  unsetenv("DCRON_RING");
+  CHECK(dcron_ring_open(&ring) == -1 && errno == ENOENT, "open without DCRON_RING");
+
+  FILE *fp = tmpfile();
+  CHECK(dcron_ring_init(&ring, fileno(fp), 100) == -1 && errno == EINVAL, "size not a power of 2");
+
+  CHECK(dcron_ring_init(&ring, fileno(fp), RING_SIZE) == 0, "dcron_ring_init error");
+  dcron_ring_close(&ring);
+
+  uint32_t size = RING_SIZE * 2;
+  CHECK(pwrite(fileno(fp), &size, sizeof(size), offsetof(struct dcron_ring_header, size)) == sizeof(size),
+        "pwrite error");
+  CHECK(dcron_ring_attach(&ring, fileno(fp)) == -1 && errno == EINVAL, "the data beyond the file");
+
+  uint32_t magic = 0;
+  CHECK(pwrite(fileno(fp), &magic, sizeof(magic), 0) == sizeof(magic), "pwrite error");
+  CHECK(dcron_ring_attach(&ring, fileno(fp)) == -1 && errno == EINVAL, "a bad magic");
+  fclose(fp);
+}
+
+static void testPut()
+{
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  std::vector<std::string> records;
+
+  CHECK(dcron_ring_put(&producer, "", "1") == -1 && errno == EINVAL, "an empty key");
+  CHECK(dcron_ring_put(&producer, "A=B", "1") == -1 && errno == EINVAL, "a key with =");
+  CHECK(dcron_ring_put(&producer, "A\nB", "1") == -1 && errno == EINVAL, "a key with \\n");
+  CHECK(dcron_ring_put(&producer, "A", std::string(RING_SIZE / 2, 'v').c_str()) == -1 && errno == EMSGSIZE,
+        "a record larger than half of the ring");
+  CHECK(consume(&consumer, &records) == 0 && producer.hdr->dropped == 0, "rejected records are put");
+
+  CHECK(dcron_ring_put(&producer, "OFFSET", "1") == 0, "put error");
+  CHECK(dcron_ring_put(&producer, "OFFSET", "2") == 0, "put error");
+  CHECK(dcron_ring_put2(&producer, "EMPTY", 5, "", 0) == 0, "put error");
+  CHECK(consume(&consumer, &records) == 3, "%d records", (int) records.size());
+  CHECK(records[0] == "OFFSET=1" && records[1] == "OFFSET=2" && records[2] == "EMPTY=", "records error");
+  CHECK(producer.hdr->tail == producer.hdr->head, "tail is not head");
+  CHECK(consume(&consumer, &records) == 0, "consumed twice");
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+}
+
+/* records of every length, the ones not fitting before the end wrap */
+static void testWrap()
+{
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  std::vector<std::string> records;
+
+  int skips = 0;
+  for (int i = 0; i < 1000; ++i) {
+    char key[16];
+    snprintf(key, sizeof(key), "K%d", i);
+    std::string value(i % 40, 'a' + i % 26);
+
+    uint64_t head = producer.hdr->head;
+    uint64_t need = dcron_ring_align(sizeof(uint32_t) + strlen(key) + 1 + value.size());
+    CHECK(dcron_ring_put(&producer, key, value.c_str()) == 0, "put %s error, %s", key, strerror(errno));
+
+    uint64_t pos = head & (RING_SIZE - 1);
+    if (producer.hdr->head != head + need) {
+      uint32_t len;
+      memcpy(&len, producer.data + pos, sizeof(len));
+      CHECK(len == DCRON_RING_SKIP && need > RING_SIZE - pos, "the skip of %s", key);
+      CHECK(producer.hdr->head == head + (RING_SIZE - pos) + need, "the skip of %s", key);
+      ++skips;
+    }
+
+    /* consume every third put, up to three records in the ring */
+    if (i % 3 != 2) continue;
+    CHECK(consume(&consumer, &records) == 3, "%d records at %s", (int) records.size(), key);
+    for (int j = 0; j < 3; ++j) {
+      int k = i - 2 + j;
+      char record[128];
+      snprintf(record, sizeof(record), "K%d=%s", k, std::string(k % 40, 'a' + k % 26).c_str());
+      CHECK(records[j] == record, "%s, expect %s", records[j].c_str(), record);
+    }
+  }
+  CHECK(skips > 0, "no record wrapped");
+  CHECK(producer.hdr->dropped == 0, "%u dropped", producer.hdr->dropped);
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+}
+
+static void testFull()
+{
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  std::vector<std::string> records;
+
+  /* 16 bytes a record */
+  int n = 0;
+  while (dcron_ring_put(&producer, "K", "0123456") == 0) ++n;
+  CHECK(errno == EAGAIN && n == RING_SIZE / 16, "%d records in a full ring", n);
+  CHECK(producer.hdr->dropped == 1, "dropped %u", producer.hdr->dropped);
+  CHECK(dcron_ring_put(&producer, "K", "") == -1 && errno == EAGAIN, "a put into a full ring");
+  CHECK(producer.hdr->dropped == 2, "dropped %u", producer.hdr->dropped);
+
+  CHECK(consume(&consumer, &records) == n, "%d records", (int) records.size());
+  CHECK(dcron_ring_put(&producer, "K", "0123456") == 0, "put after consume error");
+
+  /* 112 bytes a record, the skipped bytes at the end count as used */
+  CHECK(consume(&consumer, &records) == 1, "consume error");
+  while (producer.hdr->head % RING_SIZE != RING_SIZE - 16) {
+    CHECK(dcron_ring_put(&producer, "K", "0123456") == 0, "put error");
+    CHECK(consume(&consumer, &records) == 1, "consume error");
+  }
+  std::string value(100, 'v');
+  CHECK(dcron_ring_put(&producer, "K", value.c_str()) == 0, "put after the skip error");
+  CHECK(dcron_ring_put(&producer, "K", value.c_str()) == 0, "put error");
+  CHECK(RING_SIZE - (producer.hdr->head - producer.hdr->tail) == 16, "the skip is not counted");
+  CHECK(dcron_ring_put(&producer, "K", "0123456") == 0, "put error");
+  CHECK(dcron_ring_put(&producer, "K", "0123456") == -1 && errno == EAGAIN, "put into a full ring");
+  CHECK(producer.hdr->dropped == 3, "dropped %u", producer.hdr->dropped);
+  CHECK(consume(&consumer, &records) == 3, "%d records", (int) records.size());
+  CHECK(records[0] == "K=" + value && records[1] == "K=" + value && records[2] == "K=0123456", "records error");
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+}
+
+/* a task writing over the header or the data, the records are dropped and
+ * the ring is usable again
+ */
+static void testCorrupted()
+{
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  std::vector<std::string> records;
+
+  CHECK(dcron_ring_put(&producer, "K", "1") == 0, "put error");
+  producer.hdr->head += RING_SIZE;
+  CHECK(consume(&consumer, &records) == -1 && records.empty(), "head beyond the ring");
+  CHECK(consumer.hdr->tail == consumer.hdr->head, "tail is not moved to head");
+
+  CHECK(dcron_ring_put(&producer, "K", "2") == 0, "put error");
+  producer.hdr->head -= 4;
+  CHECK(consume(&consumer, &records) == -1 && records.empty(), "head not aligned");
+  producer.hdr->head = consumer.hdr->tail = (producer.hdr->head + 7) & ~(uint64_t) 7;
+
+  uint64_t pos = producer.hdr->head & (RING_SIZE - 1);
+  CHECK(dcron_ring_put(&producer, "K", "3") == 0, "put error");
+  uint32_t len = RING_SIZE;
+  memcpy(producer.data + pos, &len, sizeof(len));
+  CHECK(consume(&consumer, &records) == -1 && records.empty(), "a record longer than the ring");
+
+  CHECK(dcron_ring_put(&producer, "K", "4") == 0, "put error");
+  CHECK(consume(&consumer, &records) == 1 && records[0] == "K=4", "the ring after corruption");
+
+  /* the size in the header is not read again, the positions stay in the
+   * data of the mappings, a new mapping checks it
+   */
+  producer.hdr->size = 0x80000000u;
+  producer.hdr->head = consumer.hdr->tail = 1u << 30;
+  CHECK(dcron_ring_put(&producer, "K", "5") == 0, "put error");
+  CHECK(consume(&consumer, &records) == 1 && records[0] == "K=5", "the ring after a size of 2GB");
+  producer.hdr->head += 1u << 20;
+  CHECK(consume(&consumer, &records) == -1 && records.empty(), "head beyond the ring of 2GB");
+
+  struct dcron_ring again;
+  CHECK(dcron_ring_open(&again) == -1 && errno == EINVAL, "a size beyond the file is mapped");
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+}
+
+/* the bell is written once a sleep, only for the wake dcron sleeps for */
+static uint64_t rings(int bell)
+{
+  uint64_t n = 0;
+  if (read(bell, &n, sizeof(n)) != sizeof(n)) CHECK(errno == EAGAIN, "read bell error, %s", strerror(errno));
+  return n;
+}
+
+static void testBell()
+{
+  int bell = eventfd(0, EFD_NONBLOCK);
+  CHECK(bell != -1, "eventfd error, %s", strerror(errno));
+  char fd[16];
+  snprintf(fd, sizeof(fd), "%d", bell);
+  setenv("DCRON_RING_BELL", fd, 1);
+
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  std::vector<std::string> records;
+  CHECK(consumer.bell == -1 && producer.bell == bell, "the bell of DCRON_RING_BELL");
+
+  /* awake, no write */
+  CHECK(dcron_ring_put(&producer, "K", "1") == 0, "put error");
+  CHECK(rings(bell) == 0, "rung while awake");
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_PUT) == -1, "sleep on a record");
+  CHECK(consumer.hdr->sleeping == 0, "asleep on a record");
+  consume(&consumer, &records);
+
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_PUT) == 0, "sleep error");
+  CHECK(dcron_ring_put(&producer, "K", "2") == 0 && dcron_ring_put(&producer, "K", "3") == 0, "put error");
+  CHECK(rings(bell) == 1 && consumer.hdr->sleeping == 0, "a put does not ring once");
+  dcron_ring_awake(&consumer);
+  consume(&consumer, &records);
+
+  /* the flush is armed, a put does not ring, a barrier and a half full ring do */
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_BARRIER) == 0, "sleep error");
+  CHECK(dcron_ring_put(&producer, "K", "4") == 0, "put error");
+  CHECK(rings(bell) == 0, "a put rings for a barrier");
+  uint64_t barrier = dcron_ring_barrier(&producer);
+  CHECK(rings(bell) == 1, "a barrier does not ring");
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_BARRIER) == -1, "sleep on a barrier not consumed");
+  consume(&consumer, &records);
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_BARRIER) == 0, "sleep on a consumed barrier");
+  CHECK(dcron_ring_barrier_pending(&consumer), "the barrier is acked");
+  dcron_ring_ack(&consumer, barrier);
+
+  while (producer.hdr->head - producer.hdr->tail <= RING_SIZE / 2) {
+    CHECK(rings(bell) == 0, "rung before half full");
+    CHECK(dcron_ring_put(&producer, "K", "0123456") == 0, "put error");
+  }
+  CHECK(rings(bell) == 1, "a half full ring does not ring");
+  CHECK(dcron_ring_sleep(&consumer, DCRON_RING_WAKE_BARRIER) == -1, "sleep on a half full ring");
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+  unsetenv("DCRON_RING_BELL");
+  close(bell);
+}
+
+static long elapsedMs(const struct timespec &begin)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin.tv_sec) * 1000 + (now.tv_nsec - begin.tv_nsec) / 1000000;
+}
+
+struct Acker {
+  struct dcron_ring *consumer;
+  uint64_t           pos;
+};
+
+/* dcron writes the records to zookeeper after a while */
+static void *ackRoutine(void *data)
+{
+  Acker *acker = (Acker *) data;
+  usleep(100 * 1000);
+  std::vector<std::string> records;
+  consume(acker->consumer, &records);
+  dcron_ring_ack(acker->consumer, acker->pos);
+  return 0;
+}
+
+static void testWait()
+{
+  struct dcron_ring consumer, producer;
+  ringOpen(&consumer, &producer);
+  struct timespec begin;
+
+  CHECK(dcron_ring_put(&producer, "K", "1") == 0, "put error");
+  CHECK(!dcron_ring_barrier_pending(&consumer), "a barrier without commit");
+  uint64_t barrier = dcron_ring_barrier(&producer);
+  CHECK(barrier == producer.hdr->head && dcron_ring_barrier_pending(&consumer), "the barrier is not pending");
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  CHECK(dcron_ring_wait(&producer, barrier, 50) == -1 && errno == ETIMEDOUT, "wait without ack");
+  long ms = elapsedMs(begin);
+  CHECK(ms >= 50 && ms < 1000, "timed out after %ldms", ms);
+  CHECK(producer.hdr->waiters == 0, "%u waiters", producer.hdr->waiters);
+
+  /* an ack short of the barrier does not end the wait */
+  dcron_ring_ack(&consumer, barrier - 1);
+  CHECK(dcron_ring_wait(&producer, barrier, 0) == -1 && errno == ETIMEDOUT, "acked before the barrier");
+
+  Acker acker = {&consumer, barrier};
+  pthread_t tid;
+  CHECK(pthread_create(&tid, 0, ackRoutine, &acker) == 0, "pthread_create error");
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  CHECK(dcron_ring_wait(&producer, barrier, -1) == 0, "wait error, %s", strerror(errno));
+  ms = elapsedMs(begin);
+  pthread_join(tid, 0);
+  CHECK(ms >= 90 && ms < 1000, "woken after %ldms", ms);
+  CHECK(!dcron_ring_barrier_pending(&consumer), "the barrier is still pending");
+
+  /* acked already, no wait, an older ack is ignored */
+  CHECK(dcron_ring_wait(&producer, barrier, 0) == 0, "wait on an acked barrier");
+  dcron_ring_ack(&consumer, barrier - 8);
+  CHECK(consumer.hdr->acked == barrier, "acked went back");
+
+  /* commit is barrier and wait */
+  CHECK(dcron_ring_put(&producer, "K", "2") == 0, "put error");
+  acker.pos = producer.hdr->head;
+  CHECK(pthread_create(&tid, 0, ackRoutine, &acker) == 0, "pthread_create error");
+  CHECK(dcron_ring_commit(&producer, 5000) == 0, "commit error, %s", strerror(errno));
+  pthread_join(tid, 0);
+  CHECK(producer.hdr->waiters == 0, "%u waiters", producer.hdr->waiters);
+
+  dcron_ring_close(&producer);
+  dcron_ring_close(&consumer);
+}
+
+int main()
+{
+  testAttach();
+  testPut();
+  testWrap();
+  testFull();
+  testCorrupted();
+  testBell();
+  testWait();
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,267 @@
+/* CronExpr parsing and next(), TimerWheel cascade and parking
+ * usage: schedtest, exits 1 at the first failed check
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "logger.h"
+#include "scheduler.h"
+#include "timerwheel.h"
+
+LOGGER_INIT();
+
+#define ERRBUF_MAX 1024
+
+#define CHECK(cond, ...) do {                      \
+  if (!(cond)) {                                   \
+    fprintf(stderr, "%s:%d ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__);                  \
+    fprintf(stderr, "\n");                         \
+    exit(1);                                       \
+  }                                                \
+} while (0)
+
+static void setTz(const char *tz)
+{
+  setenv("TZ", tz, 1);
+  tzset();
+}
+
+/* YYYY-mm-dd HH:MM of the local time */
+static time_t at(const char *s)
+{
+  struct tm ltm;
+  memset(&ltm, 0, sizeof(ltm));
+  CHECK(strptime(s, "%Y-%m-%d %H:%M", &ltm), "bad time %s", s);
+  ltm.tm_isdst = -1;
+  return mktime(&ltm);
+}
+
+static std::string fmt(time_t t)
+{
+  if (t == -1) return "never";
+  struct tm ltm;
+  char buffer[64];
+  localtime_r(&t, &ltm);
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M %Z", &ltm);
+  return buffer;
+}
+
+struct NextCase {
+  const char *expr;
+  const char *from;
+  const char *next;   // with the zone, "never" if it never fires
+};
+
+static void testNext(const char *tz, const NextCase *cases, size_t n)
+{
+  setTz(tz);
+  char errbuf[ERRBUF_MAX];
+  for (size_t i = 0; i < n; ++i) {
+    CronExpr expr;
+    CHECK(expr.parse(cases[i].expr, errbuf), "%s %s", cases[i].expr, errbuf);
+
+    std::string next = fmt(expr.next(at(cases[i].from)));
+    CHECK(next == cases[i].next, "%s %s from %s expect %s, got %s",
+          tz, cases[i].expr, cases[i].from, cases[i].next, next.c_str());
+  }
+}
+
+static void testParse()
+{
+  static const char *INVALID[] = {
+    "", "* * * *", "* * * * * *", "60 * * * *", "* 24 * * *", "* * 0 * *", "* * 32 * *",
+    "* * * 0 *", "* * * 13 *", "* * * * 8", "5-1 * * * *", "*/0 * * * *", "1/-1 * * * *",
+    "1,,2 * * * *", "a * * * *", "* * * foo *", "* * * * funday", "1-2-3 * * * *", "@every", 0
+  };
+
+  char errbuf[ERRBUF_MAX];
+  for (int i = 0; INVALID[i]; ++i) {
+    CronExpr expr;
+    CHECK(!expr.parse(INVALID[i], errbuf), "'%s' should be invalid", INVALID[i]);
+  }
+
+  static const NextCase CASES[] = {
+    {"* * * * *",         "2024-01-10 10:00", "2024-01-10 10:01 UTC"},
+    {"*/15 * * * *",      "2024-01-10 10:00", "2024-01-10 10:15 UTC"},
+    {"1-10/4 * * * *",    "2024-01-10 10:05", "2024-01-10 10:09 UTC"},
+    {"1-10/4 * * * *",    "2024-01-10 10:09", "2024-01-10 11:01 UTC"},
+    {"5/20 * * * *",      "2024-01-10 10:30", "2024-01-10 10:45 UTC"},
+    {"0,30 9-17 * * *",   "2024-01-10 17:30", "2024-01-11 09:00 UTC"},
+    {"0 4 * * *",         "2024-01-31 05:00", "2024-02-01 04:00 UTC"},
+    {"0 0 1 jan-mar *",   "2024-03-01 00:00", "2025-01-01 00:00 UTC"},
+    {"0 0 * * mon-fri",   "2024-01-12 00:00", "2024-01-15 00:00 UTC"},   // fri -> mon
+    {"0 0 * * SAT",       "2024-01-10 00:00", "2024-01-13 00:00 UTC"},
+    {"0 0 * * 7",         "2024-01-10 00:00", "2024-01-14 00:00 UTC"},   // 7 is sunday
+    {"0 0 * * 0",         "2024-01-10 00:00", "2024-01-14 00:00 UTC"},
+    {"0 0 13 * *",        "2024-01-10 00:00", "2024-01-13 00:00 UTC"},
+    {"0 0 * 2 *",         "2024-01-10 00:00", "2024-02-01 00:00 UTC"},
+    /* both restricted, the 13th or a friday */
+    {"0 0 13 * fri",      "2024-01-10 00:00", "2024-01-12 00:00 UTC"},
+    {"0 0 13 * fri",      "2024-01-12 00:00", "2024-01-13 00:00 UTC"},
+    {"0 0 13 * fri",      "2024-01-13 00:00", "2024-01-19 00:00 UTC"},
+    /* a star on either side, the other one decides */
+    {"0 0 * * fri",       "2024-01-13 00:00", "2024-01-19 00:00 UTC"},
+    {"0 0 1-31/10 * *",   "2024-01-21 00:00", "2024-01-31 00:00 UTC"},
+    {"@hourly",           "2024-01-10 10:00", "2024-01-10 11:00 UTC"},
+    {"@daily",            "2024-01-10 10:00", "2024-01-11 00:00 UTC"},
+    {"@weekly",           "2024-01-10 10:00", "2024-01-14 00:00 UTC"},
+    {"@monthly",          "2024-01-10 10:00", "2024-02-01 00:00 UTC"},
+    {"@yearly",           "2024-01-10 10:00", "2025-01-01 00:00 UTC"},
+  };
+  testNext("UTC", CASES, sizeof(CASES) / sizeof(CASES[0]));
+}
+
+static void testMonthBoundary()
+{
+  static const NextCase CASES[] = {
+    {"0 0 31 * *",        "2024-01-31 00:00", "2024-03-31 00:00 UTC"},   // no 31st in february
+    {"59 23 31 * *",      "2024-04-01 00:00", "2024-05-31 23:59 UTC"},
+    {"0 0 29 2 *",        "2023-03-01 00:00", "2024-02-29 00:00 UTC"},
+    {"0 0 29 2 *",        "2024-02-29 00:00", "2028-02-29 00:00 UTC"},
+    {"0 0 30 2 *",        "2024-01-01 00:00", "never"},
+    {"59 23 31 12 *",     "2024-12-31 23:58", "2024-12-31 23:59 UTC"},
+    {"0 0 1 1 *",         "2024-12-31 23:59", "2025-01-01 00:00 UTC"},
+    {"0 0 31 dec sun",    "2024-12-30 00:00", "2024-12-31 00:00 UTC"},
+  };
+  testNext("UTC", CASES, sizeof(CASES) / sizeof(CASES[0]));
+}
+
+/* 2024-03-10 02:00 EST does not exist, 2024-11-03 01:00-01:59 happens twice */
+static void testDst()
+{
+  static const NextCase CASES[] = {
+    {"0 * * * *",         "2024-03-10 01:00", "2024-03-10 03:00 EDT"},
+    {"30 2 * * *",        "2024-03-09 03:00", "2024-03-11 02:30 EDT"},   // skipped that day
+    {"0 3 * * *",         "2024-03-09 04:00", "2024-03-10 03:00 EDT"},
+    {"0 4 * * *",         "2024-03-09 05:00", "2024-03-10 04:00 EDT"},
+    {"30 1 * * *",        "2024-11-02 02:00", "2024-11-03 01:30 EDT"},
+    {"0 2 * * *",         "2024-11-03 00:00", "2024-11-03 02:00 EST"},
+    {"0 0 * * *",         "2024-11-02 12:00", "2024-11-03 00:00 EDT"},
+    {"0 0 * * *",         "2024-11-03 12:00", "2024-11-04 00:00 EST"},
+  };
+  testNext("America/New_York", CASES, sizeof(CASES) / sizeof(CASES[0]));
+
+  /* the second 01:30 is not a new fire */
+  char errbuf[ERRBUF_MAX];
+  CronExpr expr;
+  CHECK(expr.parse("30 1 * * *", errbuf), "%s", errbuf);
+  time_t first = expr.next(at("2024-11-03 00:00"));
+  std::string next = fmt(expr.next(first));
+  CHECK(next == "2024-11-04 01:30 EST", "30 1 * * * after %s got %s", fmt(first).c_str(), next.c_str());
+
+  /* every minute across both changes, no minute fires twice or is lost */
+  CHECK(expr.parse("* * * * *", errbuf), "%s", errbuf);
+  time_t t = at("2024-03-10 01:50");
+  for (int i = 0; i < 30; ++i) {
+    time_t n = expr.next(t);
+    CHECK(n == t + 60, "* * * * * after %s got %s", fmt(t).c_str(), fmt(n).c_str());
+    t = n;
+  }
+  t = at("2024-11-03 00:50");
+  for (int i = 0; i < 130; ++i) {
+    time_t n = expr.next(t);
+    CHECK(n == t + 60, "* * * * * after %s got %s", fmt(t).c_str(), fmt(n).c_str());
+    t = n;
+  }
+}
+
+/* advances the wheel second by second, every timer must expire exactly
+ * at its expire and once
+ */
+static void runWheel(time_t start, const std::vector<time_t> &expires, time_t until)
+{
+  TimerWheel wheel(start);
+  std::vector<TimerNode> nodes(expires.size());
+  std::vector<time_t> fired(expires.size(), 0);
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    nodes[i].expire = expires[i];
+    nodes[i].data   = (void *) i;
+    wheel.add(&nodes[i]);
+  }
+
+  std::vector<TimerNode *> expired;
+  for (time_t now = start + 1; now <= until; ++now) {
+    expired.clear();
+    wheel.advance(now, &expired);
+    for (size_t i = 0; i < expired.size(); ++i) {
+      size_t idx = (size_t) expired[i]->data;
+      CHECK(fired[idx] == 0, "timer %d fired twice", (int) idx);
+      CHECK(!expired[i]->pending(), "timer %d is still pending", (int) idx);
+      fired[idx] = now;
+    }
+  }
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    time_t expect = expires[i] <= start ? start + 1 : expires[i];
+    if (expect > until) expect = 0;
+    CHECK(fired[i] == expect, "timer %d of +%ld fired at +%ld", (int) i,
+          (long) (expires[i] - start), (long) (fired[i] ? fired[i] - start : -1));
+  }
+}
+
+static void testWheel()
+{
+  /* not aligned to any level, so every level wraps in the run */
+  time_t start = 1700000000 + 12345;
+
+  std::vector<time_t> expires;
+  long deltas[] = {-5, 0, 1, 2, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 262145, 300000, 1000000};
+  for (size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); ++i) expires.push_back(start + deltas[i]);
+
+  srandom(20241016);
+  for (int i = 0; i < 2000; ++i) expires.push_back(start + random() % 1100000);
+  runWheel(start, expires, start + 1100000);
+
+  /* beyond 64^4 seconds the timer is parked in the last level */
+  long span = 1L << (TimerWheel::BITS * TimerWheel::LEVELS);
+  expires.clear();
+  expires.push_back(start + span - 1);
+  expires.push_back(start + span);
+  expires.push_back(start + span + 1);
+  expires.push_back(start + 2 * span + 100);
+  runWheel(start, expires, start + 2 * span + 200);
+
+  /* del, and add of a pending timer moves it */
+  TimerWheel wheel(start);
+  TimerNode a, b;
+  a.expire = start + 10;
+  b.expire = start + 10;
+  wheel.add(&a);
+  wheel.add(&b);
+  wheel.del(&a);
+  CHECK(!a.pending() && b.pending(), "del error");
+  b.expire = start + 5000;
+  wheel.add(&b);
+
+  std::vector<TimerNode *> expired;
+  wheel.advance(start + 4999, &expired);
+  CHECK(expired.empty(), "moved timer fired early");
+  wheel.advance(start + 5000, &expired);
+  CHECK(expired.size() == 1 && expired[0] == &b, "moved timer not fired");
+
+  /* a jump of the clock expires everything due at once */
+  a.expire = start + 6000;
+  b.expire = start + 70000;
+  wheel.add(&a);
+  wheel.add(&b);
+  expired.clear();
+  wheel.advance(start + 100000, &expired);
+  CHECK(expired.size() == 2, "jump expired %d", (int) expired.size());
+  CHECK(wheel.current() == start + 100000, "current error");
+}
+
+int main()
+{
+  testParse();
+  testMonthBoundary();
+  testDst();
+  testWheel();
+  printf("OK\n");
+  return 0;
+}